@@ -2,7 +2,7 @@
 
 : '
 DiskProvision - Allows the creation, management, and updating of disk images for use with QEMU.
-build_all.sh - Compile all C files in the src directory and output to the build folder.
+build_all.sh - Compile the program for this platform from the src directory and output to the build folder.
 BSD 3-Clause "New" or "Revised" License
 Copyright (c) 2024 RoyalGraphX
 All rights reserved.
@@ -10,6 +10,21 @@ All rights reserved.
 
 BUILD_DIR="build"
 
+# Libraries every program links against
+LIBS="-pthread -lz"
+
+# ./build_all.sh bench [options] builds the platform program optimized and runs its benchmark
+if [ "$1" = "bench" ]; then
+    mkdir -p "$BUILD_DIR"
+    if [ "$(uname)" = "Darwin" ]; then
+        gcc -O2 -o "$BUILD_DIR/DiskProvision" src/DiskProvision_Darwin.c $LIBS || exit 1
+    else
+        gcc -O2 -o "$BUILD_DIR/DiskProvision" src/DiskProvision.c $LIBS || exit 1
+    fi
+    shift
+    exec "$BUILD_DIR/DiskProvision" bench "$@"
+fi
+
 # Clear the console to begin compilation
 
 clear
@@ -23,14 +38,18 @@ fi
 # Create the build folder
 mkdir "$BUILD_DIR"
 
-# Find all .c files in the src directory
-c_files=$(find src -name "*.c")
+# Only the current platform's program builds here, the Linux one needs the kernel nbd and loop headers
+if [ "$(uname)" = "Darwin" ]; then
+    c_files="src/DiskProvision_Darwin.c"
+else
+    c_files="src/DiskProvision.c"
+fi
 
 # Compile each .c file
 for c_file in $c_files; do
     output_name="build/${c_file#src/}"
     output_name="${output_name%.c}"  # Remove .c extension
-    gcc -o "$output_name" "$c_file"
+    gcc -o "$output_name" "$c_file" $LIBS
 done
 
 echo "Compilation completed!"
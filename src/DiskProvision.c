@@ -6,38 +6,22 @@
  * All rights reserved.
  */
 
+#define _GNU_SOURCE // For fallocate() and copy_file_range()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>  // For stat() function
 #include <sys/statvfs.h>  // For statvfs() function
-#include <dirent.h>    // For directory listing
-#include <unistd.h> // For sleep function
-#include <ctype.h> // Include ctype.h for toupper()
-
-// Function to check if a directory exists
-int directoryExists(const char *path) {
-    struct stat info;
-    if (stat(path, &info) != 0) {
-        return 0;  // Directory does not exist
-    }
-    if (S_ISDIR(info.st_mode)) {
-        return 1;  // Directory exists
-    }
-    return 0;  // Path exists but is not a directory
-}
-
-// Function to check if a file exists
-int fileExists(const char *path) {
-    struct stat info;
-    if (stat(path, &info) != 0) {
-        return 0;  // File does not exist
-    }
-    if (S_ISREG(info.st_mode)) {
-        return 1;  // File exists
-    }
-    return 0;  // Path exists but is not a regular file
-}
+#include <unistd.h> // For rmdir()
+#include <sys/socket.h> // For socketpair()
+#include <sys/uio.h> // For writev()
+#include <linux/nbd.h> // For the NBD ioctls and wire protocol
+#include <linux/loop.h> // For LOOP_CONFIGURE
+#include "DiskProvision_Image.h" // Image creation, QCOW2 and FAT32 engine shared with the Darwin build
+#include "DiskProvision_Fuse.h" // Unprivileged FUSE mounts of FAT32 images
+#include "DiskProvision_Bench.h" // Provisioning benchmark
+#include "DiskProvision_Daemon.h" // Unix socket server
 
 // Function to get available free space on the current directory
 unsigned long long getFreeSpace() {
@@ -48,514 +32,1020 @@ unsigned long long getFreeSpace() {
     return buf.f_bsize * buf.f_bavail;
 }
 
-// Function to check if an executable file exists in PATH
-int isExecutableAvailable(const char *executable) {
-    char command[512];
-    snprintf(command, sizeof(command), "command -v %s > /dev/null", executable);
-    return system(command) == 0;
-}
-
-// Function to convert a string to uppercase
-void stringToUpper(char *str) {
-    while (*str) {
-        *str = toupper((unsigned char)*str);
-        str++;
+// Function to find the device mounted at a directory and optionally its filesystem type, returns 0 when one is mounted there
+int findMountedDevice(const char *mount_point, char *device, size_t device_size, char *type, size_t type_size) {
+    char target[4096];
+    if (realpath(mount_point, target) == NULL) {
+        return -1;
+    }
+    FILE *mounts = fopen("/proc/self/mounts", "r");
+    if (mounts == NULL) {
+        return -1;
     }
+    char line[8192];
+    int found = -1;
+    while (found != 0 && fgets(line, sizeof(line), mounts) != NULL) {
+        char source[4096], directory[4096], fstype[256];
+        if (sscanf(line, "%4095s %4095s %255s", source, directory, fstype) == 3 && strcmp(directory, target) == 0) {
+            snprintf(device, device_size, "%s", source);
+            if (type != NULL) {
+                snprintf(type, type_size, "%s", fstype);
+            }
+            found = 0;
+        }
+    }
+    fclose(mounts);
+    return found;
 }
 
-// Define the debug_disable variable (1 for disable, 0 for enable)
-#define DEBUG_DISABLE 1
-
-// Main function, conditionally compiled based on DEBUG_DISABLE
-#if DEBUG_DISABLE
-int main() {
-    printf("DiskProvision is currently disabled. Please use the bash scripts located in the legacy folder.\n");
-    printf("If you for whatever reason enable DiskProvision, do not report bugs or issues.\n");
-    printf("\n\n");
-    printf("Quickly make a new OpenCore.img by issuing the following command:\n");
-    printf("./legacy/init.sh\n\n");
-    printf("Make sure to unmount the image before using it in a Virtual Machine:\n");
-    printf("./legacy/unmount.sh\n\n");
+// Where the kernel describes block devices, and where nbd claims are recorded
+#ifndef SYSFS_BLOCK_DIR
+#define SYSFS_BLOCK_DIR "/sys/block"
+#endif
+#define NBD_LOCK_DIR "/run/lock"
+
+// Function to read a small sysfs attribute of a block device, returns 0 with the value in buf
+static int readSysfsAttribute(const char *name, const char *attribute, char *buf, size_t size) {
+    char path[256];
+    snprintf(path, sizeof(path), SYSFS_BLOCK_DIR "/%s/%s", name, attribute);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t len = read(fd, buf, size - 1);
+    close(fd);
+    if (len < 0) {
+        return -1;
+    }
+    buf[len] = '\0';
     return 0;
 }
-#else
-int main() {
-    // Check if required packages are installed
-    if (!isExecutableAvailable("qemu-img") || !isExecutableAvailable("qemu-nbd") || !isExecutableAvailable("mkfs.fat")) {
-        printf("Please install the required packages: qemu-utils and dosfstools.\n");
+
+// Function to check whether an nbd device is in use: it has a server pid or a size
+static int nbdInUse(const char *name) {
+    char value[64];
+    if (readSysfsAttribute(name, "pid", value, sizeof(value)) == 0) {
         return 1;
     }
+    return readSysfsAttribute(name, "size", value, sizeof(value)) == 0 && strtoull(value, NULL, 10) != 0;
+}
 
-    char image_name[256];
-    char image_size[256];
-    char image_format[10];
-    char image_path[512];
-    char command[512];
-    int choice;
+// Function to order nbd device names by their number
+static int compareNbdNames(const void *a, const void *b) {
+    return atoi(*(char *const *)a + 3) - atoi(*(char *const *)b + 3);
+}
 
-    do {
-        // Clear the screen by issuing the "clear" command
-        system("clear");
+// Function to list the nbd devices the kernel provides, sorted by number, returns the count or -1
+static int nbdPoolDevices(char ***names) {
+    *names = NULL;
+    DIR *dp = opendir(SYSFS_BLOCK_DIR);
+    if (dp == NULL) {
+        return -1;
+    }
+    int count = 0, capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dp)) != NULL) {
+        if (strncmp(entry->d_name, "nbd", 3) != 0 || !isdigit((unsigned char)entry->d_name[3])) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            char **grown = realloc(*names, capacity * sizeof(char *));
+            if (grown == NULL) {
+                break;
+            }
+            *names = grown;
+        }
+        if (((*names)[count] = strdup(entry->d_name)) != NULL) {
+            count++;
+        }
+    }
+    closedir(dp);
+    qsort(*names, count, sizeof(char *), compareNbdNames);
+    return count;
+}
 
-        // Display welcome message
-        printf("Welcome to DiskProvision!\n");
-        printf("Copyright (c) 2023 RoyalGraphX\n");
-        printf("Linux x86_64 Pre-Release 0.0.3\n\n");
+static void freeNames(char **names, int count) {
+    for (int i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+}
 
-        // Display menu options
-        printf("Menu:\n");
-        printf("1. Create New Disk Image\n");
-        printf("2. Delete Disk Image\n");
-        printf("3. Mount Disk Image\n");
-        printf("4. Unmount Disk Image\n");
-        printf("5. Exit\n\n");
-        printf("Enter your choice: ");
-        scanf("%d", &choice);  // Read user's choice
+// Function to get the lock file of an nbd device, it also records which image owns the device
+static void nbdLockPath(const char *name, char *path, size_t size) {
+    snprintf(path, size, NBD_LOCK_DIR "/diskprovision-%s.lock", name);
+}
 
-        // Handle user's choice
-        switch (choice) {
-            case 1:
+// Function to read the image recorded as the owner of an nbd device, empty when the claim is stale
+static void nbdPoolOwner(const char *name, char *image_path, size_t size) {
+    char path[256];
+    image_path[0] = '\0';
+    if (!nbdInUse(name)) {
+        return;  // The device was disconnected behind our back, the record no longer applies
+    }
+    nbdLockPath(name, path, sizeof(path));
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return;
+    }
+    if (fgets(image_path, (int)size, file) != NULL) {
+        image_path[strcspn(image_path, "\n")] = '\0';
+    }
+    fclose(file);
+}
 
-                system("clear");
+// Function to find the nbd device an image is already attached to, returns 0 when there is one
+static int nbdPoolFindImage(const char *image_path, char *device, size_t device_size) {
+    char real_path[4096], owner[4096];
+    char **names;
+    if (realpath(image_path, real_path) == NULL) {
+        return -1;
+    }
+    int count = nbdPoolDevices(&names);
+    int found = -1;
+    for (int i = 0; i < count && found != 0; i++) {
+        nbdPoolOwner(names[i], owner, sizeof(owner));
+        if (strcmp(owner, real_path) == 0) {
+            snprintf(device, device_size, "/dev/%s", names[i]);
+            found = 0;
+        }
+    }
+    freeNames(names, count);
+    return found;
+}
 
-               // Create New Disk Image logic
+// Function to claim the first free nbd device after start, returns its locked lock file or -1 when none is free.
+// The lock is held until the device is connected, so concurrent runs never pick the same device and a device
+// someone else is using is never touched.
+static int nbdPoolClaim(int *start, char *device, size_t device_size) {
+    char **names;
+    int count = nbdPoolDevices(&names);
+    int lock_fd = -1;
+    for (; *start < count && lock_fd < 0; (*start)++) {
+        const char *name = names[*start];
+        char path[256];
+        if (nbdInUse(name)) {
+            continue;
+        }
+        nbdLockPath(name, path, sizeof(path));
+        int fd = open(path, O_RDWR | O_CREAT, 0666);
+        if (fd < 0) {
+            continue;
+        }
+        fchmod(fd, 0666);  // Other users share the pool, whatever the umask
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0 || nbdInUse(name)) {
+            close(fd);  // Being claimed by another run, or it won the race
+            continue;
+        }
+        snprintf(device, device_size, "/dev/%s", name);
+        lock_fd = fd;
+    }
+    freeNames(names, count);
+    return lock_fd;
+}
 
-                // Check if the "images" subfolder already exists
-                if (!directoryExists("images")) {
-                    // Create the "images" subfolder if it doesn't exist
-                    if (system("mkdir images") != 0) {
-                        printf("Failed to create the 'images' subfolder.\n");
-                        break;
-                    }
-                }
+// Function to record the owner of a claimed device and release the claim
+static void nbdPoolRecord(int lock_fd, const char *image_path) {
+    char real_path[4096];
+    if (ftruncate(lock_fd, 0) == 0 && realpath(image_path, real_path) != NULL) {
+        dprintf(lock_fd, "%s\n", real_path);
+    }
+    close(lock_fd);
+}
 
-                // Display available free space before creating the image
-                unsigned long long free_space_before = getFreeSpace();
-                printf("Available free space before creating the image: %.2f GB\n", free_space_before / (1024.0 * 1024.0 * 1024.0));
-
-                // Display menu for image format selection
-                printf("Choose the image format:\n");
-                printf("1. Raw\n");
-                printf("2. QCOW2\n");
-                printf("Enter your choice (1 or 2): ");
-                int format_choice;
-                scanf("%d", &format_choice);
-
-                if (format_choice == 1) {
-                    strcpy(image_format, "raw");
-                } else if (format_choice == 2) {
-                    strcpy(image_format, "qcow2");
-                } else {
-                    printf("Invalid format choice. Using Raw format by default.\n");
-                    strcpy(image_format, "raw");
-                }
+// Function to forget the owner of a device once it is disconnected
+static void nbdPoolRelease(const char *device) {
+    char path[256];
+    nbdLockPath(device + strlen("/dev/"), path, sizeof(path));
+    int fd = open(path, O_RDWR);
+    if (fd >= 0) {
+        if (flock(fd, LOCK_EX) == 0) {
+            ftruncate(fd, 0);
+        }
+        close(fd);
+    }
+}
 
-                // Prompt user for image name
-                printf("Enter the name for the disk image (without .img extension): ");
-                scanf("%s", image_name);
+// Most connections the built-in server hands to the kernel, each one is served by its own thread
+#define NBD_MAX_CONNECTIONS 8
+#define NBD_BLOCK_SIZE 512  // vfat refuses devices whose logical blocks are larger than its sectors
+
+// One kernel connection of the built-in nbd server
+typedef struct {
+    int image_fd;
+    int socket_fd;
+    pthread_t thread;
+} NbdConnection;
+
+// Function to read a buffer completely from a stream descriptor, fails on end of stream
+static int readStream(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t got = read(fd, p, len);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        p += got;
+        len -= got;
+    }
+    return 0;
+}
 
-                // Construct the path to create the disk image in the "images" subfolder
-                snprintf(image_path, sizeof(image_path), "images/%s.img", image_name);
+// Function to serve the requests of one connection with pread/pwrite until the kernel disconnects.
+// The kernel keeps several requests in flight across the connections, so they run in parallel.
+static void *nbdServeConnection(void *arg) {
+    NbdConnection *conn = arg;
+    uint8_t request[28], reply[16];
+    uint8_t *buf = NULL;
+    size_t buf_size = 0;
+
+    while (readStream(conn->socket_fd, request, sizeof(request)) == 0 && getBE32(request) == NBD_REQUEST_MAGIC) {
+        uint32_t type = getBE32(request + 4);
+        uint32_t command = type & 0xFFFF;  // The upper half carries flags such as FUA
+        uint64_t from = getBE64(request + 16);
+        uint32_t len = getBE32(request + 24);
+        uint32_t error = 0;
+        if (command == NBD_CMD_DISC) {
+            break;
+        }
+        if ((command == NBD_CMD_READ || command == NBD_CMD_WRITE) && len > buf_size) {
+            uint8_t *grown = realloc(buf, len);
+            if (grown == NULL) {
+                break;
+            }
+            buf = grown;
+            buf_size = len;
+        }
 
-                // Check if the image file already exists
-                if (fileExists(image_path)) {
-                    printf("Disk image already exists! Please choose another name.\n");
-                    break;
-                }
+        if (command == NBD_CMD_READ) {
+            error = readAll(conn->image_fd, buf, len, from) != 0 ? EIO : 0;
+        } else if (command == NBD_CMD_WRITE) {
+            if (readStream(conn->socket_fd, buf, len) != 0) {
+                break;
+            }
+            error = writeAll(conn->image_fd, buf, len, from) != 0 ? EIO : 0;
+            if (error == 0 && (type & NBD_CMD_FLAG_FUA)) {
+                error = fdatasync(conn->image_fd) != 0 ? EIO : 0;
+            }
+        } else if (command == NBD_CMD_FLUSH) {
+            error = fdatasync(conn->image_fd) != 0 ? EIO : 0;
+        } else if (command == NBD_CMD_TRIM) {
+            fallocate(conn->image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)from, len);
+        } else {
+            error = EINVAL;
+        }
 
-                // Prompt user for image size in gigabytes
-                printf("Enter the size (in GB) for the disk image (e.g., 1): ");
-                scanf("%s", image_size);
+        putBE32(reply, NBD_REPLY_MAGIC);
+        putBE32(reply + 4, error);
+        memcpy(reply + 8, request + 8, 8);  // The handle matches the reply to its request
+        struct iovec iov[2] = {{reply, sizeof(reply)}, {buf, len}};
+        int parts = command == NBD_CMD_READ && error == 0 ? 2 : 1;
+        size_t total = sizeof(reply) + (parts == 2 ? len : 0);
+        ssize_t sent = writev(conn->socket_fd, iov, parts);
+        if (sent >= 0 && (size_t)sent < total) {
+            // Large reads may go out in pieces, finish them the simple way
+            size_t done = (size_t)sent;
+            if (done < sizeof(reply)) {
+                sent = writeStream(conn->socket_fd, reply + done, sizeof(reply) - done) == 0 ? (ssize_t)sizeof(reply) : -1;
+                done = sizeof(reply);
+            }
+            if (sent >= 0 && parts == 2) {
+                sent = writeStream(conn->socket_fd, buf + (done - sizeof(reply)), total - done) == 0 ? 0 : -1;
+            }
+        }
+        if (sent < 0) {
+            break;
+        }
+    }
+    free(buf);
+    close(conn->socket_fd);
+    return NULL;
+}
 
-                // Convert image_size to a double for comparison
-                double requested_size = atof(image_size);
+// Function run by the thread that lends itself to the kernel for the lifetime of the device
+static void *nbdDoIt(void *arg) {
+    ioctl(*(int *)arg, NBD_DO_IT);
+    return NULL;
+}
 
-                // Get available free space on the current directory
-                unsigned long long free_space = getFreeSpace();
+// Function to wait until the kernel reports the device as connected
+static int nbdWaitConnected(const char *device) {
+    char value[64];
+    for (int i = 0; i < 500; i++) {
+        if (readSysfsAttribute(device + strlen("/dev/"), "pid", value, sizeof(value)) == 0) {
+            return 0;
+        }
+        usleep(10000);
+    }
+    return -1;
+}
 
-                if (free_space == 0) {
-                    printf("Failed to get available free space on the current directory.\n");
-                    break;
-                }
+// Function to connect a raw image to an nbd device and serve it from a background process, like
+// "qemu-nbd --connect": returns once the device is usable. Needs root to configure the device.
+static int serveNbd(const char *device, const char *image_path) {
+    int image_fd = open(image_path, O_RDWR);
+    struct stat st;
+    if (image_fd < 0 || fstat(image_fd, &st) != 0) {
+        printf("Failed to open '%s': %s\n", image_path, strerror(errno));
+        return -1;
+    }
+    if (st.st_size == 0 || st.st_size % NBD_BLOCK_SIZE != 0) {
+        printf("'%s' is not a whole number of %d-byte blocks.\n", image_path, NBD_BLOCK_SIZE);
+        close(image_fd);
+        return -1;
+    }
+    int nbd_fd = open(device, O_RDWR);
+    if (nbd_fd < 0) {
+        printf("Failed to open %s: %s\n", device, strerror(errno));
+        close(image_fd);
+        return -1;
+    }
+    if (ioctl(nbd_fd, NBD_SET_BLKSIZE, (unsigned long)NBD_BLOCK_SIZE) != 0 ||
+        ioctl(nbd_fd, NBD_SET_SIZE_BLOCKS, (unsigned long)(st.st_size / NBD_BLOCK_SIZE)) != 0 ||
+        ioctl(nbd_fd, NBD_SET_FLAGS, (unsigned long)(NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+                                                      NBD_FLAG_SEND_TRIM | NBD_FLAG_CAN_MULTI_CONN)) != 0) {
+        printf("Failed to configure %s: %s\n", device, strerror(errno));
+        close(nbd_fd);
+        close(image_fd);
+        return -1;
+    }
 
-                // Check if the requested image size is greater than available free space
-                if (requested_size > (free_space / (1024.0 * 1024.0 * 1024.0))) {
-                    printf("Error: Not enough free space to create the disk image. Available space: %.2f GB\n", free_space / (1024.0 * 1024.0 * 1024.0));
-                    break;
-                }
+    // The parent returns once the child reports the device as connected
+    int ready[2];
+    if (pipe(ready) != 0) {
+        close(nbd_fd);
+        close(image_fd);
+        return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        printf("Failed to start the nbd server: %s\n", strerror(errno));
+        close(ready[0]);
+        close(ready[1]);
+        close(nbd_fd);
+        close(image_fd);
+        return -1;
+    }
+    if (pid > 0) {
+        char status = 1;
+        close(ready[1]);
+        close(nbd_fd);
+        close(image_fd);
+        if (read(ready[0], &status, 1) != 1 || status != 0) {
+            printf("Failed to connect %s.\n", device);
+            status = 1;
+        }
+        close(ready[0]);
+        return status == 0 ? 0 : -1;
+    }
 
-                // Construct the command to create the disk image
-                snprintf(command, sizeof(command), "qemu-img create -f %s %s %sG", image_format, image_path, image_size);
+    // Detach from the caller, which reads our output until it is closed
+    close(ready[0]);
+    setsid();
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+    }
 
-                // Execute the command to create the disk image
-                int result = system(command);
-                if (result == 0) {
-                    printf("Disk image 'images/%s' created successfully.\n", image_name);
-                } else {
-                    printf("Failed to create disk image.\n");
-                    break;
-                }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = cpus < 1 ? 1 : cpus > NBD_MAX_CONNECTIONS ? NBD_MAX_CONNECTIONS : (int)cpus;
+    NbdConnection connections[NBD_MAX_CONNECTIONS];
+    int started = 0;
+    for (int i = 0; i < count; i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+            break;
+        }
+        connections[started].image_fd = image_fd;
+        connections[started].socket_fd = sv[1];
+        if (ioctl(nbd_fd, NBD_SET_SOCK, (unsigned long)sv[0]) != 0 ||
+            pthread_create(&connections[started].thread, NULL, nbdServeConnection, &connections[started]) != 0) {
+            close(sv[0]);
+            close(sv[1]);
+            break;
+        }
+        close(sv[0]);  // The kernel holds its own reference
+        started++;
+    }
 
-                // Construct the command to format the disk image
-                snprintf(command, sizeof(command), "sudo qemu-nbd --connect=/dev/nbd0 -f %s %s", image_format, image_path);
+    pthread_t do_it;
+    char status = started > 0 && pthread_create(&do_it, NULL, nbdDoIt, &nbd_fd) == 0 ? 0 : 1;
+    if (status == 0 && nbdWaitConnected(device) != 0) {
+        ioctl(nbd_fd, NBD_DISCONNECT);
+        status = 1;
+    }
+    write(ready[1], &status, 1);
+    close(ready[1]);
 
-                // Execute the command to connect the image
-                result = system(command);
-                if (result == 0) {
-                    printf("Disk image '%s' connected to /dev/nbd0.\n", image_name);
-                } else {
-                    printf("Failed to connect disk image to /dev/nbd0.\n");
-                    break;
-                }
+    // NBD_DO_IT returns on disconnect, the kernel then shuts the sockets down and the threads see it
+    if (status == 0) {
+        pthread_join(do_it, NULL);
+    }
+    ioctl(nbd_fd, NBD_CLEAR_QUE);
+    ioctl(nbd_fd, NBD_CLEAR_SOCK);
+    for (int i = 0; i < started; i++) {
+        shutdown(connections[i].socket_fd, SHUT_RDWR);
+        pthread_join(connections[i].thread, NULL);
+    }
+    fsync(image_fd);
+    close(image_fd);
+    close(nbd_fd);
+    _exit(status);
+}
 
-                // Convert image_name to uppercase
-                stringToUpper(image_name);
+// Function to disconnect an nbd device, whichever server (built-in or qemu-nbd) is behind it
+static int disconnectNbd(const char *device) {
+    int nbd_fd = open(device, O_RDWR);
+    if (nbd_fd < 0) {
+        printf("Failed to open %s: %s\n", device, strerror(errno));
+        return -1;
+    }
+    int result = ioctl(nbd_fd, NBD_DISCONNECT);
+    if (result != 0) {
+        printf("Failed to disconnect %s: %s\n", device, strerror(errno));
+    }
+    ioctl(nbd_fd, NBD_CLEAR_SOCK);
+    close(nbd_fd);
+    return result;
+}
 
-                // Format the disk image using mkfs.fat
-                snprintf(command, sizeof(command), "sudo mkfs.fat -F 32 -n \"%s\" -I /dev/nbd0", image_name);
+// Function to get the path of this program, the nbd commands above run it again as root
+static const char *selfPath(void) {
+    static char self[4096];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (len < 0) {
+        return "/proc/self/exe";
+    }
+    self[len] = '\0';
+    return self;
+}
 
-                // Execute the command to format the image
-                result = system(command);
-                if (result == 0) {
-                    printf("Disk image '%s' formatted successfully.\n", image_name);
-                } else {
-                    printf("Failed to format disk image '%s'.\n", image_name);
-                }
+// Function to disconnect an nbd device and release it to the pool
+static int nbdDisconnect(const char *device) {
+    const char *disconnect_argv[] = {selfPath(), "nbd-disconnect", device, NULL};
+    if (runProcess(disconnect_argv, 1, PROCESS_TIMEOUT_MS, NULL, 0) != 0) {
+        printf("Failed to disconnect %s.\n", device);
+        return -1;
+    }
+    nbdPoolRelease(device);
+    return 0;
+}
 
-                // Disconnect the image from /dev/nbd0
-                if (system("sudo qemu-nbd --disconnect /dev/nbd0") == 0) {
-                    printf("Disk image disconnected from /dev/nbd0.\n");
-                } else {
-                    printf("Failed to disconnect disk image from /dev/nbd0.\n");
-                }
-                sleep(4);
-                break;
-            case 2:
+// Raw images are attached to loop devices, the kernel then reads and writes the image file itself
+#define LOOP_CONTROL "/dev/loop-control"
+#define LOOP_ATTACH_ATTEMPTS 8
 
-                system("clear");
+// Function to find the loop device an image is already attached to, returns 0 when there is one
+static int loopFindImage(const char *image_path, char *device, size_t device_size) {
+    char real_path[4096], backing[4096];
+    if (realpath(image_path, real_path) == NULL) {
+        return -1;
+    }
+    DIR *dp = opendir(SYSFS_BLOCK_DIR);
+    if (dp == NULL) {
+        return -1;
+    }
+    int found = -1;
+    struct dirent *entry;
+    while (found != 0 && (entry = readdir(dp)) != NULL) {
+        if (strncmp(entry->d_name, "loop", 4) == 0 && isdigit((unsigned char)entry->d_name[4]) &&
+            readSysfsAttribute(entry->d_name, "loop/backing_file", backing, sizeof(backing)) == 0) {
+            backing[strcspn(backing, "\n")] = '\0';
+            if (strcmp(backing, real_path) == 0) {
+                snprintf(device, device_size, "/dev/%s", entry->d_name);
+                found = 0;
+            }
+        }
+    }
+    closedir(dp);
+    return found;
+}
 
-                // Delete Disk Image logic
+// Function to attach an image to a free loop device in one LOOP_CONFIGURE call, with direct I/O so pages are
+// not cached twice and a partition scan for partitioned images. Runs as root, prints the device on success.
+static int attachLoop(const char *image_path) {
+    int control_fd = open(LOOP_CONTROL, O_RDWR | O_CLOEXEC);
+    if (control_fd < 0) {
+        printf("Failed to open " LOOP_CONTROL ": %s\n", strerror(errno));
+        return -1;
+    }
+    int image_fd = open(image_path, O_RDWR | O_CLOEXEC);
+    if (image_fd < 0) {
+        printf("Failed to open '%s': %s\n", image_path, strerror(errno));
+        close(control_fd);
+        return -1;
+    }
 
-                // Check if the "images" subfolder exists
-                if (!directoryExists("images")) {
-                    printf("No disk images found in 'images' subfolder. Create some images first.\n");
-                    break;
-                }
+    struct loop_config config;
+    memset(&config, 0, sizeof(config));
+    config.fd = (uint32_t)image_fd;
+    config.block_size = NBD_BLOCK_SIZE;
+    config.info.lo_flags = LO_FLAGS_DIRECT_IO | LO_FLAGS_PARTSCAN;
+    snprintf((char *)config.info.lo_file_name, sizeof(config.info.lo_file_name), "%s", image_path);
+
+    char device[64];
+    int result = -1;
+    for (int attempt = 0; attempt < LOOP_ATTACH_ATTEMPTS && result != 0; attempt++) {
+        int number = ioctl(control_fd, LOOP_CTL_GET_FREE);
+        if (number < 0) {
+            printf("No free loop device: %s\n", strerror(errno));
+            break;
+        }
+        snprintf(device, sizeof(device), "/dev/loop%d", number);
+        int loop_fd = open(device, O_RDWR | O_CLOEXEC);
+        if (loop_fd < 0) {
+            printf("Failed to open %s: %s\n", device, strerror(errno));
+            break;
+        }
+        result = ioctl(loop_fd, LOOP_CONFIGURE, &config);
+        if (result != 0 && errno == EINVAL && (config.info.lo_flags & LO_FLAGS_DIRECT_IO)) {
+            // The host filesystem cannot do direct I/O with 512-byte blocks, fall back to the page cache
+            config.info.lo_flags &= ~LO_FLAGS_DIRECT_IO;
+            result = ioctl(loop_fd, LOOP_CONFIGURE, &config);
+        }
+        if (result != 0 && errno != EBUSY) {
+            printf("Failed to configure %s: %s\n", device, strerror(errno));
+            close(loop_fd);
+            break;
+        }
+        close(loop_fd);  // Another run took the device in between when EBUSY, ask for the next free one
+    }
+    close(image_fd);
+    close(control_fd);
+    if (result == 0) {
+        printf("%s\n", device);
+    }
+    return result;
+}
 
-                // List and allow the user to select a disk image for deletion
-                printf("Disk images available for deletion:\n");
+// Function to detach a loop device, one that was already released counts as detached
+static int detachLoop(const char *device) {
+    int loop_fd = open(device, O_RDWR | O_CLOEXEC);
+    if (loop_fd < 0) {
+        printf("Failed to open %s: %s\n", device, strerror(errno));
+        return -1;
+    }
+    int result = ioctl(loop_fd, LOOP_CLR_FD, 0);
+    if (result != 0 && errno == ENXIO) {
+        result = 0;
+    } else if (result != 0) {
+        printf("Failed to detach %s: %s\n", device, strerror(errno));
+    }
+    close(loop_fd);
+    return result;
+}
 
-                int image_count = 0;
-                struct dirent *entry;
-                DIR *dp = opendir("images");
-                if (dp == NULL) {
-                    printf("Failed to open 'images' subfolder.\n");
-                    break;
-                }
+// Function to attach a raw image to a loop device through the loop-attach command, returns 0 or an exit code
+static int loopAttach(const char *real_path, char *device, size_t device_size) {
+    if (access(LOOP_CONTROL, F_OK) != 0) {
+        return EXIT_DEPENDENCY;
+    }
+    char output[4096];
+    const char *attach_argv[] = {selfPath(), "loop-attach", real_path, NULL};
+    int status = runProcess(attach_argv, 1, PROCESS_TIMEOUT_MS, output, sizeof(output));
+    char *line = strstr(output, "/dev/loop");
+    if (status != 0 || line == NULL) {
+        printf("%s", output);
+        return status < 0 ? EXIT_DEPENDENCY : 1;
+    }
+    line[strcspn(line, "\n")] = '\0';
+    snprintf(device, device_size, "%s", line);
+    return 0;
+}
 
-                while ((entry = readdir(dp))) {
-                    if (entry->d_type == DT_REG &&
-                        (strstr(entry->d_name, ".img") || strstr(entry->d_name, ".qcow2"))) {
-                        printf("%d. %s\n", ++image_count, entry->d_name);
-                    }
-                }
-                closedir(dp);
+// Function to detach a loop device through the loop-detach command
+static int loopDetach(const char *device) {
+    const char *detach_argv[] = {selfPath(), "loop-detach", device, NULL};
+    if (runProcess(detach_argv, 1, PROCESS_TIMEOUT_MS, NULL, 0) != 0) {
+        printf("Failed to detach %s.\n", device);
+        return -1;
+    }
+    return 0;
+}
 
-                if (image_count == 0) {
-                    printf("No disk images found in 'images' subfolder. Create some images first.\n");
-                    sleep(4);
-                    break;
-                }
+// Function to find which partition of an image holds its FAT32 volume, 0 when the volume spans the whole image
+static int imagePartition(const char *image_path) {
+    DiskImage image;
+    uint64_t offset;
+    if (imageOpen(&image, image_path, 0) != 0) {
+        return -1;
+    }
+    int partition = findFatVolume(&image, &offset);
+    imageClose(&image);
+    return partition;
+}
 
-                int selected_image;
-                printf("Enter the number of the image to delete (1-%d): ", image_count);
-                scanf("%d", &selected_image);
+// Function to strip the partition suffix of a loop or nbd partition node, /dev/loop0p1 becomes /dev/loop0
+static void wholeDevice(char *device) {
+    if (strncmp(device, "/dev/loop", 9) == 0 || strncmp(device, "/dev/nbd", 8) == 0) {
+        char *p = device + (device[5] == 'l' ? 9 : 8);
+        while (isdigit((unsigned char)*p)) {
+            p++;
+        }
+        if (*p == 'p') {
+            *p = '\0';
+        }
+    }
+}
 
-                if (selected_image < 1 || selected_image > image_count) {
-                    printf("Invalid selection.\n");
-                    break;
-                }
+// How long to wait for the kernel to create the node of a partition it found on a newly attached device
+#define PARTITION_WAIT_MS 5000
+
+// Function to create the mount point and mount an attached device, or the partition holding the volume, on it with
+// the caller's ownership
+static int mountDevice(const char *device, int partition, const char *mount_point) {
+    char node[80];
+    snprintf(node, sizeof(node), "%s", device);
+    if (partition > 0) {
+        snprintf(node, sizeof(node), "%sp%d", device, partition);
+        TraceMark mark = traceBegin();
+        for (int waited = 0; access(node, F_OK) != 0; waited += 10) {
+            if (waited >= PARTITION_WAIT_MS) {
+                printf("The kernel did not create %s, the partitions of %s were not scanned.\n", node, device);
+                traceEnd(&mark, "phase", "partition wait", node);
+                return -1;
+            }
+            usleep(10 * 1000);
+        }
+        traceEnd(&mark, "phase", "partition wait", node);
+    }
+    if (mkdir(mount_point, 0755) == 0) {
+        printf("Created '%s' directory.\n", mount_point);
+    } else if (errno != EEXIST) {
+        printf("Failed to create '%s' directory.\n", mount_point);
+        return -1;
+    }
+    char mount_options[64];
+    snprintf(mount_options, sizeof(mount_options), "uid=%u,gid=%u", (unsigned)getuid(), (unsigned)getgid());
+    const char *mount_argv[] = {"mount", "-o", mount_options, node, mount_point, NULL};
+    if (runProcess(mount_argv, 1, PROCESS_TIMEOUT_MS, NULL, 0) != 0) {
+        printf("Failed to mount %s to '%s' directory.\n", node, mount_point);
+        return -1;
+    }
+    printf("Image mounted to '%s' directory successfully.\n", mount_point);
+    return 0;
+}
 
-                // Get the name of the selected image
-                dp = opendir("images");
-                if (dp == NULL) {
-                    printf("Failed to open 'images' subfolder.\n");
-                    break;
-                }
+// Function to find the loop or nbd device an image is attached to, returns 0 when there is one
+int findAttachedImage(const char *real_path, char *device, size_t device_size) {
+    if (loopFindImage(real_path, device, device_size) == 0 || nbdPoolFindImage(real_path, device, device_size) == 0) {
+        return 0;
+    }
+    return -1;
+}
 
-                int current_image = 0;
-                char selected_image_name[256];
-                while ((entry = readdir(dp))) {
-                    if (entry->d_type == DT_REG &&
-                        (strstr(entry->d_name, ".img") || strstr(entry->d_name, ".qcow2"))) {
-                        current_image++;
-                        if (current_image == selected_image) {
-                            strcpy(selected_image_name, entry->d_name);
-                            break;
-                        }
-                    }
-                }
-                closedir(dp);
-
-                // Confirm deletion
-                char confirm;
-                printf("Are you sure you want to delete '%s'? (y/n): ", selected_image_name);
-                scanf(" %c", &confirm);
-
-                if (confirm == 'y' || confirm == 'Y') {
-                    char image_path[512];
-                    snprintf(image_path, sizeof(image_path), "images/%s", selected_image_name);
-
-                    // Delete the selected image
-                    if (remove(image_path) == 0) {
-                        printf("Disk image '%s' deleted successfully.\n", selected_image_name);
-                    } else {
-                        printf("Failed to delete disk image '%s'.\n", selected_image_name);
-                    }
-                } else {
-                    printf("Deletion canceled.\n");
-                }
-                sleep(2);
-                break;
-            case 3:
-                {
-                    system("clear");
+// Function to attach an image and mount it, returns 0 or an exit code. Raw images go to a loop device,
+// QCOW2 images (and raw ones on kernels without LOOP_CONFIGURE) to a free nbd device of the pool.
+int mountImage(const char *image_path, const char *mount_point, char *device, size_t device_size) {
+    // Raw images fall back to DiskProvision's own nbd server, qcow2 images still need qemu-nbd
+    int qcow2 = detectImageFormat(image_path) == IMAGE_FORMAT_QCOW2;
+    if (qcow2 && !isExecutableAvailable("qemu-nbd")) {
+        printf("Please install the required package: qemu-utils.\n");
+        return EXIT_DEPENDENCY;
+    }
+    if (findMountedDevice(mount_point, device, device_size, NULL, 0) == 0) {
+        printf("%s is already mounted at '%s', unmount it first.\n", device, mount_point);
+        return EXIT_EXISTS;
+    }
 
-                    // Mount Disk Image logic
+    // The kernel must not see metadata an interrupted DiskProvision writer left half applied
+    TraceMark mark = traceBegin();
+    if (fatReplayJournal(image_path) != 0) {
+        return 1;
+    }
+    int partition = imagePartition(image_path);
+    if (partition < 0) {
+        return 1;
+    }
+    traceEnd(&mark, "phase", "journal replay", image_path);
+
+    // Attaching the same image twice, or under a FUSE mount or put, would let two writers corrupt it. The lock is
+    // held until the attachment is in place, from then on lockImageForWriting() finds the device instead
+    char real_path[4096];
+    if (realpath(image_path, real_path) == NULL) {
+        printf("Failed to resolve '%s': %s\n", image_path, strerror(errno));
+        return EXIT_NOT_FOUND;
+    }
+    int image_lock = lockImageForWriting(image_path);
+    if (image_lock < 0) {
+        return errno == EBUSY ? EXIT_EXISTS : 1;
+    }
 
-                    // Check if the "images" subfolder exists
-                    if (!directoryExists("images")) {
-                        printf("No disk images found in 'images' subfolder. Create some images first.\n");
-                        sleep(3);
-                        break;
-                    }
+    // No nbd module and no userspace server in between for raw images
+    if (!qcow2) {
+        mark = traceBegin();
+        int code = loopAttach(real_path, device, device_size);
+        traceEnd(&mark, "phase", "loop attach", real_path);
+        if (code == 0) {
+            close(image_lock);
+            printf("Image '%s' attached as %s.\n", image_path, device);
+            if (mountDevice(device, partition, mount_point) != 0) {
+                loopDetach(device);
+                return 1;
+            }
+            return 0;
+        }
+        printf("Loop devices are not available, using nbd instead.\n");
+    }
 
-                    // Declare variables here
-                    int image_count = 0;
-                    struct dirent *entry;
-                    DIR *dp = opendir("images");
-                    int selected_image;
-                    char selected_image_name[256];
+    // Load the nbd module when the kernel has no nbd devices yet
+    mark = traceBegin();
+    char **names;
+    int count = nbdPoolDevices(&names);
+    freeNames(names, count);
+    traceEnd(&mark, "phase", "nbd probe", NULL);
+    if (count <= 0) {
+        printf("nbd module is not loaded. Loading...\n");
+        const char *modprobe_argv[] = {"modprobe", "nbd", "max_part=8", NULL};
+        if (runProcess(modprobe_argv, 1, PROCESS_TIMEOUT_MS, NULL, 0) != 0) {
+            printf("Failed to load the nbd module.\n");
+            close(image_lock);
+            return 1;
+        }
+        printf("nbd module loaded successfully.\n");
+    }
 
-                    if (dp == NULL) {
-                        printf("Failed to open 'images' subfolder.\n");
-                        sleep(3);
-                        break;
-                    }
+    int next = 0;
+    int lock_fd;
+    while ((lock_fd = nbdPoolClaim(&next, device, device_size)) >= 0) {
+        // Connect the image to the claimed device, passing the output of the server through
+        char connect_option[128], output[4096];
+        snprintf(connect_option, sizeof(connect_option), "--connect=%s", device);
+        const char *qemu_argv[] = {"qemu-nbd", connect_option, "-f", "qcow2", real_path, NULL};
+        const char *serve_argv[] = {selfPath(), "nbd-serve", device, real_path, NULL};
+        mark = traceBegin();
+        int status = runProcess(qcow2 ? qemu_argv : serve_argv, 1, PROCESS_TIMEOUT_MS, output, sizeof(output));
+        traceEnd(&mark, "phase", "nbd connect", device);
+        printf("%s", output);
+        if (status < 0) {
+            close(lock_fd);
+            close(image_lock);
+            return EXIT_DEPENDENCY;
+        }
+        if (status != 0) {
+            printf("Failed to connect %s to the image.\n", device);
+            close(lock_fd);
+            continue;
+        }
+        nbdPoolRecord(lock_fd, image_path);
+        close(image_lock);
+        printf("Image '%s' connected as %s.\n", image_path, device);
 
-                    while ((entry = readdir(dp))) {
-                        if (entry->d_type == DT_REG &&
-                            (strstr(entry->d_name, ".img") || strstr(entry->d_name, ".qcow2"))) {
-                            printf("%d. %s\n", ++image_count, entry->d_name);
-                        }
-                    }
-                    closedir(dp);
+        if (mountDevice(device, partition, mount_point) != 0) {
+            nbdDisconnect(device);
+            return 1;
+        }
+        return 0;
+    }
 
-                    if (image_count == 0) {
-                        printf("No disk images found in 'images' subfolder. Create some images first.\n");
-                        sleep(3);
-                        break;
-                    }
+    printf("No free nbd device, all of them are in use.\n");
+    close(image_lock);
+    return 1;
+}
 
-                    printf("Enter the number of the image to mount (1-%d): ", image_count);
-                    scanf("%d", &selected_image);
+// Function to unmount the image mounted at a directory and disconnect its nbd device, returns 0 or an exit code
+int unmountImage(const char *mount_point, char *device, size_t device_size) {
+    char type[256];
+    if (findMountedDevice(mount_point, device, device_size, type, sizeof(type)) != 0) {
+        printf("No mounted image found in '%s' directory.\n", mount_point);
+        return EXIT_NOT_FOUND;
+    }
 
-                    if (selected_image < 1 || selected_image > image_count) {
-                        printf("Invalid selection.\n");
-                        sleep(2);
-                        break;
-                    }
+    // FUSE mounts are undone without sudo, the server writes the FAT back once the kernel lets go
+    TraceMark mark = traceBegin();
+    if (strncmp(type, "fuse", 4) == 0) {
+        if (fuseUnmount(mount_point, 0) != 0) {
+            printf("Failed to unmount the image.\n");
+            return 1;
+        }
+        traceEnd(&mark, "phase", "unmount", mount_point);
+        mark = traceBegin();
+        fuseWaitReleased(device);
+        traceEnd(&mark, "phase", "fuse release", device);
+    } else {
+        const char *umount_argv[] = {"umount", mount_point, NULL};
+        if (runProcess(umount_argv, 1, PROCESS_TIMEOUT_MS, NULL, 0) != 0) {
+            printf("Failed to unmount the image.\n");
+            return 1;
+        }
+        traceEnd(&mark, "phase", "unmount", mount_point);
+    }
+    printf("Image unmounted.\n");
+    wholeDevice(device);
+
+    // Detach the loop device, or disconnect the NBD device and hand it back to the pool
+    mark = traceBegin();
+    if (strncmp(device, "/dev/loop", 9) == 0) {
+        if (loopDetach(device) != 0) {
+            return 1;
+        }
+        printf("Loop device %s detached.\n", device);
+    } else if (strncmp(device, "/dev/nbd", 8) == 0) {
+        if (nbdDisconnect(device) != 0) {
+            return 1;
+        }
+        printf("NBD device disconnected from %s.\n", device);
+    }
+    traceEnd(&mark, "phase", "detach", device);
 
-                    // Get the name of the selected image
-                    dp = opendir("images");
-                    if (dp == NULL) {
-                        printf("Failed to open 'images' subfolder.\n");
-                        sleep(3);
-                        break;
-                    }
+    // Remove the mount point, it is empty once unmounted
+    if (rmdir(mount_point) != 0) {
+        printf("Failed to remove '%s' directory.\n", mount_point);
+        return 1;
+    }
+    printf("Directory '%s' removed.\n", mount_point);
+    return 0;
+}
 
-                    int current_image = 0;
-                    while ((entry = readdir(dp))) {
-                        if (entry->d_type == DT_REG &&
-                            (strstr(entry->d_name, ".img") || strstr(entry->d_name, ".qcow2"))) {
-                            current_image++;
-                            if (current_image == selected_image) {
-                                strcpy(selected_image_name, entry->d_name);
-                                break;
-                            }
-                        }
-                    }
-                    closedir(dp);
-
-                    // Check if the nbd module is loaded
-                    if (system("lsmod | grep -q '^nbd'") != 0) {
-                        printf("nbd module is not loaded. Loading...\n");
-                        if (system("sudo modprobe nbd max_part=8") != 0) {
-                            printf("Failed to load the nbd module.\n");
-                            sleep(3);
-                            break;
-                        }
-                        printf("nbd module loaded successfully.\n");
-                        sleep(3);
-                    } else {
-                        printf("nbd module is already loaded. Proceeding...\n");
-                    }
+// Function to run a command line, the nbd server commands are only available on Linux
+static int runCommand(int argc, char *argv[]) {
+    if (strcmp(argv[1], "nbd-serve") == 0 && argc == 4) {
+        return serveNbd(argv[2], argv[3]) == 0 ? 0 : 1;
+    }
+    if (strcmp(argv[1], "nbd-disconnect") == 0 && argc == 3) {
+        return disconnectNbd(argv[2]) == 0 ? 0 : 1;
+    }
+    if (strcmp(argv[1], "loop-attach") == 0 && argc == 3) {
+        return attachLoop(argv[2]) == 0 ? 0 : 1;
+    }
+    if (strcmp(argv[1], "loop-detach") == 0 && argc == 3) {
+        return detachLoop(argv[2]) == 0 ? 0 : 1;
+    }
+    if (strcmp(argv[1], "fuse") == 0 && argc >= 3 && argc <= 5) {
+        // fuse [-f] <image> [mountpoint], -f keeps the server in the foreground
+        int foreground = strcmp(argv[2], "-f") == 0;
+        char image_path[512];
+        if (argc - foreground >= 3 && argc - foreground <= 4) {
+            int code = resolveImagePath(argv[2 + foreground], image_path, sizeof(image_path));
+            if (code != 0) {
+                return code;
+            }
+            return fuseMountImage(image_path, argc - foreground == 4 ? argv[3 + foreground] : MOUNT_POINT, foreground);
+        }
+    }
+    return runImageCommand(argc, argv);
+}
 
-                    int nbd_number = 0;
-                    int max_nbd_attempts = 6;  // You can adjust the maximum number of attempts
+// Define the debug_disable variable (1 for disable, 0 for enable)
+#ifndef DEBUG_DISABLE
+#define DEBUG_DISABLE 1
+#endif
+
+// Main function, conditionally compiled based on DEBUG_DISABLE
+#if DEBUG_DISABLE
+int main(int argc, char *argv[]) {
+    // Commands do not depend on the interactive menu and stay available
+    if (argc > 1) {
+        return runCommand(argc, argv);
+    }
 
-                    while (nbd_number < max_nbd_attempts) {
-                    // Check if /dev/nbdX is already connected
-                    char nbd_device[15];
-                    snprintf(nbd_device, sizeof(nbd_device), "/dev/nbd%d", nbd_number);
+    printf("DiskProvision is currently disabled. Please use the bash scripts located in the legacy folder.\n");
+    printf("If you for whatever reason enable DiskProvision, do not report bugs or issues.\n");
+    printf("\n\n");
+    printf("Quickly make a new OpenCore.img by issuing the following command:\n");
+    printf("./legacy/init.sh\n\n");
+    printf("Make sure to unmount the image before using it in a Virtual Machine:\n");
+    printf("./legacy/unmount.sh\n\n");
+    printf("Run '%s help' for the command line interface.\n\n", argv[0]);
+    return 0;
+}
+#else
+// Interactive menu, a frontend to the same functions the commands use
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        return runCommand(argc, argv);
+    }
 
-                    char lsblk_command[512];
-                    snprintf(lsblk_command, sizeof(lsblk_command), "lsblk -o NAME | grep -q '^%s$'", nbd_device);
+    char image_name[256];
+    char image_size[256];
+    char image_path[512];
+    char device[64];
+    int choice;
 
-                    if (system(lsblk_command) == 0) {
-                        printf("%s is already connected. Disconnecting...\n", nbd_device);
-                        
-                        char disconnect_command[512];
-                        snprintf(disconnect_command, sizeof(disconnect_command), "sudo qemu-nbd --disconnect %s", nbd_device);
+    do {
+        // Clear the screen
+        clearScreen();
 
-                        if (system(disconnect_command) != 0) {
-                            printf("Failed to disconnect %s.\n", nbd_device);
-                            sleep(3);
-                            break;
-                        }
-                    }
+        // Display welcome message
+        printf("Welcome to DiskProvision!\n");
+        printf("Copyright (c) 2023 RoyalGraphX\n");
+        printf("Linux x86_64 Pre-Release 0.0.3\n\n");
 
-                    // Use qemu-nbd to connect the image to the current /dev/nbdX
-                    char nbd_command[512];
-                    snprintf(nbd_command, sizeof(nbd_command), "sudo qemu-nbd --connect=%s -f raw images/%s 2>&1", nbd_device, selected_image_name);
-
-                    // Open a pipe to read the command output
-                    FILE *fp = popen(nbd_command, "r");
-                    if (fp != NULL) {
-                        // Read and print the output of the command
-                        char buffer[512];
-                        while (fgets(buffer, sizeof(buffer), fp) != NULL) {
-                            printf("%s", buffer);
-                        }
+        // Display menu options
+        printf("Menu:\n");
+        printf("1. Create New Disk Image\n");
+        printf("2. Delete Disk Image\n");
+        printf("3. Mount Disk Image\n");
+        printf("4. Unmount Disk Image\n");
+        printf("5. Exit\n\n");
+        printf("Enter your choice: ");
+        if (scanf("%d", &choice) != 1) {
+            choice = 0;
+        }
+        clearInputLine();
 
-                        // Close the pipe
-                        pclose(fp);
+        // Handle user's choice
+        switch (choice) {
+            case 1:
+                {
+                    clearScreen();
+
+                    // Display available free space before creating the image
+                    printf("Available free space before creating the image: %.2f GB\n", getFreeSpace() / (1024.0 * 1024.0 * 1024.0));
+
+                    // Display menu for image format selection
+                    printf("Choose the image format:\n");
+                    printf("1. Raw\n");
+                    printf("2. QCOW2\n");
+                    printf("Enter your choice (1 or 2): ");
+                    int format_choice = 1;
+                    scanf("%d", &format_choice);
+                    if (format_choice != 1 && format_choice != 2) {
+                        printf("Invalid format choice. Using Raw format by default.\n");
+                        format_choice = 1;
+                    }
 
-                        // Additional sleep to see the error message
-                        sleep(5);
-                    } else {
-                        printf("Failed to open pipe for command execution.\n");
+                    // Prompt user for image name and size
+                    printf("Enter the name for the disk image (without .img extension): ");
+                    scanf("%255s", image_name);
+                    printf("Enter the size (in GB) for the disk image (e.g., 1): ");
+                    scanf("%255s", image_size);
+                    uint64_t size_bytes = parseSize(image_size);
+                    if (size_bytes == 0) {
+                        printf("Invalid size '%s'.\n", image_size);
+                        clearInputLine();
+                        waitForEnter();
+                        break;
                     }
 
-                    if (system(nbd_command) == 0) {
-                        printf("Image '%s' mounted as %s.\n", selected_image_name, nbd_device);
-
-                        // Create a mount point if it doesn't exist
-                        struct stat st;
-                        if (stat("mnt", &st) == -1) {
-                            if (mkdir("mnt", 0755) != 0) {
-                                printf("Failed to create 'mnt' directory.\n");
-                                sleep(3);
-                                break;
-                            }
-                            printf("Created 'mnt' directory.\n");
-                            sleep(3);
+                    // Raw images can be sparse, preallocated or zero-filled
+                    int alloc_choice = 1;
+                    if (format_choice == 1) {
+                        printf("Choose the allocation policy:\n");
+                        printf("1. Sparse (allocate on write)\n");
+                        printf("2. Preallocated (fallocate)\n");
+                        printf("3. Zero-filled\n");
+                        printf("Enter your choice (1-3): ");
+                        scanf("%d", &alloc_choice);
+                        if (alloc_choice < 1 || alloc_choice > 3) {
+                            printf("Invalid allocation choice. Using sparse allocation by default.\n");
+                            alloc_choice = 1;
                         }
+                    }
+                    clearInputLine();
 
-                        // Mount /dev/nbdX to the "mnt" directory with desired ownership
-                        char mount_command[512];
-                        snprintf(mount_command, sizeof(mount_command), "sudo mount -o uid=$(id -u),gid=$(id -g) %s mnt", nbd_device);
-
-                        if (system(mount_command) == 0) {
-                            printf("Image mounted to 'mnt' directory successfully.\n");
-                            sleep(3);
-                            break;  // Successful mount, exit the loop
+                    // The volume label is the image name in uppercase
+                    createDiskImage(image_name, format_choice == 2 ? IMAGE_FORMAT_QCOW2 : IMAGE_FORMAT_RAW, size_bytes,
+                                    (ImageAllocPolicy)(alloc_choice - 1), IMAGE_LAYOUT_GPT, NULL, NULL);
+                    waitForEnter();
+                }
+                break;
+            case 2:
+                {
+                    clearScreen();
+
+                    // Delete Disk Image logic
+                    if (chooseImage("delete", image_path, sizeof(image_path)) == 0) {
+                        // Confirm deletion
+                        char confirm = 'n';
+                        printf("Are you sure you want to delete '%s'? (y/n): ", image_path);
+                        scanf(" %c", &confirm);
+                        clearInputLine();
+                        if (confirm == 'y' || confirm == 'Y') {
+                            deleteDiskImage(image_path);
                         } else {
-                            printf("Failed to mount %s to 'mnt' directory.\n", nbd_device);
-                            sleep(3);
+                            printf("Deletion canceled.\n");
                         }
-                    } else {
-                    printf("Failed to connect %s to the image. Error details:\n", nbd_device);
-
-                    // Print detailed error information
-                    char error_command[512];
-                    snprintf(error_command, sizeof(error_command), "sudo qemu-nbd --connect=%s -f raw images/%s", nbd_device, selected_image_name);
-                    system(error_command);
-
-                    // Additional sleep to see the error message
-                    sleep(5);
-                }
-
-                    // Increment nbd_number for the next attempt
-                    nbd_number++;
+                    }
+                    waitForEnter();
                 }
+                break;
+            case 3:
+                {
+                    clearScreen();
 
-                    // If the loop completes without a successful mount, print an error message
-                    if (nbd_number == max_nbd_attempts) {
-                        printf("Failed to mount the image on any available nbd device.\n");
+                    // Mount Disk Image logic
+                    if (chooseImage("mount", image_path, sizeof(image_path)) == 0) {
+                        mountImage(image_path, MOUNT_POINT, device, sizeof(device));
                     }
+                    waitForEnter();
                 }
                 break;
             case 4:
                 {
-                    system("clear");
+                    clearScreen();
 
                     // Unmount Disk Image logic
-
-                    // Check if the "mnt" directory exists
-                    if (directoryExists("mnt")) {
-                        // Find the connected NBD device
-                        int nbd_number = 0;
-                        char nbd_device[15];
-                        while (1) {
-                        snprintf(nbd_device, sizeof(nbd_device), "/dev/nbd%d", nbd_number);
-
-                        // Check if /dev/nbdX is already connected
-                        char lsblk_command[512];
-                        snprintf(lsblk_command, sizeof(lsblk_command), "lsblk -o NAME | grep -q '^%s$'", nbd_device);
-
-                        if (system(lsblk_command) == 0) {
-                            printf("%s is already connected. Disconnecting...\n", nbd_device);
-
-                            // Unmount the image from the "mnt" directory
-                            char umount_command[512];
-                            snprintf(umount_command, sizeof(umount_command), "sudo umount mnt");
-                            if (system(umount_command) != 0) {
-                                printf("Failed to unmount the image.\n");
-                                sleep(3);
-                                break;
-                            }
-                            printf("Image unmounted.\n");
-
-                            // Disconnect the NBD device
-                            char disconnect_command[512];
-                            snprintf(disconnect_command, sizeof(disconnect_command), "sudo qemu-nbd --disconnect %s", nbd_device);
-                            if (system(disconnect_command) != 0) {
-                                printf("Failed to disconnect NBD device.\n");
-                                sleep(3);
-                                break;
-                            }
-                            printf("NBD device disconnected from %s.\n", nbd_device);
-
-                            // Remove the "mnt" directory
-                            if (system("rm -rf mnt") != 0) {
-                                printf("Failed to remove 'mnt' directory.\n");
-                                sleep(3);
-                                break;
-                            }
-                            printf("Directory 'mnt' removed.\n");
-
-                            break;  // Exit the loop as the unmounting process is complete
-                        }
-
-                        // Increment nbd_number for the next attempt
-                        nbd_number++;
-                    }
-                    } else {
-                        printf("No mounted image found in 'mnt' directory.\n");
-                    }
-
-                    sleep(3);
+                    unmountImage(MOUNT_POINT, device, sizeof(device));
+                    waitForEnter();
                 }
                 break;
             case 5:
@@ -564,13 +1054,10 @@ int main() {
                 break;
             default:
                 printf("Invalid choice. Please select a valid option.\n");
+                waitForEnter();
         }
-
-        // Clear the input buffer
-        while (getchar() != '\n');
-
-    } while (choice != 5);
+    } while (choice != 5 && !feof(stdin));
 
     return 0;
 }
-#endif
\ No newline at end of file
+#endif
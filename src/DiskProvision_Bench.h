@@ -0,0 +1,535 @@
+/*
+ * DiskProvision - Allows the creation, management, and updating of disk images for use with QEMU.
+ * DiskProvision_Bench.h - Benchmark of the create, format, populate, mount and teardown paths.
+ * BSD 3-Clause "New" or "Revised" License
+ * Copyright (c) 2024 RoyalGraphX
+ * All rights reserved.
+ */
+
+#ifndef DISKPROVISION_BENCH_H
+#define DISKPROVISION_BENCH_H
+
+#ifdef __linux__
+#include <sys/vfs.h> // For statfs()
+#include <sys/sysmacros.h> // For major()
+#endif
+#include "DiskProvision_Image.h"
+
+#define BENCH_DEFAULT_SIZES "64M,1G,16G,64G"
+#define BENCH_DEFAULT_RUNS 5
+#define BENCH_DEFAULT_FILES 200
+#define BENCH_MAX_SIZES 16
+#define BENCH_MAX_RUNS 1000
+#define BENCH_TMPFS_MAGIC 0x01021994
+#define BENCH_RAMFS_MAGIC 0x858458F6
+#define BENCH_LOOP_MAJOR 7
+
+// Provisioning paths being compared
+typedef enum {
+    BENCH_PATH_SPARSE,
+    BENCH_PATH_FALLOC,
+    BENCH_PATH_ZERO,
+    BENCH_PATH_QCOW2,
+    BENCH_PATH_COUNT
+} BenchPath;
+
+static const char *const bench_path_names[BENCH_PATH_COUNT] = {"raw-sparse", "raw-falloc", "raw-zero", "qcow2"};
+
+// Timed steps of one provisioning cycle, in the order they run
+typedef enum {
+    BENCH_CREATE,                 // Blank raw image, or the formatted QCOW2 image
+    BENCH_FORMAT,                 // FAT32 format of the image just created
+    BENCH_POPULATE,               // put of the generated file tree
+    BENCH_MOUNT,                  // FUSE mount until the mount point answers
+    BENCH_UNMOUNT,                // FUSE unmount until the image is written back
+    BENCH_TEARDOWN,               // Deleting the image
+    BENCH_PHASE_COUNT
+} BenchPhase;
+
+static const char *const bench_phase_names[BENCH_PHASE_COUNT] = {"create", "format", "populate", "mount",
+                                                                 "unmount", "teardown"};
+
+// Samples of one path, size and phase
+typedef struct {
+    double ms[BENCH_MAX_RUNS];
+    int count;
+    int failed;
+    uint64_t allocated;           // Bytes the image used on the host after the phase, last run
+} BenchSeries;
+
+// Options of a benchmark run
+typedef struct {
+    const char *dir;
+    uint64_t sizes[BENCH_MAX_SIZES];
+    int size_count;
+    int runs;
+    int files;
+    const char *distribution;
+    int paths[BENCH_PATH_COUNT];
+    int mount;
+} BenchOptions;
+
+// Function to silence the engine while a phase is timed, messages would distort short timings
+static int benchQuiet(int quiet, int saved) {
+    fflush(stdout);
+    if (quiet) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        saved = dup(STDOUT_FILENO);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+        return saved;
+    }
+    if (saved >= 0) {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+    return -1;
+}
+
+// Function to check that the benchmark directory is memory or loop backed, so timings do not depend on a disk
+static int benchCheckDir(const char *dir, char *kind, size_t kind_size) {
+    struct stat st;
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        printf("'%s' is not a directory.\n", dir);
+        return -1;
+    }
+#ifdef __linux__
+    struct statfs fs;
+    if (statfs(dir, &fs) != 0) {
+        return -1;
+    }
+    if ((unsigned long)fs.f_type == BENCH_TMPFS_MAGIC || (unsigned long)fs.f_type == BENCH_RAMFS_MAGIC) {
+        snprintf(kind, kind_size, "tmpfs");
+        return 0;
+    }
+    if (major(st.st_dev) == BENCH_LOOP_MAJOR) {
+        snprintf(kind, kind_size, "loop");
+        return 0;
+    }
+    printf("'%s' is neither tmpfs nor on a loop device, pass --any-fs to benchmark it anyway.\n", dir);
+    return -1;
+#else
+    // macOS has no tmpfs, a RAM disk from hdiutil is what to point --dir at
+    snprintf(kind, kind_size, "unchecked");
+    return 0;
+#endif
+}
+
+// Function to draw the next value of a small deterministic generator, every run populates the same tree
+static uint64_t benchRandom(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Function to pick a file size from a distribution: small config files, a realistic EFI folder or large payloads
+static uint64_t benchFileSize(const char *distribution, uint64_t *state) {
+    uint64_t r = benchRandom(state);
+    if (strcmp(distribution, "small") == 0) {
+        return 512 + r % (16 * 1024);
+    }
+    if (strcmp(distribution, "large") == 0) {
+        return 1024 * 1024 + r % (31 * 1024 * 1024);
+    }
+    int bucket = (int)(benchRandom(state) % 100);
+    if (bucket < 80) {
+        return 256 + r % (64 * 1024);
+    }
+    if (bucket < 98) {
+        return 64 * 1024 + r % (1024 * 1024);
+    }
+    return 1024 * 1024 + r % (7 * 1024 * 1024);
+}
+
+// Function to generate the host tree every image is populated with, files spread over a few directories
+static int benchMakeTree(const char *root, int files, const char *distribution, uint64_t *total) {
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    uint8_t *buffer = malloc(IMAGE_ZERO_CHUNK);
+    if (buffer == NULL || mkdir(root, 0755) != 0) {
+        free(buffer);
+        printf("Failed to create '%s': %s\n", root, strerror(errno));
+        return -1;
+    }
+    *total = 0;
+    int result = 0;
+    for (int i = 0; i < files && result == 0; i++) {
+        // Room for the longest root the callers pass plus the directory and file name
+        char path[4096 + sizeof("/dir00/file-2147483648.bin")];
+        snprintf(path, sizeof(path), "%s/dir%02d", root, i % 16);
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            result = -1;
+            break;
+        }
+        snprintf(path, sizeof(path), "%s/dir%02d/file%05d.bin", root, i % 16, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            result = -1;
+            break;
+        }
+        uint64_t size = benchFileSize(distribution, &state);
+        for (uint64_t offset = 0; offset < size && result == 0; offset += IMAGE_ZERO_CHUNK) {
+            size_t chunk = size - offset < IMAGE_ZERO_CHUNK ? (size_t)(size - offset) : IMAGE_ZERO_CHUNK;
+            for (size_t j = 0; j + 8 <= chunk; j += 8) {
+                uint64_t value = benchRandom(&state);
+                memcpy(buffer + j, &value, 8);
+            }
+            result = writeAll(fd, buffer, chunk, offset);
+        }
+        close(fd);
+        *total += size;
+    }
+    free(buffer);
+    if (result != 0) {
+        printf("Failed to generate the benchmark files: %s\n", strerror(errno));
+    }
+    return result;
+}
+
+// Function to remove a generated tree
+static void benchRemoveTree(const char *root) {
+    struct dirent **names;
+    int count = scandir(root, &names, NULL, alphasort);
+    for (int i = 0; i < count; i++) {
+        char path[4096];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", root, names[i]->d_name);
+        if (strcmp(names[i]->d_name, ".") != 0 && strcmp(names[i]->d_name, "..") != 0 && lstat(path, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                benchRemoveTree(path);
+            } else {
+                unlink(path);
+            }
+        }
+        free(names[i]);
+    }
+    if (count >= 0) {
+        free(names);
+    }
+    rmdir(root);
+}
+
+// Function to get how many bytes a file occupies on the host
+static uint64_t benchAllocated(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (uint64_t)st.st_blocks * 512 : 0;
+}
+
+#ifdef DISKPROVISION_FUSE_H
+// Function to mount an image through FUSE from a child, the server detaches and the child returns once mounted
+static int benchMount(const char *image_path, const char *mount_point) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        _exit(fuseMountImage(image_path, mount_point, 0));
+    }
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    struct stat st;
+    return stat(mount_point, &st);
+}
+
+static int benchUnmount(const char *image_path, const char *mount_point) {
+    if (fuseUnmount(mount_point, 0) != 0) {
+        return -1;
+    }
+    int result = fuseWaitReleased(image_path);
+    rmdir(mount_point);
+    return result;
+}
+#endif
+
+// Function to run one provisioning cycle of a path and size, adding one sample to each phase
+static void benchCycle(const BenchOptions *options, BenchPath path, uint64_t size, const char *tree,
+                       BenchSeries *series) {
+    char image_path[4096], mount_point[4096];
+    snprintf(image_path, sizeof(image_path), "%s/bench.%s", options->dir, path == BENCH_PATH_QCOW2 ? "qcow2" : "img");
+    snprintf(mount_point, sizeof(mount_point), "%s/bench-mnt", options->dir);
+    unlink(image_path);
+
+    int ok = 1;
+    for (int phase = 0; phase < BENCH_PHASE_COUNT && ok; phase++) {
+        if (phase == BENCH_POPULATE && tree == NULL) {
+            continue;
+        }
+        if ((phase == BENCH_MOUNT || phase == BENCH_UNMOUNT) && !options->mount) {
+            continue;
+        }
+        struct timespec start;
+        int saved = benchQuiet(1, -1);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int result = -1;
+        switch (phase) {
+            case BENCH_CREATE:
+                if (path == BENCH_PATH_QCOW2) {
+                    result = createQcow2Image(image_path, size, "BENCH", IMAGE_LAYOUT_GPT);
+                } else {
+                    result = createRawImage(image_path, size, path == BENCH_PATH_SPARSE   ? IMAGE_ALLOC_SPARSE
+                                                              : path == BENCH_PATH_FALLOC ? IMAGE_ALLOC_FALLOCATE
+                                                                                          : IMAGE_ALLOC_ZERO);
+                }
+                break;
+            case BENCH_FORMAT:
+                result = formatFat32Image(image_path, "BENCH", IMAGE_LAYOUT_GPT);
+                break;
+            case BENCH_POPULATE:
+                result = putIntoImage(image_path, tree, "/");
+                break;
+#ifdef DISKPROVISION_FUSE_H
+            case BENCH_MOUNT:
+                result = benchMount(image_path, mount_point);
+                break;
+            case BENCH_UNMOUNT:
+                result = benchUnmount(image_path, mount_point);
+                break;
+#endif
+            case BENCH_TEARDOWN:
+                result = unlink(image_path);
+                break;
+        }
+        double ms = elapsedMs(&start);
+        benchQuiet(0, saved);
+
+        BenchSeries *s = &series[phase];
+        if (result != 0) {
+            printf("%s %llu bytes: %s failed.\n", bench_path_names[path], (unsigned long long)size,
+                   bench_phase_names[phase]);
+            s->failed++;
+            ok = 0;
+        } else if (s->count < BENCH_MAX_RUNS) {
+            s->ms[s->count++] = ms;
+            if (phase != BENCH_TEARDOWN) {
+                s->allocated = benchAllocated(image_path);
+            }
+        }
+    }
+    if (!ok) {
+#ifdef DISKPROVISION_FUSE_H
+        if (options->mount) {
+            fuseUnmount(mount_point, 1);
+            fuseWaitReleased(image_path);
+            rmdir(mount_point);
+        }
+#endif
+        unlink(image_path);
+    }
+}
+
+// Function to order samples
+static int compareSamples(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Function to get a nearest-rank percentile of sorted samples
+static double benchPercentile(const double *sorted, int count, int percent) {
+    int rank = (percent * count + 99) / 100;  // ceil(percent / 100 * count) in integers
+    return sorted[rank < 1 ? 0 : rank > count ? count - 1 : rank - 1];
+}
+
+// Function to print one result row as CSV or as a JSON object
+static void benchReport(FILE *out, int json, int first, BenchPath path, uint64_t size, BenchPhase phase,
+                        BenchSeries *s) {
+    double min = 0, max = 0, mean = 0, p50 = 0, p90 = 0, p99 = 0;
+    if (s->count > 0) {
+        qsort(s->ms, (size_t)s->count, sizeof(double), compareSamples);
+        for (int i = 0; i < s->count; i++) {
+            mean += s->ms[i] / s->count;
+        }
+        min = s->ms[0];
+        max = s->ms[s->count - 1];
+        p50 = benchPercentile(s->ms, s->count, 50);
+        p90 = benchPercentile(s->ms, s->count, 90);
+        p99 = benchPercentile(s->ms, s->count, 99);
+    }
+    if (json) {
+        fprintf(out, "%s{\"path\":\"%s\",\"size\":%llu,\"phase\":\"%s\",\"runs\":%d,\"failed\":%d,\"min_ms\":%.3f,"
+                "\"mean_ms\":%.3f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f,\"allocated\":%llu}",
+                first ? "" : ",", bench_path_names[path], (unsigned long long)size, bench_phase_names[phase], s->count,
+                s->failed, min, mean, p50, p90, p99, max, (unsigned long long)s->allocated);
+    } else {
+        fprintf(out, "%s,%llu,%s,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%llu\n", bench_path_names[path],
+                (unsigned long long)size, bench_phase_names[phase], s->count, s->failed, min, mean, p50, p90, p99, max,
+                (unsigned long long)s->allocated);
+    }
+}
+
+// Function to parse the benchmark options, returns -1 on invalid usage
+static int benchParseOptions(int argc, char *argv[], BenchOptions *options, int *any_fs) {
+    memset(options, 0, sizeof(*options));
+    options->runs = BENCH_DEFAULT_RUNS;
+    options->files = BENCH_DEFAULT_FILES;
+    options->distribution = "mixed";
+    options->dir = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+#ifdef DISKPROVISION_FUSE_H
+    options->mount = access("/dev/fuse", R_OK | W_OK) == 0;
+#endif
+    const char *sizes = BENCH_DEFAULT_SIZES;
+    const char *paths = NULL;
+    *any_fs = 0;
+
+    for (int i = 2; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--any-fs") == 0) {
+            *any_fs = 1;
+        } else if (strcmp(argv[i], "--no-mount") == 0) {
+            options->mount = 0;
+        } else if (value == NULL) {
+            return -1;
+        } else if (strcmp(argv[i], "--dir") == 0) {
+            options->dir = value;
+            i++;
+        } else if (strcmp(argv[i], "--sizes") == 0) {
+            sizes = value;
+            i++;
+        } else if (strcmp(argv[i], "--paths") == 0) {
+            paths = value;
+            i++;
+        } else if (strcmp(argv[i], "--runs") == 0) {
+            options->runs = atoi(value);
+            i++;
+        } else if (strcmp(argv[i], "--files") == 0) {
+            options->files = atoi(value);
+            i++;
+        } else if (strcmp(argv[i], "--dist") == 0) {
+            options->distribution = value;
+            i++;
+        } else {
+            return -1;
+        }
+    }
+    if (options->runs < 1 || options->runs > BENCH_MAX_RUNS || options->files < 0 ||
+        (strcmp(options->distribution, "small") != 0 && strcmp(options->distribution, "mixed") != 0 &&
+         strcmp(options->distribution, "large") != 0)) {
+        return -1;
+    }
+
+    char list[256];
+    snprintf(list, sizeof(list), "%s", sizes);
+    for (char *save = NULL, *item = strtok_r(list, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        if (options->size_count == BENCH_MAX_SIZES || (options->sizes[options->size_count++] = parseSize(item)) == 0) {
+            return -1;
+        }
+    }
+    for (int p = 0; p < BENCH_PATH_COUNT; p++) {
+        options->paths[p] = paths == NULL;
+    }
+    if (paths != NULL) {
+        snprintf(list, sizeof(list), "%s", paths);
+        for (char *save = NULL, *item = strtok_r(list, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+            int found = 0;
+            for (int p = 0; p < BENCH_PATH_COUNT; p++) {
+                if (strcmp(item, bench_path_names[p]) == 0 || strcmp(item, bench_path_names[p] + 4) == 0) {
+                    options->paths[p] = found = 1;
+                }
+            }
+            if (!found) {
+                return -1;
+            }
+        }
+    }
+    return options->size_count > 0 ? 0 : -1;
+}
+
+// Function to time every provisioning path over a range of image sizes and print the percentiles as CSV, or as
+// JSON with --json. Preallocated paths are skipped for sizes the benchmark directory has no room for.
+int runBench(int argc, char *argv[]) {
+    BenchOptions options;
+    int any_fs;
+    if (benchParseOptions(argc, argv, &options, &any_fs) != 0) {
+        printf("Usage: %s bench [--dir DIR] [--sizes 64M,1G,16G,64G] [--paths sparse,falloc,zero,qcow2] [--runs N]\n"
+               "       [--files N] [--dist small|mixed|large] [--no-mount] [--any-fs]\n", argv[0]);
+        return EXIT_USAGE;
+    }
+    char kind[32];
+    if (benchCheckDir(options.dir, kind, sizeof(kind)) != 0 && !any_fs) {
+        return 1;
+    }
+
+    // The populated tree is generated once, images too small to hold it twice over skip populating
+    char tree[4096];
+    snprintf(tree, sizeof(tree), "%s/bench-src", options.dir);
+    benchRemoveTree(tree);
+    uint64_t tree_bytes = 0;
+    if (options.files > 0 && benchMakeTree(tree, options.files, options.distribution, &tree_bytes) != 0) {
+        benchRemoveTree(tree);
+        return 1;
+    }
+    printf("Benchmarking in '%s' (%s): %d runs, %d files (%s, %.2f MB)%s.\n", options.dir, kind, options.runs,
+           options.files, options.distribution, tree_bytes / (1024.0 * 1024.0), options.mount ? ", FUSE mounts" : "");
+
+    BenchSeries (*results)[BENCH_PATH_COUNT][BENCH_PHASE_COUNT] = calloc((size_t)options.size_count,
+                                                                           sizeof(*results));
+    if (results == NULL) {
+        benchRemoveTree(tree);
+        return 1;
+    }
+    int skipped[BENCH_MAX_SIZES][BENCH_PATH_COUNT] = {{0}};
+    for (int run = 0; run < options.runs; run++) {
+        for (int z = 0; z < options.size_count; z++) {
+            for (int p = 0; p < BENCH_PATH_COUNT; p++) {
+                if (!options.paths[p] || skipped[z][p]) {
+                    continue;
+                }
+                struct statvfs vfs;
+                uint64_t free_bytes = statvfs(options.dir, &vfs) == 0 ? (uint64_t)vfs.f_bavail * vfs.f_frsize : 0;
+                if ((p == BENCH_PATH_FALLOC || p == BENCH_PATH_ZERO) && options.sizes[z] + options.sizes[z] / 8 > free_bytes) {
+                    printf("Skipping %s at %.2f GB, '%s' has %.2f GB free.\n", bench_path_names[p],
+                           options.sizes[z] / (1024.0 * 1024.0 * 1024.0), options.dir,
+                           free_bytes / (1024.0 * 1024.0 * 1024.0));
+                    skipped[z][p] = 1;
+                    continue;
+                }
+                int populate = options.files > 0 && tree_bytes * 2 < options.sizes[z];
+                benchCycle(&options, (BenchPath)p, options.sizes[z], populate ? tree : NULL, results[z][p]);
+            }
+        }
+    }
+    benchRemoveTree(tree);
+
+    int failed = 0;
+    for (int z = 0; z < options.size_count; z++) {
+        for (int p = 0; p < BENCH_PATH_COUNT; p++) {
+            for (int phase = 0; phase < BENCH_PHASE_COUNT; phase++) {
+                failed |= results[z][p][phase].failed > 0;
+            }
+        }
+    }
+    int json = json_out != NULL;
+    FILE *out = json ? json_out : stdout;
+    if (json) {
+        jsonBegin(argv[1], failed ? 1 : 0);
+        fprintf(out, ",\"dir\":");
+        jsonString(out, options.dir);
+        fprintf(out, ",\"filesystem\":\"%s\",\"files\":%d,\"file_bytes\":%llu,\"results\":[", kind, options.files,
+                (unsigned long long)tree_bytes);
+    } else {
+        fprintf(out, "path,size,phase,runs,failed,min_ms,mean_ms,p50_ms,p90_ms,p99_ms,max_ms,allocated\n");
+    }
+    int first = 1;
+    for (int z = 0; z < options.size_count; z++) {
+        for (int p = 0; p < BENCH_PATH_COUNT; p++) {
+            for (int phase = 0; phase < BENCH_PHASE_COUNT; phase++) {
+                BenchSeries *s = &results[z][p][phase];
+                if (s->count > 0 || s->failed > 0) {
+                    benchReport(out, json, first, (BenchPath)p, options.sizes[z], (BenchPhase)phase, s);
+                    first = 0;
+                }
+            }
+        }
+    }
+    if (json) {
+        fprintf(out, "]");
+        jsonEnd();
+    }
+    free(results);
+    return failed ? 1 : 0;
+}
+
+#endif // DISKPROVISION_BENCH_H
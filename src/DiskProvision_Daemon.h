@@ -0,0 +1,576 @@
+/*
+ * DiskProvision - Allows the creation, management, and updating of disk images for use with QEMU.
+ * DiskProvision_Daemon.h - Long running server answering commands over a Unix socket.
+ * BSD 3-Clause "New" or "Revised" License
+ * Copyright (c) 2024 RoyalGraphX
+ * All rights reserved.
+ */
+
+#ifndef DISKPROVISION_DAEMON_H
+#define DISKPROVISION_DAEMON_H
+
+#include <sys/socket.h>
+#include <sys/un.h> // For struct sockaddr_un
+#include "DiskProvision_Image.h"
+
+#define DAEMON_SOCKET IMAGES_DIR "/.socket"
+#define DAEMON_MAX_LINE 8192
+#define DAEMON_MAX_ARGS 64
+#define DAEMON_BACKLOG 64
+
+// Programs the commands start, looked up once so every request finds them in the cache
+#ifdef __linux__
+static const char *const daemon_programs[] = {"sudo", "mount", "umount", "modprobe", "qemu-img", "qemu-nbd", NULL};
+#else
+static const char *const daemon_programs[] = {"hdiutil", "diskutil", "rm", NULL};
+#endif
+
+// A connected client, requests are read line by line and run one after the other, answers are queued until the
+// socket takes them
+typedef struct {
+    int fd;                       // -1 once the client is gone
+    char *in;                     // Bytes of requests not handled yet
+    size_t in_len;
+    size_t in_capacity;
+    size_t line_len;              // Bytes received of the last line so far, including those dropped as too long
+    char *out;                    // Answers waiting to be sent
+    size_t out_len;
+    size_t out_capacity;
+    int closing;                  // Set once the client stopped sending, it is dropped when nothing is left to do
+    int running;                  // Set while a request of this client is being served
+} DaemonClient;
+
+// A request being served by a forked child, which writes its answer into a pipe
+typedef struct {
+    pid_t pid;
+    int fd;
+    int client;
+    char *answer;
+    size_t answer_len;
+    size_t answer_capacity;
+} DaemonWorker;
+
+static volatile sig_atomic_t daemon_stopping;
+
+// Function to note SIGINT and SIGTERM, the loop finishes the running requests and exits
+static void daemonSignal(int signal_number) {
+    (void)signal_number;
+    daemon_stopping = 1;
+}
+
+// Function to append bytes to a growing buffer
+static int daemonAppend(char **buffer, size_t *len, size_t *capacity, const char *data, size_t size) {
+    if (*len + size > *capacity) {
+        size_t grown = *capacity ? *capacity : 4096;
+        while (grown < *len + size) {
+            grown *= 2;
+        }
+        char *bigger = realloc(*buffer, grown);
+        if (bigger == NULL) {
+            return -1;
+        }
+        *buffer = bigger;
+        *capacity = grown;
+    }
+    memcpy(*buffer + *len, data, size);
+    *len += size;
+    return 0;
+}
+
+// Function to queue the bytes a client sent. Of a line longer than DAEMON_MAX_LINE only the first
+// DAEMON_MAX_LINE bytes are kept, daemonStart() answers it with an error in turn and the rest is dropped.
+static int daemonReceive(DaemonClient *client, const char *data, size_t size) {
+    while (size > 0) {
+        const char *newline = memchr(data, '\n', size);
+        size_t len = newline != NULL ? (size_t)(newline - data) : size;
+        size_t keep = client->line_len < DAEMON_MAX_LINE ? DAEMON_MAX_LINE - client->line_len : 0;
+        if (daemonAppend(&client->in, &client->in_len, &client->in_capacity, data, keep < len ? keep : len) != 0 ||
+            (newline != NULL && daemonAppend(&client->in, &client->in_len, &client->in_capacity, "\n", 1) != 0)) {
+            return -1;
+        }
+        client->line_len = newline != NULL ? 0 : client->line_len + len;
+        len += newline != NULL;
+        data += len;
+        size -= len;
+    }
+    return 0;
+}
+
+// Function to split a request line into arguments at spaces and tabs, double quotes group an argument and a
+// backslash inside them escapes the next character. Returns the argument count or -1 for an unterminated quote.
+static int daemonSplit(char *line, char *args[], int max_args) {
+    int count = 0;
+    char *read = line, *write = line;
+    while (*read != '\0') {
+        while (*read == ' ' || *read == '\t') {
+            read++;
+        }
+        if (*read == '\0') {
+            break;
+        }
+        if (count == max_args) {
+            return -1;
+        }
+        args[count++] = write;
+        while (*read != '\0' && *read != ' ' && *read != '\t') {
+            if (*read != '"') {
+                *write++ = *read++;
+                continue;
+            }
+            read++;
+            while (*read != '"') {
+                if (*read == '\0') {
+                    return -1;
+                }
+                if (*read == '\\' && read[1] != '\0') {
+                    read++;
+                }
+                *write++ = *read++;
+            }
+            read++;
+        }
+        if (*read != '\0') {
+            read++;
+        }
+        *write++ = '\0';
+    }
+    return count;
+}
+
+// Function to read a whole file from the start, NUL-terminated
+static char *daemonReadBack(FILE *file) {
+    long size = ftell(file);
+    char *text = malloc(size > 0 ? (size_t)size + 1 : 1);
+    if (text == NULL) {
+        return NULL;
+    }
+    rewind(file);
+    size_t got = size > 0 ? fread(text, 1, (size_t)size, file) : 0;
+    text[got] = '\0';
+    return text;
+}
+
+// Function run in the forked child of a request: the command runs exactly as with --json, then its JSON result
+// goes into the pipe with the request id and the command's messages added in front
+static void daemonServe(int answer_fd, const char *id, int argc, char *argv[]) {
+    // Nothing of the daemon's own command line carries over into the request
+    json_out = NULL;
+    json_written = 0;
+    trace_enabled = 0;
+    trace_count = 0;
+
+    FILE *result = tmpfile();
+    FILE *messages = tmpfile();
+    int null_fd = open("/dev/null", O_RDONLY);
+    if (result == NULL || messages == NULL || null_fd < 0) {
+        _exit(1);
+    }
+    dup2(null_fd, STDIN_FILENO);
+    close(null_fd);
+    fflush(stdout);
+    dup2(fileno(result), STDOUT_FILENO);
+    dup2(fileno(messages), STDERR_FILENO);
+
+    argv[argc++] = "--json";
+    argv[argc] = NULL;
+    int code = runImageCommand(argc, argv);
+    fflush(stdout);
+    fflush(stderr);
+
+    fseek(result, 0, SEEK_END);
+    fseek(messages, 0, SEEK_END);
+    char *json = daemonReadBack(result);
+    char *text = daemonReadBack(messages);
+    FILE *answer = fdopen(answer_fd, "w");
+    if (answer == NULL) {
+        _exit(1);
+    }
+    fprintf(answer, "{\"id\":");
+    jsonString(answer, id);
+    fprintf(answer, ",\"messages\":");
+    jsonString(answer, text != NULL ? text : "");
+    if (json != NULL && json[0] == '{') {
+        json[strcspn(json, "\n")] = '\0';
+        fprintf(answer, ",%s\n", json + 1);
+    } else {
+        fprintf(answer, ",\"status\":\"error\",\"exit_code\":%d}\n", code);
+    }
+    fclose(answer);
+    _exit(code);
+}
+
+// Function to answer a request the daemon refuses without starting it
+static void daemonRefuse(DaemonClient *client, const char *id, const char *message) {
+    char line[1024];
+    FILE *out = fmemopen(line, sizeof(line), "w");
+    if (out == NULL) {
+        return;
+    }
+    fprintf(out, "{\"id\":");
+    jsonString(out, id);
+    fprintf(out, ",\"messages\":");
+    jsonString(out, message);
+    fprintf(out, ",\"status\":\"error\",\"exit_code\":%d}\n", EXIT_USAGE);
+    long len = ftell(out);
+    fclose(out);
+    if (len > 0 && (size_t)len < sizeof(line)) {
+        daemonAppend(&client->out, &client->out_len, &client->out_capacity, line, (size_t)len);
+    }
+}
+
+// Function to start the next complete request line of a client once its previous request has finished, so
+// pipelined requests see each other's results. Returns 1 when a line was taken off its input.
+static int daemonStart(DaemonClient *clients, int client_count, int index, DaemonWorker *worker, const char *self,
+                       int listen_fd, DaemonWorker *workers, int worker_count) {
+    DaemonClient *client = &clients[index];
+    char *newline = client->in_len > 0 ? memchr(client->in, '\n', client->in_len) : NULL;
+    if (newline == NULL || client->running) {
+        return 0;
+    }
+    size_t line_len = (size_t)(newline - client->in);
+    char line[DAEMON_MAX_LINE + 1];
+    memcpy(line, client->in, line_len);
+    line[line_len] = '\0';
+    memmove(client->in, client->in + line_len + 1, client->in_len - line_len - 1);
+    client->in_len -= line_len + 1;
+    int too_long = line_len == DAEMON_MAX_LINE;
+    int has_nul = strlen(line) != line_len;
+    line[strcspn(line, "\r")] = '\0';
+
+    // "<id> <command> [arguments]", the id comes back with the answer so pipelined answers can be told apart
+    char *args[DAEMON_MAX_ARGS + 3];
+    char first[64];
+    size_t skip = strspn(line, " \t");
+    snprintf(first, sizeof(first), "%.*s", (int)strcspn(line + skip, " \t"), line + skip);
+    int count = daemonSplit(line, args + 1, DAEMON_MAX_ARGS);
+    if (count == 0) {
+        return 1;  // Blank lines are ignored
+    }
+    const char *id = count > 0 && !too_long ? args[1] : first;  // A malformed request is answered under its first word
+    if (too_long || has_nul) {
+        char message[64];
+        snprintf(message, sizeof(message), too_long ? "Request longer than %d bytes.\n" : "Malformed request.\n",
+                 DAEMON_MAX_LINE - 1);
+        daemonRefuse(client, id, message);
+        return 1;
+    }
+    if (count < 2) {
+        daemonRefuse(client, id, count < 0 ? "Malformed request.\n" : "Requests are '<id> <command> [arguments]'.\n");
+        return 1;
+    }
+    if (strcmp(args[2], "daemon") == 0 || strcmp(args[2], "bench") == 0) {
+        daemonRefuse(client, id, "This command is not available through the daemon.\n");
+        return 1;
+    }
+
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) {
+        daemonRefuse(client, id, "Failed to start the request.\n");
+        return 1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        daemonRefuse(client, id, "Failed to start the request.\n");
+        return 1;
+    }
+    if (pid == 0) {
+        // The child keeps nothing of the daemon open but its own answer pipe
+        close(pipe_fds[0]);
+        close(listen_fd);
+        for (int i = 0; i < client_count; i++) {
+            if (clients[i].fd >= 0) {
+                close(clients[i].fd);
+            }
+        }
+        for (int i = 0; i < worker_count; i++) {
+            if (workers[i].pid > 0) {
+                close(workers[i].fd);
+            }
+        }
+        // A Ctrl-C meant for the daemon must not cut a request short, it finishes on its own
+        setpgid(0, 0);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        args[1] = (char *)self;
+        daemonServe(pipe_fds[1], id, count, args + 1);
+    }
+    close(pipe_fds[1]);
+    fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC);
+    worker->pid = pid;
+    worker->fd = pipe_fds[0];
+    worker->client = index;
+    worker->answer_len = 0;
+    client->running = 1;
+    return 1;
+}
+
+// Function to serve requests on a Unix socket until SIGINT or SIGTERM. The programs the commands need are looked
+// up and the image catalog is refreshed once; every request then runs in a forked child that starts with all of it.
+int runDaemon(int argc, char *argv[]) {
+    const char *socket_path = optionValue(argc, argv, "--socket");
+    const char *jobs = optionValue(argc, argv, "-j");
+    if (socket_path == NULL) {
+        socket_path = DAEMON_SOCKET;
+    }
+    int max_workers = jobs != NULL ? atoi(jobs) : 0;
+    if ((jobs != NULL && max_workers <= 0) || argc % 2 != 0) {
+        printf("Usage: %s daemon [--socket PATH] [-j N]\n", argv[0]);
+        return EXIT_USAGE;
+    }
+    if (max_workers <= 0) {
+        // Requests spend most of their time waiting on the disk and on other programs
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        max_workers = 4 * (cores > 0 ? (int)cores : 1);
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        printf("Socket path '%s' is too long.\n", socket_path);
+        return EXIT_USAGE;
+    }
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+    if (strncmp(socket_path, IMAGES_DIR "/", strlen(IMAGES_DIR "/")) == 0 && mkdir(IMAGES_DIR, 0755) != 0 &&
+        errno != EEXIST) {
+        printf("Failed to create the '%s' subfolder: %s\n", IMAGES_DIR, strerror(errno));
+        return 1;
+    }
+
+    // A socket nobody answers on is left over from a daemon that did not exit cleanly
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        printf("Failed to create the socket: %s\n", strerror(errno));
+        return 1;
+    }
+    if (connect(listen_fd, (struct sockaddr *)&address, sizeof(address)) == 0) {
+        printf("A daemon is already listening on '%s'.\n", socket_path);
+        close(listen_fd);
+        return EXIT_EXISTS;
+    }
+    close(listen_fd);
+    unlink(socket_path);
+
+    // Only the user running the daemon may connect, requests run with its privileges
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask = umask(0077);
+    int bound = listen_fd >= 0 && bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+    umask(mask);
+    if (!bound || listen(listen_fd, DAEMON_BACKLOG) != 0) {
+        printf("Failed to listen on '%s': %s\n", socket_path, strerror(errno));
+        if (listen_fd >= 0) {
+            close(listen_fd);
+        }
+        return 1;
+    }
+    fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+
+    // Warm up what every request would otherwise redo
+    for (int i = 0; daemon_programs[i] != NULL; i++) {
+        findExecutable(daemon_programs[i]);
+    }
+    ImageInfo *images;
+    long image_count = catalogImages(IMAGES_DIR, &images);
+    if (image_count >= 0) {
+        free(images);
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = daemonSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    daemon_stopping = 0;
+    printf("Listening on '%s', serving up to %d requests at a time.\n", socket_path, max_workers);
+    fflush(stdout);
+
+    DaemonClient *clients = NULL;
+    int client_count = 0;
+    DaemonWorker *workers = calloc((size_t)max_workers, sizeof(DaemonWorker));
+    struct pollfd *fds = NULL;
+    int *owners = NULL;  // For each polled descriptor: -1 the listener, -2 - w worker w, else the client index
+    unsigned long served = 0;
+    int busy = 0;
+    if (workers == NULL) {
+        close(listen_fd);
+        unlink(socket_path);
+        return 1;
+    }
+
+    while (!daemon_stopping || busy > 0) {
+        // Start what the free workers can take, clients are served in turn so none of them starves the others
+        for (int started = 1; started && busy < max_workers;) {
+            started = 0;
+            for (int c = 0; c < client_count && busy < max_workers; c++) {
+                if (clients[c].fd < 0 || daemon_stopping) {
+                    continue;
+                }
+                int w = 0;
+                while (workers[w].pid > 0) {
+                    w++;
+                }
+                if (daemonStart(clients, client_count, c, &workers[w], argv[0], listen_fd, workers, max_workers)) {
+                    started = 1;
+                    busy += workers[w].pid > 0;
+                }
+            }
+        }
+
+        // Drop clients that hung up and have nothing left running or to send
+        for (int c = 0; c < client_count; c++) {
+            DaemonClient *client = &clients[c];
+            int pending = client->in_len > 0 && memchr(client->in, '\n', client->in_len) != NULL && !daemon_stopping;
+            if (client->fd >= 0 && client->closing && client->running == 0 && client->out_len == 0 && !pending) {
+                close(client->fd);
+                client->fd = -1;
+                free(client->in);
+                free(client->out);
+                client->in = client->out = NULL;
+                client->in_len = client->in_capacity = client->out_len = client->out_capacity = 0;
+            }
+        }
+
+        int nfds = 0;
+        struct pollfd *grown_fds = realloc(fds, (size_t)(1 + client_count + max_workers) * sizeof(struct pollfd));
+        int *grown_owners = realloc(owners, (size_t)(1 + client_count + max_workers) * sizeof(int));
+        if (grown_fds != NULL) {
+            fds = grown_fds;
+        }
+        if (grown_owners != NULL) {
+            owners = grown_owners;
+        }
+        if (grown_fds == NULL || grown_owners == NULL) {
+            break;
+        }
+        if (!daemon_stopping) {
+            fds[nfds] = (struct pollfd){listen_fd, POLLIN, 0};
+            owners[nfds++] = -1;
+        }
+        for (int c = 0; c < client_count; c++) {
+            // Requests queue up in the socket while enough of them are buffered already
+            int reading = clients[c].fd >= 0 && !clients[c].closing && clients[c].in_len < DAEMON_MAX_LINE * 4;
+            if (clients[c].fd >= 0 && (reading || clients[c].out_len > 0)) {
+                short events = (reading ? POLLIN : 0) | (clients[c].out_len > 0 ? POLLOUT : 0);
+                fds[nfds] = (struct pollfd){clients[c].fd, events, 0};
+                owners[nfds++] = c;
+            }
+        }
+        for (int w = 0; w < max_workers; w++) {
+            if (workers[w].pid > 0) {
+                fds[nfds] = (struct pollfd){workers[w].fd, POLLIN, 0};
+                owners[nfds++] = -2 - w;  // Apart from the clients, accept() may add some before this is looked at
+            }
+        }
+        if (poll(fds, (nfds_t)nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Failed to wait for requests: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < nfds; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            if (owners[i] == -1) {
+                int fd = accept(listen_fd, NULL, NULL);
+                if (fd < 0) {
+                    continue;
+                }
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                int slot = 0;
+                while (slot < client_count && clients[slot].fd >= 0) {
+                    slot++;
+                }
+                if (slot == client_count) {
+                    DaemonClient *grown = realloc(clients, (size_t)(client_count + 1) * sizeof(DaemonClient));
+                    if (grown == NULL) {
+                        close(fd);
+                        continue;
+                    }
+                    clients = grown;
+                    client_count++;
+                }
+                memset(&clients[slot], 0, sizeof(DaemonClient));
+                clients[slot].fd = fd;
+            } else if (owners[i] >= 0) {
+                DaemonClient *client = &clients[owners[i]];
+                if (fds[i].revents & POLLOUT) {
+                    ssize_t sent = send(client->fd, client->out, client->out_len, 0);
+                    if (sent > 0) {
+                        memmove(client->out, client->out + sent, client->out_len - (size_t)sent);
+                        client->out_len -= (size_t)sent;
+                    } else if (sent < 0 && errno != EAGAIN && errno != EINTR) {
+                        client->out_len = 0;  // The client is gone, its answers go nowhere
+                        client->closing = 1;
+                    }
+                }
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                    char chunk[4096];
+                    ssize_t got = client->closing ? 0 : recv(client->fd, chunk, sizeof(chunk), 0);
+                    if (got > 0 && daemonReceive(client, chunk, (size_t)got) != 0) {
+                        daemonRefuse(client, "", "Out of memory.\n");
+                        client->in_len = 0;
+                        client->closing = 1;
+                    } else if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+                        client->closing = 1;
+                    }
+                }
+            } else {
+                DaemonWorker *worker = &workers[-2 - owners[i]];
+                char chunk[4096];
+                ssize_t got = read(worker->fd, chunk, sizeof(chunk));
+                if (got > 0) {
+                    daemonAppend(&worker->answer, &worker->answer_len, &worker->answer_capacity, chunk, (size_t)got);
+                } else if (got == 0 || errno != EINTR) {
+                    // The answer is complete once the child closed the pipe
+                    close(worker->fd);
+                    waitpid(worker->pid, NULL, 0);
+                    DaemonClient *client = &clients[worker->client];
+                    client->running = 0;
+                    if (client->fd >= 0 && worker->answer_len > 0) {
+                        daemonAppend(&client->out, &client->out_len, &client->out_capacity, worker->answer,
+                                     worker->answer_len);
+                    }
+                    worker->pid = 0;
+                    busy--;
+                    served++;
+                }
+            }
+        }
+    }
+
+    for (int w = 0; w < max_workers; w++) {
+        free(workers[w].answer);
+    }
+    for (int c = 0; c < client_count; c++) {
+        if (clients[c].fd >= 0) {
+            // Answers of the last requests still go out
+            fcntl(clients[c].fd, F_SETFL, 0);
+            if (clients[c].out_len > 0) {
+                writeStream(clients[c].fd, clients[c].out, clients[c].out_len);
+            }
+            close(clients[c].fd);
+        }
+        free(clients[c].in);
+        free(clients[c].out);
+    }
+    free(workers);
+    free(clients);
+    free(fds);
+    free(owners);
+    close(listen_fd);
+    unlink(socket_path);
+    printf("Daemon stopped after %lu requests.\n", served);
+    return 0;
+}
+
+#endif
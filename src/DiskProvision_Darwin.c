@@ -6,33 +6,241 @@
  * All rights reserved.
  */
 
+#include "DiskProvision_Image.h" // Image creation, QCOW2 and FAT32 engine shared with the Linux build, first for its feature macros
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h> // For sleep function
-#include <ctype.h>  // Include ctype.h for toupper()
-#include <dirent.h> // For directory listing
+#include <unistd.h> // For access()
 #include <sys/stat.h> // For stat() function
 #include <pwd.h>
+#include "DiskProvision_Bench.h" // Provisioning benchmark
+#include "DiskProvision_Daemon.h" // Unix socket server
+
+// File in the working directory remembering which QCOW2 image is unpacked in the mount point
+#define UTM_MOUNT_RECORD ".utm_mounted"
+
+// Function to find the disk hdiutil attached an image as, returns 0 when it is attached
+int findAttachedImage(const char *real_path, char *device, size_t device_size) {
+    char output[16384];
+    const char *info_argv[] = {"hdiutil", "info", NULL};
+    if (runProcess(info_argv, 0, PROCESS_TIMEOUT_MS, output, sizeof(output)) != 0) {
+        return -1;
+    }
+    // Every image is an "image-path : ..." line followed by the /dev/disk nodes attached for it
+    int match = 0;
+    for (char *line = strtok(output, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        char name[64];
+        if (strncmp(line, "image-path", 10) == 0) {
+            const char *value = strstr(line, ": ");
+            match = value != NULL && strcmp(value + 2, real_path) == 0;
+        } else if (match && sscanf(line, "%63s", name) == 1 && strncmp(name, "/dev/disk", 9) == 0) {
+            snprintf(device, device_size, "%s", name);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Function to attach an image with hdiutil, QCOW2 images (which hdiutil cannot attach) are unpacked instead
+int mountImage(const char *image_path, const char *mount_point, char *device, size_t device_size) {
+    if (access(UTM_MOUNT_RECORD, F_OK) == 0) {
+        printf("A UTM image is already mounted, unmount it first.\n");
+        return EXIT_EXISTS;
+    }
+
+    // The kernel must not see metadata an interrupted DiskProvision writer left half applied
+    TraceMark mark = traceBegin();
+    if (fatReplayJournal(image_path) != 0) {
+        return 1;
+    }
+    traceEnd(&mark, "phase", "journal replay", image_path);
+
+    if (detectImageFormat(image_path) == IMAGE_FORMAT_QCOW2) {
+        // The FAT32 volume is read through the L1/L2 tables into the mount point
+        if (getFromImage(image_path, "/", mount_point) != 0) {
+            printf("Failed to mount the UTM image.\n");
+            return 1;
+        }
+        FILE *record = fopen(UTM_MOUNT_RECORD, "w");
+        if (record == NULL) {
+            printf("Failed to record the mounted UTM image.\n");
+            return 1;
+        }
+        fprintf(record, "%s\n%s\n", image_path, mount_point);
+        fclose(record);
+        snprintf(device, device_size, "%s", image_path);
+        printf("UTM image '%s' mounted to '%s' directory successfully.\n", image_path, mount_point);
+        return 0;
+    }
+
+    // Attaching under a FUSE mount or put, or twice, would let two writers corrupt the image. The lock is held
+    // until hdiutil has attached it, from then on lockImageForWriting() finds the disk instead
+    int image_lock = lockImageForWriting(image_path);
+    if (image_lock < 0) {
+        return errno == EBUSY ? EXIT_EXISTS : 1;
+    }
+
+    // Find where the volume is, macOS does not mount EFI System Partitions on its own
+    DiskImage image;
+    uint64_t offset;
+    int partition = -1;
+    if (imageOpen(&image, image_path, 0) == 0) {
+        partition = findFatVolume(&image, &offset);
+        imageClose(&image);
+    }
+    if (partition < 0) {
+        close(image_lock);
+        return 1;
+    }
+
+    // Mount the disk image to the mount point
+    if (partition == 0) {
+        const char *attach_argv[] = {"hdiutil", "attach", image_path, "-mountpoint", mount_point, NULL};
+        int status = runProcess(attach_argv, 0, PROCESS_TIMEOUT_MS, NULL, 0);
+        close(image_lock);
+        if (status != 0) {
+            printf("Failed to mount the disk image.\n");
+            return 1;
+        }
+    } else {
+        // Attach without mounting, then mount the partition holding the volume, e.g. /dev/disk4s1
+        char output[4096], node[64] = "", suffix[16];
+        const char *attach_argv[] = {"hdiutil", "attach", "-nomount", image_path, NULL};
+        int status = runProcess(attach_argv, 0, PROCESS_TIMEOUT_MS, output, sizeof(output));
+        close(image_lock);
+        if (status != 0) {
+            printf("%sFailed to attach the disk image.\n", output);
+            return 1;
+        }
+        snprintf(suffix, sizeof(suffix), "s%d", partition);
+        for (char *line = strtok(output, "\n"); line != NULL && node[0] == '\0'; line = strtok(NULL, "\n")) {
+            char name[64];
+            size_t len;
+            if (sscanf(line, "%63s", name) == 1 && strncmp(name, "/dev/disk", 9) == 0 &&
+                (len = strlen(name)) > strlen(suffix) && strcmp(name + len - strlen(suffix), suffix) == 0) {
+                snprintf(node, sizeof(node), "%s", name);
+            }
+        }
+        if (mkdir(mount_point, 0755) != 0 && errno != EEXIST) {
+            node[0] = '\0';
+        }
+        const char *mount_argv[] = {"diskutil", "mount", "-mountPoint", mount_point, node, NULL};
+        if (node[0] == '\0' || runProcess(mount_argv, 0, PROCESS_TIMEOUT_MS, NULL, 0) != 0) {
+            printf("Failed to mount the EFI System Partition of the disk image.\n");
+            if (node[0] != '\0') {
+                node[strlen(node) - strlen(suffix)] = '\0';
+                const char *detach_argv[] = {"hdiutil", "detach", node, NULL};
+                runProcess(detach_argv, 0, PROCESS_TIMEOUT_MS, NULL, 0);
+            }
+            return 1;
+        }
+    }
+    snprintf(device, device_size, "%s", image_path);
+    printf("Disk image '%s' mounted to '%s' directory successfully.\n", image_path, mount_point);
+    return 0;
+}
+
+// Function to detach the image at a mount point, an unpacked QCOW2 image is written back into its file first
+int unmountImage(const char *mount_point, char *device, size_t device_size) {
+    FILE *record = fopen(UTM_MOUNT_RECORD, "r");
+    if (record != NULL) {
+        char image_path[1024] = "", unpacked[1024] = "";
+        if (fgets(image_path, sizeof(image_path), record) == NULL || fgets(unpacked, sizeof(unpacked), record) == NULL) {
+            unpacked[0] = '\0';
+        }
+        fclose(record);
+        image_path[strcspn(image_path, "\n")] = '\0';
+        unpacked[strcspn(unpacked, "\n")] = '\0';
+        if (unpacked[0] == '\0') {
+            snprintf(unpacked, sizeof(unpacked), "%s", MOUNT_POINT);
+        }
+
+        // Only changed and new files are written into the QCOW2 image, files deleted from the mount point go from it too
+        FatSyncStats stats;
+        if (syncIntoImage(unpacked, image_path, "/", SYNC_DELETE, &stats) != 0) {
+            printf("Failed to write '%s' back to the UTM image, leaving it mounted.\n", unpacked);
+            return 1;
+        }
+        const char *remove_argv[] = {"rm", "-rf", unpacked, NULL};
+        if (runProcess(remove_argv, 0, PROCESS_TIMEOUT_MS, NULL, 0) != 0) {
+            printf("Failed to remove '%s' directory.\n", unpacked);
+        }
+        remove(UTM_MOUNT_RECORD);
+        snprintf(device, device_size, "%s", image_path);
+        printf("UTM image unmounted.\n");
+        return 0;
+    }
 
-// Function to convert a string to uppercase
-void stringToUpper(char *str) {
-    while (*str) {
-        *str = toupper((unsigned char)*str);
-        str++;
+    // Check if the mount point exists
+    if (access(mount_point, F_OK) != 0) {
+        printf("No mounted image found in '%s' directory.\n", mount_point);
+        return EXIT_NOT_FOUND;
     }
+    const char *detach_argv[] = {"hdiutil", "detach", mount_point, NULL};
+    if (runProcess(detach_argv, 0, PROCESS_TIMEOUT_MS, NULL, 0) != 0) {
+        printf("Failed to unmount the image.\n");
+        return 1;
+    }
+    snprintf(device, device_size, "%s", mount_point);
+    printf("Image unmounted.\n");
+    return 0;
 }
 
-// Function to check if a file exists
-int fileExists(const char *path) {
-    struct stat info;
-    return stat(path, &info) == 0 && S_ISREG(info.st_mode);
+// Function to let the user pick one of the UTM QCOW2 images, returns 0 and fills path on success
+int chooseUtmImage(const char *username, char *path, size_t path_size) {
+    // Specify the directory to check for UTM images
+    char utm_directory[512];
+    snprintf(utm_directory, sizeof(utm_directory),
+             "/Users/%s/Library/Containers/com.utmapp.UTM/Data/Documents/DarwinUTM.utm/Data", username);
+
+    ImageInfo *images;
+    long count = collectImages(utm_directory, &images);
+    if (count < 0) {
+        printf("Failed to open UTM directory.\n");
+        return -1;
+    }
+
+    printf("UTM Disk images available:\n");
+    long shown = 0;
+    for (long i = 0; i < count; i++) {
+        if (images[i].format == IMAGE_FORMAT_QCOW2) {
+            images[shown++] = images[i];
+            printf("%ld. %s\n", shown, images[i].name);
+        }
+    }
+    if (shown == 0) {
+        printf("No UTM disk images found in the specified directory.\n");
+        free(images);
+        return -1;
+    }
+
+    int selected = 0;
+    printf("Enter the number of the UTM image to mount (1-%ld): ", shown);
+    if (scanf("%d", &selected) != 1) {
+        selected = 0;
+    }
+    clearInputLine();
+    if (selected < 1 || selected > shown) {
+        printf("Invalid selection.\n");
+        free(images);
+        return -1;
+    }
+    snprintf(path, path_size, "%s", images[selected - 1].path);
+    free(images);
+    return 0;
 }
 
-int main() {
+// Interactive menu, a frontend to the same functions the commands use
+int main(int argc, char *argv[]) {
+    // Commands work the same as on Linux and never prompt, clear the screen or wait
+    if (argc > 1) {
+        return runImageCommand(argc, argv);
+    }
+
     char image_name[256];
     char image_size[256];
     char image_path[512];
+    char device[1024];
     char username[256];
 
     // Get the username based on the UID of the user who launched the program
@@ -49,7 +257,7 @@ int main() {
     int choice;
 
     do {
-        system("clear");
+        clearScreen();
 
         // Display welcome message
         printf("Welcome to DiskProvision, %s!\n", username);
@@ -66,308 +274,79 @@ int main() {
         printf("6. Unmount UTM Disk Image\n");
         printf("7. Exit\n\n");
         printf("Enter your choice: ");
-        scanf("%d", &choice);
+        if (scanf("%d", &choice) != 1) {
+            choice = 0;
+        }
+        clearInputLine();
 
         // Handle user's choice
         switch (choice) {
             case 1:
-                system("clear");
-
-                // Create New Disk Image logic
+                clearScreen();
 
                 // Prompt user for image size in gigabytes
                 printf("Enter the size (in GB) for the disk image (e.g., 1): ");
-                scanf("%s", image_size);
+                scanf("%255s", image_size);
 
                 // Prompt user for image name
                 printf("Enter the name for the disk image (without .img extension): ");
-                scanf("%s", image_name);
-
-                // Construct the path for the .dmg image
-                snprintf(image_path, sizeof(image_path), "images/%s.dmg", image_name);
-
-                // Check if the "images" subfolder already exists
-                if (access("images", F_OK) != 0) {
-                    // Create the "images" subfolder if it doesn't exist
-                    if (mkdir("images", 0755) != 0) {
-                        printf("Failed to create the 'images' subfolder.\n");
-                        break;
-                    }
-                }
-
-                // Create a new disk image with specified size and format
-                char create_command[512];
-                snprintf(create_command, sizeof(create_command),
-                         "hdiutil create -size %sG -type UDIF -fs \"FAT32\" -volname \"%s\" %s",
-                         image_size, image_name, image_path);
-
-                if (system(create_command) != 0) {
-                    printf("Failed to create the disk image.\n");
-                    break;
-                }
-
-                // Rename the .dmg to .img
-                char rename_command[512];
-                snprintf(rename_command, sizeof(rename_command),
-                         "mv %s images/%s.img", image_path, image_name);
-
-                if (system(rename_command) != 0) {
-                    printf("Failed to rename the disk image to .img.\n");
-                    break;
+                scanf("%255s", image_name);
+                clearInputLine();
+
+                // Raw FAT32 images are created natively, hdiutil attaches them like any other disk image
+                if (parseSize(image_size) == 0) {
+                    printf("Invalid size '%s'.\n", image_size);
+                } else {
+                    createDiskImage(image_name, IMAGE_FORMAT_RAW, parseSize(image_size), IMAGE_ALLOC_SPARSE, IMAGE_LAYOUT_GPT,
+                                    NULL, NULL);
                 }
-
-                printf("Disk image 'images/%s.img' created successfully.\n", image_name);
+                waitForEnter();
                 break;
             case 2:
-                {
-                    system("clear");
-
-                    // Mount Disk Image logic
-
-                    // Check if the "images" subfolder exists
-                    if (access("images", F_OK) != 0) {
-                        printf("No disk images found in 'images' subfolder. Create some images first.\n");
-                        sleep(2);
-                        break;
-                    }
-
-                    printf("Disk images available:\n");
+                clearScreen();
 
-                    // List all files in the "images" subfolder
-                    DIR *dp;
-                    struct dirent *entry;
-                    dp = opendir("images");
-                    if (dp == NULL) {
-                        printf("Failed to open 'images' subfolder.\n");
-                        sleep(2);
-                        break;
-                    }
-
-                    int image_count = 0;
-                    char image_names[256][256];
-
-                    while ((entry = readdir(dp))) {
-                        if (entry->d_type == DT_REG && strstr(entry->d_name, ".img")) {
-                            image_count++;
-                            strcpy(image_names[image_count], entry->d_name);
-                            printf("%d. %s\n", image_count, entry->d_name);
-                        }
-                    }
-                    closedir(dp);
-
-                    if (image_count == 0) {
-                        printf("No disk images found in 'images' subfolder. Create some images first.\n");
-                        sleep(2);
-                        break;
-                    }
-
-                    int selected_image;
-                    printf("Enter the number of the image to mount (1-%d): ", image_count);
-                    scanf("%d", &selected_image);
-
-                    if (selected_image < 1 || selected_image > image_count) {
-                        printf("Invalid selection.\n");
-                        sleep(2);
-                        break;
-                    }
-
-                    // Get the name of the selected image
-                    strcpy(image_name, image_names[selected_image]);
-
-                    // Construct the path for the .img image
-                    snprintf(image_path, sizeof(image_path), "images/%s", image_name);
-
-                    // Mount the disk image to the "mnt" directory
-                    char mount_command[512];
-                    snprintf(mount_command, sizeof(mount_command),
-                             "hdiutil attach %s -mountpoint mnt/", image_path);
-
-                    if (system(mount_command) != 0) {
-                        printf("Failed to mount the disk image.\n");
-                        sleep(2);
-                        break;
-                    }
-
-                    printf("Disk image '%s' mounted to 'mnt' directory successfully.\n", image_name);
-                    sleep(2);
+                // Mount Disk Image logic
+                if (chooseImage("mount", image_path, sizeof(image_path)) == 0) {
+                    mountImage(image_path, MOUNT_POINT, device, sizeof(device));
                 }
+                waitForEnter();
                 break;
             case 3:
-                {
-                    system("clear");
-
-                    // Unmount Disk Image logic
+            case 6:
+                clearScreen();
 
-                    // Check if the "mnt" directory exists
-                    if (access("mnt", F_OK) == 0) {
-                        // Unmount the image from the "mnt" directory
-                        if (system("hdiutil detach mnt/") != 0) {
-                            printf("Failed to unmount the image.\n");
-                            sleep(2);
-                            break;
-                        }
-                        printf("Image unmounted.\n");
-                    } else {
-                        printf("No mounted image found in 'mnt' directory.\n");
-                    }
-                    sleep(2);
-                }
+                // Unmount Disk Image logic, UTM images are written back first
+                unmountImage(MOUNT_POINT, device, sizeof(device));
+                waitForEnter();
                 break;
             case 4:
                 {
-                    system("clear");
+                    clearScreen();
 
                     // Delete Disk Image logic
-
-                    // Check if the "images" subfolder exists
-                    if (access("images", F_OK) != 0) {
-                        printf("No disk images found in 'images' subfolder. Create some images first.\n");
-                        sleep(2);
-                        break;
-                    }
-
-                    printf("Disk images available for deletion:\n");
-
-                    // List all files in the "images" subfolder
-                    DIR *dp;
-                    struct dirent *entry;
-                    dp = opendir("images");
-                    if (dp == NULL) {
-                        printf("Failed to open 'images' subfolder.\n");
-                        sleep(2);
-                        break;
-                    }
-
-                    int image_count = 0;
-                    char image_names[256][256];
-
-                    while ((entry = readdir(dp))) {
-                        if (entry->d_type == DT_REG && strstr(entry->d_name, ".img")) {
-                            image_count++;
-                            strcpy(image_names[image_count], entry->d_name);
-                            printf("%d. %s\n", image_count, entry->d_name);
-                        }
-                    }
-                    closedir(dp);
-
-                    if (image_count == 0) {
-                        printf("No disk images found in 'images' subfolder. Create some images first.\n");
-                        sleep(2);
-                        break;
-                    }
-
-                    int selected_image;
-                    printf("Enter the number of the image to delete (1-%d): ", image_count);
-                    scanf("%d", &selected_image);
-
-                    if (selected_image < 1 || selected_image > image_count) {
-                        printf("Invalid selection.\n");
-                        sleep(2);
-                        break;
-                    }
-
-                    // Get the name of the selected image
-                    strcpy(image_name, image_names[selected_image]);
-
-                    // Construct the path for the .img image
-                    snprintf(image_path, sizeof(image_path), "images/%s", image_name);
-
-                    // Confirm deletion
-                    char confirm;
-                    printf("Are you sure you want to delete '%s'? (y/n): ", image_name);
-                    scanf(" %c", &confirm);
-
-                    if (confirm == 'y' || confirm == 'Y') {
-                        // Delete the selected image
-                        if (remove(image_path) == 0) {
-                            printf("Disk image '%s' deleted successfully.\n", image_name);
-                            sleep(2);
+                    if (chooseImage("delete", image_path, sizeof(image_path)) == 0) {
+                        // Confirm deletion
+                        char confirm = 'n';
+                        printf("Are you sure you want to delete '%s'? (y/n): ", image_path);
+                        scanf(" %c", &confirm);
+                        clearInputLine();
+                        if (confirm == 'y' || confirm == 'Y') {
+                            deleteDiskImage(image_path);
                         } else {
-                            printf("Failed to delete disk image '%s'.\n", image_name);
+                            printf("Deletion canceled.\n");
                         }
-                    } else {
-                        printf("Deletion canceled.\n");
                     }
+                    waitForEnter();
                 }
                 break;
             case 5:
-                {
-                    system("clear");
-
-                    // Mount UTM Disk Image logic
-
-                    // Specify the directory to check for UTM images
-                    char utm_directory[512];
-                    snprintf(utm_directory, sizeof(utm_directory),
-                             "/Users/%s/Library/Containers/com.utmapp.UTM/Data/Documents/DarwinUTM.utm/Data/", username);
-
-                    printf("UTM Disk images available:\n");
-
-                    // List all files in the UTM directory
-                    DIR *utm_dp;
-                    struct dirent *utm_entry;
-                    utm_dp = opendir(utm_directory);
-                    if (utm_dp == NULL) {
-                        printf("Failed to open UTM directory.\n");
-                        sleep(2);
-                        break;
-                    }
-
-                    int utm_image_count = 0;
-                    char utm_image_names[256][256];
-
-                    while ((utm_entry = readdir(utm_dp))) {
-                        if (utm_entry->d_type == DT_REG && strstr(utm_entry->d_name, ".qcow2")) {
-                            utm_image_count++;
-                            strcpy(utm_image_names[utm_image_count], utm_entry->d_name);
-                            printf("%d. %s\n", utm_image_count, utm_entry->d_name);
-                        }
-                    }
-                    closedir(utm_dp);
+                clearScreen();
 
-                    if (utm_image_count == 0) {
-                        printf("No UTM disk images found in the specified directory.\n");
-                        sleep(2);
-                        break;
-                    }
-
-                    int selected_utm_image;
-                    printf("Enter the number of the UTM image to mount (1-%d): ", utm_image_count);
-                    scanf("%d", &selected_utm_image);
-
-                    if (selected_utm_image < 1 || selected_utm_image > utm_image_count) {
-                        printf("Invalid selection.\n");
-                        sleep(2);
-                        break;
-                    }
-
-                    // Get the name of the selected UTM image
-                    strcpy(image_name, utm_image_names[selected_utm_image]);
-
-                    // Construct the path for the .qcow2 UTM image
-                    snprintf(image_path, sizeof(image_path), "%s%s", utm_directory, image_name);
-
-                    // TODO: Convert QCOW2 to a temporary .img to mount
-
-                    // TODO: Mount the converted UTM image to the "mnt" directory
-                    char mount_utm_command[512];
-                    snprintf(mount_utm_command, sizeof(mount_utm_command),
-                             "hdiutil attach %s -mountpoint mnt/", image_path);
-
-                    if (system(mount_utm_command) != 0) {
-                        printf("Failed to mount the UTM image.\n");
-                        sleep(2);
-                        break;
-                    }
-
-                    printf("UTM image '%s' mounted to 'mnt' directory successfully.\n", image_name);
-                    sleep(2);
+                // Mount UTM Disk Image logic
+                if (chooseUtmImage(username, image_path, sizeof(image_path)) == 0) {
+                    mountImage(image_path, MOUNT_POINT, device, sizeof(device));
                 }
-                break;
-            case 6:
-                // TODO: Unmount UTM Disk Image Logic, includes TODO: Convert back temp .img
-                printf("Currently not available.\n");
-                sleep(2);
+                waitForEnter();
                 break;
             case 7:
                 // Exit the program
@@ -375,13 +354,9 @@ int main() {
                 break;
             default:
                 printf("Invalid choice. Please select a valid option.\n");
-                sleep(2);
+                waitForEnter();
         }
-
-        // Clear the input buffer
-        while (getchar() != '\n');
-
-    } while (choice != 7);
+    } while (choice != 7 && !feof(stdin));
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,1293 @@
+/*
+ * DiskProvision - Allows the creation, management, and updating of disk images for use with QEMU.
+ * DiskProvision_Fuse.h - Unprivileged mounting of FAT32 images through FUSE, speaking the kernel protocol directly.
+ * BSD 3-Clause "New" or "Revised" License
+ * Copyright (c) 2024 RoyalGraphX
+ * All rights reserved.
+ */
+
+#ifndef DISKPROVISION_FUSE_H
+#define DISKPROVISION_FUSE_H
+
+#include <signal.h>
+#include <sys/mount.h> // For mount() when running as root
+#include <sys/socket.h> // For receiving the /dev/fuse descriptor from fusermount
+#include <sys/uio.h> // For writev()
+#include <linux/fuse.h> // For the FUSE kernel protocol
+#include "DiskProvision_Image.h"
+
+// Tuning of the FUSE server
+#define FUSE_MAX_WRITE (1024 * 1024)          // Largest write the kernel may send in one request
+#define FUSE_BUFFER_SIZE (FUSE_MAX_WRITE + 64 * 1024)
+#define FUSE_CACHE_BYTES (32 * 1024 * 1024)   // Cluster cache for file data
+#define FUSE_READAHEAD_BYTES (512 * 1024)     // Read ahead along the FAT chain on sequential reads
+#define FUSE_HASH_BUCKETS 4096
+#define FUSE_TIMEOUT 1                        // Seconds the kernel may cache entries and attributes
+
+// A file or directory the kernel knows about, the node id is its index in the node table
+typedef struct {
+    uint64_t parent;              // Node id of the containing directory, 0 once unlinked
+    char name[FAT_NAME_MAX * 3 + 1];
+    uint8_t attr;
+    uint32_t first_cluster;
+    uint32_t size;
+    time_t mtime;
+    size_t entry_offset;          // Short entry of the node inside its parent directory
+    size_t lfn_offset;            // First LFN entry, equals entry_offset when there is none
+    uint64_t lookups;             // Kernel references, the node is released when they drop to zero
+    uint64_t generation;
+    uint64_t hash_next;           // Next node id in the same hash bucket
+    uint32_t *chain;              // Cluster chain of a file, loaded on first access
+    long chain_length;
+    uint64_t next_read;           // End of the last read, a read starting here is sequential
+    int used;
+} FuseNode;
+
+// One slot of the direct-mapped cluster cache
+typedef struct {
+    uint32_t cluster;             // 0 when the slot is empty
+    uint8_t *data;
+} FuseCacheSlot;
+
+// A mounted image: the FAT and every directory touched stay in memory and are written back on fsync and unmount
+typedef struct {
+    FatVolume vol;
+    int fuse_fd;
+    char mount_point[4096];
+    FuseNode **nodes;
+    uint64_t node_count;
+    uint64_t node_capacity;
+    uint64_t free_node;           // Head of the list of unused node ids, linked through hash_next
+    uint64_t generation;
+    uint64_t buckets[FUSE_HASH_BUCKETS];
+    FatDir **dirs;                // Loaded directories, write-back cache
+    size_t dir_count;
+    size_t dir_capacity;
+    FuseCacheSlot *cache;
+    uint32_t cache_slots;
+    uint8_t *scratch;             // Read-ahead buffer
+    uid_t uid;
+    gid_t gid;
+} FuseFs;
+
+static volatile sig_atomic_t fuse_stop;
+
+// Function to hash a parent and a name the way fatFindEntry compares them, ignoring ASCII case
+static uint32_t fuseHash(uint64_t parent, const char *name) {
+    uint64_t h = 1469598103934665603ULL ^ parent;
+    for (const unsigned char *c = (const unsigned char *)name; *c; c++) {
+        h = (h ^ tolower(*c)) * 1099511628211ULL;
+    }
+    return (uint32_t)(h % FUSE_HASH_BUCKETS);
+}
+
+// Function to find the node of a name in a directory, 0 when the kernel has not looked it up yet
+static uint64_t fuseFindNode(FuseFs *fs, uint64_t parent, const char *name) {
+    for (uint64_t id = fs->buckets[fuseHash(parent, name)]; id != 0; id = fs->nodes[id]->hash_next) {
+        if (fs->nodes[id]->parent == parent && strcasecmp(fs->nodes[id]->name, name) == 0) {
+            return id;
+        }
+    }
+    return 0;
+}
+
+// Functions to add a node to and remove it from the name hash
+static void fuseHashInsert(FuseFs *fs, uint64_t id) {
+    uint32_t bucket = fuseHash(fs->nodes[id]->parent, fs->nodes[id]->name);
+    fs->nodes[id]->hash_next = fs->buckets[bucket];
+    fs->buckets[bucket] = id;
+}
+
+static void fuseHashRemove(FuseFs *fs, uint64_t id) {
+    FuseNode *node = fs->nodes[id];
+    if (node->parent == 0) {
+        return;  // Unlinked nodes are not hashed
+    }
+    uint64_t *link = &fs->buckets[fuseHash(node->parent, node->name)];
+    while (*link != 0 && *link != id) {
+        link = &fs->nodes[*link]->hash_next;
+    }
+    if (*link == id) {
+        *link = node->hash_next;
+    }
+    node->hash_next = 0;
+}
+
+// Function to get a node for a directory entry, reusing the one the kernel already holds
+static uint64_t fuseNodeFor(FuseFs *fs, uint64_t parent, const FatEntry *entry) {
+    uint64_t id = fuseFindNode(fs, parent, entry->name);
+    if (id == 0) {
+        if (fs->free_node != 0) {
+            id = fs->free_node;
+            fs->free_node = fs->nodes[id]->hash_next;
+        } else {
+            if (fs->node_count == fs->node_capacity) {
+                uint64_t capacity = fs->node_capacity * 2;
+                FuseNode **grown = realloc(fs->nodes, capacity * sizeof(FuseNode *));
+                if (grown == NULL) {
+                    return 0;
+                }
+                fs->nodes = grown;
+                fs->node_capacity = capacity;
+            }
+            if ((fs->nodes[fs->node_count] = calloc(1, sizeof(FuseNode))) == NULL) {
+                return 0;
+            }
+            id = fs->node_count++;
+        }
+        FuseNode *node = fs->nodes[id];
+        memset(node, 0, sizeof(*node));
+        node->used = 1;
+        node->parent = parent;
+        node->generation = ++fs->generation;
+        snprintf(node->name, sizeof(node->name), "%s", entry->name);
+        fuseHashInsert(fs, id);
+    }
+    FuseNode *node = fs->nodes[id];
+    node->attr = entry->attr;
+    if (node->first_cluster != entry->first_cluster) {
+        free(node->chain);
+        node->chain = NULL;
+    }
+    node->first_cluster = entry->first_cluster;
+    node->size = entry->size;
+    node->mtime = unixTimeFromDos(entry->time, entry->date);
+    node->entry_offset = entry->offset;
+    node->lfn_offset = entry->lfn_offset;
+    return id;
+}
+
+// Function to release a node the kernel has forgotten
+static void fuseFreeNode(FuseFs *fs, uint64_t id) {
+    FuseNode *node = fs->nodes[id];
+    fuseHashRemove(fs, id);
+    free(node->chain);
+    memset(node, 0, sizeof(*node));
+    node->hash_next = fs->free_node;
+    fs->free_node = id;
+}
+
+// Function to get a node by the id the kernel passes, NULL for ids it should not have
+static FuseNode *fuseNode(FuseFs *fs, uint64_t id) {
+    if (id == 0 || id >= fs->node_count || !fs->nodes[id]->used) {
+        return NULL;
+    }
+    return fs->nodes[id];
+}
+
+// Function to get a directory from the write-back cache, loading it on first use
+static FatDir *fuseDir(FuseFs *fs, uint32_t first_cluster) {
+    for (size_t i = 0; i < fs->dir_count; i++) {
+        if (fs->dirs[i]->first_cluster == first_cluster) {
+            return fs->dirs[i];
+        }
+    }
+    if (fs->dir_count == fs->dir_capacity) {
+        size_t capacity = fs->dir_capacity ? fs->dir_capacity * 2 : 64;
+        FatDir **grown = realloc(fs->dirs, capacity * sizeof(FatDir *));
+        if (grown == NULL) {
+            return NULL;
+        }
+        fs->dirs = grown;
+        fs->dir_capacity = capacity;
+    }
+    FatDir *dir = malloc(sizeof(FatDir));
+    if (dir == NULL || fatLoadDir(&fs->vol, first_cluster, dir) != 0) {
+        free(dir);
+        return NULL;
+    }
+    fs->dirs[fs->dir_count++] = dir;
+    return dir;
+}
+
+// Function to drop a removed directory from the cache without writing it back
+static void fuseForgetDir(FuseFs *fs, uint32_t first_cluster) {
+    for (size_t i = 0; i < fs->dir_count; i++) {
+        if (fs->dirs[i]->first_cluster == first_cluster) {
+            fatFreeDir(fs->dirs[i]);
+            free(fs->dirs[i]);
+            fs->dirs[i] = fs->dirs[--fs->dir_count];
+            return;
+        }
+    }
+}
+
+// Function to get the directory listing of a directory node
+static FatDir *fuseNodeDir(FuseFs *fs, const FuseNode *node) {
+    return fuseDir(fs, node->first_cluster ? node->first_cluster : fs->vol.root_cluster);
+}
+
+// Function to write the cached directories, the FAT and the image metadata back
+static int fuseSync(FuseFs *fs) {
+    int result = 0;
+    for (size_t i = 0; i < fs->dir_count; i++) {
+        if (fatStoreDir(&fs->vol, fs->dirs[i]) != 0) {
+            result = -1;
+        }
+    }
+    if (fatFlush(&fs->vol) != 0 || imageFlush(fs->vol.image) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+// Function to copy the state of a node into its short directory entry, in memory until the next sync
+static void fuseStoreEntry(FuseFs *fs, FuseNode *node) {
+    FuseNode *parent = fuseNode(fs, node->parent);
+    FatDir *dir = parent ? fuseNodeDir(fs, parent) : NULL;
+    if (dir == NULL || node->entry_offset + FAT_DIR_ENTRY_SIZE > dir->size) {
+        return;
+    }
+    uint8_t *e = dir->data + node->entry_offset;
+    uint16_t time_field, date_field;
+    dosTimeFromUnix(node->mtime, &time_field, &date_field);
+    e[11] = node->attr;
+    putLE16(e + 18, date_field);
+    putLE16(e + 20, node->first_cluster >> 16);
+    putLE16(e + 22, time_field);
+    putLE16(e + 24, date_field);
+    putLE16(e + 26, node->first_cluster & 0xFFFF);
+    putLE32(e + 28, (node->attr & FAT_ATTR_DIRECTORY) ? 0 : node->size);
+    dir->dirty = 1;
+}
+
+// Function to get the cluster chain of a file node
+static int fuseChain(FuseFs *fs, FuseNode *node) {
+    if (node->chain != NULL || node->first_cluster == 0) {
+        return 0;
+    }
+    node->chain_length = fatGetChain(&fs->vol, node->first_cluster, &node->chain);
+    if (node->chain_length < 0) {
+        node->chain = NULL;
+        node->chain_length = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to find the cache slot of a cluster, NULL on a miss
+static FuseCacheSlot *fuseCacheLookup(FuseFs *fs, uint32_t cluster) {
+    FuseCacheSlot *slot = &fs->cache[cluster % fs->cache_slots];
+    return slot->cluster == cluster ? slot : NULL;
+}
+
+// Function to forget the cached data of released clusters
+static void fuseCacheDrop(FuseFs *fs, const uint32_t *clusters, long count) {
+    for (long i = 0; i < count; i++) {
+        FuseCacheSlot *slot = fuseCacheLookup(fs, clusters[i]);
+        if (slot != NULL) {
+            slot->cluster = 0;
+        }
+    }
+}
+
+// Function to load a cluster of a file into the cache. Misses read the contiguous run that follows in one I/O,
+// up to the read-ahead window when the access is sequential
+static FuseCacheSlot *fuseCacheLoad(FuseFs *fs, const FuseNode *node, long index, int sequential) {
+    uint32_t cluster = node->chain[index];
+    FuseCacheSlot *slot = fuseCacheLookup(fs, cluster);
+    if (slot != NULL) {
+        return slot;
+    }
+    long window = sequential ? FUSE_READAHEAD_BYTES / fs->vol.cluster_size : 1;
+    long run = 1;
+    while (run < window && index + run < node->chain_length && node->chain[index + run] == cluster + run &&
+           fuseCacheLookup(fs, cluster + run) == NULL) {
+        run++;
+    }
+    if (imageRead(fs->vol.image, fs->scratch, (size_t)run * fs->vol.cluster_size,
+                  fatClusterOffset(&fs->vol, cluster)) != 0) {
+        return NULL;
+    }
+    for (long i = 0; i < run; i++) {
+        FuseCacheSlot *fill = &fs->cache[(cluster + i) % fs->cache_slots];
+        fill->cluster = cluster + i;
+        memcpy(fill->data, fs->scratch + (size_t)i * fs->vol.cluster_size, fs->vol.cluster_size);
+    }
+    return &fs->cache[cluster % fs->cache_slots];
+}
+
+// Function to read file data through the cluster cache, returns the bytes read or -errno
+static long fuseReadData(FuseFs *fs, FuseNode *node, uint64_t offset, uint32_t len, uint8_t *out) {
+    if (offset >= node->size) {
+        return 0;
+    }
+    if (offset + len > node->size) {
+        len = (uint32_t)(node->size - offset);
+    }
+    if (fuseChain(fs, node) != 0) {
+        return -EIO;
+    }
+    int sequential = offset == node->next_read;
+    uint32_t cs = fs->vol.cluster_size;
+    for (uint32_t done = 0; done < len;) {
+        long index = (long)((offset + done) / cs);
+        uint32_t within = (uint32_t)((offset + done) % cs);
+        uint32_t chunk = cs - within < len - done ? cs - within : len - done;
+        if (index >= node->chain_length) {
+            return -EIO;
+        }
+        FuseCacheSlot *slot = fuseCacheLoad(fs, node, index, sequential);
+        if (slot == NULL) {
+            return -EIO;
+        }
+        memcpy(out + done, slot->data + within, chunk);
+        done += chunk;
+    }
+    node->next_read = offset + len;
+    return len;
+}
+
+// Function to write file data to the image, keeping cached clusters current
+static int fuseWriteClusters(FuseFs *fs, FuseNode *node, uint64_t offset, uint64_t len, const uint8_t *data) {
+    uint32_t cs = fs->vol.cluster_size;
+    while (len > 0) {
+        long index = (long)(offset / cs);
+        uint32_t within = (uint32_t)(offset % cs);
+
+        // Coalesce the physically contiguous clusters the write covers
+        long run = 1;
+        while ((uint64_t)(run * cs) - within < len && index + run < node->chain_length &&
+               node->chain[index + run] == node->chain[index] + run) {
+            run++;
+        }
+        uint64_t chunk = (uint64_t)run * cs - within < len ? (uint64_t)run * cs - within : len;
+        uint64_t host = fatClusterOffset(&fs->vol, node->chain[index]) + within;
+        int result = data ? imageWrite(fs->vol.image, data, (size_t)chunk, host)
+                          : imageZero(fs->vol.image, host, chunk);
+        if (result != 0) {
+            return -1;
+        }
+        for (long i = 0; i < run; i++) {
+            FuseCacheSlot *slot = fuseCacheLookup(fs, node->chain[index + i]);
+            uint64_t start = i == 0 ? within : 0;
+            uint64_t end = (uint64_t)(i + 1) * cs - within > chunk ? chunk + within - (uint64_t)i * cs : cs;
+            if (slot != NULL && start < end) {
+                if (data) {
+                    memcpy(slot->data + start, data + ((uint64_t)i * cs + start - within), (size_t)(end - start));
+                } else {
+                    memset(slot->data + start, 0, (size_t)(end - start));
+                }
+            }
+        }
+        if (data) {
+            data += chunk;
+        }
+        offset += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Function to grow or shrink the cluster chain of a file to hold size bytes, returns 0 or -errno
+static int fuseResizeChain(FuseFs *fs, FuseNode *node, uint64_t size) {
+    uint32_t cs = fs->vol.cluster_size;
+    long needed = (long)((size + cs - 1) / cs);
+    if (fuseChain(fs, node) != 0) {
+        return -EIO;
+    }
+    if (needed > node->chain_length) {
+        uint32_t first;
+        uint32_t link_from = node->chain_length ? node->chain[node->chain_length - 1] : 0;
+        // Clusters freed since the last sync can only be reused once a sync committed their release
+        FatJournal *journal = fs->vol.journal;
+        if ((uint64_t)(needed - node->chain_length) > fs->vol.free_clusters && journal != NULL &&
+            journal->held_count > 0 && fuseSync(fs) != 0) {
+            return -EIO;
+        }
+        if (fatAllocate(&fs->vol, (uint32_t)(needed - node->chain_length), &first, link_from) != 0) {
+            return -ENOSPC;
+        }
+        if (node->first_cluster == 0) {
+            node->first_cluster = first;
+        }
+    } else if (needed < node->chain_length) {
+        fuseCacheDrop(fs, node->chain + needed, node->chain_length - needed);
+        if (needed == 0) {
+            fatFreeChain(&fs->vol, node->first_cluster);
+            node->first_cluster = 0;
+        } else {
+            fatFreeChain(&fs->vol, node->chain[needed]);
+            fatSetEntry(&fs->vol, node->chain[needed - 1], FAT32_EOC);
+        }
+    } else {
+        return 0;
+    }
+    free(node->chain);
+    node->chain = NULL;
+    node->chain_length = 0;
+    return fuseChain(fs, node) == 0 ? 0 : -EIO;
+}
+
+// Function to change the size of a file, new space reads back as zeros, returns 0 or -errno
+static int fuseTruncate(FuseFs *fs, FuseNode *node, uint64_t size) {
+    if (size > 0xFFFFFFFFULL) {
+        return -EFBIG;
+    }
+    uint64_t old_size = node->size;
+    int result = fuseResizeChain(fs, node, size);
+    if (result != 0) {
+        return result;
+    }
+    if (size > old_size && fuseWriteClusters(fs, node, old_size, size - old_size, NULL) != 0) {
+        return -EIO;
+    }
+    node->size = (uint32_t)size;
+    node->mtime = time(NULL);
+    fuseStoreEntry(fs, node);
+    return 0;
+}
+
+// Function to write file data, growing the file as needed, returns the bytes written or -errno
+static long fuseWriteData(FuseFs *fs, FuseNode *node, uint64_t offset, uint32_t len, const uint8_t *data) {
+    if (offset + len > 0xFFFFFFFFULL) {
+        return -EFBIG;
+    }
+    if (offset + len > node->size) {
+        int result = fuseResizeChain(fs, node, offset + len);
+        if (result != 0) {
+            return result;
+        }
+        // A write past the end leaves a gap that has to read back as zeros
+        if (offset > node->size && fuseWriteClusters(fs, node, node->size, offset - node->size, NULL) != 0) {
+            return -EIO;
+        }
+        node->size = (uint32_t)(offset + len);
+    } else if (fuseChain(fs, node) != 0) {
+        return -EIO;
+    }
+    if (len > 0 && fuseWriteClusters(fs, node, offset, len, data) != 0) {
+        return -EIO;
+    }
+    node->mtime = time(NULL);
+    fuseStoreEntry(fs, node);
+    return len;
+}
+
+// Function to fill the attributes of a node
+static void fuseFillAttr(FuseFs *fs, uint64_t id, struct fuse_attr *attr) {
+    FuseNode *node = fs->nodes[id];
+    int is_dir = (node->attr & FAT_ATTR_DIRECTORY) != 0;
+    memset(attr, 0, sizeof(*attr));
+    attr->ino = id;
+    attr->size = is_dir ? fs->vol.cluster_size : node->size;
+    attr->blocks = ((uint64_t)node->size + fs->vol.cluster_size - 1) / fs->vol.cluster_size * (fs->vol.cluster_size / 512);
+    attr->atime = attr->mtime = attr->ctime = (uint64_t)node->mtime;
+    attr->mode = is_dir ? (S_IFDIR | 0755) : (S_IFREG | ((node->attr & FAT_ATTR_READ_ONLY) ? 0444 : 0644));
+    attr->nlink = is_dir ? 2 : 1;
+    attr->uid = fs->uid;
+    attr->gid = fs->gid;
+    attr->blksize = fs->vol.cluster_size;
+}
+
+// Function to send a reply, error is a positive errno or 0
+static void fuseReply(FuseFs *fs, uint64_t unique, int error, const void *data, size_t len) {
+    struct fuse_out_header header;
+    header.len = (uint32_t)(sizeof(header) + (error ? 0 : len));
+    header.error = -error;
+    header.unique = unique;
+    struct iovec iov[2] = {{&header, sizeof(header)}, {(void *)data, len}};
+    if (writev(fs->fuse_fd, iov, error || len == 0 ? 1 : 2) < 0 && errno != ENOENT) {
+        fuse_stop = 1;  // ENOENT only means the request was interrupted
+    }
+}
+
+// Function to answer a lookup-style request with the entry of a node
+static void fuseReplyEntry(FuseFs *fs, uint64_t unique, uint64_t id) {
+    struct fuse_entry_out out;
+    memset(&out, 0, sizeof(out));
+    out.nodeid = id;
+    out.generation = fs->nodes[id]->generation;
+    out.entry_valid = FUSE_TIMEOUT;
+    out.attr_valid = FUSE_TIMEOUT;
+    fuseFillAttr(fs, id, &out.attr);
+    fs->nodes[id]->lookups++;
+    fuseReply(fs, unique, 0, &out, sizeof(out));
+}
+
+// Function to check a name for use in a FAT directory, returns 0 or a positive errno
+static int fuseCheckName(const char *name) {
+    if (strlen(name) > FAT_NAME_MAX) {
+        return ENAMETOOLONG;
+    }
+    if (name[0] == '\0' || strpbrk(name, "\\/:*?\"<>|") != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return EINVAL;
+    }
+    return 0;
+}
+
+// Function to mark the entries of a node (LFN entries and short entry) as deleted in its directory
+static void fuseEraseEntry(FatDir *dir, const FuseNode *node) {
+    for (size_t pos = node->lfn_offset; pos <= node->entry_offset && pos + FAT_DIR_ENTRY_SIZE <= dir->size;
+         pos += FAT_DIR_ENTRY_SIZE) {
+        dir->data[pos] = FAT_ENTRY_DELETED;
+    }
+    dir->dirty = 1;
+}
+
+// Function to look up a child of a directory node and make sure the kernel-side node is current
+static uint64_t fuseLookupChild(FuseFs *fs, uint64_t parent_id, const char *name, int *error) {
+    FuseNode *parent = fuseNode(fs, parent_id);
+    FatDir *dir;
+    FatEntry entry;
+    if (parent == NULL || !(parent->attr & FAT_ATTR_DIRECTORY) || (dir = fuseNodeDir(fs, parent)) == NULL) {
+        *error = parent == NULL ? ENOENT : parent->attr & FAT_ATTR_DIRECTORY ? EIO : ENOTDIR;
+        return 0;
+    }
+    uint64_t id = fuseFindNode(fs, parent_id, name);
+    if (id != 0) {
+        return id;  // Nodes the kernel holds are kept current by every change made through them
+    }
+    if (!fatFindEntry(dir, name, &entry)) {
+        *error = ENOENT;
+        return 0;
+    }
+    if ((entry.attr & FAT_ATTR_DIRECTORY) && entry.first_cluster == 0) {
+        entry.first_cluster = fs->vol.root_cluster;
+    }
+    id = fuseNodeFor(fs, parent_id, &entry);
+    *error = id ? 0 : ENOMEM;
+    return id;
+}
+
+// Function to create a file or directory in a directory node, returns the new node id or 0 with error set
+static uint64_t fuseCreate(FuseFs *fs, uint64_t parent_id, const char *name, int directory, int *error) {
+    FuseNode *parent = fuseNode(fs, parent_id);
+    FatDir *dir;
+    FatEntry entry;
+    if ((*error = fuseCheckName(name)) != 0) {
+        return 0;
+    }
+    if (parent == NULL || (dir = fuseNodeDir(fs, parent)) == NULL) {
+        *error = ENOENT;
+        return 0;
+    }
+    if (fatFindEntry(dir, name, &entry)) {
+        *error = EEXIST;
+        return 0;
+    }
+    int result = directory ? fatMakeDir(&fs->vol, dir, name, time(NULL), &entry)
+                           : fatAddEntry(&fs->vol, dir, name, FAT_ATTR_ARCHIVE, 0, 0, time(NULL), &entry);
+    if (result != 0) {
+        *error = ENOSPC;
+        return 0;
+    }
+    dosTimeFromUnix(time(NULL), &entry.time, &entry.date);
+    uint64_t id = fuseNodeFor(fs, parent_id, &entry);
+    *error = id ? 0 : ENOMEM;
+    return id;
+}
+
+// Function to check whether a directory holds anything besides "." and ".."
+static int fuseDirEmpty(FuseFs *fs, uint32_t first_cluster) {
+    FatDir *dir = fuseDir(fs, first_cluster);
+    FatEntry entry;
+    size_t pos = 0;
+    return dir != NULL && !fatNextEntry(dir, &pos, &entry);
+}
+
+// Function to remove a file or an empty directory, returns 0 or a positive errno
+static int fuseRemove(FuseFs *fs, uint64_t parent_id, const char *name, int directory) {
+    int error;
+    uint64_t id = fuseLookupChild(fs, parent_id, name, &error);
+    if (id == 0) {
+        return error;
+    }
+    FuseNode *node = fs->nodes[id];
+    int is_dir = (node->attr & FAT_ATTR_DIRECTORY) != 0;
+    if (directory != is_dir) {
+        return directory ? ENOTDIR : EISDIR;
+    }
+    if (is_dir && !fuseDirEmpty(fs, node->first_cluster)) {
+        return ENOTEMPTY;
+    }
+    if (fuseChain(fs, node) == 0) {
+        fuseCacheDrop(fs, node->chain, node->chain_length);
+    }
+    fuseEraseEntry(fuseNodeDir(fs, fs->nodes[parent_id]), node);
+    if (is_dir) {
+        fuseForgetDir(fs, node->first_cluster);
+    }
+    if (node->first_cluster != 0) {
+        fatFreeChain(&fs->vol, node->first_cluster);
+    }
+
+    // The kernel may still reference the node, it stays around detached until forgotten
+    fuseHashRemove(fs, id);
+    node->parent = 0;
+    node->first_cluster = 0;
+    node->size = 0;
+    free(node->chain);
+    node->chain = NULL;
+    node->chain_length = 0;
+    if (node->lookups == 0) {
+        fuseFreeNode(fs, id);
+    }
+    return 0;
+}
+
+// Function to move or rename an entry, replacing a compatible target, returns 0 or a positive errno
+static int fuseRename(FuseFs *fs, uint64_t parent_id, const char *name, uint64_t new_parent_id, const char *new_name,
+                      uint32_t flags) {
+    int error;
+    if ((error = fuseCheckName(new_name)) != 0) {
+        return error;
+    }
+    if (flags & ~RENAME_NOREPLACE) {
+        return EINVAL;
+    }
+    uint64_t id = fuseLookupChild(fs, parent_id, name, &error);
+    if (id == 0) {
+        return error;
+    }
+    FuseNode *new_parent = fuseNode(fs, new_parent_id);
+    if (new_parent == NULL || !(new_parent->attr & FAT_ATTR_DIRECTORY)) {
+        return ENOENT;
+    }
+    FuseNode *node = fs->nodes[id];
+    int is_dir = (node->attr & FAT_ATTR_DIRECTORY) != 0;
+
+    // A directory cannot move below itself
+    for (uint64_t p = new_parent_id; is_dir && p != 0 && p != FUSE_ROOT_ID; p = fs->nodes[p]->parent) {
+        if (p == id) {
+            return EINVAL;
+        }
+    }
+
+    uint64_t target = fuseLookupChild(fs, new_parent_id, new_name, &error);
+    if (target == id) {
+        target = 0;  // Only the case of the name changes
+    } else if (target != 0) {
+        if (flags & RENAME_NOREPLACE) {
+            return EEXIST;
+        }
+        int target_dir = (fs->nodes[target]->attr & FAT_ATTR_DIRECTORY) != 0;
+        if (target_dir != is_dir) {
+            return is_dir ? ENOTDIR : EISDIR;
+        }
+        if ((error = fuseRemove(fs, new_parent_id, new_name, target_dir)) != 0) {
+            return error;
+        }
+    }
+
+    // The old entries are released first so a rename within one directory can reuse them
+    FatDir *dir = fuseNodeDir(fs, fs->nodes[parent_id]);
+    FatDir *new_dir = fuseNodeDir(fs, new_parent);
+    if (dir == NULL || new_dir == NULL) {
+        return EIO;
+    }
+    fuseEraseEntry(dir, node);
+    FatEntry entry;
+    time_t mtime = node->mtime;
+    uint32_t first_cluster = is_dir && node->first_cluster == fs->vol.root_cluster ? 0 : node->first_cluster;
+    if (fatAddEntry(&fs->vol, new_dir, new_name, node->attr, first_cluster, is_dir ? 0 : node->size, mtime, &entry) != 0) {
+        // Put the old name back, its slots are still free
+        FatEntry restored;
+        fatAddEntry(&fs->vol, dir, node->name, node->attr, first_cluster, is_dir ? 0 : node->size, mtime, &restored);
+        node->entry_offset = restored.offset;
+        node->lfn_offset = restored.lfn_offset;
+        return ENOSPC;
+    }
+
+    // A moved directory has to point its ".." entry at the new parent
+    if (is_dir && new_parent_id != parent_id) {
+        FatDir *moved = fuseDir(fs, node->first_cluster);
+        if (moved != NULL && moved->size >= 2 * FAT_DIR_ENTRY_SIZE) {
+            uint32_t parent_cluster = new_parent->first_cluster == fs->vol.root_cluster ? 0 : new_parent->first_cluster;
+            putLE16(moved->data + FAT_DIR_ENTRY_SIZE + 20, parent_cluster >> 16);
+            putLE16(moved->data + FAT_DIR_ENTRY_SIZE + 26, parent_cluster & 0xFFFF);
+            moved->dirty = 1;
+        }
+    }
+
+    fuseHashRemove(fs, id);
+    node->parent = new_parent_id;
+    snprintf(node->name, sizeof(node->name), "%s", new_name);
+    node->entry_offset = entry.offset;
+    node->lfn_offset = entry.lfn_offset;
+    fuseHashInsert(fs, id);
+    return 0;
+}
+
+// Function to list a directory: "." and "..", then the live entries. The offset of an entry is its byte position
+// in the directory plus 2, so a listing can resume where the previous reply ended.
+static void fuseReadDir(FuseFs *fs, uint64_t unique, uint64_t id, uint64_t offset, uint32_t size) {
+    FuseNode *node = fuseNode(fs, id);
+    FatDir *dir = node ? fuseNodeDir(fs, node) : NULL;
+    if (dir == NULL) {
+        fuseReply(fs, unique, node ? EIO : ENOENT, NULL, 0);
+        return;
+    }
+    uint8_t *out = fs->scratch;
+    size_t used = 0;
+    if (size > FUSE_READAHEAD_BYTES) {
+        size = FUSE_READAHEAD_BYTES;
+    }
+
+    size_t pos = offset >= 2 ? (size_t)(offset - 2) : 0;
+    for (uint64_t next = offset; ;) {
+        FatEntry entry;
+        const char *name;
+        uint32_t type;
+        uint64_t entry_offset;
+        if (next < 2) {
+            name = next == 0 ? "." : "..";
+            type = S_IFDIR >> 12;
+            entry_offset = next + 1;
+        } else if (fatNextEntry(dir, &pos, &entry)) {
+            name = entry.name;
+            type = (entry.attr & FAT_ATTR_DIRECTORY ? S_IFDIR : S_IFREG) >> 12;
+            entry_offset = pos + 2;
+        } else {
+            break;
+        }
+        size_t name_len = strlen(name);
+        size_t record = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + name_len);
+        if (used + record > size) {
+            break;
+        }
+        struct fuse_dirent *dirent = (struct fuse_dirent *)(out + used);
+        memset(dirent, 0, record);
+        dirent->ino = 0xFFFFFFFFULL;  // Node ids are only handed out by lookup
+        dirent->off = entry_offset;
+        dirent->namelen = (uint32_t)name_len;
+        dirent->type = type;
+        memcpy(dirent->name, name, name_len);
+        used += record;
+        next = entry_offset;
+    }
+    fuseReply(fs, unique, 0, out, used);
+}
+
+// Function to apply a setattr request: size and modification time are kept, ownership and mode are not stored
+static void fuseSetAttr(FuseFs *fs, uint64_t unique, uint64_t id, const struct fuse_setattr_in *in) {
+    FuseNode *node = fuseNode(fs, id);
+    if (node == NULL) {
+        fuseReply(fs, unique, ENOENT, NULL, 0);
+        return;
+    }
+    if (in->valid & FATTR_SIZE) {
+        int result = node->attr & FAT_ATTR_DIRECTORY ? -EISDIR : fuseTruncate(fs, node, in->size);
+        if (result != 0) {
+            fuseReply(fs, unique, -result, NULL, 0);
+            return;
+        }
+    }
+    if (in->valid & (FATTR_MTIME | FATTR_MTIME_NOW)) {
+        node->mtime = (in->valid & FATTR_MTIME_NOW) ? time(NULL) : (time_t)in->mtime;
+    }
+    if ((in->valid & FATTR_MODE) && !(node->attr & FAT_ATTR_DIRECTORY)) {
+        node->attr = (in->mode & 0200) ? (node->attr & ~FAT_ATTR_READ_ONLY) : (node->attr | FAT_ATTR_READ_ONLY);
+    }
+    if (id != FUSE_ROOT_ID) {
+        fuseStoreEntry(fs, node);
+    }
+    struct fuse_attr_out out;
+    memset(&out, 0, sizeof(out));
+    out.attr_valid = FUSE_TIMEOUT;
+    fuseFillAttr(fs, id, &out.attr);
+    fuseReply(fs, unique, 0, &out, sizeof(out));
+}
+
+// Function to handle one request from the kernel
+static void fuseHandle(FuseFs *fs, const struct fuse_in_header *in, const uint8_t *arg) {
+    uint64_t id = in->nodeid;
+    uint64_t unique = in->unique;
+    FuseNode *node = fuseNode(fs, id);
+    int error = 0;
+
+    switch (in->opcode) {
+        case FUSE_INIT: {
+            const struct fuse_init_in *init = (const void *)arg;
+            struct fuse_init_out out;
+            memset(&out, 0, sizeof(out));
+            out.major = FUSE_KERNEL_VERSION;
+            out.minor = init->minor < FUSE_KERNEL_MINOR_VERSION ? init->minor : FUSE_KERNEL_MINOR_VERSION;
+            out.max_readahead = init->max_readahead;
+            out.flags = init->flags & (FUSE_BIG_WRITES | FUSE_MAX_PAGES);
+            out.max_background = 16;
+            out.congestion_threshold = 12;
+            out.max_write = FUSE_MAX_WRITE;
+            out.time_gran = 1000000000;  // FAT keeps whole (even) seconds
+            out.max_pages = FUSE_MAX_WRITE / 4096;
+            if (init->major != FUSE_KERNEL_VERSION) {
+                fuseReply(fs, unique, EPROTO, NULL, 0);
+                fuse_stop = 1;
+            } else {
+                fuseReply(fs, unique, 0, &out, out.minor < 23 ? FUSE_COMPAT_22_INIT_OUT_SIZE : sizeof(out));
+            }
+            return;
+        }
+        case FUSE_DESTROY:
+            fuseSync(fs);
+            fuseReply(fs, unique, 0, NULL, 0);
+            fuse_stop = 1;
+            return;
+        case FUSE_FORGET:
+            if (node != NULL && id != FUSE_ROOT_ID) {
+                uint64_t count = ((const struct fuse_forget_in *)arg)->nlookup;
+                node->lookups = node->lookups > count ? node->lookups - count : 0;
+                if (node->lookups == 0) {
+                    fuseFreeNode(fs, id);
+                }
+            }
+            return;  // Forget has no reply
+        case FUSE_BATCH_FORGET: {
+            const struct fuse_batch_forget_in *batch = (const void *)arg;
+            const struct fuse_forget_one *one = (const void *)(batch + 1);
+            for (uint32_t i = 0; i < batch->count; i++) {
+                FuseNode *forgotten = fuseNode(fs, one[i].nodeid);
+                if (forgotten != NULL && one[i].nodeid != FUSE_ROOT_ID) {
+                    forgotten->lookups = forgotten->lookups > one[i].nlookup ? forgotten->lookups - one[i].nlookup : 0;
+                    if (forgotten->lookups == 0) {
+                        fuseFreeNode(fs, one[i].nodeid);
+                    }
+                }
+            }
+            return;
+        }
+        case FUSE_INTERRUPT:
+            return;  // Every request is answered right away
+        case FUSE_LOOKUP: {
+            uint64_t child = fuseLookupChild(fs, id, (const char *)arg, &error);
+            if (child != 0) {
+                fuseReplyEntry(fs, unique, child);
+            } else {
+                fuseReply(fs, unique, error, NULL, 0);
+            }
+            return;
+        }
+        case FUSE_GETATTR: {
+            if (node == NULL) {
+                break;
+            }
+            struct fuse_attr_out out;
+            memset(&out, 0, sizeof(out));
+            out.attr_valid = FUSE_TIMEOUT;
+            fuseFillAttr(fs, id, &out.attr);
+            fuseReply(fs, unique, 0, &out, sizeof(out));
+            return;
+        }
+        case FUSE_SETATTR:
+            fuseSetAttr(fs, unique, id, (const struct fuse_setattr_in *)arg);
+            return;
+        case FUSE_OPEN:
+        case FUSE_OPENDIR:
+        case FUSE_CREATE: {
+            struct {
+                struct fuse_entry_out entry;
+                struct fuse_open_out open;
+            } out;
+            memset(&out, 0, sizeof(out));
+            uint32_t flags = ((const struct fuse_open_in *)arg)->flags;
+            if (in->opcode == FUSE_CREATE) {
+                const char *name = (const char *)arg + sizeof(struct fuse_create_in);
+                uint64_t child = fuseCreate(fs, id, name, 0, &error);
+                if (child == 0) {
+                    break;
+                }
+                out.entry.nodeid = child;
+                out.entry.generation = fs->nodes[child]->generation;
+                out.entry.entry_valid = FUSE_TIMEOUT;
+                out.entry.attr_valid = FUSE_TIMEOUT;
+                fuseFillAttr(fs, child, &out.entry.attr);
+                fs->nodes[child]->lookups++;
+                out.open.open_flags = FOPEN_KEEP_CACHE;
+                fuseReply(fs, unique, 0, &out, sizeof(out));
+                return;
+            }
+            if (node == NULL) {
+                break;
+            }
+            if (in->opcode == FUSE_OPEN && (flags & O_TRUNC) && (error = -fuseTruncate(fs, node, 0)) != 0) {
+                break;
+            }
+            out.open.open_flags = in->opcode == FUSE_OPEN ? FOPEN_KEEP_CACHE : 0;
+            fuseReply(fs, unique, 0, &out.open, sizeof(out.open));
+            return;
+        }
+        case FUSE_MKNOD:
+        case FUSE_MKDIR: {
+            int directory = in->opcode == FUSE_MKDIR;
+            const char *name = (const char *)arg + (directory ? sizeof(struct fuse_mkdir_in) : sizeof(struct fuse_mknod_in));
+            if (!directory && !S_ISREG(((const struct fuse_mknod_in *)arg)->mode)) {
+                error = EPERM;  // FAT has no device nodes, fifos or sockets
+                break;
+            }
+            uint64_t child = fuseCreate(fs, id, name, directory, &error);
+            if (child == 0) {
+                break;
+            }
+            fuseReplyEntry(fs, unique, child);
+            return;
+        }
+        case FUSE_READ: {
+            const struct fuse_read_in *read_in = (const void *)arg;
+            uint32_t size = read_in->size < FUSE_MAX_WRITE ? read_in->size : FUSE_MAX_WRITE;
+            if (node == NULL) {
+                break;
+            }
+            static uint8_t *data;
+            if (data == NULL && (data = malloc(FUSE_MAX_WRITE)) == NULL) {
+                error = ENOMEM;
+                break;
+            }
+            long got = fuseReadData(fs, node, read_in->offset, size, data);
+            if (got < 0) {
+                error = (int)-got;
+                break;
+            }
+            fuseReply(fs, unique, 0, data, (size_t)got);
+            return;
+        }
+        case FUSE_WRITE: {
+            const struct fuse_write_in *write_in = (const void *)arg;
+            if (node == NULL) {
+                break;
+            }
+            long written = fuseWriteData(fs, node, write_in->offset, write_in->size, arg + sizeof(*write_in));
+            if (written < 0) {
+                error = (int)-written;
+                break;
+            }
+            struct fuse_write_out out = {(uint32_t)written, 0};
+            fuseReply(fs, unique, 0, &out, sizeof(out));
+            return;
+        }
+        case FUSE_READDIR: {
+            const struct fuse_read_in *read_in = (const void *)arg;
+            fuseReadDir(fs, unique, id, read_in->offset, read_in->size);
+            return;
+        }
+        case FUSE_UNLINK:
+        case FUSE_RMDIR:
+            error = fuseRemove(fs, id, (const char *)arg, in->opcode == FUSE_RMDIR);
+            break;
+        case FUSE_RENAME:
+        case FUSE_RENAME2: {
+            uint64_t new_parent = in->opcode == FUSE_RENAME ? ((const struct fuse_rename_in *)arg)->newdir
+                                                            : ((const struct fuse_rename2_in *)arg)->newdir;
+            uint32_t flags = in->opcode == FUSE_RENAME ? 0 : ((const struct fuse_rename2_in *)arg)->flags;
+            const char *name = (const char *)arg + (in->opcode == FUSE_RENAME ? sizeof(struct fuse_rename_in)
+                                                                               : sizeof(struct fuse_rename2_in));
+            error = fuseRename(fs, id, name, new_parent, name + strlen(name) + 1, flags);
+            break;
+        }
+        case FUSE_STATFS: {
+            struct fuse_statfs_out out;
+            memset(&out, 0, sizeof(out));
+            out.st.blocks = fs->vol.cluster_count;
+            out.st.bfree = fs->vol.free_clusters;
+            out.st.bavail = fs->vol.free_clusters;
+            out.st.bsize = fs->vol.cluster_size;
+            out.st.frsize = fs->vol.cluster_size;
+            out.st.namelen = FAT_NAME_MAX;
+            fuseReply(fs, unique, 0, &out, sizeof(out));
+            return;
+        }
+        case FUSE_FSYNC:
+        case FUSE_FSYNCDIR:
+            error = fuseSync(fs) == 0 ? 0 : EIO;
+            break;
+        case FUSE_RELEASE:
+        case FUSE_RELEASEDIR:
+        case FUSE_FLUSH:
+            break;
+        default:
+            error = ENOSYS;
+            break;
+    }
+    if (node == NULL && error == 0 && in->opcode != FUSE_RELEASE && in->opcode != FUSE_RELEASEDIR &&
+        in->opcode != FUSE_FLUSH && in->opcode != FUSE_UNLINK && in->opcode != FUSE_RMDIR &&
+        in->opcode != FUSE_RENAME && in->opcode != FUSE_RENAME2 && in->opcode != FUSE_FSYNC &&
+        in->opcode != FUSE_FSYNCDIR) {
+        error = ENOENT;
+    }
+    fuseReply(fs, unique, error, NULL, 0);
+}
+
+// Function to prepare the server state for a volume
+static int fuseInit(FuseFs *fs) {
+    fs->node_capacity = 1024;
+    fs->nodes = calloc(fs->node_capacity, sizeof(FuseNode *));
+    fs->cache_slots = FUSE_CACHE_BYTES / fs->vol.cluster_size;
+    fs->cache = calloc(fs->cache_slots, sizeof(FuseCacheSlot));
+    fs->scratch = malloc(FUSE_READAHEAD_BYTES > fs->vol.cluster_size ? FUSE_READAHEAD_BYTES : fs->vol.cluster_size);
+    uint8_t *cache_data = malloc((size_t)fs->cache_slots * fs->vol.cluster_size);
+    if (fs->nodes == NULL || fs->cache == NULL || fs->scratch == NULL || cache_data == NULL) {
+        free(cache_data);
+        return -1;
+    }
+    for (uint32_t i = 0; i < fs->cache_slots; i++) {
+        fs->cache[i].data = cache_data + (size_t)i * fs->vol.cluster_size;
+    }
+
+    // Node 0 is never handed out, node 1 is the root directory
+    for (int i = 0; i < 2; i++) {
+        fs->nodes[i] = calloc(1, sizeof(FuseNode));
+        if (fs->nodes[i] == NULL) {
+            return -1;
+        }
+    }
+    fs->node_count = 2;
+    FuseNode *root = fs->nodes[FUSE_ROOT_ID];
+    root->used = 1;
+    root->attr = FAT_ATTR_DIRECTORY;
+    root->first_cluster = fs->vol.root_cluster;
+    root->mtime = time(NULL);
+    root->lookups = 1;
+    fs->uid = getuid();
+    fs->gid = getgid();
+    return 0;
+}
+
+// Function to release the server state
+static void fuseFree(FuseFs *fs) {
+    for (uint64_t i = 0; i < fs->node_count; i++) {
+        if (fs->nodes[i] != NULL) {
+            free(fs->nodes[i]->chain);
+            free(fs->nodes[i]);
+        }
+    }
+    free(fs->nodes);
+    for (size_t i = 0; i < fs->dir_count; i++) {
+        fatFreeDir(fs->dirs[i]);
+        free(fs->dirs[i]);
+    }
+    free(fs->dirs);
+    if (fs->cache != NULL) {
+        free(fs->cache[0].data);
+    }
+    free(fs->cache);
+    free(fs->scratch);
+}
+
+// Function to receive the /dev/fuse descriptor fusermount passes back over a socket
+static int fuseReceiveFd(int sock) {
+    char byte;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, 0) <= 0) {
+        return -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+    return fd;
+}
+
+// Function to run fusermount3 (or the older fusermount) with arguments, returns its exit status
+static int fuseRunFusermount(const char *const arguments[], int comm_fd) {
+    const char *helper = findExecutable("fusermount3");
+    if (helper == NULL && (helper = findExecutable("fusermount")) == NULL) {
+        printf("fusermount3 was not found, install the fuse3 package.\n");
+        return -1;
+    }
+    const char *argv[8] = {helper};
+    for (int i = 0; arguments[i] != NULL && i < 6; i++) {
+        argv[i + 1] = arguments[i];
+    }
+
+    // fusermount sends the /dev/fuse descriptor back over the socket named in its environment
+    char value[16];
+    snprintf(value, sizeof(value), "%d", comm_fd);
+    if (comm_fd >= 0) {
+        setenv("_FUSE_COMMFD", value, 1);
+    }
+    int status = runProcess(argv, 0, PROCESS_TIMEOUT_MS, NULL, 0);
+    unsetenv("_FUSE_COMMFD");
+    return status;
+}
+
+// Function to mount a FUSE filesystem at a directory: directly as root, through setuid fusermount otherwise.
+// Returns the /dev/fuse descriptor or -1.
+static int fuseMount(const char *image_path, const char *mount_point) {
+    char options[4096 + 128];
+    if (geteuid() == 0) {
+        int fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            printf("Failed to open /dev/fuse: %s\n", strerror(errno));
+            return -1;
+        }
+        snprintf(options, sizeof(options), "fd=%d,rootmode=40000,user_id=%u,group_id=%u,default_permissions", fd,
+                 (unsigned)getuid(), (unsigned)getgid());
+        if (mount(image_path, mount_point, "fuse.diskprovision", MS_NOSUID | MS_NODEV, options) != 0) {
+            printf("Failed to mount '%s': %s\n", mount_point, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        return -1;
+    }
+    snprintf(options, sizeof(options), "fsname=%s,subtype=diskprovision,default_permissions", image_path);
+    const char *arguments[] = {"-o", options, "--", mount_point, NULL};
+    int status = fuseRunFusermount(arguments, sv[1]);
+    close(sv[1]);
+    int fd = status == 0 ? fuseReceiveFd(sv[0]) : -1;
+    close(sv[0]);
+    if (fd < 0) {
+        printf("Failed to mount '%s' through fusermount.\n", mount_point);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+// Function to unmount a FUSE mount point, lazily when the server itself gives up on a busy mount
+int fuseUnmount(const char *mount_point, int lazy) {
+    if (geteuid() == 0) {
+        if (umount2(mount_point, lazy ? MNT_DETACH : 0) != 0) {
+            printf("Failed to unmount '%s': %s\n", mount_point, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+    const char *arguments[] = {"-u", "--", mount_point, NULL};
+    const char *lazy_arguments[] = {"-u", "-z", "--", mount_point, NULL};
+    return fuseRunFusermount(lazy ? lazy_arguments : arguments, -1) == 0 ? 0 : -1;
+}
+
+// Function to wait until the server of an unmounted image has written everything back and let go of it
+int fuseWaitReleased(const char *image_path) {
+    int fd = open(image_path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    int result = flock(fd, LOCK_SH);
+    close(fd);
+    return result;
+}
+
+static void fuseSignal(int signal_number) {
+    (void)signal_number;
+    fuse_stop = 1;
+}
+
+// Function to serve kernel requests until the filesystem is unmounted or a signal arrives
+static void fuseLoop(FuseFs *fs) {
+    uint8_t *buffer = malloc(FUSE_BUFFER_SIZE);
+    if (buffer == NULL) {
+        return;
+    }
+    while (!fuse_stop) {
+        ssize_t len = read(fs->fuse_fd, buffer, FUSE_BUFFER_SIZE);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOENT) {
+                continue;  // The request was interrupted before we read it
+            }
+            break;  // ENODEV once unmounted
+        }
+        if ((size_t)len < sizeof(struct fuse_in_header)) {
+            break;
+        }
+        const struct fuse_in_header *in = (const void *)buffer;
+        fuseHandle(fs, in, buffer + sizeof(*in));
+    }
+    free(buffer);
+}
+
+// Function to mount the FAT32 filesystem of an image at a directory without root, nbd or a kernel module.
+// The server runs in the background unless foreground is set and writes everything back when unmounted.
+int fuseMountImage(const char *image_path, const char *mount_point, int foreground) {
+    static FuseFs fs;
+    memset(&fs, 0, sizeof(fs));
+    char real_image[4096];
+    if (realpath(image_path, real_image) == NULL) {
+        printf("Failed to resolve '%s': %s\n", image_path, strerror(errno));
+        return EXIT_NOT_FOUND;
+    }
+
+    // The lock is held until the last write-back, it keeps other writers off the image and lets unmount wait
+    int lock_fd = lockImageForWriting(image_path);
+    if (lock_fd < 0) {
+        return errno == EBUSY ? EXIT_EXISTS : 1;
+    }
+    if (fatOpen(&fs.vol, real_image, 1) != 0) {
+        close(lock_fd);
+        return 1;
+    }
+    if ((mkdir(mount_point, 0755) != 0 && errno != EEXIST) || realpath(mount_point, fs.mount_point) == NULL) {
+        printf("Failed to create '%s' directory.\n", mount_point);
+        fatClose(&fs.vol);
+        close(lock_fd);
+        return 1;
+    }
+    if (fuseInit(&fs) != 0) {
+        printf("Failed to allocate the FUSE caches.\n");
+        fuseFree(&fs);
+        fatClose(&fs.vol);
+        close(lock_fd);
+        return 1;
+    }
+    fs.fuse_fd = fuseMount(real_image, fs.mount_point);
+    if (fs.fuse_fd < 0) {
+        fuseFree(&fs);
+        fatClose(&fs.vol);
+        close(lock_fd);
+        return 1;
+    }
+    printf("Image '%s' mounted to '%s' through FUSE.\n", image_path, mount_point);
+    fflush(stdout);
+
+    if (!foreground) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            printf("Failed to start the FUSE server: %s\n", strerror(errno));
+            fuseUnmount(fs.mount_point, 1);
+            close(lock_fd);
+            return 1;
+        }
+        if (pid > 0) {
+            _exit(0);  // The parent must not flush the volume the child now owns
+        }
+        setsid();
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            close(null_fd);
+        }
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = fuseSignal;  // No SA_RESTART, the blocking read has to return
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGHUP, &action, NULL);
+
+    fuseLoop(&fs);
+    int result = fuseSync(&fs);
+    if (fuse_stop) {
+        fuseUnmount(fs.mount_point, 1);
+    }
+    close(fs.fuse_fd);
+    fuseFree(&fs);
+    if (fatClose(&fs.vol) != 0) {
+        result = -1;
+    }
+    close(lock_fd);
+    if (foreground) {
+        printf("Image '%s' unmounted from '%s'.\n", image_path, mount_point);
+    }
+    return result == 0 ? 0 : 1;
+}
+
+#endif // DISKPROVISION_FUSE_H
@@ -0,0 +1,7891 @@
+/*
+ * DiskProvision - Allows the creation, management, and updating of disk images for use with QEMU.
+ * DiskProvision_Image.h - Image creation, QCOW2 access and the userspace FAT32 engine, shared by all platforms.
+ * BSD 3-Clause "New" or "Revised" License
+ * Copyright (c) 2024 RoyalGraphX
+ * All rights reserved.
+ */
+
+#ifndef DISKPROVISION_IMAGE_H
+#define DISKPROVISION_IMAGE_H
+
+// Must come before any system header, so programs include this header first
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // For O_DIRECT, fallocate() and copy_file_range() on Linux
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> // For strcasecmp()
+#include <ctype.h>
+#include <stdint.h> // For fixed-width on-disk structure fields
+#include <fcntl.h> // For open() flags
+#include <errno.h> // For errno and strerror()
+#include <time.h> // For localtime()
+#include <unistd.h>
+#include <dirent.h> // For scandir()
+#include <sys/stat.h>
+#include <sys/statvfs.h> // For statvfs()
+#include <sys/time.h> // For gettimeofday()
+#include <sys/mman.h> // For mmap()
+#include <pthread.h> // For the batch worker pool
+#include <sys/ioctl.h>
+#include <sys/file.h> // For flock() on the image catalog
+#include <zlib.h> // For compressed QCOW2 clusters
+#include <sys/wait.h> // For waitpid()
+#include <spawn.h> // For posix_spawn(), external tools run without a shell
+#include <poll.h>
+#include <signal.h>
+#ifdef __linux__
+#include <linux/falloc.h> // For FALLOC_FL_PUNCH_HOLE
+#include <linux/fs.h> // For FICLONE
+#include <linux/io_uring.h> // For the bulk write engine, used through raw system calls
+#include <sys/syscall.h>
+#include <sys/uio.h> // For struct iovec
+#endif
+#ifdef __APPLE__
+#include <sys/clonefile.h> // For clonefile()
+#include <sys/event.h> // For kqueue(), waiting for a program to exit
+#include <sys/param.h> // For MAXPATHLEN
+#define st_mtim st_mtimespec // Darwin names the nanosecond modification time differently
+#endif
+
+// FAT32 on-disk parameters, matching the defaults chosen by mkfs.fat 4.2 for "-F 32 -I"
+#define FAT_SECTOR_SIZE 512
+#define FAT32_RESERVED_SECTORS 32
+#define FAT32_NUM_FATS 2
+#define FAT32_MEDIA 0xF8
+#define FAT32_INFO_SECTOR 1
+#define FAT32_BACKUP_BOOT 6
+#define FAT32_ROOT_CLUSTER 2
+#define FAT32_EOC 0x0FFFFFF8
+#define FAT32_MAX_CLUSTERS ((1 << 28) - 16)
+#define FAT32_MAX_CLUSTER_SIZE 128  // In sectors, 64 KiB
+#define FAT_DIR_ENTRY_SIZE 32
+#define FAT_ATTR_VOLUME 0x08
+
+// Layout of a FAT32 volume, everything the formatter needs to write the metadata
+typedef struct {
+    uint64_t offset;               // Byte offset of the volume inside the image
+    uint32_t total_sectors;
+    uint32_t hidden_sectors;
+    uint16_t reserved_sectors;
+    uint8_t sectors_per_cluster;
+    uint32_t fat_length;           // Sectors per FAT
+    uint32_t cluster_count;
+    uint16_t heads;
+    uint16_t sectors_per_track;
+    uint32_t volume_id;
+    time_t create_time;
+    char label[11];                // Space padded, not NUL terminated
+} Fat32Layout;
+
+// Dummy x86 boot code written by mkfs.fat, prints a message when booted from
+static const char fat32BootCode[] =
+    "\x0e"              // push cs
+    "\x1f"              // pop ds
+    "\xbe\x5b\x7c"      // mov si, offset message_txt
+    "\xac"              // write_msg: lodsb
+    "\x22\xc0"          // and al, al
+    "\x74\x0b"          // jz key_press
+    "\x56"              // push si
+    "\xb4\x0e"          // mov ah, 0eh
+    "\xbb\x07\x00"      // mov bx, 0007h
+    "\xcd\x10"          // int 10h
+    "\x5e"              // pop si
+    "\xeb\xf0"          // jmp write_msg
+    "\x32\xe4"          // key_press: xor ah, ah
+    "\xcd\x16"          // int 16h
+    "\xcd\x19"          // int 19h
+    "\xeb\xfe"          // foo: jmp foo
+    "This is not a bootable disk.  Please insert a bootable floppy and\r\n"
+    "press any key to try again ... \r\n";
+
+// Offsets of the boot code and its message inside the FAT32 boot sector
+#define FAT32_BOOT_CODE_OFFSET 0x5A
+#define FAT32_BOOT_CODE_SIZE 420
+#define FAT32_BOOT_MESSAGE_OFFSET 29
+
+// Functions to store little-endian values into on-disk structures
+static void putLE16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static void putLE32(uint8_t *p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = v >> 24;
+}
+
+static void putLE64(uint8_t *p, uint64_t v) {
+    putLE32(p, (uint32_t)v);
+    putLE32(p + 4, (uint32_t)(v >> 32));
+}
+
+// Functions to load little-endian values from on-disk structures
+static uint16_t getLE16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t getLE32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t getLE64(const uint8_t *p) {
+    return ((uint64_t)getLE32(p + 4) << 32) | getLE32(p);
+}
+
+// Function to round a sector count up to a multiple of the cluster size
+static uint32_t alignToCluster(uint32_t sectors, uint32_t cluster_size) {
+    return (sectors + cluster_size - 1) & ~(cluster_size - 1);
+}
+
+// Function to fill in a space padded 11 byte volume label ("NO NAME" when empty)
+void setFat32Label(Fat32Layout *layout, const char *label) {
+    memset(layout->label, ' ', sizeof(layout->label));
+    if (label == NULL || label[0] == '\0') {
+        label = "NO NAME";
+    }
+    for (size_t i = 0; i < sizeof(layout->label) && label[i]; i++) {
+        layout->label[i] = toupper((unsigned char)label[i]);
+    }
+}
+
+// Function to compute the FAT32 layout mkfs.fat would pick for a volume of the given size
+int computeFat32Layout(uint64_t size_bytes, Fat32Layout *layout) {
+    uint64_t sectors = size_bytes / FAT_SECTOR_SIZE;
+
+    memset(layout, 0, sizeof(*layout));
+    if (sectors > 0xFFFFFFFFULL) {
+        printf("Volume is too large for FAT32 (maximum 2 TB).\n");
+        return -1;
+    }
+
+    // CHS geometry: SD card recommendation below 256 MB, LBA-Assist translation above
+    if (sectors <= 524288) {
+        layout->heads = sectors <= 32768 ? 2 : sectors <= 65536 ? 4 : sectors <= 262144 ? 8 : 16;
+        layout->sectors_per_track = sectors <= 4096 ? 16 : 32;
+    } else {
+        layout->heads = sectors <= 16 * 63 * 1024 ? 16 :
+                        sectors <= 32 * 63 * 1024 ? 32 :
+                        sectors <= 64 * 63 * 1024 ? 64 :
+                        sectors <= 128 * 63 * 1024 ? 128 : 255;
+        layout->sectors_per_track = 63;
+    }
+
+    // Same cluster size table as Microsoft's format command
+    uint32_t cluster_size = sectors > 32ULL * 1024 * 1024 * 2 ? 64 :
+                            sectors > 16ULL * 1024 * 1024 * 2 ? 32 :
+                            sectors > 8ULL * 1024 * 1024 * 2 ? 16 :
+                            sectors > 260ULL * 1024 * 2 ? 8 : 1;
+
+    // DOS and mtools want the sector count to be a multiple of the track size
+    sectors = sectors / layout->sectors_per_track * layout->sectors_per_track;
+
+    uint32_t clusters = 0;
+    uint32_t fat_length = 0;
+    while (cluster_size <= FAT32_MAX_CLUSTER_SIZE) {
+        uint64_t reserved = alignToCluster(FAT32_RESERVED_SECTORS, cluster_size);
+        if (sectors <= reserved) {
+            break;
+        }
+        uint64_t data_sectors = sectors - reserved;
+        uint64_t estimate = (data_sectors * FAT_SECTOR_SIZE + FAT32_NUM_FATS * 8) /
+                            (cluster_size * FAT_SECTOR_SIZE + FAT32_NUM_FATS * 4);
+        fat_length = alignToCluster((uint32_t)(((estimate + 2) * 4 + FAT_SECTOR_SIZE - 1) / FAT_SECTOR_SIZE), cluster_size);
+
+        // The unused tails of the FATs and the data area may add up to a phantom cluster, so recount
+        uint64_t max_clusters = (uint64_t)fat_length * FAT_SECTOR_SIZE / 4;
+        if (max_clusters > FAT32_MAX_CLUSTERS) {
+            max_clusters = FAT32_MAX_CLUSTERS;
+        }
+        if (data_sectors > (uint64_t)FAT32_NUM_FATS * fat_length) {
+            uint64_t count = (data_sectors - (uint64_t)FAT32_NUM_FATS * fat_length) / cluster_size;
+            if (count > 0 && count <= max_clusters) {
+                clusters = (uint32_t)count;
+                break;
+            }
+        }
+        cluster_size <<= 1;
+    }
+
+    if (clusters == 0) {
+        printf("Volume is too small to hold a FAT32 filesystem.\n");
+        return -1;
+    }
+
+    layout->total_sectors = (uint32_t)sectors;
+    layout->reserved_sectors = alignToCluster(FAT32_RESERVED_SECTORS, cluster_size);
+    layout->sectors_per_cluster = cluster_size;
+    layout->fat_length = fat_length;
+    layout->cluster_count = clusters;
+
+    // Volume serial and label timestamp are derived from the current time, like mkfs.fat
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    layout->volume_id = (uint32_t)(((uint64_t)now.tv_sec << 20) | now.tv_usec);
+    layout->create_time = now.tv_sec;
+    setFat32Label(layout, NULL);
+    return 0;
+}
+
+// Function to build the FAT32 boot sector for a layout
+static void buildFat32BootSector(const Fat32Layout *layout, uint8_t *sector) {
+    memset(sector, 0, FAT_SECTOR_SIZE);
+    sector[0] = 0xEB;
+    sector[1] = FAT32_BOOT_CODE_OFFSET - 2;
+    sector[2] = 0x90;
+    memcpy(sector + 3, "mkfs.fat", 8);
+    putLE16(sector + 11, FAT_SECTOR_SIZE);
+    sector[13] = layout->sectors_per_cluster;
+    putLE16(sector + 14, layout->reserved_sectors);
+    sector[16] = FAT32_NUM_FATS;
+    if (layout->total_sectors < 65536) {
+        putLE16(sector + 19, (uint16_t)layout->total_sectors);
+    } else {
+        putLE32(sector + 32, layout->total_sectors);
+    }
+    sector[21] = FAT32_MEDIA;
+    putLE16(sector + 24, layout->sectors_per_track);
+    putLE16(sector + 26, layout->heads);
+    putLE32(sector + 28, layout->hidden_sectors);
+    putLE32(sector + 36, layout->fat_length);
+    putLE32(sector + 44, FAT32_ROOT_CLUSTER);
+    putLE16(sector + 48, FAT32_INFO_SECTOR);
+    putLE16(sector + 50, FAT32_BACKUP_BOOT);
+    sector[64] = 0x80;  // Drive number
+    sector[66] = 0x29;  // Extended boot signature
+    putLE32(sector + 67, layout->volume_id);
+    memcpy(sector + 71, layout->label, sizeof(layout->label));
+    memcpy(sector + 82, "FAT32   ", 8);
+
+    // The message pointer in the boot code is relative to where BIOS loads the sector
+    memcpy(sector + FAT32_BOOT_CODE_OFFSET, fat32BootCode, sizeof(fat32BootCode) - 1);
+    putLE16(sector + FAT32_BOOT_CODE_OFFSET + 3, 0x7C00 + FAT32_BOOT_CODE_OFFSET + FAT32_BOOT_MESSAGE_OFFSET);
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+}
+
+// Function to build the FSInfo sector, cluster 2 is already taken by the root directory
+static void buildFat32InfoSector(const Fat32Layout *layout, uint8_t *sector) {
+    memset(sector, 0, FAT_SECTOR_SIZE);
+    memcpy(sector, "RRaA", 4);
+    memcpy(sector + 484, "rrAa", 4);
+    putLE32(sector + 488, layout->cluster_count - 1);
+    putLE32(sector + 492, FAT32_ROOT_CLUSTER);
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+}
+
+// Function to fill in the volume label entry of the root directory
+static void buildFat32LabelEntry(const Fat32Layout *layout, uint8_t *entry) {
+    memset(entry, 0, FAT_DIR_ENTRY_SIZE);
+    memcpy(entry, layout->label, sizeof(layout->label));
+    if (entry[0] == 0xE5) {
+        entry[0] = 0x05;
+    }
+    entry[11] = FAT_ATTR_VOLUME;
+
+    uint16_t time_field = 0;
+    uint16_t date_field = 1 + (1 << 5);  // Fall back to 1980-01-01 00:00:00
+    struct tm tm_buf;
+    struct tm *ctime = localtime_r(&layout->create_time, &tm_buf);
+    if (ctime && ctime->tm_year >= 80 && ctime->tm_year <= 207) {
+        time_field = (ctime->tm_sec >> 1) + (ctime->tm_min << 5) + (ctime->tm_hour << 11);
+        date_field = ctime->tm_mday + ((ctime->tm_mon + 1) << 5) + ((ctime->tm_year - 80) << 9);
+    }
+    putLE16(entry + 14, time_field);
+    putLE16(entry + 16, date_field);
+    putLE16(entry + 18, date_field);
+    putLE16(entry + 22, time_field);
+    putLE16(entry + 24, date_field);
+}
+
+// One timed span of --trace: the whole command, a phase of it or a subprocess
+typedef struct {
+    const char *category;         // "command", "phase" or "process"
+    char name[48];
+    char detail[192];             // Command line of a subprocess, empty otherwise
+    uint64_t start_us;            // Monotonic clock, relative to the start of tracing
+    uint64_t duration_us;
+    uint64_t bytes;               // Bytes DiskProvision wrote while the span was open, on any thread
+    int thread;
+} TraceSpan;
+
+// Start of an open span, from traceBegin()
+typedef struct {
+    uint64_t start_us;
+    uint64_t bytes;
+} TraceMark;
+
+// Bytes written to images and journals by this process, counted whether or not a trace is recorded
+static uint64_t written_bytes;
+
+// Spans recorded so far, nothing is recorded and every trace call is a single branch while trace_enabled is 0
+static int trace_enabled;
+static uint64_t trace_origin_us;
+static TraceSpan *trace_spans;
+static size_t trace_count;
+static size_t trace_capacity;
+static int trace_threads;
+static __thread int trace_thread;  // Small per-thread number for the trace, 0 until the thread records a span
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to read the monotonic clock in microseconds
+static uint64_t traceClock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+// Function to start recording spans
+void traceStart(void) {
+    trace_origin_us = traceClock();
+    trace_enabled = 1;
+}
+
+// Function to mark the start of a span
+TraceMark traceBegin(void) {
+    TraceMark mark = {0, 0};
+    if (trace_enabled) {
+        mark.start_us = traceClock() - trace_origin_us;
+        mark.bytes = __atomic_load_n(&written_bytes, __ATOMIC_RELAXED);
+    }
+    return mark;
+}
+
+// Function to record a span that started at mark, detail may be NULL
+void traceEnd(const TraceMark *mark, const char *category, const char *name, const char *detail) {
+    if (!trace_enabled) {
+        return;
+    }
+    uint64_t end = traceClock() - trace_origin_us;
+    uint64_t bytes = __atomic_load_n(&written_bytes, __ATOMIC_RELAXED) - mark->bytes;
+    pthread_mutex_lock(&trace_lock);
+    if (trace_count == trace_capacity) {
+        size_t capacity = trace_capacity ? trace_capacity * 2 : 64;
+        TraceSpan *grown = realloc(trace_spans, capacity * sizeof(TraceSpan));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&trace_lock);
+            return;
+        }
+        trace_spans = grown;
+        trace_capacity = capacity;
+    }
+    if (trace_thread == 0) {
+        trace_thread = ++trace_threads;
+    }
+    TraceSpan *span = &trace_spans[trace_count++];
+    span->category = category;
+    snprintf(span->name, sizeof(span->name), "%s", name);
+    snprintf(span->detail, sizeof(span->detail), "%s", detail != NULL ? detail : "");
+    span->start_us = mark->start_us;
+    span->duration_us = end - mark->start_us;
+    span->bytes = bytes;
+    span->thread = trace_thread;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Function to count bytes written, for the open spans and for the throughput batch reports
+static void countWritten(uint64_t bytes) {
+    __atomic_fetch_add(&written_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+// Function to write a buffer completely at the given offset
+int writeAll(int fd, const void *buf, size_t len, uint64_t offset) {
+    const uint8_t *p = buf;
+    size_t total = len;
+    while (len > 0) {
+        ssize_t written = pwrite(fd, p, len, (off_t)offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += written;
+        len -= written;
+        offset += written;
+    }
+    countWritten(total);
+    return 0;
+}
+
+// Function to read a buffer completely from the given offset, short reads past EOF are zero filled
+int readAll(int fd, void *buf, size_t len, uint64_t offset) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t got = pread(fd, p, len, (off_t)offset);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (got == 0) {
+            memset(p, 0, len);
+            break;
+        }
+        p += got;
+        len -= got;
+        offset += got;
+    }
+    return 0;
+}
+
+// Function to make a byte range read back as zeros, preallocated images stay allocated and sparse ones stay sparse
+int zeroRange(int fd, uint64_t offset, uint64_t len) {
+    if (len == 0) {
+        return 0;
+    }
+#ifdef __linux__
+    struct stat st;
+    int preallocated = fstat(fd, &st) == 0 && (uint64_t)st.st_blocks * 512 >= (uint64_t)st.st_size;
+    int mode = preallocated ? FALLOC_FL_ZERO_RANGE : FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+    if (fallocate(fd, mode, (off_t)offset, (off_t)len) == 0) {
+        return 0;
+    }
+#endif
+
+    static const uint8_t zeros[64 * 1024];
+    while (len > 0) {
+        size_t chunk = len < sizeof(zeros) ? len : sizeof(zeros);
+        if (writeAll(fd, zeros, chunk, offset) != 0) {
+            return -1;
+        }
+        offset += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Bulk write engine parameters, buffers are page aligned so they can go to an O_DIRECT descriptor
+#define IO_ENGINE_DEFAULT_DEPTH 32
+#define IO_ENGINE_MAX_DEPTH 256
+#define IO_ENGINE_BLOCK (1024 * 1024)
+#define IO_ENGINE_ALIGN 4096
+#define IO_ENGINE_MAX_THREADS 16
+
+// Writes the engine keeps in flight, set with --queue-depth
+static int io_queue_depth = IO_ENGINE_DEFAULT_DEPTH;
+
+// State of one write request, each request owns one IO_ENGINE_BLOCK buffer
+typedef enum {
+    IO_REQUEST_FREE,
+    IO_REQUEST_FILLING,           // Handed out by ioEngineBuffer(), not submitted yet
+    IO_REQUEST_QUEUED,            // Waiting for a pool thread
+    IO_REQUEST_IN_FLIGHT
+} IoRequestState;
+
+typedef struct {
+    const uint8_t *data;          // The request buffer, or the shared zero buffer
+    size_t len;
+    uint64_t offset;
+    IoRequestState state;
+} IoRequest;
+
+// Asynchronous writer for large sequential transfers: io_uring with registered buffers on Linux, a pool of pwrite
+// threads where io_uring is unavailable. Aligned requests go to an O_DIRECT descriptor when one could be opened.
+typedef struct {
+    int active;
+    int fd;                       // Buffered descriptor, owned by the caller
+    int direct_fd;                // Same file without the page cache, -1 when unavailable
+    int depth;
+    uint8_t *buffers;             // depth request buffers, then one zero buffer
+    IoRequest *requests;
+    int in_flight;                // Requests submitted and not completed yet
+    int error;                    // First errno a write failed with, reported by ioEngineDrain()
+#ifdef __linux__
+    int ring_fd;                  // -1 when the thread pool is used
+    int fixed;                    // Set when the buffers are registered with the ring
+    int unsubmitted;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+#endif
+    pthread_t threads[IO_ENGINE_MAX_THREADS];
+    int thread_count;
+    int *queue;                   // Request indexes waiting for a pool thread, in submission order
+    int queue_head, queue_count;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} IoEngine;
+
+// Function to write one request synchronously, on the direct descriptor when it is aligned for it
+static int ioEngineWriteRequest(IoEngine *io, const IoRequest *req) {
+    if (io->direct_fd >= 0 && req->offset % IO_ENGINE_ALIGN == 0 && req->len % IO_ENGINE_ALIGN == 0) {
+        if (writeAll(io->direct_fd, req->data, req->len, req->offset) == 0) {
+            return 0;
+        }
+        if (errno != EINVAL) {
+            return -1;
+        }
+        // The filesystem refused the direct write, the buffered descriptor takes it (pwrite is idempotent)
+    }
+    return writeAll(io->fd, req->data, req->len, req->offset);
+}
+
+// Function run by each pool thread, writing queued requests until the engine closes
+static void *ioEngineWorker(void *arg) {
+    IoEngine *io = arg;
+    pthread_mutex_lock(&io->lock);
+    for (;;) {
+        while (io->queue_count == 0 && !io->stopping) {
+            pthread_cond_wait(&io->changed, &io->lock);
+        }
+        if (io->queue_count == 0) {
+            break;
+        }
+        IoRequest *req = &io->requests[io->queue[io->queue_head]];
+        io->queue_head = (io->queue_head + 1) % io->depth;
+        io->queue_count--;
+        req->state = IO_REQUEST_IN_FLIGHT;
+        pthread_mutex_unlock(&io->lock);
+        int result = ioEngineWriteRequest(io, req);
+        int saved = errno;
+        pthread_mutex_lock(&io->lock);
+        if (result != 0 && io->error == 0) {
+            io->error = saved;
+        }
+        req->state = IO_REQUEST_FREE;
+        io->in_flight--;
+        pthread_cond_broadcast(&io->changed);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+#ifdef __linux__
+// Function to hand the queued submissions to the kernel, optionally waiting for at least one completion
+static int ioUringEnter(IoEngine *io, unsigned wait) {
+    for (;;) {
+        long done = syscall(__NR_io_uring_enter, io->ring_fd, io->unsubmitted, wait, wait ? IORING_ENTER_GETEVENTS : 0,
+                            NULL, 0);
+        if (done >= 0) {
+            io->unsubmitted -= (int)done;
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return -1;
+        }
+        if (errno != EINTR) {
+            wait = 1;  // Out of resources, let completions drain first
+        }
+    }
+}
+
+// Function to retire every completed request. Direct writes the filesystem refused and short writes are finished
+// with a buffered pwrite.
+static void ioUringReap(IoEngine *io) {
+    unsigned head = *io->cq_head;
+    unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+        IoRequest *req = &io->requests[cqe->user_data];
+        if (cqe->res > 0) {
+            countWritten((uint64_t)cqe->res);
+        }
+        if (cqe->res < 0 || (size_t)cqe->res < req->len) {
+            size_t done = cqe->res > 0 ? (size_t)cqe->res : 0;
+            if (cqe->res == -EINVAL && io->direct_fd >= 0) {
+                close(io->direct_fd);  // Later requests go through the page cache
+                io->direct_fd = -1;
+            } else if (cqe->res < 0 && io->error == 0) {
+                io->error = -cqe->res;
+            }
+            if (io->error == 0 && writeAll(io->fd, req->data + done, req->len - done, req->offset + done) != 0) {
+                io->error = errno;
+            }
+        }
+        req->state = IO_REQUEST_FREE;
+        io->in_flight--;
+        head++;
+    }
+    __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Function to set up an io_uring instance of depth entries with the request buffers registered, returns -1 when
+// the kernel does not offer io_uring and the thread pool has to be used
+static int ioUringOpen(IoEngine *io) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    io->ring_fd = (int)syscall(__NR_io_uring_setup, io->depth, &params);
+    if (io->ring_fd < 0) {
+        return -1;
+    }
+    io->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) && io->cq_map_size > io->sq_map_size) {
+        io->sq_map_size = io->cq_map_size;
+    }
+    io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    io->sq_map = mmap(NULL, io->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd,
+                      IORING_OFF_SQ_RING);
+    io->cq_map = MAP_FAILED;
+    io->sqes = MAP_FAILED;
+    if (io->sq_map != MAP_FAILED) {
+        io->cq_map = (params.features & IORING_FEAT_SINGLE_MMAP) ? io->sq_map :
+                     mmap(NULL, io->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd,
+                          IORING_OFF_CQ_RING);
+        io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd,
+                        IORING_OFF_SQES);
+    }
+    if (io->sq_map == MAP_FAILED || io->cq_map == MAP_FAILED || io->sqes == MAP_FAILED) {
+        if (io->sqes != MAP_FAILED) {
+            munmap(io->sqes, io->sqes_size);
+        }
+        if (io->cq_map != MAP_FAILED && io->cq_map != io->sq_map) {
+            munmap(io->cq_map, io->cq_map_size);
+        }
+        if (io->sq_map != MAP_FAILED) {
+            munmap(io->sq_map, io->sq_map_size);
+        }
+        close(io->ring_fd);
+        io->ring_fd = -1;
+        return -1;
+    }
+    uint8_t *sq = io->sq_map, *cq = io->cq_map;
+    io->sq_head = (unsigned *)(sq + params.sq_off.head);
+    io->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    io->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    io->sq_array = (unsigned *)(sq + params.sq_off.array);
+    io->cq_head = (unsigned *)(cq + params.cq_off.head);
+    io->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    io->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Registered buffers spare the kernel pinning every page on each write, plain writes are used when the
+    // locked memory limit does not allow it
+    struct iovec iov[IO_ENGINE_MAX_DEPTH + 1];
+    for (int i = 0; i <= io->depth; i++) {
+        iov[i].iov_base = io->buffers + (size_t)i * IO_ENGINE_BLOCK;
+        iov[i].iov_len = IO_ENGINE_BLOCK;
+    }
+    io->fixed = syscall(__NR_io_uring_register, io->ring_fd, IORING_REGISTER_BUFFERS, iov, io->depth + 1) == 0;
+    return 0;
+}
+
+// Function to queue one request on the ring, the kernel sees it with the next ioUringEnter()
+static void ioUringQueue(IoEngine *io, int index) {
+    IoRequest *req = &io->requests[index];
+    unsigned tail = *io->sq_tail;
+    unsigned slot = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = &io->sqes[slot];
+    int direct = io->direct_fd >= 0 && req->offset % IO_ENGINE_ALIGN == 0 && req->len % IO_ENGINE_ALIGN == 0;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = io->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = direct ? io->direct_fd : io->fd;
+    sqe->addr = (uint64_t)(uintptr_t)req->data;
+    sqe->len = (uint32_t)req->len;
+    sqe->off = req->offset;
+    sqe->buf_index = (uint16_t)((req->data - io->buffers) / IO_ENGINE_BLOCK);
+    sqe->user_data = (uint64_t)index;
+    io->sq_array[slot] = slot;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    io->unsubmitted++;
+    io->in_flight++;
+    req->state = IO_REQUEST_IN_FLIGHT;
+}
+#endif
+
+// Function to open the engine on fd, with direct set aligned writes also bypass the page cache. expected is how
+// many bytes the caller is going to write, 0 when unknown, small transfers do not set up more buffers than they use.
+int ioEngineOpen(IoEngine *io, int fd, int direct, uint64_t expected) {
+    memset(io, 0, sizeof(*io));
+    io->fd = fd;
+    io->direct_fd = -1;
+    io->depth = io_queue_depth;
+    if (expected > 0 && (expected + IO_ENGINE_BLOCK - 1) / IO_ENGINE_BLOCK < (uint64_t)io->depth) {
+        io->depth = (int)((expected + IO_ENGINE_BLOCK - 1) / IO_ENGINE_BLOCK);
+    }
+    if (posix_memalign((void **)&io->buffers, IO_ENGINE_ALIGN, (size_t)(io->depth + 1) * IO_ENGINE_BLOCK) != 0 ||
+        (io->requests = calloc(io->depth, sizeof(IoRequest))) == NULL ||
+        (io->queue = calloc(io->depth, sizeof(int))) == NULL) {
+        free(io->buffers);
+        free(io->requests);
+        free(io->queue);
+        return -1;
+    }
+    memset(io->buffers + (size_t)io->depth * IO_ENGINE_BLOCK, 0, IO_ENGINE_BLOCK);
+
+    // A second descriptor for the same file, the flag cannot be set on fd without affecting its other users
+    if (direct) {
+#if defined(__linux__)
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        io->direct_fd = open(path, O_WRONLY | O_DIRECT);
+#elif defined(__APPLE__)
+        char path[MAXPATHLEN];
+        if (fcntl(fd, F_GETPATH, path) == 0 && (io->direct_fd = open(path, O_WRONLY)) >= 0) {
+            fcntl(io->direct_fd, F_NOCACHE, 1);
+        }
+#endif
+    }
+
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->changed, NULL);
+    io->active = 1;
+#ifdef __linux__
+    if (ioUringOpen(io) == 0) {
+        return 0;
+    }
+#endif
+    int threads = io->depth < IO_ENGINE_MAX_THREADS ? io->depth : IO_ENGINE_MAX_THREADS;
+    while (io->thread_count < threads &&
+           pthread_create(&io->threads[io->thread_count], NULL, ioEngineWorker, io) == 0) {
+        io->thread_count++;
+    }
+    return 0;
+}
+
+// Function to wait for a request to complete, with none in flight it returns right away
+static void ioEngineWait(IoEngine *io) {
+#ifdef __linux__
+    if (io->ring_fd >= 0) {
+        if (io->in_flight > 0) {
+            if (ioUringEnter(io, 1) != 0 && io->error == 0) {
+                io->error = errno;
+            }
+            ioUringReap(io);
+        }
+        return;
+    }
+#endif
+    if (io->in_flight > 0) {
+        pthread_cond_wait(&io->changed, &io->lock);
+    }
+}
+
+// Function to claim a free request, waiting for one to complete when all are busy
+static int ioEngineClaim(IoEngine *io) {
+    for (;;) {
+        for (int i = 0; i < io->depth; i++) {
+            if (io->requests[i].state == IO_REQUEST_FREE) {
+                io->requests[i].state = IO_REQUEST_FILLING;
+                return i;
+            }
+        }
+        ioEngineWait(io);
+    }
+}
+
+// Function to submit a claimed request
+static void ioEngineQueue(IoEngine *io, int index, const uint8_t *data, size_t len, uint64_t offset) {
+    IoRequest *req = &io->requests[index];
+    req->data = data;
+    req->len = len;
+    req->offset = offset;
+#ifdef __linux__
+    if (io->ring_fd >= 0) {
+        ioUringQueue(io, index);
+        if (io->unsubmitted >= (io->depth + 3) / 4 && ioUringEnter(io, 0) != 0 && io->error == 0) {
+            io->error = errno;
+        }
+        ioUringReap(io);
+        return;
+    }
+#endif
+    if (io->thread_count == 0) {
+        // No thread could be started, the write happens right here
+        if (ioEngineWriteRequest(io, req) != 0 && io->error == 0) {
+            io->error = errno;
+        }
+        req->state = IO_REQUEST_FREE;
+        return;
+    }
+    req->state = IO_REQUEST_QUEUED;
+    io->queue[(io->queue_head + io->queue_count) % io->depth] = index;
+    io->queue_count++;
+    io->in_flight++;
+    pthread_cond_broadcast(&io->changed);
+}
+
+// Function to get an IO_ENGINE_BLOCK buffer to fill, it has to be passed to ioEngineSubmit() next
+uint8_t *ioEngineBuffer(IoEngine *io) {
+    pthread_mutex_lock(&io->lock);
+    int index = ioEngineClaim(io);
+    pthread_mutex_unlock(&io->lock);
+    return io->buffers + (size_t)index * IO_ENGINE_BLOCK;
+}
+
+// Function to write len bytes of a buffer from ioEngineBuffer() at offset, returns -1 once any write has failed
+int ioEngineSubmit(IoEngine *io, uint8_t *buf, size_t len, uint64_t offset) {
+    pthread_mutex_lock(&io->lock);
+    ioEngineQueue(io, (int)((buf - io->buffers) / IO_ENGINE_BLOCK), buf, len, offset);
+    int error = io->error;
+    pthread_mutex_unlock(&io->lock);
+    errno = error;
+    return error == 0 ? 0 : -1;
+}
+
+// Function to write a caller buffer through the engine, it is copied so it can be reused right away
+int ioEngineWrite(IoEngine *io, const void *data, size_t len, uint64_t offset) {
+    const uint8_t *p = data;
+    while (len > 0) {
+        size_t chunk = len < IO_ENGINE_BLOCK ? len : IO_ENGINE_BLOCK;
+        uint8_t *buf = ioEngineBuffer(io);
+        memcpy(buf, p, chunk);
+        if (ioEngineSubmit(io, buf, chunk, offset) != 0) {
+            return -1;
+        }
+        p += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Function to write zeros over a byte range, every request shares the one zero buffer
+int ioEngineZero(IoEngine *io, uint64_t offset, uint64_t len) {
+    const uint8_t *zeros = io->buffers + (size_t)io->depth * IO_ENGINE_BLOCK;
+    pthread_mutex_lock(&io->lock);
+    while (len > 0 && io->error == 0) {
+        size_t chunk = len < IO_ENGINE_BLOCK ? (size_t)len : IO_ENGINE_BLOCK;
+        ioEngineQueue(io, ioEngineClaim(io), zeros, chunk, offset);
+        offset += chunk;
+        len -= chunk;
+    }
+    int error = io->error;
+    pthread_mutex_unlock(&io->lock);
+    errno = error;
+    return error == 0 ? 0 : -1;
+}
+
+// Function to wait until every submitted write has completed, returns -1 with errno set when any of them failed
+int ioEngineDrain(IoEngine *io) {
+    if (!io->active) {
+        return 0;
+    }
+    pthread_mutex_lock(&io->lock);
+#ifdef __linux__
+    if (io->ring_fd >= 0 && io->unsubmitted > 0 && ioUringEnter(io, 0) != 0 && io->error == 0) {
+        io->error = errno;
+    }
+#endif
+    while (io->in_flight > 0) {
+        ioEngineWait(io);
+    }
+    int error = io->error;
+    pthread_mutex_unlock(&io->lock);
+    errno = error;
+    return error == 0 ? 0 : -1;
+}
+
+// Function to drain and release the engine, the caller's descriptor stays open
+int ioEngineClose(IoEngine *io) {
+    if (!io->active) {
+        return 0;
+    }
+    int result = ioEngineDrain(io);
+    int saved = errno;
+    pthread_mutex_lock(&io->lock);
+    io->stopping = 1;
+    pthread_cond_broadcast(&io->changed);
+    pthread_mutex_unlock(&io->lock);
+    for (int i = 0; i < io->thread_count; i++) {
+        pthread_join(io->threads[i], NULL);
+    }
+#ifdef __linux__
+    if (io->ring_fd >= 0) {
+        munmap(io->sqes, io->sqes_size);
+        if (io->cq_map != io->sq_map) {
+            munmap(io->cq_map, io->cq_map_size);
+        }
+        munmap(io->sq_map, io->sq_map_size);
+        close(io->ring_fd);
+    }
+#endif
+    if (io->direct_fd >= 0) {
+        close(io->direct_fd);
+    }
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->changed);
+    free(io->buffers);
+    free(io->requests);
+    free(io->queue);
+    io->active = 0;
+    errno = saved;
+    return result;
+}
+
+// Destination of volume metadata writes, lets the formatter target raw files and QCOW2 images alike
+typedef struct {
+    int (*write)(void *ctx, const void *buf, size_t len, uint64_t offset);
+    int (*zero)(void *ctx, uint64_t offset, uint64_t len);
+    void *ctx;
+} BlockWriter;
+
+// Function to write the boot region, both FATs and the empty root directory of a FAT32 volume
+int writeFat32Volume(const BlockWriter *out, const Fat32Layout *layout) {
+    size_t reserved_bytes = (size_t)layout->reserved_sectors * FAT_SECTOR_SIZE;
+    size_t cluster_bytes = (size_t)layout->sectors_per_cluster * FAT_SECTOR_SIZE;
+    uint64_t fat_bytes = (uint64_t)layout->fat_length * FAT_SECTOR_SIZE;
+    uint64_t fat_start = layout->offset + reserved_bytes;
+    uint64_t data_start = fat_start + FAT32_NUM_FATS * fat_bytes;
+
+    // Boot sector, FSInfo and their backups at sectors 6 and 7, the rest of the reserved area is zero
+    uint8_t *reserved = calloc(1, reserved_bytes);
+    if (reserved == NULL) {
+        return -1;
+    }
+    buildFat32BootSector(layout, reserved);
+    buildFat32InfoSector(layout, reserved + FAT32_INFO_SECTOR * FAT_SECTOR_SIZE);
+    memcpy(reserved + FAT32_BACKUP_BOOT * FAT_SECTOR_SIZE, reserved, 2 * FAT_SECTOR_SIZE);
+    int result = out->write(out->ctx, reserved, reserved_bytes, layout->offset);
+    free(reserved);
+    if (result != 0) {
+        return -1;
+    }
+
+    // Each FAT starts with the media descriptor, the reserved entry 1 and the root directory chain
+    uint8_t fat_head[FAT_SECTOR_SIZE] = {0};
+    putLE32(fat_head, 0x0FFFFF00 | FAT32_MEDIA);
+    putLE32(fat_head + 4, 0x0FFFFFFF);
+    putLE32(fat_head + 8, FAT32_EOC);
+    for (int i = 0; i < FAT32_NUM_FATS; i++) {
+        uint64_t fat_offset = fat_start + i * fat_bytes;
+        if (out->write(out->ctx, fat_head, sizeof(fat_head), fat_offset) != 0 ||
+            out->zero(out->ctx, fat_offset + FAT_SECTOR_SIZE, fat_bytes - FAT_SECTOR_SIZE) != 0) {
+            return -1;
+        }
+    }
+
+    // Root directory cluster, holding only the volume label when one was given
+    if (memcmp(layout->label, "NO NAME    ", sizeof(layout->label)) != 0) {
+        uint8_t label_entry[FAT_DIR_ENTRY_SIZE];
+        buildFat32LabelEntry(layout, label_entry);
+        if (out->write(out->ctx, label_entry, sizeof(label_entry), data_start) != 0 ||
+            out->zero(out->ctx, data_start + FAT_DIR_ENTRY_SIZE, cluster_bytes - FAT_DIR_ENTRY_SIZE) != 0) {
+            return -1;
+        }
+    } else if (out->zero(out->ctx, data_start, cluster_bytes) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// GUID partition table parameters, the EFI System Partition starts and ends on 1 MiB boundaries
+#define GPT_SIGNATURE "EFI PART"
+#define GPT_REVISION 0x00010000
+#define GPT_HEADER_SIZE 92
+#define GPT_ENTRY_COUNT 128
+#define GPT_ENTRY_SIZE 128
+#define GPT_ENTRY_SECTORS (GPT_ENTRY_COUNT * GPT_ENTRY_SIZE / FAT_SECTOR_SIZE)
+#define GPT_ALIGNMENT_SECTORS 2048
+#define GPT_MAX_ENTRY_BYTES (1024 * 1024)
+#define MBR_PARTITION_TABLE 446
+#define MBR_TYPE_FAT32_CHS 0x0B
+#define MBR_TYPE_FAT32_LBA 0x0C
+#define MBR_TYPE_ESP 0xEF
+#define MBR_TYPE_PROTECTIVE 0xEE
+
+// Partition type GUIDs in on-disk byte order: EFI System (C12A7328-F81F-11D2-BA4B-00A0C93EC93B) and
+// Microsoft basic data (EBD0A0A2-B9E5-4433-87C0-68B6B72699C7), the latter is only looked for when reading
+static const uint8_t gptEspType[16] = {0x28, 0x73, 0x2A, 0xC1, 0x1F, 0xF8, 0xD2, 0x11,
+                                       0xBA, 0x4B, 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B};
+static const uint8_t gptBasicDataType[16] = {0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9, 0x33, 0x44,
+                                             0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7};
+
+// How the FAT32 volume is laid out inside a new image
+typedef enum {
+    IMAGE_LAYOUT_GPT,          // Protective MBR, GPT and an EFI System Partition holding the volume
+    IMAGE_LAYOUT_SUPERFLOPPY   // Volume over the whole image, like mkfs.fat -I
+} ImageLayout;
+
+// Function to parse a layout name, NULL selects GPT, returns -1 when unknown
+int parseImageLayout(const char *name) {
+    if (name == NULL || strcmp(name, "gpt") == 0) {
+        return IMAGE_LAYOUT_GPT;
+    }
+    if (strcmp(name, "superfloppy") == 0 || strcmp(name, "none") == 0) {
+        return IMAGE_LAYOUT_SUPERFLOPPY;
+    }
+    return -1;
+}
+
+// Function to get the sectors of the EFI System Partition: 1 MiB in, ending on the last 1 MiB boundary before the
+// backup GPT, returns -1 when the image is too small to hold any
+static int gptEspRange(uint64_t image_size, uint64_t *first, uint64_t *last) {
+    uint64_t sectors = image_size / FAT_SECTOR_SIZE;
+    uint64_t reserved_tail = 1 + GPT_ENTRY_SECTORS;
+    if (sectors < 2 * GPT_ALIGNMENT_SECTORS + reserved_tail) {
+        printf("Image is too small for a GPT layout.\n");
+        return -1;
+    }
+    *first = GPT_ALIGNMENT_SECTORS;
+    *last = (sectors - reserved_tail) / GPT_ALIGNMENT_SECTORS * GPT_ALIGNMENT_SECTORS - 1;
+    return 0;
+}
+
+// Function to compute the FAT32 layout of a new image, over the whole image or inside its EFI System Partition
+int computeImageLayout(uint64_t image_size, ImageLayout kind, Fat32Layout *layout) {
+    if (kind == IMAGE_LAYOUT_SUPERFLOPPY) {
+        return computeFat32Layout(image_size, layout);
+    }
+    uint64_t first, last;
+    if (gptEspRange(image_size, &first, &last) != 0 ||
+        computeFat32Layout((last - first + 1) * FAT_SECTOR_SIZE, layout) != 0) {
+        return -1;
+    }
+    layout->offset = first * FAT_SECTOR_SIZE;
+    layout->hidden_sectors = (uint32_t)first;
+    return 0;
+}
+
+// Function to fill in a random (version 4) GUID, falling back to the clock when /dev/urandom is unavailable
+static void randomGuid(uint8_t *guid) {
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, guid, 16) != 16) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        uint64_t state = ((uint64_t)now.tv_sec << 32) ^ (uint64_t)now.tv_nsec ^ ((uint64_t)getpid() << 16);
+        for (int i = 0; i < 16; i++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            guid[i] = (uint8_t)state;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    guid[7] = (guid[7] & 0x0F) | 0x40;  // The third field is stored little-endian, its top nibble is the version
+    guid[8] = (guid[8] & 0x3F) | 0x80;
+}
+
+// Function to build a GPT header, the entries it points at must already be final
+static void buildGptHeader(uint8_t *sector, const uint8_t *disk_guid, uint64_t current, uint64_t backup,
+                           uint64_t entries_lba, uint64_t last_usable, uint32_t entries_crc) {
+    memset(sector, 0, FAT_SECTOR_SIZE);
+    memcpy(sector, GPT_SIGNATURE, 8);
+    putLE32(sector + 8, GPT_REVISION);
+    putLE32(sector + 12, GPT_HEADER_SIZE);
+    putLE64(sector + 24, current);
+    putLE64(sector + 32, backup);
+    putLE64(sector + 40, 2 + GPT_ENTRY_SECTORS);
+    putLE64(sector + 48, last_usable);
+    memcpy(sector + 56, disk_guid, 16);
+    putLE64(sector + 72, entries_lba);
+    putLE32(sector + 80, GPT_ENTRY_COUNT);
+    putLE32(sector + 84, GPT_ENTRY_SIZE);
+    putLE32(sector + 88, entries_crc);
+    putLE32(sector + 16, (uint32_t)crc32(0, sector, GPT_HEADER_SIZE));
+}
+
+// Function to write a protective MBR, the primary and backup GPT with one EFI System Partition, and zeros over
+// everything outside the partition. Writes go out in offset order except the backup, which is returned in tail
+// for the caller to write once the volume is in place.
+static int writeGptPartitionTable(const BlockWriter *out, uint64_t image_size, uint8_t *tail) {
+    uint64_t sectors = image_size / FAT_SECTOR_SIZE;
+    uint64_t first, last;
+    if (gptEspRange(image_size, &first, &last) != 0) {
+        return -1;
+    }
+    size_t head_bytes = (2 + GPT_ENTRY_SECTORS) * FAT_SECTOR_SIZE;
+    uint8_t *head = calloc(1, head_bytes);
+    if (head == NULL) {
+        return -1;
+    }
+
+    // One partition of type 0xEE over the whole disk, so MBR-only tools leave the disk alone
+    uint8_t *mbr_entry = head + MBR_PARTITION_TABLE;
+    mbr_entry[2] = 0x02;
+    mbr_entry[4] = MBR_TYPE_PROTECTIVE;
+    mbr_entry[5] = mbr_entry[6] = mbr_entry[7] = 0xFF;
+    putLE32(mbr_entry + 8, 1);
+    putLE32(mbr_entry + 12, sectors - 1 > 0xFFFFFFFFULL ? 0xFFFFFFFF : (uint32_t)(sectors - 1));
+    head[510] = 0x55;
+    head[511] = 0xAA;
+
+    // The partition entry array, identical for both copies
+    static const char name[] = "EFI System Partition";
+    uint8_t *entries = head + 2 * FAT_SECTOR_SIZE;
+    uint8_t disk_guid[16];
+    memcpy(entries, gptEspType, 16);
+    randomGuid(entries + 16);
+    putLE64(entries + 32, first);
+    putLE64(entries + 40, last);
+    for (size_t i = 0; i < sizeof(name) - 1; i++) {
+        putLE16(entries + 56 + i * 2, (uint8_t)name[i]);
+    }
+    randomGuid(disk_guid);
+    uint32_t entries_crc = (uint32_t)crc32(0, entries, GPT_ENTRY_COUNT * GPT_ENTRY_SIZE);
+    uint64_t last_usable = sectors - 2 - GPT_ENTRY_SECTORS;
+    buildGptHeader(head + FAT_SECTOR_SIZE, disk_guid, 1, sectors - 1, 2, last_usable, entries_crc);
+
+    memcpy(tail, entries, GPT_ENTRY_SECTORS * FAT_SECTOR_SIZE);
+    buildGptHeader(tail + GPT_ENTRY_SECTORS * FAT_SECTOR_SIZE, disk_guid, sectors - 1, 1, sectors - 1 - GPT_ENTRY_SECTORS,
+                   last_usable, entries_crc);
+
+    int result = out->write(out->ctx, head, head_bytes, 0);
+    free(head);
+    if (result == 0) {
+        result = out->zero(out->ctx, head_bytes, first * FAT_SECTOR_SIZE - head_bytes);
+    }
+    return result;
+}
+
+// Function to write the FAT32 volume of a new image, preceded by the partition table when the layout has one, so a
+// boot-ready image comes out of one pass from the start of the image to its end
+int writeImageVolume(const BlockWriter *out, uint64_t image_size, ImageLayout kind, const Fat32Layout *layout) {
+    if (kind == IMAGE_LAYOUT_SUPERFLOPPY) {
+        return writeFat32Volume(out, layout);
+    }
+    uint8_t *tail = malloc((1 + GPT_ENTRY_SECTORS) * FAT_SECTOR_SIZE);
+    uint64_t first, last;
+    if (tail == NULL || gptEspRange(image_size, &first, &last) != 0) {
+        free(tail);
+        return -1;
+    }
+    uint64_t tail_offset = (image_size / FAT_SECTOR_SIZE - 1 - GPT_ENTRY_SECTORS) * FAT_SECTOR_SIZE;
+    uint64_t esp_end = (last + 1) * FAT_SECTOR_SIZE;
+    int result = writeGptPartitionTable(out, image_size, tail);
+    if (result == 0) {
+        result = writeFat32Volume(out, layout);
+    }
+    if (result == 0) {
+        result = out->zero(out->ctx, esp_end, tail_offset - esp_end);
+    }
+    if (result == 0) {
+        result = out->write(out->ctx, tail, (1 + GPT_ENTRY_SECTORS) * FAT_SECTOR_SIZE, tail_offset);
+    }
+    free(tail);
+    return result;
+}
+
+// Allocation policies for newly created raw images
+typedef enum {
+    IMAGE_ALLOC_SPARSE,     // ftruncate only, blocks are allocated on first write
+    IMAGE_ALLOC_FALLOCATE,  // fallocate the full size up front, unwritten extents read as zero
+    IMAGE_ALLOC_ZERO        // Write zeros over the full size
+} ImageAllocPolicy;
+
+#define IMAGE_ZERO_CHUNK (4 * 1024 * 1024)
+
+// Function to get the printable name of an allocation policy
+const char *allocPolicyName(ImageAllocPolicy policy) {
+    switch (policy) {
+        case IMAGE_ALLOC_FALLOCATE:
+            return "preallocated";
+        case IMAGE_ALLOC_ZERO:
+            return "zero-filled";
+        default:
+            return "sparse";
+    }
+}
+
+// Function to parse an allocation policy name, returns -1 when unknown
+int parseAllocPolicy(const char *name) {
+    if (strcmp(name, "sparse") == 0) {
+        return IMAGE_ALLOC_SPARSE;
+    }
+    if (strcmp(name, "falloc") == 0 || strcmp(name, "prealloc") == 0 || strcmp(name, "preallocated") == 0) {
+        return IMAGE_ALLOC_FALLOCATE;
+    }
+    if (strcmp(name, "zero") == 0 || strcmp(name, "full") == 0) {
+        return IMAGE_ALLOC_ZERO;
+    }
+    return -1;
+}
+
+// Function to parse a size such as "512M" or "1.5G" into bytes, a bare number means gigabytes
+uint64_t parseSize(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value <= 0) {
+        return 0;
+    }
+    double scale;
+    switch (toupper((unsigned char)*end)) {
+        case 'K':
+            scale = 1024.0;
+            break;
+        case 'M':
+            scale = 1024.0 * 1024.0;
+            break;
+        case '\0':
+        case 'G':
+            scale = 1024.0 * 1024.0 * 1024.0;
+            break;
+        case 'T':
+            scale = 1024.0 * 1024.0 * 1024.0 * 1024.0;
+            break;
+        default:
+            return 0;
+    }
+    // Round up to whole sectors, like qemu-img does
+    uint64_t bytes = (uint64_t)(value * scale + 0.5);
+    return (bytes + FAT_SECTOR_SIZE - 1) / FAT_SECTOR_SIZE * FAT_SECTOR_SIZE;
+}
+
+// Function to write zeros over the first len bytes of a file, queue depth writes at a time past the page cache
+static int zeroFill(int fd, uint64_t len) {
+    IoEngine io;
+    if (ioEngineOpen(&io, fd, 1, len) != 0) {
+        return -1;
+    }
+    int result = ioEngineZero(&io, 0, len);
+    if (ioEngineClose(&io) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+// Function to create a raw image in-process, replacing "qemu-img create -f raw"
+int createRawImage(const char *image_path, uint64_t size, ImageAllocPolicy policy) {
+    int fd = open(image_path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        printf("Failed to create '%s': %s\n", image_path, strerror(errno));
+        return -1;
+    }
+
+    int result = ftruncate(fd, (off_t)size);
+    if (result == 0 && policy == IMAGE_ALLOC_FALLOCATE) {
+#ifdef __linux__
+        result = fallocate(fd, 0, 0, (off_t)size);
+#else
+        result = -1;
+        errno = EOPNOTSUPP;
+#endif
+        if (result != 0 && errno == EOPNOTSUPP) {
+            printf("The filesystem does not support fallocate, zero-filling instead.\n");
+            policy = IMAGE_ALLOC_ZERO;
+            result = 0;
+        }
+    }
+    if (result == 0 && policy == IMAGE_ALLOC_ZERO) {
+        result = zeroFill(fd, size);
+    }
+    if (result == 0) {
+        result = fsync(fd);
+    }
+    if (result != 0) {
+        printf("Failed to allocate '%s': %s\n", image_path, strerror(errno));
+        close(fd);
+        unlink(image_path);
+        return -1;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    close(fd);
+    printf("Created %s raw image '%s': %.2f GB logical, %.2f MB allocated.\n", allocPolicyName(policy), image_path,
+           size / (1024.0 * 1024.0 * 1024.0), st.st_blocks * 512.0 / (1024.0 * 1024.0));
+    return 0;
+}
+
+// QCOW2 version 3 parameters, the same defaults qemu-img uses
+#define QCOW2_MAGIC 0x514649FB
+#define QCOW2_VERSION 3
+#define QCOW2_CLUSTER_BITS 16
+#define QCOW2_CLUSTER_SIZE (1 << QCOW2_CLUSTER_BITS)
+#define QCOW2_HEADER_LENGTH 112
+#define QCOW2_REFCOUNT_ORDER 4  // 16-bit refcounts
+#define QCOW2_OFLAG_COPIED (1ULL << 63)
+#define QCOW2_OFLAG_COMPRESSED (1ULL << 62)
+#define QCOW2_OFLAG_ZERO 1ULL
+#define QCOW2_OFFSET_MASK 0x00FFFFFFFFFFFE00ULL
+
+// Functions to store and load big-endian values, QCOW2 metadata is big-endian
+static void putBE16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static void putBE32(uint8_t *p, uint32_t v) {
+    putBE16(p, v >> 16);
+    putBE16(p + 2, v & 0xffff);
+}
+
+static void putBE64(uint8_t *p, uint64_t v) {
+    putBE32(p, v >> 32);
+    putBE32(p + 4, v & 0xffffffff);
+}
+
+static uint16_t getBE16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t getBE32(const uint8_t *p) {
+    return ((uint32_t)getBE16(p) << 16) | getBE16(p + 2);
+}
+
+static uint64_t getBE64(const uint8_t *p) {
+    return ((uint64_t)getBE32(p) << 32) | getBE32(p + 4);
+}
+
+// A guest cluster with data, collected in memory while a new QCOW2 image is being built
+typedef struct {
+    uint64_t index;
+    uint8_t *data;
+} Qcow2BuilderCluster;
+
+// In-memory QCOW2 image under construction, written out in one pass by qcow2BuilderFinish()
+typedef struct {
+    uint64_t size;
+    Qcow2BuilderCluster *clusters;
+    size_t count;
+    size_t capacity;
+} Qcow2Builder;
+
+// Function to find a guest cluster of the builder, optionally adding it zero-filled
+static uint8_t *qcow2BuilderCluster(Qcow2Builder *b, uint64_t index, int create) {
+    for (size_t i = 0; i < b->count; i++) {
+        if (b->clusters[i].index == index) {
+            return b->clusters[i].data;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    if (b->count == b->capacity) {
+        size_t capacity = b->capacity ? b->capacity * 2 : 16;
+        Qcow2BuilderCluster *grown = realloc(b->clusters, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            return NULL;
+        }
+        b->clusters = grown;
+        b->capacity = capacity;
+    }
+    uint8_t *data = calloc(1, QCOW2_CLUSTER_SIZE);
+    if (data == NULL) {
+        return NULL;
+    }
+    b->clusters[b->count].index = index;
+    b->clusters[b->count].data = data;
+    b->count++;
+    return data;
+}
+
+// Function to check whether a buffer holds only zero bytes
+int isZeroBuffer(const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    return len == 0 || (p[0] == 0 && memcmp(p, p + 1, len - 1) == 0);
+}
+
+// BlockWriter callbacks of the builder, zero writes never allocate a cluster
+static int qcow2BuilderWrite(void *ctx, const void *buf, size_t len, uint64_t offset) {
+    Qcow2Builder *b = ctx;
+    const uint8_t *p = buf;
+    while (len > 0) {
+        uint64_t index = offset >> QCOW2_CLUSTER_BITS;
+        size_t within = offset & (QCOW2_CLUSTER_SIZE - 1);
+        size_t chunk = QCOW2_CLUSTER_SIZE - within < len ? QCOW2_CLUSTER_SIZE - within : len;
+        int zero = isZeroBuffer(p, chunk);
+        uint8_t *cluster = qcow2BuilderCluster(b, index, !zero);
+        if (cluster != NULL) {
+            memcpy(cluster + within, p, chunk);
+        } else if (!zero) {
+            return -1;
+        }
+        p += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static int qcow2BuilderZero(void *ctx, uint64_t offset, uint64_t len) {
+    Qcow2Builder *b = ctx;
+    for (size_t i = 0; i < b->count; i++) {
+        uint64_t start = b->clusters[i].index << QCOW2_CLUSTER_BITS;
+        uint64_t end = start + QCOW2_CLUSTER_SIZE;
+        uint64_t from = offset > start ? offset : start;
+        uint64_t to = offset + len < end ? offset + len : end;
+        if (from < to) {
+            memset(b->clusters[i].data + (from - start), 0, (size_t)(to - from));
+        }
+    }
+    return 0;
+}
+
+// Function to order builder clusters by guest index
+static int compareBuilderClusters(const void *a, const void *b) {
+    uint64_t x = ((const Qcow2BuilderCluster *)a)->index;
+    uint64_t y = ((const Qcow2BuilderCluster *)b)->index;
+    return x < y ? -1 : x > y;
+}
+
+// Function to release the memory held by a builder
+static void qcow2BuilderFree(Qcow2Builder *b) {
+    for (size_t i = 0; i < b->count; i++) {
+        free(b->clusters[i].data);
+    }
+    free(b->clusters);
+    b->clusters = NULL;
+    b->count = 0;
+}
+
+// Function to write a built image: header, L1, refcount table and blocks, L2 tables, then data, in file order
+static int qcow2BuilderFinish(Qcow2Builder *b, int fd, uint64_t *written) {
+    const uint64_t cs = QCOW2_CLUSTER_SIZE;
+    const uint64_t l2_entries = cs / 8;
+    const uint64_t refcounts_per_block = cs * 8 / (1 << QCOW2_REFCOUNT_ORDER);
+
+    // Clusters that were zeroed again after being written need no allocation
+    size_t kept = 0;
+    for (size_t i = 0; i < b->count; i++) {
+        if (isZeroBuffer(b->clusters[i].data, cs)) {
+            free(b->clusters[i].data);
+        } else {
+            b->clusters[kept++] = b->clusters[i];
+        }
+    }
+    b->count = kept;
+    qsort(b->clusters, b->count, sizeof(*b->clusters), compareBuilderClusters);
+
+    uint64_t l1_size = (b->size + cs * l2_entries - 1) / (cs * l2_entries);
+    uint64_t l1_clusters = (l1_size * 8 + cs - 1) / cs;
+    if (l1_clusters == 0) {
+        l1_clusters = 1;
+    }
+    uint64_t l2_count = 0;
+    for (size_t i = 0; i < b->count; i++) {
+        if (i == 0 || b->clusters[i].index / l2_entries != b->clusters[i - 1].index / l2_entries) {
+            l2_count++;
+        }
+    }
+
+    // The refcount structures have to count themselves, iterate until the sizes settle
+    uint64_t rb_count = 1, rt_clusters = 1, total;
+    for (;;) {
+        total = 1 + l1_clusters + rt_clusters + rb_count + l2_count + b->count;
+        uint64_t need_rb = (total + refcounts_per_block - 1) / refcounts_per_block;
+        uint64_t need_rt = (need_rb * 8 + cs - 1) / cs;
+        if (need_rb == rb_count && need_rt == rt_clusters) {
+            break;
+        }
+        rb_count = need_rb;
+        rt_clusters = need_rt;
+    }
+
+    uint64_t l1_offset = cs;
+    uint64_t rt_offset = l1_offset + l1_clusters * cs;
+    uint64_t rb_offset = rt_offset + rt_clusters * cs;
+    uint64_t l2_offset = rb_offset + rb_count * cs;
+    uint64_t data_offset = l2_offset + l2_count * cs;
+    uint64_t meta_bytes = data_offset;
+
+    uint8_t *meta = calloc(1, (size_t)meta_bytes);
+    if (meta == NULL) {
+        return -1;
+    }
+
+    // Header followed by the end-of-extensions marker
+    putBE32(meta, QCOW2_MAGIC);
+    putBE32(meta + 4, QCOW2_VERSION);
+    putBE32(meta + 20, QCOW2_CLUSTER_BITS);
+    putBE64(meta + 24, b->size);
+    putBE32(meta + 36, (uint32_t)l1_size);
+    putBE64(meta + 40, l1_offset);
+    putBE64(meta + 48, rt_offset);
+    putBE32(meta + 56, (uint32_t)rt_clusters);
+    putBE32(meta + 96, QCOW2_REFCOUNT_ORDER);
+    putBE32(meta + 100, QCOW2_HEADER_LENGTH);
+
+    // Every host cluster is referenced exactly once
+    for (uint64_t i = 0; i < rb_count; i++) {
+        putBE64(meta + rt_offset + i * 8, rb_offset + i * cs);
+    }
+    for (uint64_t i = 0; i < total; i++) {
+        putBE16(meta + rb_offset + i * 2, 1);
+    }
+
+    uint64_t l2_table = l2_offset - cs;
+    for (size_t i = 0; i < b->count; i++) {
+        uint64_t index = b->clusters[i].index;
+        if (i == 0 || index / l2_entries != b->clusters[i - 1].index / l2_entries) {
+            l2_table += cs;
+            putBE64(meta + l1_offset + (index / l2_entries) * 8, l2_table | QCOW2_OFLAG_COPIED);
+        }
+        putBE64(meta + l2_table + (index % l2_entries) * 8, (data_offset + i * cs) | QCOW2_OFLAG_COPIED);
+    }
+
+    int result = writeAll(fd, meta, (size_t)meta_bytes, 0);
+    free(meta);
+    for (size_t i = 0; i < b->count && result == 0; i++) {
+        result = writeAll(fd, b->clusters[i].data, cs, data_offset + i * cs);
+    }
+    *written = data_offset + b->count * cs;
+    return result;
+}
+
+// Function to create a FAT32 formatted QCOW2 image in one pass, replacing qemu-img + qemu-nbd + mkfs.fat
+int createQcow2Image(const char *image_path, uint64_t size, const char *label, ImageLayout kind) {
+    Fat32Layout layout;
+    if (computeImageLayout(size, kind, &layout) != 0) {
+        return -1;
+    }
+    setFat32Label(&layout, label);
+
+    Qcow2Builder builder = {size, NULL, 0, 0};
+    BlockWriter writer = {qcow2BuilderWrite, qcow2BuilderZero, &builder};
+    if (writeImageVolume(&writer, size, kind, &layout) != 0) {
+        printf("Failed to build the FAT32 metadata.\n");
+        qcow2BuilderFree(&builder);
+        return -1;
+    }
+
+    int fd = open(image_path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        printf("Failed to create '%s': %s\n", image_path, strerror(errno));
+        qcow2BuilderFree(&builder);
+        return -1;
+    }
+    uint64_t written = 0;
+    int result = qcow2BuilderFinish(&builder, fd, &written);
+    qcow2BuilderFree(&builder);
+    if (result == 0) {
+        result = fsync(fd);
+    }
+    close(fd);
+    if (result != 0) {
+        printf("Failed to write '%s': %s\n", image_path, strerror(errno));
+        unlink(image_path);
+        return -1;
+    }
+
+    printf("Created FAT32 qcow2 image '%s': %.2f GB virtual, %.0f KB written.\n", image_path,
+           size / (1024.0 * 1024.0 * 1024.0), written / 1024.0);
+    return 0;
+}
+
+// Block access layer, raw images are used as they are and QCOW2 guest offsets go through the L1/L2 tables
+#define IMAGE_L2_CACHE_SLOTS 32
+#define IMAGE_RB_CACHE_SLOTS 4
+#define QCOW2_INCOMPAT_DIRTY (1ULL << 0)
+#define QCOW2_INCOMPAT_CORRUPT (1ULL << 1)
+#define QCOW2_INCOMPAT_COMPRESSION (1ULL << 3)
+
+typedef enum {
+    IMAGE_FORMAT_RAW,
+    IMAGE_FORMAT_QCOW2
+} ImageFormat;
+
+// One cached metadata cluster, an L2 table or a refcount block
+typedef struct {
+    uint64_t offset;              // Host offset of the cluster, 0 for an empty slot
+    uint8_t *data;
+    uint64_t last_used;
+    int dirty;
+} ImageCacheSlot;
+
+// An opened image, QCOW2 metadata changes stay in memory until imageFlush()
+typedef struct {
+    int fd;
+    int writable;
+    ImageFormat format;
+    uint64_t size;                // Guest size in bytes
+    uint32_t cluster_bits;
+    uint64_t cluster_size;
+    uint64_t l2_entries;
+    uint8_t *l1;                  // Kept big-endian, exactly as on disk
+    uint32_t l1_size;
+    uint64_t l1_offset;
+    int l1_dirty;
+    uint8_t *refcount_table;      // Only loaded for writable images
+    uint64_t rt_offset;
+    uint32_t rt_clusters;
+    int rt_dirty;
+    int header_dirty;             // Set when the refcount table moved
+    uint64_t file_end;            // New host clusters are appended here
+    ImageCacheSlot l2_cache[IMAGE_L2_CACHE_SLOTS];
+    ImageCacheSlot rb_cache[IMAGE_RB_CACHE_SLOTS];
+    uint64_t cache_clock;
+    uint8_t *inflated;            // Last compressed cluster read, decompressed
+    uint64_t inflated_entry;      // Its L2 entry, 0 when none
+} DiskImage;
+
+// Function to tell raw and QCOW2 images apart by their magic, returns -1 when the file cannot be read
+int detectImageFormat(const char *image_path) {
+    uint8_t magic[4];
+    int fd = open(image_path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    int result = readAll(fd, magic, sizeof(magic), 0);
+    close(fd);
+    if (result != 0) {
+        return -1;
+    }
+    return getBE32(magic) == QCOW2_MAGIC ? IMAGE_FORMAT_QCOW2 : IMAGE_FORMAT_RAW;
+}
+
+// Function to get the qemu name of an image format
+const char *imageFormatName(ImageFormat format) {
+    return format == IMAGE_FORMAT_QCOW2 ? "qcow2" : "raw";
+}
+
+// Function to get a metadata cluster through a small LRU cache, loading it from the image or starting it zeroed
+static ImageCacheSlot *imageCacheGet(DiskImage *img, ImageCacheSlot *slots, int count, uint64_t offset, int load) {
+    ImageCacheSlot *victim = &slots[0];
+    for (int i = 0; i < count; i++) {
+        if (slots[i].data != NULL && slots[i].offset == offset) {
+            slots[i].last_used = ++img->cache_clock;
+            return &slots[i];
+        }
+        if (slots[i].last_used < victim->last_used) {
+            victim = &slots[i];
+        }
+    }
+
+    if (victim->dirty) {
+        if (writeAll(img->fd, victim->data, (size_t)img->cluster_size, victim->offset) != 0) {
+            printf("Failed to write QCOW2 metadata: %s\n", strerror(errno));
+            return NULL;
+        }
+        victim->dirty = 0;
+    }
+    if (victim->data == NULL && (victim->data = malloc((size_t)img->cluster_size)) == NULL) {
+        return NULL;
+    }
+    victim->offset = 0;
+    victim->last_used = 0;
+    if (!load) {
+        memset(victim->data, 0, (size_t)img->cluster_size);
+    } else if (readAll(img->fd, victim->data, (size_t)img->cluster_size, offset) != 0) {
+        printf("Failed to read QCOW2 metadata: %s\n", strerror(errno));
+        return NULL;
+    }
+    victim->offset = offset;
+    victim->last_used = ++img->cache_clock;
+    return victim;
+}
+
+// Function to write back every dirty slot of a cache
+static int imageCacheFlush(DiskImage *img, ImageCacheSlot *slots, int count) {
+    for (int i = 0; i < count; i++) {
+        if (slots[i].dirty) {
+            if (writeAll(img->fd, slots[i].data, (size_t)img->cluster_size, slots[i].offset) != 0) {
+                return -1;
+            }
+            slots[i].dirty = 0;
+        }
+    }
+    return 0;
+}
+
+// Function to reserve host clusters at the end of the image file, their refcounts are set by the caller
+static uint64_t qcow2Reserve(DiskImage *img, uint64_t count) {
+    uint64_t offset = img->file_end;
+    img->file_end += count * img->cluster_size;
+    return offset;
+}
+
+static int qcow2UpdateRefcount(DiskImage *img, uint64_t host_offset, int delta);
+
+// Function to move the refcount table to a larger copy at the end of the file
+static int qcow2GrowRefcountTable(DiskImage *img, uint64_t rt_index) {
+    uint64_t cs = img->cluster_size;
+    uint64_t clusters = img->rt_clusters ? img->rt_clusters : 1;
+    while (clusters * (cs / 8) <= rt_index) {
+        clusters *= 2;
+    }
+    uint8_t *table = calloc(1, (size_t)(clusters * cs));
+    if (table == NULL) {
+        return -1;
+    }
+    memcpy(table, img->refcount_table, (size_t)(img->rt_clusters * cs));
+
+    uint64_t old_offset = img->rt_offset;
+    uint32_t old_clusters = img->rt_clusters;
+    free(img->refcount_table);
+    img->refcount_table = table;
+    img->rt_offset = qcow2Reserve(img, clusters);
+    img->rt_clusters = (uint32_t)clusters;
+    img->rt_dirty = 1;
+    img->header_dirty = 1;
+
+    for (uint64_t i = 0; i < clusters; i++) {
+        if (qcow2UpdateRefcount(img, img->rt_offset + i * cs, 1) < 0) {
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < old_clusters; i++) {
+        if (qcow2UpdateRefcount(img, old_offset + i * cs, -1) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to add delta to the refcount of a host cluster, returns the new refcount or -1 on failure
+static int qcow2UpdateRefcount(DiskImage *img, uint64_t host_offset, int delta) {
+    uint64_t cluster = host_offset >> img->cluster_bits;
+    uint64_t per_block = img->cluster_size / 2;
+    uint64_t rt_index = cluster / per_block;
+    if (rt_index >= img->rt_clusters * (img->cluster_size / 8) && qcow2GrowRefcountTable(img, rt_index) != 0) {
+        return -1;
+    }
+
+    uint64_t block = getBE64(img->refcount_table + rt_index * 8) & QCOW2_OFFSET_MASK;
+    ImageCacheSlot *slot;
+    if (block == 0) {
+        // A new refcount block is appended, it then counts itself or is counted by a block further out
+        block = qcow2Reserve(img, 1);
+        putBE64(img->refcount_table + rt_index * 8, block);
+        img->rt_dirty = 1;
+        if ((slot = imageCacheGet(img, img->rb_cache, IMAGE_RB_CACHE_SLOTS, block, 0)) == NULL) {
+            return -1;
+        }
+        slot->dirty = 1;
+        if (qcow2UpdateRefcount(img, block, 1) < 0) {
+            return -1;
+        }
+    }
+    if ((slot = imageCacheGet(img, img->rb_cache, IMAGE_RB_CACHE_SLOTS, block, 1)) == NULL) {
+        return -1;
+    }
+
+    uint8_t *p = slot->data + (cluster % per_block) * 2;
+    int value = getBE16(p) + delta;
+    if (value < 0 || value > 0xFFFF) {
+        printf("Refcount of host cluster %llu is out of range, the image may be corrupt.\n",
+               (unsigned long long)cluster);
+        return -1;
+    }
+    putBE16(p, (uint16_t)value);
+    slot->dirty = 1;
+    return value;
+}
+
+// Function to find the L2 table of a guest cluster, *slot is NULL when it is unallocated and allocate is not set
+static int qcow2L2Table(DiskImage *img, uint64_t guest_cluster, int allocate, ImageCacheSlot **slot) {
+    uint64_t l1_index = guest_cluster / img->l2_entries;
+    *slot = NULL;
+    if (l1_index >= img->l1_size) {
+        printf("Guest offset lies beyond the QCOW2 L1 table.\n");
+        return -1;
+    }
+
+    uint64_t l2_offset = getBE64(img->l1 + l1_index * 8) & QCOW2_OFFSET_MASK;
+    if (l2_offset != 0) {
+        *slot = imageCacheGet(img, img->l2_cache, IMAGE_L2_CACHE_SLOTS, l2_offset, 1);
+        return *slot != NULL ? 0 : -1;
+    }
+    if (!allocate) {
+        return 0;
+    }
+
+    l2_offset = qcow2Reserve(img, 1);
+    if (qcow2UpdateRefcount(img, l2_offset, 1) < 0 ||
+        (*slot = imageCacheGet(img, img->l2_cache, IMAGE_L2_CACHE_SLOTS, l2_offset, 0)) == NULL) {
+        return -1;
+    }
+    (*slot)->dirty = 1;
+    putBE64(img->l1 + l1_index * 8, l2_offset | QCOW2_OFLAG_COPIED);
+    img->l1_dirty = 1;
+    return 0;
+}
+
+// Function to give back the host clusters referenced by an L2 entry, fully released data clusters are punched
+int qcow2ReleaseEntry(DiskImage *img, uint64_t entry) {
+    uint64_t first, last;
+    if (entry & QCOW2_OFLAG_COMPRESSED) {
+        // Compressed data is byte-addressed and may straddle host clusters shared with its neighbours
+        int shift = 62 - (img->cluster_bits - 8);
+        uint64_t offset = entry & ((1ULL << shift) - 1);
+        uint64_t sectors = ((entry >> shift) & ((1ULL << (img->cluster_bits - 8)) - 1)) + 1;
+        uint64_t end = (offset & ~511ULL) + sectors * 512;
+        first = offset >> img->cluster_bits;
+        last = (end - 1) >> img->cluster_bits;
+    } else {
+        uint64_t host = entry & QCOW2_OFFSET_MASK;
+        if (host == 0) {
+            return 0;
+        }
+        first = last = host >> img->cluster_bits;
+    }
+
+    for (uint64_t c = first; c <= last; c++) {
+        int refcount = qcow2UpdateRefcount(img, c << img->cluster_bits, -1);
+        if (refcount < 0) {
+            return -1;
+        }
+#ifdef __linux__
+        if (refcount == 0) {
+            fallocate(img->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)(c << img->cluster_bits),
+                      (off_t)img->cluster_size);
+        }
+#endif
+    }
+    return 0;
+}
+
+// Function to decompress the cluster behind a compressed L2 entry, the last one stays cached for partial reads
+static const uint8_t *qcow2Inflate(DiskImage *img, uint64_t entry) {
+    if (img->inflated != NULL && img->inflated_entry == entry) {
+        return img->inflated;
+    }
+    int shift = 62 - (img->cluster_bits - 8);
+    uint64_t offset = entry & ((1ULL << shift) - 1);
+    uint64_t sectors = ((entry >> shift) & ((1ULL << (img->cluster_bits - 8)) - 1)) + 1;
+    size_t len = (size_t)((offset & ~511ULL) + sectors * 512 - offset);
+    uint8_t *packed = malloc(len);
+    if (img->inflated == NULL) {
+        img->inflated = malloc(img->cluster_size);
+    }
+    if (packed == NULL || img->inflated == NULL) {
+        free(packed);
+        return NULL;
+    }
+
+    // The sector count may reach past the end of the file for the last cluster
+    ssize_t got = pread(img->fd, packed, len, (off_t)offset);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    int result = got > 0 ? inflateInit2(&stream, -15) : Z_ERRNO;
+    if (result == Z_OK) {
+        stream.next_in = packed;
+        stream.avail_in = (uInt)got;
+        stream.next_out = img->inflated;
+        stream.avail_out = (uInt)img->cluster_size;
+        result = inflate(&stream, Z_FINISH);
+        inflateEnd(&stream);
+    }
+    free(packed);
+    if ((result != Z_STREAM_END && result != Z_BUF_ERROR) || stream.avail_out != 0) {
+        printf("Compressed QCOW2 cluster at %llu is corrupt.\n", (unsigned long long)offset);
+        img->inflated_entry = 0;
+        errno = EIO;
+        return NULL;
+    }
+    img->inflated_entry = entry;
+    return img->inflated;
+}
+
+// Function to read guest data, unallocated and zero clusters read as zeros and contiguous host runs take one pread
+int imageRead(DiskImage *img, void *buf, size_t len, uint64_t offset) {
+    if (img->format == IMAGE_FORMAT_RAW) {
+        return readAll(img->fd, buf, len, offset);
+    }
+
+    uint8_t *p = buf;
+    uint8_t *run_buf = NULL;
+    uint64_t run_host = 0;
+    size_t run_len = 0;
+    while (len > 0) {
+        uint64_t within = offset & (img->cluster_size - 1);
+        size_t chunk = img->cluster_size - within < len ? (size_t)(img->cluster_size - within) : len;
+        uint64_t host = 0;
+        if (offset < img->size) {
+            uint64_t guest_cluster = offset >> img->cluster_bits;
+            ImageCacheSlot *slot;
+            if (qcow2L2Table(img, guest_cluster, 0, &slot) != 0) {
+                return -1;
+            }
+            uint64_t entry = slot ? getBE64(slot->data + (guest_cluster % img->l2_entries) * 8) : 0;
+            if (entry & QCOW2_OFLAG_COMPRESSED) {
+                if (run_len > 0 && readAll(img->fd, run_buf, run_len, run_host) != 0) {
+                    return -1;
+                }
+                run_len = 0;
+                const uint8_t *cluster = qcow2Inflate(img, entry & ~QCOW2_OFLAG_COPIED);
+                if (cluster == NULL) {
+                    return -1;
+                }
+                memcpy(p, cluster + within, chunk);
+                p += chunk;
+                offset += chunk;
+                len -= chunk;
+                continue;
+            }
+            if (!(entry & QCOW2_OFLAG_ZERO)) {
+                host = entry & QCOW2_OFFSET_MASK;
+            }
+        }
+
+        if (run_len > 0 && (host == 0 || host + within != run_host + run_len)) {
+            if (readAll(img->fd, run_buf, run_len, run_host) != 0) {
+                return -1;
+            }
+            run_len = 0;
+        }
+        if (host == 0) {
+            memset(p, 0, chunk);
+        } else {
+            if (run_len == 0) {
+                run_buf = p;
+                run_host = host + within;
+            }
+            run_len += chunk;
+        }
+        p += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+    return run_len > 0 ? readAll(img->fd, run_buf, run_len, run_host) : 0;
+}
+
+// Function to turn a compressed cluster back into a plain one so it can be written in place, returns its host offset
+static uint64_t qcow2Decompress(DiskImage *img, ImageCacheSlot *slot, uint8_t *l2_entry, uint64_t entry) {
+    const uint8_t *cluster = qcow2Inflate(img, entry & ~QCOW2_OFLAG_COPIED);
+    if (cluster == NULL) {
+        return 0;
+    }
+    uint64_t host = qcow2Reserve(img, 1);
+    if (qcow2UpdateRefcount(img, host, 1) < 0 || writeAll(img->fd, cluster, (size_t)img->cluster_size, host) != 0 ||
+        qcow2ReleaseEntry(img, entry) != 0) {
+        return 0;
+    }
+    img->inflated_entry = 0;
+    putBE64(l2_entry, host | QCOW2_OFLAG_COPIED);
+    slot->dirty = 1;
+    return host;
+}
+
+// Function to write guest data, clusters are allocated on first write and contiguous host runs take one pwrite
+int imageWrite(DiskImage *img, const void *buf, size_t len, uint64_t offset) {
+    if (img->format == IMAGE_FORMAT_RAW) {
+        return writeAll(img->fd, buf, len, offset);
+    }
+    if (offset + len > img->size) {
+        printf("Write beyond the end of the QCOW2 image.\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    const uint8_t *p = buf;
+    const uint8_t *run_buf = NULL;
+    uint64_t run_host = 0;
+    size_t run_len = 0;
+    while (len > 0) {
+        uint64_t within = offset & (img->cluster_size - 1);
+        size_t chunk = img->cluster_size - within < len ? (size_t)(img->cluster_size - within) : len;
+        uint64_t guest_cluster = offset >> img->cluster_bits;
+        ImageCacheSlot *slot;
+        if (qcow2L2Table(img, guest_cluster, 1, &slot) != 0) {
+            return -1;
+        }
+
+        uint8_t *l2_entry = slot->data + (guest_cluster % img->l2_entries) * 8;
+        uint64_t entry = getBE64(l2_entry);
+        uint64_t host = entry & QCOW2_OFFSET_MASK;
+        if (entry & QCOW2_OFLAG_COMPRESSED) {
+            if ((host = qcow2Decompress(img, slot, l2_entry, entry)) == 0) {
+                return -1;
+            }
+        } else if (host == 0) {
+            // Appended clusters lie past the end of the file, whatever the write leaves out reads as zeros
+            host = qcow2Reserve(img, 1);
+            if (qcow2UpdateRefcount(img, host, 1) < 0) {
+                return -1;
+            }
+            putBE64(l2_entry, host | QCOW2_OFLAG_COPIED);
+            slot->dirty = 1;
+        } else if (entry & QCOW2_OFLAG_ZERO) {
+            // A preallocated zero cluster still holds stale data on the host
+            if (chunk < img->cluster_size && zeroRange(img->fd, host, img->cluster_size) != 0) {
+                return -1;
+            }
+            putBE64(l2_entry, host | QCOW2_OFLAG_COPIED);
+            slot->dirty = 1;
+        }
+
+        if (run_len > 0 && host + within != run_host + run_len) {
+            if (writeAll(img->fd, run_buf, run_len, run_host) != 0) {
+                return -1;
+            }
+            run_len = 0;
+        }
+        if (run_len == 0) {
+            run_buf = p;
+            run_host = host + within;
+        }
+        run_len += chunk;
+        p += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+    return run_len > 0 ? writeAll(img->fd, run_buf, run_len, run_host) : 0;
+}
+
+// Function to make a guest range read as zeros, whole QCOW2 clusters are deallocated instead of written
+int imageZero(DiskImage *img, uint64_t offset, uint64_t len) {
+    if (img->format == IMAGE_FORMAT_RAW) {
+        return zeroRange(img->fd, offset, len);
+    }
+
+    while (len > 0) {
+        uint64_t within = offset & (img->cluster_size - 1);
+        uint64_t chunk = img->cluster_size - within < len ? img->cluster_size - within : len;
+        uint64_t guest_cluster = offset >> img->cluster_bits;
+        ImageCacheSlot *slot;
+        if (offset >= img->size) {
+            break;
+        }
+        if (qcow2L2Table(img, guest_cluster, 0, &slot) != 0) {
+            return -1;
+        }
+
+        uint8_t *l2_entry = slot ? slot->data + (guest_cluster % img->l2_entries) * 8 : NULL;
+        uint64_t entry = l2_entry ? getBE64(l2_entry) : 0;
+        uint64_t host = entry & QCOW2_OFFSET_MASK;
+        if (entry == 0 || (!(entry & QCOW2_OFLAG_COMPRESSED) && (entry & QCOW2_OFLAG_ZERO))) {
+            // Already reads as zeros
+        } else if (chunk == img->cluster_size) {
+            putBE64(l2_entry, 0);
+            slot->dirty = 1;
+            if (qcow2ReleaseEntry(img, entry) != 0) {
+                return -1;
+            }
+        } else if ((entry & QCOW2_OFLAG_COMPRESSED) && (host = qcow2Decompress(img, slot, l2_entry, entry)) == 0) {
+            return -1;
+        } else if (zeroRange(img->fd, host + within, chunk) != 0) {
+            return -1;
+        }
+        offset += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Function to write back QCOW2 metadata, refcounts first so no table ever references an uncounted cluster
+int imageFlush(DiskImage *img) {
+    if (img->format == IMAGE_FORMAT_RAW || !img->writable) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(img->fd, &st) != 0 || ((uint64_t)st.st_size < img->file_end && ftruncate(img->fd, (off_t)img->file_end) != 0)) {
+        return -1;
+    }
+    if (imageCacheFlush(img, img->rb_cache, IMAGE_RB_CACHE_SLOTS) != 0) {
+        return -1;
+    }
+    if (img->rt_dirty) {
+        if (writeAll(img->fd, img->refcount_table, (size_t)img->rt_clusters * img->cluster_size, img->rt_offset) != 0) {
+            return -1;
+        }
+        img->rt_dirty = 0;
+    }
+    if (img->header_dirty) {
+        uint8_t fields[12];
+        putBE64(fields, img->rt_offset);
+        putBE32(fields + 8, img->rt_clusters);
+        if (writeAll(img->fd, fields, sizeof(fields), 48) != 0) {
+            return -1;
+        }
+        img->header_dirty = 0;
+    }
+    if (imageCacheFlush(img, img->l2_cache, IMAGE_L2_CACHE_SLOTS) != 0) {
+        return -1;
+    }
+    if (img->l1_dirty) {
+        if (writeAll(img->fd, img->l1, (size_t)img->l1_size * 8, img->l1_offset) != 0) {
+            return -1;
+        }
+        img->l1_dirty = 0;
+    }
+    return 0;
+}
+
+// Function to flush and release an image
+int imageClose(DiskImage *img) {
+    int result = imageFlush(img);
+    if (result == 0 && img->writable && fsync(img->fd) != 0) {
+        result = -1;
+    }
+    if (result != 0) {
+        printf("Failed to write back the image: %s\n", strerror(errno));
+    }
+    for (int i = 0; i < IMAGE_L2_CACHE_SLOTS; i++) {
+        free(img->l2_cache[i].data);
+    }
+    for (int i = 0; i < IMAGE_RB_CACHE_SLOTS; i++) {
+        free(img->rb_cache[i].data);
+    }
+    free(img->l1);
+    free(img->refcount_table);
+    free(img->inflated);
+    close(img->fd);
+    memset(img, 0, sizeof(*img));
+    img->fd = -1;
+    return result;
+}
+
+// Function to validate a QCOW2 header and load the L1 table, plus the refcount table when writing
+static int qcow2OpenHeader(DiskImage *img, const uint8_t *header, const char *image_path) {
+    uint32_t version = getBE32(header + 4);
+    if (version != 2 && version != 3) {
+        printf("'%s' uses QCOW2 version %u, only versions 2 and 3 are supported.\n", image_path, version);
+        return -1;
+    }
+    if (getBE64(header + 8) != 0) {
+        printf("'%s' has a backing file, QCOW2 images with backing files are not supported.\n", image_path);
+        return -1;
+    }
+    if (getBE32(header + 32) != 0) {
+        printf("'%s' is encrypted, encrypted QCOW2 images are not supported.\n", image_path);
+        return -1;
+    }
+
+    img->cluster_bits = getBE32(header + 20);
+    if (img->cluster_bits < 9 || img->cluster_bits > 21) {
+        printf("'%s' has an invalid QCOW2 cluster size.\n", image_path);
+        return -1;
+    }
+    img->cluster_size = 1ULL << img->cluster_bits;
+    img->l2_entries = img->cluster_size / 8;
+    img->size = getBE64(header + 24);
+    img->l1_size = getBE32(header + 36);
+    img->l1_offset = getBE64(header + 40);
+    img->rt_offset = getBE64(header + 48);
+    img->rt_clusters = getBE32(header + 56);
+    uint32_t snapshots = getBE32(header + 60);
+
+    uint64_t incompatible = 0, autoclear = 0;
+    uint32_t refcount_order = QCOW2_REFCOUNT_ORDER;
+    if (version == 3) {
+        incompatible = getBE64(header + 72);
+        autoclear = getBE64(header + 88);
+        refcount_order = getBE32(header + 96);
+    }
+    if (incompatible & (QCOW2_INCOMPAT_DIRTY | QCOW2_INCOMPAT_CORRUPT)) {
+        printf("'%s' was not closed cleanly or is marked corrupt, repair it with 'qemu-img check -r all' first.\n",
+               image_path);
+        return -1;
+    }
+    if (incompatible & ~QCOW2_INCOMPAT_COMPRESSION) {
+        printf("'%s' uses QCOW2 features that are not supported (external data file or extended L2 entries).\n",
+               image_path);
+        return -1;
+    }
+    if ((incompatible & QCOW2_INCOMPAT_COMPRESSION) && getBE32(header + 100) > 104 && header[104] != 0) {
+        printf("'%s' compresses clusters with zstd, only zlib compressed QCOW2 images are supported.\n", image_path);
+        return -1;
+    }
+    if (img->writable && (snapshots != 0 || refcount_order != QCOW2_REFCOUNT_ORDER)) {
+        printf("'%s' has internal snapshots or %u-bit refcounts, it can only be opened read-only.\n", image_path,
+               1U << refcount_order);
+        return -1;
+    }
+    if ((img->l1_offset | img->rt_offset) & (img->cluster_size - 1) ||
+        (uint64_t)img->l1_size * img->l2_entries < (img->size + img->cluster_size - 1) >> img->cluster_bits) {
+        printf("'%s' has a corrupt QCOW2 header.\n", image_path);
+        return -1;
+    }
+
+    img->l1 = malloc(img->l1_size ? (size_t)img->l1_size * 8 : 8);
+    if (img->l1 == NULL || readAll(img->fd, img->l1, (size_t)img->l1_size * 8, img->l1_offset) != 0) {
+        printf("Failed to read the QCOW2 L1 table of '%s'.\n", image_path);
+        return -1;
+    }
+    if (!img->writable) {
+        return 0;
+    }
+
+    size_t rt_bytes = (size_t)img->rt_clusters * img->cluster_size;
+    img->refcount_table = malloc(rt_bytes ? rt_bytes : 8);
+    if (img->refcount_table == NULL || readAll(img->fd, img->refcount_table, rt_bytes, img->rt_offset) != 0) {
+        printf("Failed to read the QCOW2 refcount table of '%s'.\n", image_path);
+        return -1;
+    }
+    // Autoclear features (such as persistent dirty bitmaps) are invalidated by writers that do not know them
+    if (autoclear != 0) {
+        uint8_t cleared[8] = {0};
+        if (writeAll(img->fd, cleared, sizeof(cleared), 88) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to open a raw or QCOW2 image for block access, the format is detected from the header
+int imageOpen(DiskImage *img, const char *image_path, int writable) {
+    memset(img, 0, sizeof(*img));
+    img->writable = writable;
+    img->fd = open(image_path, writable ? O_RDWR : O_RDONLY);
+    if (img->fd < 0) {
+        printf("Failed to open '%s': %s\n", image_path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    uint8_t header[QCOW2_HEADER_LENGTH];
+    if (fstat(img->fd, &st) != 0 || readAll(img->fd, header, sizeof(header), 0) != 0) {
+        printf("Failed to read '%s': %s\n", image_path, strerror(errno));
+        close(img->fd);
+        return -1;
+    }
+    if (getBE32(header) != QCOW2_MAGIC) {
+        img->format = IMAGE_FORMAT_RAW;
+        img->size = (uint64_t)st.st_size;
+        return 0;
+    }
+
+    img->format = IMAGE_FORMAT_QCOW2;
+    if (qcow2OpenHeader(img, header, image_path) != 0) {
+        img->writable = 0;
+        imageClose(img);
+        return -1;
+    }
+    img->file_end = ((uint64_t)st.st_size + img->cluster_size - 1) & ~(img->cluster_size - 1);
+    return 0;
+}
+
+// Functions backing a BlockWriter with an opened image
+static int imageWriterWrite(void *ctx, const void *buf, size_t len, uint64_t offset) {
+    return imageWrite(ctx, buf, len, offset);
+}
+
+static int imageWriterZero(void *ctx, uint64_t offset, uint64_t len) {
+    return imageZero(ctx, offset, len);
+}
+
+// Function to load a GPT header and its entry array, returns 0 when both pass their CRC and the header is where it
+// says it is. The caller frees the entries.
+static int gptReadHeader(DiskImage *img, uint64_t lba, uint8_t *header, uint8_t **entries, size_t *entries_bytes) {
+    if (imageRead(img, header, FAT_SECTOR_SIZE, lba * FAT_SECTOR_SIZE) != 0 || memcmp(header, GPT_SIGNATURE, 8) != 0) {
+        return -1;
+    }
+    uint32_t header_size = getLE32(header + 12);
+    uint32_t header_crc = getLE32(header + 16);
+    uint32_t count = getLE32(header + 80);
+    uint32_t entry_size = getLE32(header + 84);
+    if (header_size < GPT_HEADER_SIZE || header_size > FAT_SECTOR_SIZE || getLE64(header + 24) != lba ||
+        entry_size < GPT_ENTRY_SIZE || (uint64_t)count * entry_size > GPT_MAX_ENTRY_BYTES) {
+        return -1;
+    }
+    putLE32(header + 16, 0);
+    int valid = (uint32_t)crc32(0, header, header_size) == header_crc;
+    putLE32(header + 16, header_crc);
+    *entries_bytes = (size_t)count * entry_size;
+    *entries = valid ? malloc(*entries_bytes ? *entries_bytes : 1) : NULL;
+    if (*entries == NULL || imageRead(img, *entries, *entries_bytes, getLE64(header + 72) * FAT_SECTOR_SIZE) != 0 ||
+        (uint32_t)crc32(0, *entries, *entries_bytes) != getLE32(header + 88)) {
+        free(*entries);
+        *entries = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to find the FAT32 volume of an image: the EFI System Partition (or else a basic data partition) of a
+// GPT, read from the primary header or, when that one is damaged, from the backup
+static int gptFindVolume(DiskImage *img, uint64_t *offset) {
+    uint64_t sectors = img->size / FAT_SECTOR_SIZE;
+    uint64_t lbas[2] = {1, sectors - 1};
+    uint8_t header[FAT_SECTOR_SIZE];
+    for (int copy = 0; copy < 2; copy++) {
+        uint8_t *entries;
+        size_t entries_bytes;
+        if (gptReadHeader(img, lbas[copy], header, &entries, &entries_bytes) != 0) {
+            continue;
+        }
+        uint32_t count = getLE32(header + 80);
+        uint32_t entry_size = getLE32(header + 84);
+        int found = 0;
+        for (int pass = 0; pass < 2 && found == 0; pass++) {
+            for (uint32_t i = 0; i < count && found == 0; i++) {
+                const uint8_t *entry = entries + (size_t)i * entry_size;
+                uint64_t first = getLE64(entry + 32);
+                if (memcmp(entry, pass == 0 ? gptEspType : gptBasicDataType, 16) == 0 && first < sectors) {
+                    *offset = first * FAT_SECTOR_SIZE;
+                    found = (int)i + 1;
+                }
+            }
+        }
+        free(entries);
+        if (found > 0) {
+            return found;
+        }
+    }
+    return -1;
+}
+
+// Function to find the FAT32 volume of an image: a partition when sector 0 holds a GPT or MBR partition table,
+// otherwise the whole image. Returns the partition number (0 for a superfloppy) or -1 when there is no volume.
+int findFatVolume(DiskImage *img, uint64_t *offset) {
+    uint8_t sector[FAT_SECTOR_SIZE];
+    *offset = 0;
+    if (imageRead(img, sector, sizeof(sector), 0) != 0) {
+        return -1;
+    }
+    if (sector[510] != 0x55 || sector[511] != 0xAA) {
+        return 0;  // fatMount() reports what is wrong with it
+    }
+    const uint8_t *table = sector + MBR_PARTITION_TABLE;
+    if (table[4] == MBR_TYPE_PROTECTIVE) {
+        int partition = gptFindVolume(img, offset);
+        if (partition < 0) {
+            printf("The GPT of the image has no usable FAT partition.\n");
+        }
+        return partition;
+    }
+
+    // A FAT boot sector carries a valid BPB where an MBR has boot code
+    uint16_t bps = getLE16(sector + 11);
+    if ((sector[0] == 0xEB || sector[0] == 0xE9) && (bps == 512 || bps == 1024 || bps == 2048 || bps == 4096) &&
+        sector[13] != 0 && (sector[13] & (sector[13] - 1)) == 0 && sector[16] != 0) {
+        return 0;
+    }
+    for (int i = 0; i < 4; i++) {
+        const uint8_t *entry = table + i * 16;
+        if (entry[4] == MBR_TYPE_ESP || entry[4] == MBR_TYPE_FAT32_CHS || entry[4] == MBR_TYPE_FAT32_LBA) {
+            *offset = (uint64_t)getLE32(entry + 8) * FAT_SECTOR_SIZE;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// Platform specific, implemented by DiskProvision.c and DiskProvision_Darwin.c. Returns 0 when the image at
+// real_path is attached as a block device (loop, nbd or hdiutil), device receives which one.
+int findAttachedImage(const char *real_path, char *device, size_t device_size);
+
+// Function to lock an image for a command that modifies it, the lock is held until the returned descriptor is
+// closed. Images attached as a block device, mounted through FUSE or written by another DiskProvision process
+// are refused with errno EBUSY.
+int lockImageForWriting(const char *image_path) {
+    char real_path[4096], device[256];
+    if (realpath(image_path, real_path) == NULL) {
+        int saved = errno;
+        printf("Failed to resolve '%s': %s\n", image_path, strerror(saved));
+        errno = saved;
+        return -1;
+    }
+    int fd = open(real_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        int saved = errno;
+        printf("Failed to open '%s': %s\n", image_path, strerror(saved));
+        errno = saved;
+        return -1;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        printf("Image '%s' is in use by a FUSE mount or another writer.\n", image_path);
+        close(fd);
+        errno = EBUSY;
+        return -1;
+    }
+    if (findAttachedImage(real_path, device, sizeof(device)) == 0) {
+        printf("Image '%s' is attached as %s, unmount it first.\n", image_path, device);
+        close(fd);
+        errno = EBUSY;
+        return -1;
+    }
+    return fd;
+}
+
+// Function to format an image as FAT32, inside a new GPT or over the whole image, replacing sgdisk + mkfs.fat -F 32
+int formatFat32Image(const char *image_path, const char *label, ImageLayout kind) {
+    int lock_fd = lockImageForWriting(image_path);
+    if (lock_fd < 0) {
+        return -1;
+    }
+    DiskImage image;
+    if (imageOpen(&image, image_path, 1) != 0) {
+        close(lock_fd);
+        return -1;
+    }
+
+    Fat32Layout layout;
+    if (computeImageLayout(image.size, kind, &layout) != 0) {
+        imageClose(&image);
+        close(lock_fd);
+        return -1;
+    }
+    if (label != NULL && strlen(label) > sizeof(layout.label)) {
+        printf("Volume label '%s' is longer than 11 characters, truncating.\n", label);
+    }
+    setFat32Label(&layout, label);
+
+    BlockWriter writer = {imageWriterWrite, imageWriterZero, &image};
+    int result = writeImageVolume(&writer, image.size, kind, &layout);
+    if (result != 0) {
+        printf("Failed to write FAT32 filesystem to '%s': %s\n", image_path, strerror(errno));
+    }
+    if (imageClose(&image) != 0) {
+        result = -1;
+    }
+    close(lock_fd);
+    return result;
+}
+
+// Directory entry attributes and limits used by the userspace FAT32 engine
+#define FAT_ATTR_READ_ONLY 0x01
+#define FAT_ATTR_HIDDEN 0x02
+#define FAT_ATTR_SYSTEM 0x04
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_ARCHIVE 0x20
+#define FAT_ATTR_LFN 0x0F
+#define FAT_LFN_CHARS 13
+#define FAT_NAME_MAX 255
+#define FAT_CASE_LOWER_BASE 0x08
+#define FAT_CASE_LOWER_EXT 0x10
+#define FAT_ENTRY_DELETED 0xE5
+#define FAT_COPY_BUFFER_SIZE (4 * 1024 * 1024)
+
+// Metadata write-ahead log, a sidecar next to the image holding the last committed transaction
+#define FAT_JOURNAL_MAGIC "DPJOURNL"
+#define FAT_JOURNAL_VERSION 1
+#define FAT_JOURNAL_SUFFIX ".journal"
+#define FAT_JOURNAL_HEADER_SIZE 32
+#define FAT_JOURNAL_RECORD_SIZE 16
+
+// One metadata write waiting for the next commit
+typedef struct {
+    uint64_t offset;              // Image offset the bytes belong at
+    uint32_t len;
+    uint8_t *data;
+} FatJournalRecord;
+
+// Metadata writes of the open transaction, they only reach the image once the journal is on disk
+typedef struct {
+    char path[4096];
+    int fd;                       // Locked from fatOpen() to fatClose(), keeps other writers off the image, -1 for readers
+    FatJournalRecord *records;
+    size_t count;
+    size_t capacity;
+    uint8_t *fresh;               // Bit per cluster allocated in the open transaction, still free in the committed FAT
+    uint8_t *held;                // Bit per cluster freed in the open transaction, in use until the commit
+    uint32_t held_count;
+} FatJournal;
+
+// An opened FAT32 volume, the whole FAT is kept in memory and written back once on flush
+typedef struct {
+    DiskImage *image;
+    int owns_image;               // Set when fatOpen() opened the image and fatClose() has to release it
+    int writable;
+    uint64_t offset;              // Byte offset of the volume inside the image
+    uint32_t bytes_per_sector;
+    uint32_t sectors_per_cluster;
+    uint32_t cluster_size;
+    uint32_t reserved_sectors;
+    uint32_t num_fats;
+    uint32_t fat_length;
+    uint32_t total_sectors;
+    uint32_t root_cluster;
+    uint32_t info_sector;
+    uint32_t cluster_count;
+    uint64_t fat_start;
+    uint64_t data_start;
+    uint8_t *fat;
+    uint8_t *fat_dirty;           // One flag per FAT sector
+    uint32_t free_clusters;
+    uint32_t next_free;
+    uint8_t *buffer;              // Staging buffer for file data, FAT_COPY_BUFFER_SIZE bytes
+    const uint8_t *map;           // Read-only mapping of a raw image, NULL when not mapped
+    uint64_t map_size;
+    int no_copy_range;            // Set once copy_file_range turned out to be unsupported
+    FatJournal *journal;          // NULL when metadata goes straight to the image
+    IoEngine *io;                 // File data writes of a raw image in flight, NULL until the first file is put
+} FatVolume;
+
+// A directory loaded into memory together with its cluster chain
+typedef struct {
+    uint32_t first_cluster;
+    uint32_t *clusters;
+    uint32_t cluster_count;
+    uint8_t *data;
+    size_t size;
+    int dirty;
+} FatDir;
+
+// A decoded directory entry, long name already assembled
+typedef struct {
+    char name[FAT_NAME_MAX * 3 + 1];  // UTF-8
+    uint8_t short_name[11];
+    uint8_t attr;
+    uint32_t first_cluster;
+    uint32_t size;
+    uint16_t time;
+    uint16_t date;
+    size_t offset;                    // Byte offset of the short entry inside the directory
+    size_t lfn_offset;                // Byte offset of the first LFN entry, equals offset when there is none
+} FatEntry;
+
+// Function to get the milliseconds elapsed since a monotonic start time
+double elapsedMs(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Function to find the first guest offset at or after offset that may hold data, holes of raw images and
+// unallocated or zero clusters of QCOW2 images are skipped. Returns img->size when the rest reads as zeros.
+uint64_t imageNextData(DiskImage *img, uint64_t offset) {
+    if (img->format == IMAGE_FORMAT_RAW) {
+#ifdef SEEK_DATA
+        off_t data = lseek(img->fd, (off_t)offset, SEEK_DATA);
+        if (data < 0) {
+            return errno == ENXIO ? img->size : offset;
+        }
+        return (uint64_t)data;
+#else
+        return offset;
+#endif
+    }
+
+    for (uint64_t cluster = offset >> img->cluster_bits; (cluster << img->cluster_bits) < img->size;) {
+        ImageCacheSlot *slot;
+        if (qcow2L2Table(img, cluster, 0, &slot) != 0) {
+            return cluster << img->cluster_bits;  // Let the read report the error
+        }
+        if (slot == NULL) {
+            cluster = (cluster / img->l2_entries + 1) * img->l2_entries;  // No L2 table, nothing allocated
+            continue;
+        }
+        uint64_t entry = getBE64(slot->data + (cluster % img->l2_entries) * 8);
+        if (entry != 0 && ((entry & QCOW2_OFLAG_COMPRESSED) || !(entry & QCOW2_OFLAG_ZERO))) {
+            uint64_t start = cluster << img->cluster_bits;
+            return start > offset ? start : offset;
+        }
+        cluster++;
+    }
+    return img->size;
+}
+
+// Streaming conversion moves guest clusters through a bounded ring: a reader thread fills it in guest order,
+// compression workers pack the clusters and the writer stores them in the same order
+#define CONVERT_RING_SLOTS 64
+#define CONVERT_WRITE_BUFFER IO_ENGINE_BLOCK
+#define QCOW2_REFCOUNTS_PER_BLOCK (QCOW2_CLUSTER_SIZE * 8 / (1 << QCOW2_REFCOUNT_ORDER))
+
+typedef enum {
+    CONVERT_SLOT_FREE,
+    CONVERT_SLOT_READ,            // Holds guest data, waiting for a compression worker
+    CONVERT_SLOT_BUSY,            // Being compressed
+    CONVERT_SLOT_DONE             // Ready for the writer
+} ConvertSlotState;
+
+typedef struct {
+    uint64_t guest_offset;
+    uint8_t *data;
+    uint8_t *packed;
+    size_t packed_len;            // 0 when the cluster is stored as it is
+    ConvertSlotState state;
+} ConvertSlot;
+
+typedef struct {
+    DiskImage *source;
+    ConvertSlot slots[CONVERT_RING_SLOTS];
+    uint64_t read_count;          // Clusters queued by the reader
+    uint64_t claim_count;         // Clusters taken by compression workers
+    uint64_t write_count;         // Clusters stored by the writer
+    uint64_t data_bytes;          // Non-zero guest bytes read
+    int reader_done;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} ConvertRing;
+
+// Function run by the reader thread, queues every non-zero guest cluster of the source in order
+static void *convertReader(void *arg) {
+    ConvertRing *ring = arg;
+    DiskImage *src = ring->source;
+    uint64_t offset = 0;
+    while (!ring->failed && (offset = imageNextData(src, offset)) < src->size) {
+        offset &= ~(uint64_t)(QCOW2_CLUSTER_SIZE - 1);
+        pthread_mutex_lock(&ring->lock);
+        while (!ring->failed && ring->read_count - ring->write_count == CONVERT_RING_SLOTS) {
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        }
+        pthread_mutex_unlock(&ring->lock);
+
+        // The slot is free and only the reader touches it until it is queued
+        ConvertSlot *slot = &ring->slots[ring->read_count % CONVERT_RING_SLOTS];
+        size_t len = src->size - offset < QCOW2_CLUSTER_SIZE ? (size_t)(src->size - offset) : QCOW2_CLUSTER_SIZE;
+        memset(slot->data + len, 0, QCOW2_CLUSTER_SIZE - len);
+        if (imageRead(src, slot->data, len, offset) != 0) {
+            printf("Failed to read the source image at %llu: %s\n", (unsigned long long)offset, strerror(errno));
+            pthread_mutex_lock(&ring->lock);
+            ring->failed = 1;
+            pthread_cond_broadcast(&ring->changed);
+            pthread_mutex_unlock(&ring->lock);
+            break;
+        }
+        if (!isZeroBuffer(slot->data, len)) {
+            slot->guest_offset = offset;
+            slot->packed_len = 0;
+            pthread_mutex_lock(&ring->lock);
+            slot->state = CONVERT_SLOT_READ;
+            ring->read_count++;
+            ring->data_bytes += len;
+            pthread_cond_broadcast(&ring->changed);
+            pthread_mutex_unlock(&ring->lock);
+        }
+        offset += QCOW2_CLUSTER_SIZE;
+    }
+    pthread_mutex_lock(&ring->lock);
+    ring->reader_done = 1;
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+// Function run by each compression worker, packs clusters with raw deflate the way QEMU expects them
+static void *convertCompressor(void *arg) {
+    ConvertRing *ring = arg;
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -12, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        pthread_mutex_lock(&ring->lock);
+        ring->failed = 1;
+        pthread_cond_broadcast(&ring->changed);
+        pthread_mutex_unlock(&ring->lock);
+        return NULL;
+    }
+    pthread_mutex_lock(&ring->lock);
+    for (;;) {
+        while (!ring->failed && ring->claim_count == ring->read_count && !ring->reader_done) {
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        }
+        if (ring->failed || ring->claim_count == ring->read_count) {
+            break;
+        }
+        ConvertSlot *slot = &ring->slots[ring->claim_count++ % CONVERT_RING_SLOTS];
+        slot->state = CONVERT_SLOT_BUSY;
+        pthread_mutex_unlock(&ring->lock);
+
+        // Clusters that do not shrink are stored uncompressed
+        deflateReset(&stream);
+        stream.next_in = slot->data;
+        stream.avail_in = QCOW2_CLUSTER_SIZE;
+        stream.next_out = slot->packed;
+        stream.avail_out = QCOW2_CLUSTER_SIZE - 512;
+        slot->packed_len = deflate(&stream, Z_FINISH) == Z_STREAM_END ? stream.total_out : 0;
+
+        pthread_mutex_lock(&ring->lock);
+        slot->state = CONVERT_SLOT_DONE;
+        pthread_cond_broadcast(&ring->changed);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    deflateEnd(&stream);
+    return NULL;
+}
+
+// Destination of a conversion: buffered sequential writes, plus the QCOW2 tables being built
+typedef struct {
+    int fd;
+    ImageFormat format;
+    uint64_t size;
+    IoEngine io;
+    uint8_t *buffer;              // Engine buffer collecting pending bytes, submitted once they stop being contiguous
+    uint64_t buffer_offset;
+    size_t buffer_len;
+    uint64_t written;             // Bytes handed to the file
+    // QCOW2 output, host clusters are handed out in file order
+    uint64_t next_cluster;
+    uint64_t packed_end;          // Where the next compressed cluster goes, 0 when no cluster is open for packing
+    uint8_t *l1;
+    uint32_t l1_size;
+    uint8_t *l2;
+    uint64_t l2_index;            // L1 index of the table in l2, UINT64_MAX for none
+    uint8_t *rb;                  // Refcount block of the range being filled
+    uint64_t *rb_offsets;         // Host offset of the refcount block of every range so far
+    uint64_t rb_count;
+} ConvertOutput;
+
+// Function to write out the collected bytes
+static int convertFlush(ConvertOutput *out) {
+    if (out->buffer_len > 0 && ioEngineSubmit(&out->io, out->buffer, out->buffer_len, out->buffer_offset) != 0) {
+        return -1;
+    }
+    if (out->buffer_len > 0) {
+        out->buffer = NULL;  // The engine owns it until the write completes
+    }
+    out->written += out->buffer_len;
+    out->buffer_len = 0;
+    return 0;
+}
+
+// Function to write bytes to the output, contiguous writes are collected into one
+static int convertWrite(ConvertOutput *out, const void *data, size_t len, uint64_t offset) {
+    if (out->buffer_len > 0 && (offset != out->buffer_offset + out->buffer_len ||
+                                out->buffer_len + len > CONVERT_WRITE_BUFFER) && convertFlush(out) != 0) {
+        return -1;
+    }
+    if (len > CONVERT_WRITE_BUFFER) {
+        out->written += len;
+        return ioEngineWrite(&out->io, data, len, offset);
+    }
+    if (out->buffer == NULL) {
+        out->buffer = ioEngineBuffer(&out->io);
+    }
+    if (out->buffer_len == 0) {
+        out->buffer_offset = offset;
+    }
+    memcpy(out->buffer + out->buffer_len, data, len);
+    out->buffer_len += len;
+    return 0;
+}
+
+// Function to add a reference to a host cluster, it always lies in the range being filled
+static void convertReference(ConvertOutput *out, uint64_t cluster) {
+    uint8_t *count = out->rb + (cluster % QCOW2_REFCOUNTS_PER_BLOCK) * 2;
+    putBE16(count, getBE16(count) + 1);
+}
+
+// Function to hand out count contiguous host clusters. Every range of QCOW2_REFCOUNTS_PER_BLOCK clusters starts
+// with its own refcount block (right after the header in the first range), which is written once the range is full.
+static int convertClaim(ConvertOutput *out, uint64_t count, uint64_t *first) {
+    uint64_t range = out->next_cluster / QCOW2_REFCOUNTS_PER_BLOCK;
+    if (out->rb_count == 0 || (out->next_cluster + count - 1) / QCOW2_REFCOUNTS_PER_BLOCK != range ||
+        out->next_cluster % QCOW2_REFCOUNTS_PER_BLOCK == 0) {
+        // Move to the next range when the clusters would cross into it
+        if (out->rb_count > 0) {
+            if (convertWrite(out, out->rb, QCOW2_CLUSTER_SIZE, out->rb_offsets[out->rb_count - 1]) != 0) {
+                return -1;
+            }
+            range = (out->next_cluster + QCOW2_REFCOUNTS_PER_BLOCK - 1) / QCOW2_REFCOUNTS_PER_BLOCK;
+        }
+        uint64_t *grown = realloc(out->rb_offsets, (size_t)(range + 1) * sizeof(uint64_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        out->rb_offsets = grown;
+        while (out->rb_count < range) {
+            out->rb_offsets[out->rb_count++] = 0;  // Only possible for ranges nothing was allocated in
+        }
+        uint64_t slot = range * QCOW2_REFCOUNTS_PER_BLOCK + (range == 0 ? 1 : 0);
+        out->rb_offsets[out->rb_count++] = slot * QCOW2_CLUSTER_SIZE;
+        memset(out->rb, 0, QCOW2_CLUSTER_SIZE);
+        if (range == 0) {
+            convertReference(out, 0);  // The header
+        }
+        convertReference(out, slot);
+        out->next_cluster = slot + 1;
+        out->packed_end = 0;
+    }
+    *first = out->next_cluster;
+    out->next_cluster += count;
+    return 0;
+}
+
+// Function to allocate and reference whole host clusters, returns the host offset or 0 on failure
+static uint64_t convertAllocate(ConvertOutput *out, uint64_t count) {
+    uint64_t first;
+    if (convertClaim(out, count, &first) != 0) {
+        return 0;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        convertReference(out, first + i);
+    }
+    out->packed_end = 0;  // Compressed data never continues after a whole cluster
+    return first * QCOW2_CLUSTER_SIZE;
+}
+
+// Function to store the L2 table being filled behind the data it maps
+static int convertFlushL2(ConvertOutput *out) {
+    if (out->l2_index == UINT64_MAX) {
+        return 0;
+    }
+    uint64_t offset = convertAllocate(out, 1);
+    if (offset == 0 || convertWrite(out, out->l2, QCOW2_CLUSTER_SIZE, offset) != 0) {
+        return -1;
+    }
+    putBE64(out->l1 + out->l2_index * 8, offset | QCOW2_OFLAG_COPIED);
+    out->l2_index = UINT64_MAX;
+    return 0;
+}
+
+// Function to store one guest cluster in the output, compressed when packed_len is set
+static int convertStore(ConvertOutput *out, const ConvertSlot *slot) {
+    if (out->format == IMAGE_FORMAT_RAW) {
+        size_t len = out->size - slot->guest_offset < QCOW2_CLUSTER_SIZE ? (size_t)(out->size - slot->guest_offset)
+                                                                           : QCOW2_CLUSTER_SIZE;
+        return convertWrite(out, slot->data, len, slot->guest_offset);
+    }
+
+    const uint64_t l2_entries = QCOW2_CLUSTER_SIZE / 8;
+    uint64_t guest_cluster = slot->guest_offset / QCOW2_CLUSTER_SIZE;
+    if (guest_cluster / l2_entries != out->l2_index) {
+        if (convertFlushL2(out) != 0) {
+            return -1;
+        }
+        memset(out->l2, 0, QCOW2_CLUSTER_SIZE);
+        out->l2_index = guest_cluster / l2_entries;
+    }
+
+    uint64_t entry;
+    if (slot->packed_len == 0) {
+        uint64_t host = convertAllocate(out, 1);
+        if (host == 0 || convertWrite(out, slot->data, QCOW2_CLUSTER_SIZE, host) != 0) {
+            return -1;
+        }
+        entry = host | QCOW2_OFLAG_COPIED;
+    } else {
+        // Compressed clusters are packed back to back, one may spill into the next host cluster
+        uint64_t start = out->packed_end, first;
+        if (start == 0 || start % QCOW2_CLUSTER_SIZE == 0) {
+            if (convertClaim(out, 1, &first) != 0) {
+                return -1;
+            }
+            start = first * QCOW2_CLUSTER_SIZE;
+        } else if ((start + slot->packed_len - 1) / QCOW2_CLUSTER_SIZE != start / QCOW2_CLUSTER_SIZE) {
+            if (convertClaim(out, 1, &first) != 0) {
+                return -1;
+            }
+            if (first != start / QCOW2_CLUSTER_SIZE + 1) {
+                start = first * QCOW2_CLUSTER_SIZE;  // A refcount block sits in between, start afresh
+            }
+        }
+        uint64_t end = start + slot->packed_len;
+        for (uint64_t c = start / QCOW2_CLUSTER_SIZE; c <= (end - 1) / QCOW2_CLUSTER_SIZE; c++) {
+            convertReference(out, c);
+        }
+        if (convertWrite(out, slot->packed, slot->packed_len, start) != 0) {
+            return -1;
+        }
+        out->packed_end = end;
+        uint64_t sectors = (end - 1) / 512 - start / 512;
+        entry = QCOW2_OFLAG_COMPRESSED | (sectors << (62 - (QCOW2_CLUSTER_BITS - 8))) | start;
+    }
+    putBE64(out->l2 + (guest_cluster % l2_entries) * 8, entry);
+    return 0;
+}
+
+// Function to write the remaining tables and the header of a QCOW2 output
+static int convertFinishQcow2(ConvertOutput *out) {
+    if (convertFlushL2(out) != 0) {
+        return -1;
+    }
+    uint64_t l1_clusters = ((uint64_t)out->l1_size * 8 + QCOW2_CLUSTER_SIZE - 1) / QCOW2_CLUSTER_SIZE;
+    uint64_t l1_offset = convertAllocate(out, l1_clusters ? l1_clusters : 1);
+    if (l1_offset == 0 || convertWrite(out, out->l1, (size_t)out->l1_size * 8, l1_offset) != 0) {
+        return -1;
+    }
+
+    // One spare entry, allocating the table itself may open another range
+    uint64_t rt_clusters = ((out->rb_count + 1) * 8 + QCOW2_CLUSTER_SIZE - 1) / QCOW2_CLUSTER_SIZE;
+    uint64_t rt_offset = convertAllocate(out, rt_clusters);
+    uint8_t *table = calloc(1, (size_t)(rt_clusters * QCOW2_CLUSTER_SIZE));
+    if (rt_offset == 0 || table == NULL) {
+        free(table);
+        return -1;
+    }
+    for (uint64_t i = 0; i < out->rb_count; i++) {
+        putBE64(table + i * 8, out->rb_offsets[i]);
+    }
+    int result = convertWrite(out, table, (size_t)(rt_clusters * QCOW2_CLUSTER_SIZE), rt_offset);
+    free(table);
+    if (result != 0 || convertWrite(out, out->rb, QCOW2_CLUSTER_SIZE, out->rb_offsets[out->rb_count - 1]) != 0) {
+        return -1;
+    }
+
+    uint8_t header[QCOW2_CLUSTER_SIZE] = {0};
+    putBE32(header, QCOW2_MAGIC);
+    putBE32(header + 4, QCOW2_VERSION);
+    putBE32(header + 20, QCOW2_CLUSTER_BITS);
+    putBE64(header + 24, out->size);
+    putBE32(header + 36, out->l1_size);
+    putBE64(header + 40, l1_offset);
+    putBE64(header + 48, rt_offset);
+    putBE32(header + 56, (uint32_t)rt_clusters);
+    putBE32(header + 96, QCOW2_REFCOUNT_ORDER);
+    putBE32(header + 100, QCOW2_HEADER_LENGTH);
+    return convertWrite(out, header, sizeof(header), 0);
+}
+
+// Function to convert an image between raw and QCOW2 in one pass with bounded memory. Holes and zero clusters
+// are skipped, with compress set QCOW2 clusters are deflated by a pool of workers (one per core when workers is 0).
+int convertImage(const char *source_path, const char *dest_path, ImageFormat format, int compress, int workers) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    compress = compress && format == IMAGE_FORMAT_QCOW2;
+
+    DiskImage src;
+    if (imageOpen(&src, source_path, 0) != 0) {
+        return -1;
+    }
+    int fd = open(dest_path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        printf("Failed to create '%s': %s\n", dest_path, strerror(errno));
+        imageClose(&src);
+        return -1;
+    }
+
+    ConvertOutput out;
+    memset(&out, 0, sizeof(out));
+    out.fd = fd;
+    out.format = format;
+    out.size = src.size;
+    out.l2_index = UINT64_MAX;
+    out.l1_size = (uint32_t)((src.size + (uint64_t)QCOW2_CLUSTER_SIZE * (QCOW2_CLUSTER_SIZE / 8) - 1) /
+                             ((uint64_t)QCOW2_CLUSTER_SIZE * (QCOW2_CLUSTER_SIZE / 8)));
+    int result = ioEngineOpen(&out.io, fd, 1, 0);
+    if (format == IMAGE_FORMAT_QCOW2) {
+        out.l1 = calloc(out.l1_size ? out.l1_size : 1, 8);
+        out.l2 = malloc(QCOW2_CLUSTER_SIZE);
+        out.rb = malloc(QCOW2_CLUSTER_SIZE);
+        uint64_t header;
+        if (out.l1 == NULL || out.l2 == NULL || out.rb == NULL || convertClaim(&out, 0, &header) != 0) {
+            result = -1;
+        }
+    } else if (ftruncate(fd, (off_t)src.size) != 0) {
+        result = -1;
+    }
+
+    ConvertRing ring;
+    memset(&ring, 0, sizeof(ring));
+    ring.source = &src;
+    pthread_mutex_init(&ring.lock, NULL);
+    pthread_cond_init(&ring.changed, NULL);
+    for (int i = 0; i < CONVERT_RING_SLOTS && result == 0; i++) {
+        ring.slots[i].data = malloc(QCOW2_CLUSTER_SIZE);
+        ring.slots[i].packed = compress ? malloc(QCOW2_CLUSTER_SIZE) : NULL;
+        if (ring.slots[i].data == NULL || (compress && ring.slots[i].packed == NULL)) {
+            result = -1;
+        }
+    }
+
+    if (workers <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cores > 0 ? (int)cores : 1;
+    }
+    pthread_t reader;
+    pthread_t *compressors = compress ? malloc((size_t)workers * sizeof(pthread_t)) : NULL;
+    int started = 0, reading = result == 0 && pthread_create(&reader, NULL, convertReader, &ring) == 0;
+    while (reading && compressors != NULL && started < workers &&
+           pthread_create(&compressors[started], NULL, convertCompressor, &ring) == 0) {
+        started++;
+    }
+    if (!reading || (compress && started == 0)) {
+        result = -1;
+        pthread_mutex_lock(&ring.lock);
+        ring.failed = 1;
+        pthread_cond_broadcast(&ring.changed);
+        pthread_mutex_unlock(&ring.lock);
+    }
+
+    // The writer takes the clusters in the order the reader queued them
+    pthread_mutex_lock(&ring.lock);
+    while (result == 0) {
+        ConvertSlot *slot = &ring.slots[ring.write_count % CONVERT_RING_SLOTS];
+        ConvertSlotState ready = compress ? CONVERT_SLOT_DONE : CONVERT_SLOT_READ;
+        while (!ring.failed && !(ring.write_count < ring.read_count && slot->state == ready) &&
+               !(ring.reader_done && ring.write_count == ring.read_count)) {
+            pthread_cond_wait(&ring.changed, &ring.lock);
+        }
+        if (ring.failed || ring.write_count == ring.read_count) {
+            break;
+        }
+        pthread_mutex_unlock(&ring.lock);
+        result = convertStore(&out, slot);
+        pthread_mutex_lock(&ring.lock);
+        slot->state = CONVERT_SLOT_FREE;
+        ring.write_count++;
+        if (result != 0) {
+            ring.failed = 1;
+        }
+        pthread_cond_broadcast(&ring.changed);
+    }
+    if (ring.failed) {
+        result = -1;
+    }
+    pthread_mutex_unlock(&ring.lock);
+    if (reading) {
+        pthread_join(reader, NULL);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(compressors[i], NULL);
+    }
+    free(compressors);
+    for (int i = 0; i < CONVERT_RING_SLOTS; i++) {
+        free(ring.slots[i].data);
+        free(ring.slots[i].packed);
+    }
+    pthread_mutex_destroy(&ring.lock);
+    pthread_cond_destroy(&ring.changed);
+
+    if (result == 0 && format == IMAGE_FORMAT_QCOW2) {
+        result = convertFinishQcow2(&out);
+    }
+    if (result == 0) {
+        result = convertFlush(&out);
+    }
+    if (ioEngineClose(&out.io) != 0) {
+        result = -1;
+    }
+    if (result == 0 && format == IMAGE_FORMAT_QCOW2) {
+        result = ftruncate(fd, (off_t)(out.next_cluster * QCOW2_CLUSTER_SIZE));
+    }
+    if (result == 0) {
+        result = fsync(fd);
+    }
+    if (result != 0) {
+        printf("Failed to write '%s': %s\n", dest_path, strerror(errno));
+    }
+    close(fd);
+    free(out.l1);
+    free(out.l2);
+    free(out.rb);
+    free(out.rb_offsets);
+    uint64_t source_size = src.size;
+    ImageFormat source_format = src.format;
+    imageClose(&src);
+    if (result != 0) {
+        unlink(dest_path);
+        return -1;
+    }
+
+    double seconds = elapsedMs(&start) / 1000.0;
+    printf("Converted '%s' (%s) to '%s' (%s%s): %.2f GB virtual, %.2f MB of data, %.2f MB written in %.2f s "
+           "(%.1f MB/s).\n", source_path, imageFormatName(source_format), dest_path, imageFormatName(format),
+           compress ? ", compressed" : "", source_size / (1024.0 * 1024.0 * 1024.0),
+           ring.data_bytes / (1024.0 * 1024.0), out.written / (1024.0 * 1024.0), seconds,
+           ring.data_bytes / (1024.0 * 1024.0) / (seconds > 0 ? seconds : 1));
+    return 0;
+}
+
+// Function to convert a Unix timestamp to DOS time and date fields
+void dosTimeFromUnix(time_t t, uint16_t *time_field, uint16_t *date_field) {
+    struct tm tm_buf;
+    struct tm *tm = localtime_r(&t, &tm_buf);
+    if (tm == NULL || tm->tm_year < 80) {
+        *time_field = 0;
+        *date_field = 1 + (1 << 5);
+        return;
+    }
+    if (tm->tm_year > 207) {
+        *time_field = (23 << 11) | (59 << 5) | 29;
+        *date_field = (127 << 9) | (12 << 5) | 31;
+        return;
+    }
+    *time_field = (tm->tm_sec >> 1) | (tm->tm_min << 5) | (tm->tm_hour << 11);
+    *date_field = tm->tm_mday | ((tm->tm_mon + 1) << 5) | ((tm->tm_year - 80) << 9);
+}
+
+// Function to check whether a cluster number can be followed in the FAT
+static int fatIsDataCluster(const FatVolume *vol, uint32_t cluster) {
+    return cluster >= 2 && cluster < vol->cluster_count + 2;
+}
+
+// Function to get the byte offset of a data cluster inside the image
+uint64_t fatClusterOffset(const FatVolume *vol, uint32_t cluster) {
+    return vol->data_start + (uint64_t)(cluster - 2) * vol->cluster_size;
+}
+
+// Functions to read and update a FAT entry, the reserved top four bits are preserved
+uint32_t fatGetEntry(const FatVolume *vol, uint32_t cluster) {
+    return getLE32(vol->fat + (size_t)cluster * 4) & 0x0FFFFFFF;
+}
+
+void fatSetEntry(FatVolume *vol, uint32_t cluster, uint32_t value) {
+    uint8_t *p = vol->fat + (size_t)cluster * 4;
+    putLE32(p, (getLE32(p) & 0xF0000000) | (value & 0x0FFFFFFF));
+    vol->fat_dirty[(size_t)cluster * 4 / vol->bytes_per_sector] = 1;
+}
+
+// Function to attach to the FAT32 volume stored at the given offset of an open image
+int fatMount(FatVolume *vol, DiskImage *image, uint64_t offset, int writable) {
+    uint8_t boot[FAT_SECTOR_SIZE];
+
+    memset(vol, 0, sizeof(*vol));
+    vol->image = image;
+    vol->writable = writable;
+    vol->offset = offset;
+    if (imageRead(image, boot, sizeof(boot), offset) != 0) {
+        printf("Failed to read the boot sector: %s\n", strerror(errno));
+        return -1;
+    }
+
+    vol->bytes_per_sector = getLE16(boot + 11);
+    vol->sectors_per_cluster = boot[13];
+    vol->reserved_sectors = getLE16(boot + 14);
+    vol->num_fats = boot[16];
+    vol->total_sectors = getLE16(boot + 19) ? getLE16(boot + 19) : getLE32(boot + 32);
+    vol->fat_length = getLE32(boot + 36);
+    vol->root_cluster = getLE32(boot + 44);
+    vol->info_sector = getLE16(boot + 48);
+
+    uint32_t bps = vol->bytes_per_sector;
+    uint32_t spc = vol->sectors_per_cluster;
+    if (boot[510] != 0x55 || boot[511] != 0xAA || (bps != 512 && bps != 1024 && bps != 2048 && bps != 4096) ||
+        spc == 0 || (spc & (spc - 1)) != 0 || vol->reserved_sectors == 0 || vol->num_fats == 0 ||
+        getLE16(boot + 17) != 0 || getLE16(boot + 22) != 0 || vol->fat_length == 0) {
+        printf("The image does not contain a FAT32 filesystem.\n");
+        return -1;
+    }
+
+    uint64_t meta_sectors = vol->reserved_sectors + (uint64_t)vol->num_fats * vol->fat_length;
+    if (vol->total_sectors <= meta_sectors) {
+        printf("The FAT32 boot sector is corrupt.\n");
+        return -1;
+    }
+    vol->cluster_size = bps * spc;
+    vol->cluster_count = (uint32_t)((vol->total_sectors - meta_sectors) / spc);
+    if ((uint64_t)vol->cluster_count + 2 > (uint64_t)vol->fat_length * bps / 4) {
+        vol->cluster_count = (uint32_t)((uint64_t)vol->fat_length * bps / 4 - 2);
+    }
+    vol->fat_start = offset + (uint64_t)vol->reserved_sectors * bps;
+    vol->data_start = vol->fat_start + (uint64_t)vol->num_fats * vol->fat_length * bps;
+    if (!fatIsDataCluster(vol, vol->root_cluster)) {
+        printf("The FAT32 root directory cluster is invalid.\n");
+        return -1;
+    }
+
+    size_t fat_bytes = (size_t)vol->fat_length * bps;
+    vol->fat = malloc(fat_bytes);
+    vol->fat_dirty = calloc(vol->fat_length, 1);
+    if (vol->fat == NULL || vol->fat_dirty == NULL || imageRead(image, vol->fat, fat_bytes, vol->fat_start) != 0) {
+        printf("Failed to load the FAT.\n");
+        free(vol->fat);
+        free(vol->fat_dirty);
+        return -1;
+    }
+
+    // The FSInfo free count is only a hint, counting keeps allocation honest after unclean writers
+    vol->next_free = 2;
+    for (uint32_t c = 2; c < vol->cluster_count + 2; c++) {
+        if (fatGetEntry(vol, c) == 0) {
+            if (vol->free_clusters++ == 0) {
+                vol->next_free = c;
+            }
+        }
+    }
+    return 0;
+}
+
+// Function to queue a metadata write in the open transaction, a rewrite of the same range replaces the earlier one
+static int fatJournalAppend(FatJournal *journal, const void *buf, size_t len, uint64_t offset) {
+    for (size_t i = journal->count; i-- > 0;) {
+        FatJournalRecord *record = &journal->records[i];
+        if (record->offset == offset && record->len == len) {
+            memcpy(record->data, buf, len);
+            return 0;
+        }
+    }
+    if (journal->count == journal->capacity) {
+        size_t capacity = journal->capacity ? journal->capacity * 2 : 64;
+        FatJournalRecord *grown = realloc(journal->records, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            return -1;
+        }
+        journal->records = grown;
+        journal->capacity = capacity;
+    }
+    uint8_t *data = malloc(len);
+    if (data == NULL) {
+        return -1;
+    }
+    memcpy(data, buf, len);
+    journal->records[journal->count].offset = offset;
+    journal->records[journal->count].len = (uint32_t)len;
+    journal->records[journal->count].data = data;
+    journal->count++;
+    return 0;
+}
+
+// Function to drop queued writes that lie inside a range, used for clusters that were freed before the commit
+static void fatJournalDiscard(FatJournal *journal, uint64_t offset, uint64_t len) {
+    size_t kept = 0;
+    for (size_t i = 0; i < journal->count; i++) {
+        FatJournalRecord *record = &journal->records[i];
+        if (record->offset >= offset && record->offset + record->len <= offset + len) {
+            free(record->data);
+        } else {
+            journal->records[kept++] = *record;
+        }
+    }
+    journal->count = kept;
+}
+
+// Function to write metadata through the journal when the volume has one
+static int fatWriteMeta(FatVolume *vol, const void *buf, size_t len, uint64_t offset) {
+    if (vol->journal != NULL) {
+        return fatJournalAppend(vol->journal, buf, len, offset);
+    }
+    return imageWrite(vol->image, buf, len, offset);
+}
+
+// Function to lay the queued writes over bytes just read from the image, so readers see the open transaction
+static void fatJournalOverlay(const FatVolume *vol, uint8_t *buf, size_t len, uint64_t offset) {
+    for (size_t i = 0; vol->journal != NULL && i < vol->journal->count; i++) {
+        const FatJournalRecord *record = &vol->journal->records[i];
+        uint64_t from = record->offset > offset ? record->offset : offset;
+        uint64_t to = record->offset + record->len < offset + len ? record->offset + record->len : offset + len;
+        if (from < to) {
+            memcpy(buf + (from - offset), record->data + (from - record->offset), (size_t)(to - from));
+        }
+    }
+}
+
+// Function to read metadata as the open transaction left it
+static int fatReadMeta(FatVolume *vol, void *buf, size_t len, uint64_t offset) {
+    if (imageRead(vol->image, buf, len, offset) != 0) {
+        return -1;
+    }
+    fatJournalOverlay(vol, buf, len, offset);
+    return 0;
+}
+
+// Function to make the open transaction durable and apply it. File data written so far and the previous
+// transaction are synced first, then the journal is written and synced in one go and only then is the image touched.
+static int fatJournalCommit(FatVolume *vol) {
+    FatJournal *journal = vol->journal;
+    if (journal == NULL || journal->count == 0) {
+        return 0;
+    }
+    if (imageFlush(vol->image) != 0 || fsync(vol->image->fd) != 0) {
+        return -1;
+    }
+
+    size_t size = FAT_JOURNAL_HEADER_SIZE;
+    for (size_t i = 0; i < journal->count; i++) {
+        size += FAT_JOURNAL_RECORD_SIZE + journal->records[i].len;
+    }
+    uint8_t *buf = calloc(1, size);
+    if (buf == NULL) {
+        return -1;
+    }
+    uint8_t *p = buf + FAT_JOURNAL_HEADER_SIZE;
+    for (size_t i = 0; i < journal->count; i++) {
+        const FatJournalRecord *record = &journal->records[i];
+        putLE32(p, (uint32_t)record->offset);
+        putLE32(p + 4, (uint32_t)(record->offset >> 32));
+        putLE32(p + 8, record->len);
+        memcpy(p + FAT_JOURNAL_RECORD_SIZE, record->data, record->len);
+        p += FAT_JOURNAL_RECORD_SIZE + record->len;
+    }
+    memcpy(buf, FAT_JOURNAL_MAGIC, 8);
+    putLE32(buf + 8, FAT_JOURNAL_VERSION);
+    putLE32(buf + 12, (uint32_t)journal->count);
+    putLE32(buf + 16, (uint32_t)size);
+    putLE32(buf + 20, (uint32_t)((uint64_t)size >> 32));
+    putLE32(buf + 24, (uint32_t)crc32(crc32(0L, buf, 24), buf + FAT_JOURNAL_HEADER_SIZE,
+                                      (uInt)(size - FAT_JOURNAL_HEADER_SIZE)));
+    int result = writeAll(journal->fd, buf, size, 0);
+    free(buf);
+    if (result != 0 || ftruncate(journal->fd, (off_t)size) != 0 || fsync(journal->fd) != 0) {
+        printf("Failed to write the journal '%s': %s\n", journal->path, strerror(errno));
+        return -1;
+    }
+
+    // Once the journal is on disk a crash anywhere below is repaired by replaying it
+    for (size_t i = 0; i < journal->count; i++) {
+        const FatJournalRecord *record = &journal->records[i];
+        if (result == 0 && imageWrite(vol->image, record->data, record->len, record->offset) != 0) {
+            result = -1;
+        }
+        free(record->data);
+    }
+    journal->count = 0;
+
+    // The clusters freed by the transaction are free in the committed FAT now and can take new data
+    if (journal->held != NULL) {
+        size_t bitmap_size = ((size_t)vol->cluster_count + 2 + 7) / 8;
+        memset(journal->held, 0, bitmap_size);
+        memset(journal->fresh, 0, bitmap_size);
+        vol->free_clusters += journal->held_count;
+        journal->held_count = 0;
+    }
+    return result;
+}
+
+// Function to free the writes a transaction holds
+static void fatJournalFreeRecords(FatJournal *journal) {
+    for (size_t i = 0; i < journal->count; i++) {
+        free(journal->records[i].data);
+    }
+    free(journal->records);
+    journal->records = NULL;
+    journal->count = 0;
+    journal->capacity = 0;
+}
+
+// Function to finish a committed journal after the image itself has been synced
+static void fatJournalClose(FatVolume *vol, int synced) {
+    FatJournal *journal = vol->journal;
+    if (journal == NULL) {
+        return;
+    }
+    if (journal->fd >= 0) {
+        if (synced && journal->count == 0) {
+            unlink(journal->path);
+        }
+        close(journal->fd);
+    }
+    fatJournalFreeRecords(journal);
+    free(journal->fresh);
+    free(journal->held);
+    free(journal);
+    vol->journal = NULL;
+}
+
+// Function to lock the journal at path without waiting, returns its descriptor or -1. A journal that was
+// unlinked by its previous holder between the open and the lock is not the one at path any more, so it is retried.
+static int fatJournalLock(const char *path, int create) {
+    for (;;) {
+        int fd = open(path, create ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+        if (fd < 0) {
+            return -1;
+        }
+        struct stat held, current;
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &held) != 0) {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            return -1;
+        }
+        if (stat(path, &current) == 0 && current.st_dev == held.st_dev && current.st_ino == held.st_ino) {
+            return fd;
+        }
+        close(fd);
+        if (!create) {
+            errno = ENOENT;
+            return -1;
+        }
+    }
+}
+
+// Function to read a journal into a transaction, a torn journal loads nothing because none of its writes reached
+// the image yet. Returns the number of writes loaded or -1.
+static long fatJournalLoad(int fd, FatJournal *journal) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    uint8_t *buf = malloc(size ? size : 1);
+    if (buf == NULL) {
+        return -1;
+    }
+    int valid = size >= FAT_JOURNAL_HEADER_SIZE && readAll(fd, buf, size, 0) == 0 &&
+                memcmp(buf, FAT_JOURNAL_MAGIC, 8) == 0 && getLE32(buf + 8) == FAT_JOURNAL_VERSION &&
+                getLE32(buf + 16) == (uint32_t)size && getLE32(buf + 20) == (uint32_t)((uint64_t)size >> 32) &&
+                getLE32(buf + 24) == (uint32_t)crc32(crc32(0L, buf, 24), buf + FAT_JOURNAL_HEADER_SIZE,
+                                                     (uInt)(size - FAT_JOURNAL_HEADER_SIZE));
+    long loaded = 0;
+    if (valid) {
+        uint32_t count = getLE32(buf + 12);
+        const uint8_t *p = buf + FAT_JOURNAL_HEADER_SIZE;
+        for (uint32_t i = 0; i < count && loaded >= 0; i++) {
+            uint64_t offset = getLE32(p) | ((uint64_t)getLE32(p + 4) << 32);
+            uint32_t len = getLE32(p + 8);
+            if ((size_t)(p - buf) + FAT_JOURNAL_RECORD_SIZE + len > size ||
+                fatJournalAppend(journal, p + FAT_JOURNAL_RECORD_SIZE, len, offset) != 0) {
+                loaded = -1;
+            } else {
+                loaded++;
+            }
+            p += FAT_JOURNAL_RECORD_SIZE + len;
+        }
+    }
+    free(buf);
+    return loaded;
+}
+
+// Function to replay the locked journal of an image. The caller discards the journal afterwards when this succeeds.
+static int fatReplayJournalFd(const char *image_path, int fd) {
+    FatJournal pending;
+    struct stat st;
+    memset(&pending, 0, sizeof(pending));
+    long count = fatJournalLoad(fd, &pending);
+    int result = 0;
+    if (count > 0) {
+        DiskImage image;
+        if (imageOpen(&image, image_path, 1) != 0) {
+            printf("'%s' has an unfinished metadata journal that could not be replayed.\n", image_path);
+            result = -1;
+        } else {
+            for (size_t i = 0; i < pending.count && result == 0; i++) {
+                const FatJournalRecord *record = &pending.records[i];
+                result = imageWrite(&image, record->data, record->len, record->offset);
+            }
+            if (imageClose(&image) != 0) {
+                result = -1;
+            }
+            if (result == 0) {
+                printf("Replayed %ld metadata writes from the journal of '%s'.\n", count, image_path);
+            } else {
+                printf("Failed to replay the journal of '%s'.\n", image_path);
+            }
+        }
+    } else if (count < 0) {
+        printf("Failed to read the journal of '%s'.\n", image_path);
+        result = -1;
+    } else if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        printf("Dropped an incomplete metadata journal of '%s', the image was not touched by it.\n", image_path);
+    }
+    fatJournalFreeRecords(&pending);
+    return result;
+}
+
+// Function to replay the journal an interrupted writer left next to an image. Journals held by a live writer are
+// left alone, its metadata only reaches the image through its own commits.
+int fatReplayJournal(const char *image_path) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s" FAT_JOURNAL_SUFFIX, image_path);
+    int fd = fatJournalLock(path, 0);
+    if (fd < 0) {
+        return errno == ENOENT || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    int result = fatReplayJournalFd(image_path, fd);
+    if (result == 0) {
+        unlink(path);
+    }
+    close(fd);
+    return result;
+}
+
+// Function to load the journal an interrupted writer left next to an image without touching the image, so a reader
+// sees the metadata a replay will write. Returns NULL when there is nothing to lay over the image.
+static FatJournal *fatJournalPending(const char *image_path, int *failed) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s" FAT_JOURNAL_SUFFIX, image_path);
+    *failed = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    FatJournal *journal = calloc(1, sizeof(FatJournal));
+    long count = journal != NULL ? fatJournalLoad(fd, journal) : -1;
+    close(fd);
+    if (count <= 0) {
+        if (count < 0) {
+            printf("Failed to read the journal of '%s'.\n", image_path);
+            *failed = 1;
+        }
+        if (journal != NULL) {
+            fatJournalFreeRecords(journal);
+            free(journal);
+        }
+        return NULL;
+    }
+    snprintf(journal->path, sizeof(journal->path), "%s", path);
+    journal->fd = -1;
+    return journal;
+}
+
+// Function to open a raw or QCOW2 image and attach to its FAT32 volume, the EFI System Partition of partitioned
+// images. Writable volumes journal their metadata, an interrupted earlier writer is recovered first. Readers never
+// write, they see the image with its pending journal laid over it.
+int fatOpen(FatVolume *vol, const char *image_path, int writable) {
+    FatJournal *journal = NULL;
+    if (!writable) {
+        int failed;
+        journal = fatJournalPending(image_path, &failed);
+        if (failed) {
+            return -1;
+        }
+    } else {
+        // The journal stays locked until fatClose(), a second writer fails here before it touched anything
+        journal = calloc(1, sizeof(FatJournal));
+        if (journal == NULL) {
+            return -1;
+        }
+        snprintf(journal->path, sizeof(journal->path), "%s" FAT_JOURNAL_SUFFIX, image_path);
+        journal->fd = fatJournalLock(journal->path, 1);
+        if (journal->fd < 0) {
+            int saved = errno;
+            if (saved == EWOULDBLOCK) {
+                printf("'%s' is being written by another process: %s\n", image_path, strerror(saved));
+            } else {
+                printf("Failed to lock the journal '%s': %s\n", journal->path, strerror(saved));
+            }
+            free(journal);
+            errno = saved;
+            return -1;
+        }
+        if (fatReplayJournalFd(image_path, journal->fd) != 0 || ftruncate(journal->fd, 0) != 0) {
+            close(journal->fd);
+            free(journal);
+            return -1;
+        }
+    }
+    DiskImage *image = malloc(sizeof(DiskImage));
+    uint64_t offset;
+    if (image == NULL || imageOpen(image, image_path, writable) != 0) {
+        free(image);
+        image = NULL;
+    } else if (findFatVolume(image, &offset) < 0 || fatMount(vol, image, offset, writable) != 0) {
+        imageClose(image);
+        free(image);
+        image = NULL;
+    } else if (writable) {
+        size_t bitmap_size = ((size_t)vol->cluster_count + 2 + 7) / 8;
+        journal->fresh = calloc(bitmap_size, 1);
+        journal->held = calloc(bitmap_size, 1);
+        if (journal->fresh == NULL || journal->held == NULL) {
+            free(vol->fat);
+            free(vol->fat_dirty);
+            imageClose(image);
+            free(image);
+            image = NULL;
+        }
+    }
+    if (image == NULL) {
+        if (journal != NULL) {
+            if (journal->fd >= 0) {
+                unlink(journal->path);
+                close(journal->fd);
+            }
+            fatJournalFreeRecords(journal);
+            free(journal->fresh);
+            free(journal->held);
+            free(journal);
+        }
+        return -1;
+    }
+    vol->owns_image = 1;
+    vol->journal = journal;
+    if (journal != NULL && !writable) {
+        fatJournalOverlay(vol, vol->fat, (size_t)vol->fat_length * vol->bytes_per_sector, vol->fat_start);
+    }
+    return 0;
+}
+
+// Function to write back every dirty FAT sector to all FAT copies and refresh FSInfo
+int fatFlush(FatVolume *vol) {
+    if (!vol->writable) {
+        return 0;
+    }
+
+    // File data reaches the image before the metadata pointing at it
+    if (vol->io != NULL && ioEngineDrain(vol->io) != 0) {
+        printf("Failed to write file data: %s\n", strerror(errno));
+        return -1;
+    }
+
+    uint32_t bps = vol->bytes_per_sector;
+    for (uint32_t s = 0; s < vol->fat_length;) {
+        if (!vol->fat_dirty[s]) {
+            s++;
+            continue;
+        }
+        // Coalesce runs of dirty sectors into one write per FAT copy
+        uint32_t run = s;
+        while (run < vol->fat_length && vol->fat_dirty[run]) {
+            vol->fat_dirty[run++] = 0;
+        }
+        for (uint32_t i = 0; i < vol->num_fats; i++) {
+            uint64_t fat_offset = vol->fat_start + (uint64_t)i * vol->fat_length * bps;
+            if (fatWriteMeta(vol, vol->fat + (size_t)s * bps, (size_t)(run - s) * bps, fat_offset + (uint64_t)s * bps) != 0) {
+                printf("Failed to write the FAT: %s\n", strerror(errno));
+                return -1;
+            }
+        }
+        s = run;
+    }
+
+    if (vol->info_sector != 0 && vol->info_sector != 0xFFFF && vol->info_sector < vol->reserved_sectors) {
+        uint8_t info[FAT_SECTOR_SIZE];
+        uint64_t info_offset = vol->offset + (uint64_t)vol->info_sector * bps;
+        if (fatReadMeta(vol, info, sizeof(info), info_offset) == 0 &&
+            memcmp(info, "RRaA", 4) == 0 && memcmp(info + 484, "rrAa", 4) == 0) {
+            putLE32(info + 488, vol->free_clusters + (vol->journal != NULL ? vol->journal->held_count : 0));
+            putLE32(info + 492, vol->next_free);
+            if (fatWriteMeta(vol, info, sizeof(info), info_offset) != 0) {
+                printf("Failed to update FSInfo: %s\n", strerror(errno));
+                return -1;
+            }
+        }
+    }
+    return fatJournalCommit(vol);
+}
+
+// Function to flush and release a volume, together with its image when fatOpen() opened it
+int fatClose(FatVolume *vol) {
+    int result = fatFlush(vol);
+    if (vol->io != NULL) {
+        ioEngineClose(vol->io);
+        free(vol->io);
+        vol->io = NULL;
+    }
+    if (vol->map != NULL) {
+        munmap((void *)vol->map, vol->map_size);
+        vol->map = NULL;
+    }
+    if (vol->owns_image) {
+        if (imageClose(vol->image) != 0) {
+            result = -1;
+        }
+        free(vol->image);
+    } else if (result == 0 && imageFlush(vol->image) != 0) {
+        result = -1;
+    }
+    fatJournalClose(vol, result == 0 && vol->owns_image);
+    vol->image = NULL;
+    free(vol->fat);
+    free(vol->fat_dirty);
+    free(vol->buffer);
+    vol->fat = NULL;
+    vol->fat_dirty = NULL;
+    vol->buffer = NULL;
+    return result;
+}
+
+// Function to collect the clusters of a chain, returns the number of clusters or -1 on a corrupt chain
+long fatGetChain(const FatVolume *vol, uint32_t first, uint32_t **clusters) {
+    size_t capacity = 16;
+    long count = 0;
+    uint32_t *list = malloc(capacity * sizeof(uint32_t));
+    if (list == NULL) {
+        return -1;
+    }
+
+    for (uint32_t c = first; fatIsDataCluster(vol, c); c = fatGetEntry(vol, c)) {
+        if ((uint64_t)count >= vol->cluster_count) {
+            free(list);
+            printf("Cluster chain starting at %u loops.\n", first);
+            return -1;
+        }
+        if ((size_t)count == capacity) {
+            capacity *= 2;
+            uint32_t *grown = realloc(list, capacity * sizeof(uint32_t));
+            if (grown == NULL) {
+                free(list);
+                return -1;
+            }
+            list = grown;
+        }
+        list[count++] = c;
+    }
+    *clusters = list;
+    return count;
+}
+
+// Function to check whether a cluster can be handed out. Clusters freed in the open transaction stay taken, the
+// committed FAT a crash would bring back still points at them.
+static int fatClusterAvailable(const FatVolume *vol, uint32_t c) {
+    return fatGetEntry(vol, c) == 0 &&
+           (vol->journal == NULL || vol->journal->held == NULL || !(vol->journal->held[c / 8] & (1u << (c % 8))));
+}
+
+// Function to allocate a chain of clusters, preferring one contiguous run from the next-free hint
+int fatAllocate(FatVolume *vol, uint32_t count, uint32_t *first, uint32_t link_from) {
+    if (count == 0) {
+        *first = 0;
+        return 0;
+    }
+    if (count > vol->free_clusters) {
+        uint32_t held = vol->journal != NULL ? vol->journal->held_count : 0;
+        if (held > 0) {
+            printf("Not enough free space in the image (%u clusters needed, %u free, %u more once the changes are "
+                   "committed).\n", count, vol->free_clusters, held);
+        } else {
+            printf("Not enough free space in the image (%u clusters needed, %u free).\n", count, vol->free_clusters);
+        }
+        return -1;
+    }
+
+    uint32_t end = vol->cluster_count + 2;
+    uint32_t run_start = 0;
+    uint32_t run_length = 0;
+
+    // First pass looks for a single run large enough, starting at the hint and wrapping once
+    for (uint32_t scanned = 0, c = vol->next_free; scanned < vol->cluster_count; scanned++, c++) {
+        if (c >= end) {
+            c = 2;
+            run_length = 0;
+        }
+        if (!fatClusterAvailable(vol, c)) {
+            run_length = 0;
+            continue;
+        }
+        if (run_length++ == 0) {
+            run_start = c;
+        }
+        if (run_length == count) {
+            break;
+        }
+    }
+
+    uint32_t previous = link_from;
+    *first = 0;
+    if (run_length == count) {
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t c = run_start + i;
+            if (previous) {
+                fatSetEntry(vol, previous, c);
+            }
+            if (*first == 0) {
+                *first = c;
+            }
+            previous = c;
+        }
+    } else {
+        // Fragmented volume, take free clusters in order
+        uint32_t taken = 0;
+        for (uint32_t c = 2; c < end && taken < count; c++) {
+            if (!fatClusterAvailable(vol, c)) {
+                continue;
+            }
+            if (previous) {
+                fatSetEntry(vol, previous, c);
+            }
+            if (*first == 0) {
+                *first = c;
+            }
+            previous = c;
+            taken++;
+            fatSetEntry(vol, c, FAT32_EOC);
+        }
+    }
+    fatSetEntry(vol, previous, FAT32_EOC);
+    vol->free_clusters -= count;
+    vol->next_free = previous + 1 < end ? previous + 1 : 2;
+    if (vol->journal != NULL && vol->journal->fresh != NULL) {
+        for (uint32_t c = *first; fatIsDataCluster(vol, c); c = fatGetEntry(vol, c)) {
+            vol->journal->fresh[c / 8] |= (uint8_t)(1u << (c % 8));
+        }
+    }
+    return 0;
+}
+
+// Function to release every cluster of a chain
+void fatFreeChain(FatVolume *vol, uint32_t first) {
+    // Freed clusters may be handed out again at once, no write to them may still be in flight
+    if (vol->io != NULL) {
+        ioEngineDrain(vol->io);  // A failure stays recorded and is reported by fatFlush()
+    }
+    uint32_t freed = 0;
+    uint32_t c = first;
+    while (fatIsDataCluster(vol, c) && freed < vol->cluster_count) {
+        uint32_t next = fatGetEntry(vol, c);
+        if (next == 0) {
+            break;
+        }
+        fatSetEntry(vol, c, 0);
+        FatJournal *journal = vol->journal;
+        if (journal != NULL && journal->count > 0) {
+            fatJournalDiscard(journal, fatClusterOffset(vol, c), vol->cluster_size);
+        }
+        uint8_t bit = (uint8_t)(1u << (c % 8));
+        if (journal != NULL && journal->held != NULL && !(journal->fresh[c / 8] & bit)) {
+            // Data written over it before the commit would corrupt the files a replayed journal restores
+            journal->held[c / 8] |= bit;
+            journal->held_count++;
+        } else {
+            if (journal != NULL && journal->fresh != NULL) {
+                journal->fresh[c / 8] &= (uint8_t)~bit;
+            }
+            vol->free_clusters++;
+            if (journal == NULL && c < vol->next_free) {
+                vol->next_free = c;
+            }
+        }
+        freed++;
+        c = next;
+    }
+}
+
+// Function to transfer a cluster chain to or from a contiguous buffer, one I/O per contiguous run
+static int fatChainIO(FatVolume *vol, const uint32_t *clusters, uint32_t count, uint8_t *buf, int write) {
+    for (uint32_t i = 0; i < count;) {
+        uint32_t run = 1;
+        while (i + run < count && clusters[i + run] == clusters[i] + run) {
+            run++;
+        }
+        size_t len = (size_t)run * vol->cluster_size;
+        uint64_t offset = fatClusterOffset(vol, clusters[i]);
+        uint8_t *p = buf + (size_t)i * vol->cluster_size;
+        if (write && vol->journal != NULL) {
+            // Journaled one cluster at a time so freeing a cluster can drop exactly its pending write
+            for (uint32_t j = 0; j < run; j++) {
+                if (fatJournalAppend(vol->journal, p + (size_t)j * vol->cluster_size, vol->cluster_size,
+                                     offset + (uint64_t)j * vol->cluster_size) != 0) {
+                    return -1;
+                }
+            }
+        } else if (!write && vol->map != NULL && offset + len <= vol->map_size) {
+            memcpy(p, vol->map + offset, len);
+            fatJournalOverlay(vol, p, len, offset);
+        } else if (write ? imageWrite(vol->image, p, len, offset) : fatReadMeta(vol, p, len, offset)) {
+            return -1;
+        }
+        i += run;
+    }
+    return 0;
+}
+
+// Function to load a directory and its cluster chain into memory
+int fatLoadDir(FatVolume *vol, uint32_t first_cluster, FatDir *dir) {
+    memset(dir, 0, sizeof(*dir));
+    dir->first_cluster = first_cluster;
+    long count = fatGetChain(vol, first_cluster, &dir->clusters);
+    if (count <= 0) {
+        if (count == 0) {
+            free(dir->clusters);
+            dir->clusters = NULL;
+            printf("Directory at cluster %u has no clusters.\n", first_cluster);
+        }
+        return -1;
+    }
+    dir->cluster_count = (uint32_t)count;
+    dir->size = (size_t)count * vol->cluster_size;
+    dir->data = malloc(dir->size);
+    if (dir->data == NULL || fatChainIO(vol, dir->clusters, dir->cluster_count, dir->data, 0) != 0) {
+        printf("Failed to read directory at cluster %u.\n", first_cluster);
+        free(dir->data);
+        free(dir->clusters);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to write a modified directory back to the image
+int fatStoreDir(FatVolume *vol, FatDir *dir) {
+    if (!dir->dirty) {
+        return 0;
+    }
+    if (fatChainIO(vol, dir->clusters, dir->cluster_count, dir->data, 1) != 0) {
+        printf("Failed to write directory at cluster %u: %s\n", dir->first_cluster, strerror(errno));
+        return -1;
+    }
+    dir->dirty = 0;
+    return 0;
+}
+
+// Function to release the memory of a loaded directory
+void fatFreeDir(FatDir *dir) {
+    free(dir->data);
+    free(dir->clusters);
+    dir->data = NULL;
+    dir->clusters = NULL;
+}
+
+// Function to compute the checksum binding LFN entries to their short entry
+static uint8_t fatShortNameChecksum(const uint8_t *short_name) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + short_name[i];
+    }
+    return sum;
+}
+
+// Function to append a UCS-2 code unit to a UTF-8 string
+static size_t utf8Encode(uint16_t unit, char *out) {
+    if (unit < 0x80) {
+        out[0] = (char)unit;
+        return 1;
+    }
+    if (unit < 0x800) {
+        out[0] = (char)(0xC0 | (unit >> 6));
+        out[1] = (char)(0x80 | (unit & 0x3F));
+        return 2;
+    }
+    out[0] = (char)(0xE0 | (unit >> 12));
+    out[1] = (char)(0x80 | ((unit >> 6) & 0x3F));
+    out[2] = (char)(0x80 | (unit & 0x3F));
+    return 3;
+}
+
+// Function to decode a UTF-8 name into UCS-2, returns the number of code units or -1 when it does not fit
+static int utf8ToUcs2(const char *name, uint16_t *out, int max_units) {
+    const uint8_t *p = (const uint8_t *)name;
+    int count = 0;
+    while (*p) {
+        uint32_t cp;
+        if (*p < 0x80) {
+            cp = *p++;
+        } else if ((*p & 0xE0) == 0xC0 && (p[1] & 0xC0) == 0x80) {
+            cp = ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+            p += 2;
+        } else if ((*p & 0xF0) == 0xE0 && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80) {
+            cp = ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+            p += 3;
+        } else {
+            cp = '_';  // Outside the BMP or malformed
+            p++;
+            while ((*p & 0xC0) == 0x80) {
+                p++;
+            }
+        }
+        if (count == max_units) {
+            return -1;
+        }
+        out[count++] = (uint16_t)cp;
+    }
+    return count;
+}
+
+// Function to turn an 8.3 directory entry name into a readable name, honouring the NT lowercase flags
+static void fatShortNameToString(const uint8_t *entry, char *out) {
+    int len = 0;
+    uint8_t flags = entry[12];
+    for (int i = 0; i < 8 && entry[i] != ' '; i++) {
+        uint8_t c = (i == 0 && entry[0] == 0x05) ? 0xE5 : entry[i];
+        out[len++] = (flags & FAT_CASE_LOWER_BASE) ? tolower(c) : c;
+    }
+    if (entry[8] != ' ') {
+        out[len++] = '.';
+        for (int i = 8; i < 11 && entry[i] != ' '; i++) {
+            out[len++] = (flags & FAT_CASE_LOWER_EXT) ? tolower(entry[i]) : entry[i];
+        }
+    }
+    out[len] = '\0';
+}
+
+// Function to decode the next live entry of a directory, skipping "." and "..", returns 0 at the end
+int fatNextEntry(const FatDir *dir, size_t *pos, FatEntry *out) {
+    uint16_t lfn[20 * FAT_LFN_CHARS];
+    int lfn_expected = 0;
+    int lfn_length = 0;
+    uint8_t lfn_checksum = 0;
+    size_t lfn_offset = 0;
+
+    for (; *pos + FAT_DIR_ENTRY_SIZE <= dir->size; *pos += FAT_DIR_ENTRY_SIZE) {
+        const uint8_t *e = dir->data + *pos;
+        if (e[0] == 0x00) {
+            return 0;
+        }
+        if (e[0] == FAT_ENTRY_DELETED) {
+            lfn_length = 0;
+            continue;
+        }
+
+        if ((e[11] & 0x3F) == FAT_ATTR_LFN) {
+            int ordinal = e[0] & 0x1F;
+            if (e[0] & 0x40) {
+                lfn_expected = ordinal;
+                lfn_length = ordinal * FAT_LFN_CHARS;
+                lfn_checksum = e[13];
+                lfn_offset = *pos;
+            } else if (lfn_length == 0 || ordinal != lfn_expected || e[13] != lfn_checksum) {
+                lfn_length = 0;
+                continue;
+            }
+            if (ordinal == 0 || ordinal > 20) {
+                lfn_length = 0;
+                continue;
+            }
+            static const int char_offsets[FAT_LFN_CHARS] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+            for (int i = 0; i < FAT_LFN_CHARS; i++) {
+                lfn[(ordinal - 1) * FAT_LFN_CHARS + i] = getLE16(e + char_offsets[i]);
+            }
+            lfn_expected = ordinal - 1;
+            continue;
+        }
+
+        if ((e[11] & FAT_ATTR_VOLUME) || (e[0] == '.' && (e[1] == ' ' || (e[1] == '.' && e[2] == ' ')))) {
+            lfn_length = 0;
+            continue;
+        }
+
+        memcpy(out->short_name, e, 11);
+        out->attr = e[11];
+        out->first_cluster = ((uint32_t)getLE16(e + 20) << 16) | getLE16(e + 26);
+        out->size = getLE32(e + 28);
+        out->time = getLE16(e + 22);
+        out->date = getLE16(e + 24);
+        out->offset = *pos;
+        out->lfn_offset = *pos;
+
+        // Use the long name only when the whole LFN sequence arrived and matches this entry
+        if (lfn_expected == 0 && lfn_length > 0 && lfn_checksum == fatShortNameChecksum(e)) {
+            size_t len = 0;
+            for (int i = 0; i < lfn_length && lfn[i] != 0x0000 && lfn[i] != 0xFFFF; i++) {
+                len += utf8Encode(lfn[i], out->name + len);
+            }
+            out->name[len] = '\0';
+            out->lfn_offset = lfn_offset;
+        } else {
+            fatShortNameToString(e, out->name);
+        }
+        *pos += FAT_DIR_ENTRY_SIZE;
+        return 1;
+    }
+    return 0;
+}
+
+// Function to look up a name in a directory, case-insensitively like the FAT drivers do
+int fatFindEntry(const FatDir *dir, const char *name, FatEntry *out) {
+    size_t pos = 0;
+    char short_name[13];
+    while (fatNextEntry(dir, &pos, out)) {
+        fatShortNameToString(out->short_name, short_name);
+        if (strcasecmp(out->name, name) == 0 || strcasecmp(short_name, name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to check whether a character may appear in an 8.3 name
+static int fatIsShortNameChar(unsigned char c) {
+    return isalnum(c) || strchr("!#$%&'()-@^_`{}~", c) != NULL;
+}
+
+// Function to check whether an 11 byte short name is already used in a directory
+static int fatShortNameExists(const FatDir *dir, const uint8_t *short_name) {
+    for (size_t pos = 0; pos + FAT_DIR_ENTRY_SIZE <= dir->size; pos += FAT_DIR_ENTRY_SIZE) {
+        const uint8_t *e = dir->data + pos;
+        if (e[0] == 0x00) {
+            break;
+        }
+        if (e[0] != FAT_ENTRY_DELETED && (e[11] & 0x3F) != FAT_ATTR_LFN && memcmp(e, short_name, 11) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to derive the 8.3 name of a file, returns 1 when a long name entry is needed as well
+static int fatMakeShortName(const FatDir *dir, const char *name, uint8_t *short_name, uint8_t *case_flags) {
+    const char *dot = strrchr(name, '.');
+    size_t base_len = dot && dot != name ? (size_t)(dot - name) : strlen(name);
+    const char *ext = dot && dot != name ? dot + 1 : "";
+    size_t ext_len = strlen(ext);
+
+    memset(short_name, ' ', 11);
+    *case_flags = 0;
+
+    // Names that already are valid 8.3 with a uniform case per part need no long name
+    int plain = base_len >= 1 && base_len <= 8 && ext_len <= 3 && name[0] != '.';
+    int base_lower = 0, base_upper = 0, ext_lower = 0, ext_upper = 0;
+    for (size_t i = 0; plain && i < base_len; i++) {
+        unsigned char c = name[i];
+        plain = fatIsShortNameChar(c) && c < 0x80;
+        base_lower |= islower(c) != 0;
+        base_upper |= isupper(c) != 0;
+    }
+    for (size_t i = 0; plain && i < ext_len; i++) {
+        unsigned char c = ext[i];
+        plain = fatIsShortNameChar(c) && c < 0x80;
+        ext_lower |= islower(c) != 0;
+        ext_upper |= isupper(c) != 0;
+    }
+    if (plain && !(base_lower && base_upper) && !(ext_lower && ext_upper)) {
+        for (size_t i = 0; i < base_len; i++) {
+            short_name[i] = toupper((unsigned char)name[i]);
+        }
+        for (size_t i = 0; i < ext_len; i++) {
+            short_name[8 + i] = toupper((unsigned char)ext[i]);
+        }
+        if (!fatShortNameExists(dir, short_name)) {
+            *case_flags = (base_lower ? FAT_CASE_LOWER_BASE : 0) | (ext_lower ? FAT_CASE_LOWER_EXT : 0);
+            return 0;
+        }
+    }
+
+    // Basis name: uppercase, invalid characters become '_', spaces and extra dots are dropped
+    char basis[9] = {0};
+    char extension[4] = {0};
+    int lossy = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < base_len; i++) {
+        unsigned char c = name[i];
+        if (c == ' ' || c == '.') {
+            lossy = 1;
+            continue;
+        }
+        if (n == 8) {
+            lossy = 1;
+            break;
+        }
+        if (c >= 0x80 || !fatIsShortNameChar(c)) {
+            lossy = 1;
+            c = '_';
+        }
+        basis[n++] = toupper(c);
+    }
+    n = 0;
+    for (size_t i = 0; i < ext_len; i++) {
+        unsigned char c = ext[i];
+        if (c == ' ') {
+            lossy = 1;
+            continue;
+        }
+        if (n == 3) {
+            lossy = 1;
+            break;
+        }
+        if (c >= 0x80 || !fatIsShortNameChar(c)) {
+            lossy = 1;
+            c = '_';
+        }
+        extension[n++] = toupper(c);
+    }
+    if (basis[0] == '\0') {
+        strcpy(basis, "_");
+        lossy = 1;
+    }
+    memcpy(short_name + 8, extension, strlen(extension));
+
+    if (!lossy) {
+        memcpy(short_name, basis, strlen(basis));
+        if (!fatShortNameExists(dir, short_name)) {
+            return 1;
+        }
+    }
+
+    // Numeric tail "~N", shortening the basis as the number grows
+    for (int tail = 1; tail < 1000000; tail++) {
+        char suffix[9];
+        int suffix_len = snprintf(suffix, sizeof(suffix), "~%d", tail);
+        size_t keep = strlen(basis);
+        if (keep > (size_t)(8 - suffix_len)) {
+            keep = 8 - suffix_len;
+        }
+        memset(short_name, ' ', 8);
+        memcpy(short_name, basis, keep);
+        memcpy(short_name + keep, suffix, suffix_len);
+        if (!fatShortNameExists(dir, short_name)) {
+            return 1;
+        }
+    }
+    return -1;
+}
+
+// Function to grow a directory by one zeroed cluster
+static int fatExtendDir(FatVolume *vol, FatDir *dir) {
+    uint32_t cluster;
+    if (fatAllocate(vol, 1, &cluster, dir->clusters[dir->cluster_count - 1]) != 0) {
+        return -1;
+    }
+    uint32_t *clusters = realloc(dir->clusters, (dir->cluster_count + 1) * sizeof(uint32_t));
+    uint8_t *data = realloc(dir->data, dir->size + vol->cluster_size);
+    if (clusters != NULL) {
+        dir->clusters = clusters;
+    }
+    if (data != NULL) {
+        dir->data = data;
+    }
+    if (clusters == NULL || data == NULL) {
+        return -1;
+    }
+    dir->clusters[dir->cluster_count++] = cluster;
+    memset(dir->data + dir->size, 0, vol->cluster_size);
+    dir->size += vol->cluster_size;
+    dir->dirty = 1;
+    return 0;
+}
+
+// Function to find room for a run of entries, growing the directory when it is full
+static long fatReserveSlots(FatVolume *vol, FatDir *dir, int slots) {
+    for (;;) {
+        int run = 0;
+        for (size_t pos = 0; pos + FAT_DIR_ENTRY_SIZE <= dir->size; pos += FAT_DIR_ENTRY_SIZE) {
+            uint8_t first = dir->data[pos];
+            if (first == 0x00 || first == FAT_ENTRY_DELETED) {
+                if (++run == slots) {
+                    return (long)(pos - (size_t)(slots - 1) * FAT_DIR_ENTRY_SIZE);
+                }
+            } else {
+                run = 0;
+            }
+        }
+        if (fatExtendDir(vol, dir) != 0) {
+            printf("Failed to grow directory at cluster %u.\n", dir->first_cluster);
+            return -1;
+        }
+    }
+}
+
+// Function to fill in the fields of a short directory entry
+static void fatFillShortEntry(uint8_t *e, uint8_t attr, uint32_t first_cluster, uint32_t size, time_t mtime) {
+    uint16_t time_field, date_field;
+    dosTimeFromUnix(mtime, &time_field, &date_field);
+    e[11] = attr;
+    e[13] = 0;
+    putLE16(e + 14, time_field);
+    putLE16(e + 16, date_field);
+    putLE16(e + 18, date_field);
+    putLE16(e + 20, first_cluster >> 16);
+    putLE16(e + 22, time_field);
+    putLE16(e + 24, date_field);
+    putLE16(e + 26, first_cluster & 0xFFFF);
+    putLE32(e + 28, size);
+}
+
+// Function to add an entry to a directory, writing LFN entries whenever the name is not plain 8.3
+int fatAddEntry(FatVolume *vol, FatDir *dir, const char *name, uint8_t attr, uint32_t first_cluster,
+                uint32_t size, time_t mtime, FatEntry *out) {
+    uint16_t units[FAT_NAME_MAX];
+    int unit_count = utf8ToUcs2(name, units, FAT_NAME_MAX);
+    if (unit_count <= 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strpbrk(name, "\\/:*?\"<>|") != NULL) {
+        printf("'%s' is not a valid FAT file name.\n", name);
+        return -1;
+    }
+
+    uint8_t short_name[11];
+    uint8_t case_flags;
+    int need_lfn = fatMakeShortName(dir, name, short_name, &case_flags);
+    if (need_lfn < 0) {
+        printf("No short name left for '%s'.\n", name);
+        return -1;
+    }
+    int lfn_count = need_lfn ? (unit_count + FAT_LFN_CHARS - 1) / FAT_LFN_CHARS : 0;
+
+    long slot = fatReserveSlots(vol, dir, lfn_count + 1);
+    if (slot < 0) {
+        return -1;
+    }
+
+    // LFN entries are stored last fragment first, each carrying the short name checksum
+    uint8_t checksum = fatShortNameChecksum(short_name);
+    static const int char_offsets[FAT_LFN_CHARS] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+    for (int i = 0; i < lfn_count; i++) {
+        int ordinal = lfn_count - i;
+        uint8_t *e = dir->data + slot + (size_t)i * FAT_DIR_ENTRY_SIZE;
+        memset(e, 0, FAT_DIR_ENTRY_SIZE);
+        e[0] = ordinal | (i == 0 ? 0x40 : 0);
+        e[11] = FAT_ATTR_LFN;
+        e[13] = checksum;
+        for (int j = 0; j < FAT_LFN_CHARS; j++) {
+            int index = (ordinal - 1) * FAT_LFN_CHARS + j;
+            uint16_t unit = index < unit_count ? units[index] : index == unit_count ? 0x0000 : 0xFFFF;
+            putLE16(e + char_offsets[j], unit);
+        }
+    }
+
+    size_t offset = (size_t)slot + (size_t)lfn_count * FAT_DIR_ENTRY_SIZE;
+    uint8_t *e = dir->data + offset;
+    memset(e, 0, FAT_DIR_ENTRY_SIZE);
+    memcpy(e, short_name, 11);
+    if (e[0] == 0xE5) {
+        e[0] = 0x05;
+    }
+    fatFillShortEntry(e, attr, first_cluster, size, mtime);
+    e[12] = case_flags;
+    dir->dirty = 1;
+
+    if (out != NULL) {
+        snprintf(out->name, sizeof(out->name), "%s", name);
+        memcpy(out->short_name, e, 11);
+        out->attr = attr;
+        out->first_cluster = first_cluster;
+        out->size = size;
+        out->offset = offset;
+        out->lfn_offset = (size_t)slot;
+    }
+    return 0;
+}
+
+// Function to create a subdirectory with its "." and ".." entries
+int fatMakeDir(FatVolume *vol, FatDir *parent, const char *name, time_t mtime, FatEntry *out) {
+    uint32_t cluster;
+    if (fatAllocate(vol, 1, &cluster, 0) != 0) {
+        return -1;
+    }
+
+    uint8_t *data = calloc(1, vol->cluster_size);
+    if (data == NULL) {
+        fatFreeChain(vol, cluster);
+        return -1;
+    }
+    memset(data, ' ', 11);
+    data[0] = '.';
+    fatFillShortEntry(data, FAT_ATTR_DIRECTORY, cluster, 0, mtime);
+    memset(data + FAT_DIR_ENTRY_SIZE, ' ', 11);
+    data[FAT_DIR_ENTRY_SIZE] = '.';
+    data[FAT_DIR_ENTRY_SIZE + 1] = '.';
+    uint32_t parent_cluster = parent->first_cluster == vol->root_cluster ? 0 : parent->first_cluster;
+    fatFillShortEntry(data + FAT_DIR_ENTRY_SIZE, FAT_ATTR_DIRECTORY, parent_cluster, 0, mtime);
+
+    int result = fatWriteMeta(vol, data, vol->cluster_size, fatClusterOffset(vol, cluster));
+    free(data);
+    if (result != 0 || fatAddEntry(vol, parent, name, FAT_ATTR_DIRECTORY, cluster, 0, mtime, out) != 0) {
+        fatFreeChain(vol, cluster);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to open the directory at a slash separated path, optionally creating missing components
+int fatOpenDirPath(FatVolume *vol, const char *path, int create, FatDir *dir) {
+    if (fatLoadDir(vol, vol->root_cluster, dir) != 0) {
+        return -1;
+    }
+
+    char component[FAT_NAME_MAX * 3 + 1];
+    const char *p = path;
+    while (*p) {
+        while (*p == '/') {
+            p++;
+        }
+        size_t len = strcspn(p, "/");
+        if (len == 0) {
+            break;
+        }
+        if (len >= sizeof(component)) {
+            printf("Path component too long in '%s'.\n", path);
+            fatFreeDir(dir);
+            return -1;
+        }
+        memcpy(component, p, len);
+        component[len] = '\0';
+        p += len;
+
+        FatEntry entry;
+        if (!fatFindEntry(dir, component, &entry)) {
+            if (!create) {
+                printf("'%s' not found in the image.\n", path);
+                fatFreeDir(dir);
+                errno = ENOENT;
+                return -1;
+            }
+            if (fatMakeDir(vol, dir, component, time(NULL), &entry) != 0 || fatStoreDir(vol, dir) != 0) {
+                fatFreeDir(dir);
+                return -1;
+            }
+        } else if (!(entry.attr & FAT_ATTR_DIRECTORY)) {
+            printf("'%s' is not a directory in the image.\n", component);
+            fatFreeDir(dir);
+            return -1;
+        }
+
+        fatFreeDir(dir);
+        if (fatLoadDir(vol, entry.first_cluster ? entry.first_cluster : vol->root_cluster, dir) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Statistics gathered while copying files into an image
+typedef struct {
+    unsigned long files;
+    unsigned long directories;
+    uint64_t bytes;
+} FatPutStats;
+
+// Function to stream a host file into a freshly allocated cluster chain. On raw images the writes go through the
+// I/O engine and overlap the reads of the next files, fatFlush() waits for them before the metadata is written.
+static int fatWriteFileData(FatVolume *vol, int host_fd, const uint32_t *clusters, uint32_t count, uint64_t size) {
+    if (vol->io == NULL && vol->image->format == IMAGE_FORMAT_RAW) {
+        if ((vol->io = malloc(sizeof(IoEngine))) == NULL || ioEngineOpen(vol->io, vol->image->fd, 1, 0) != 0) {
+            free(vol->io);
+            vol->io = NULL;
+            return -1;
+        }
+    }
+    if (vol->io == NULL && vol->buffer == NULL && (vol->buffer = malloc(FAT_COPY_BUFFER_SIZE)) == NULL) {
+        return -1;
+    }
+    size_t buffer_size = vol->io != NULL ? IO_ENGINE_BLOCK : FAT_COPY_BUFFER_SIZE;
+
+    for (uint32_t i = 0; i < count && size > 0;) {
+        uint32_t run = 1;
+        while (i + run < count && clusters[i + run] == clusters[i] + run) {
+            run++;
+        }
+
+        // One contiguous run becomes a series of large sequential writes
+        uint64_t offset = fatClusterOffset(vol, clusters[i]);
+        uint64_t remaining = (uint64_t)run * vol->cluster_size;
+        if (remaining > size) {
+            remaining = size;
+        }
+        size -= remaining;
+        while (remaining > 0) {
+            size_t chunk = remaining < buffer_size ? (size_t)remaining : buffer_size;
+            uint8_t *buffer = vol->io != NULL ? ioEngineBuffer(vol->io) : vol->buffer;
+            size_t filled = 0;
+            while (filled < chunk) {
+                ssize_t got = read(host_fd, buffer + filled, chunk - filled);
+                if (got < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (got <= 0) {
+                    printf("Source file shrank or failed to read while copying.\n");
+                    if (vol->io != NULL) {
+                        ioEngineSubmit(vol->io, buffer, 0, offset);  // Hands the buffer back
+                    }
+                    return -1;
+                }
+                filled += got;
+            }
+            int result;
+            if (vol->io != NULL) {
+                // The tail of the last cluster is zeroed so the write stays aligned for O_DIRECT
+                size_t padded = (chunk + vol->cluster_size - 1) / vol->cluster_size * vol->cluster_size;
+                memset(buffer + chunk, 0, padded - chunk);
+                result = ioEngineSubmit(vol->io, buffer, padded, offset);
+            } else {
+                result = imageWrite(vol->image, buffer, chunk, offset);
+            }
+            if (result != 0) {
+                printf("Failed to write file data: %s\n", strerror(errno));
+                return -1;
+            }
+            offset += chunk;
+            remaining -= chunk;
+        }
+        i += run;
+    }
+    return 0;
+}
+
+// Function to copy one host file into a directory of the image, replacing an existing file of the same name
+int fatPutFile(FatVolume *vol, FatDir *dir, const char *host_path, const char *name, const struct stat *st,
+               FatPutStats *stats) {
+    if ((uint64_t)st->st_size > 0xFFFFFFFFULL) {
+        printf("'%s' is larger than the 4 GB FAT32 file size limit.\n", host_path);
+        return -1;
+    }
+
+    FatEntry existing;
+    int found = fatFindEntry(dir, name, &existing);
+    if (found && (existing.attr & FAT_ATTR_DIRECTORY)) {
+        printf("'%s' already exists as a directory in the image.\n", name);
+        return -1;
+    }
+
+    int host_fd = open(host_path, O_RDONLY);
+    if (host_fd < 0) {
+        printf("Failed to open '%s': %s\n", host_path, strerror(errno));
+        return -1;
+    }
+
+    if (found) {
+        fatFreeChain(vol, existing.first_cluster);
+    }
+
+    uint32_t count = (uint32_t)(((uint64_t)st->st_size + vol->cluster_size - 1) / vol->cluster_size);
+    uint32_t first = 0;
+    uint32_t *clusters = NULL;
+    int result = fatAllocate(vol, count, &first, 0);
+    if (result == 0 && count > 0) {
+        result = fatGetChain(vol, first, &clusters) == (long)count ? 0 : -1;
+        if (result == 0) {
+            result = fatWriteFileData(vol, host_fd, clusters, count, (uint64_t)st->st_size);
+        }
+        free(clusters);
+    }
+    close(host_fd);
+
+    if (result != 0) {
+        if (first) {
+            fatFreeChain(vol, first);
+        }
+        if (found) {
+            // The old chain is gone, leave a consistent empty file behind
+            fatFillShortEntry(dir->data + existing.offset, existing.attr, 0, 0, st->st_mtime);
+            dir->dirty = 1;
+        }
+        return -1;
+    }
+
+    if (found) {
+        fatFillShortEntry(dir->data + existing.offset, FAT_ATTR_ARCHIVE, first, (uint32_t)st->st_size, st->st_mtime);
+        dir->dirty = 1;
+    } else if (fatAddEntry(vol, dir, name, FAT_ATTR_ARCHIVE, first, (uint32_t)st->st_size, st->st_mtime, NULL) != 0) {
+        if (first) {
+            fatFreeChain(vol, first);
+        }
+        return -1;
+    }
+    stats->files++;
+    stats->bytes += (uint64_t)st->st_size;
+    return 0;
+}
+
+// Function to recursively copy the contents of a host directory into a directory of the image
+int fatPutTree(FatVolume *vol, FatDir *dir, const char *host_dir, FatPutStats *stats) {
+    struct dirent **names;
+    int count = scandir(host_dir, &names, NULL, alphasort);
+    if (count < 0) {
+        printf("Failed to read '%s': %s\n", host_dir, strerror(errno));
+        return -1;
+    }
+
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        const char *name = names[i]->d_name;
+        char host_path[4096];
+        struct stat st;
+
+        if (result != 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            free(names[i]);
+            continue;
+        }
+        snprintf(host_path, sizeof(host_path), "%s/%s", host_dir, name);
+        if (stat(host_path, &st) != 0) {
+            printf("Skipping '%s': %s\n", host_path, strerror(errno));
+        } else if (S_ISREG(st.st_mode)) {
+            result = fatPutFile(vol, dir, host_path, name, &st, stats);
+        } else if (S_ISDIR(st.st_mode)) {
+            FatEntry entry;
+            FatDir child;
+            if (fatFindEntry(dir, name, &entry)) {
+                if (!(entry.attr & FAT_ATTR_DIRECTORY)) {
+                    printf("'%s' already exists as a file in the image.\n", name);
+                    result = -1;
+                }
+            } else {
+                result = fatMakeDir(vol, dir, name, st.st_mtime, &entry);
+                if (result == 0) {
+                    stats->directories++;
+                }
+            }
+            if (result == 0 && (result = fatLoadDir(vol, entry.first_cluster, &child)) == 0) {
+                result = fatPutTree(vol, &child, host_path, stats);
+                if (fatStoreDir(vol, &child) != 0) {
+                    result = -1;
+                }
+                fatFreeDir(&child);
+            }
+        } else {
+            printf("Skipping '%s': not a regular file or directory.\n", host_path);
+        }
+        free(names[i]);
+    }
+    free(names);
+    return result;
+}
+
+// Function to copy a host file or directory tree into an image without mounting it
+int putIntoImage(const char *image_path, const char *host_path, const char *dest_path) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct stat st;
+    if (stat(host_path, &st) != 0) {
+        printf("Failed to access '%s': %s\n", host_path, strerror(errno));
+        return -1;
+    }
+
+    FatVolume vol;
+    FatDir dir;
+    int lock_fd = lockImageForWriting(image_path);
+    if (lock_fd < 0) {
+        return -1;
+    }
+    if (fatOpen(&vol, image_path, 1) != 0) {
+        close(lock_fd);
+        return -1;
+    }
+    if (fatOpenDirPath(&vol, dest_path, 1, &dir) != 0) {
+        fatClose(&vol);
+        close(lock_fd);
+        return -1;
+    }
+
+    FatPutStats stats = {0};
+    int result;
+    if (S_ISDIR(st.st_mode)) {
+        result = fatPutTree(&vol, &dir, host_path, &stats);
+    } else {
+        const char *name = strrchr(host_path, '/');
+        result = fatPutFile(&vol, &dir, host_path, name ? name + 1 : host_path, &st, &stats);
+    }
+
+    // Directory entries go out after the file data, the FAT last in one batch
+    if (fatStoreDir(&vol, &dir) != 0) {
+        result = -1;
+    }
+    fatFreeDir(&dir);
+    if (fatClose(&vol) != 0) {
+        printf("Failed to flush the FAT of '%s': %s\n", image_path, strerror(errno));
+        result = -1;
+    }
+    close(lock_fd);
+
+    if (result == 0) {
+        printf("Copied %lu files and %lu directories (%.2f MB) into '%s' in %.1f ms.\n", stats.files, stats.directories,
+               stats.bytes / (1024.0 * 1024.0), image_path, elapsedMs(&start));
+    }
+    return result;
+}
+
+// Options and statistics of a sync run
+#define SYNC_CHECKSUM 0x01        // Compare the contents of files whose size and time match too
+#define SYNC_DELETE 0x02          // Remove what is in the image but not in the host directory
+
+typedef struct {
+    unsigned long files;          // Host files looked at
+    unsigned long updated;        // Files whose data or time changed
+    unsigned long added;          // Files and directories created
+    unsigned long removed;        // Files and directories deleted with SYNC_DELETE
+    uint64_t bytes;               // Host bytes compared or copied
+    uint64_t written;             // Bytes actually written to the image
+} FatSyncStats;
+
+// Function to mark the LFN entries and the short entry of a directory entry as deleted
+static void fatEraseEntry(FatDir *dir, const FatEntry *entry) {
+    for (size_t pos = entry->lfn_offset; pos <= entry->offset; pos += FAT_DIR_ENTRY_SIZE) {
+        dir->data[pos] = FAT_ENTRY_DELETED;
+    }
+    dir->dirty = 1;
+}
+
+// Function to record the host modification time of a synced file in its creation time, which FAT keeps to 10 ms.
+// Write times only have 2 second steps, too coarse to notice an edit made right after the previous sync.
+static void fatStampSyncTime(uint8_t *e, const struct stat *st) {
+    uint16_t time_field, date_field;
+    dosTimeFromUnix(st->st_mtime, &time_field, &date_field);
+    e[13] = (uint8_t)((st->st_mtime & 1) * 100 + st->st_mtim.tv_nsec / 10000000);
+    putLE16(e + 14, time_field);
+    putLE16(e + 16, date_field);
+}
+
+// Function to check whether an entry still carries the time fatStampSyncTime() recorded for a host file
+static int fatSyncTimeMatches(const uint8_t *e, const struct stat *st) {
+    uint8_t stamp[FAT_DIR_ENTRY_SIZE];
+    memcpy(stamp, e, sizeof(stamp));
+    fatStampSyncTime(stamp, st);
+    return memcmp(stamp + 13, e + 13, 5) == 0 && memcmp(stamp + 14, e + 22, 4) == 0;
+}
+
+// Function to free everything below a directory of the image, the directory's own chain included
+static int fatRemoveTree(FatVolume *vol, uint32_t first_cluster, unsigned long *removed) {
+    FatDir dir;
+    if (fatLoadDir(vol, first_cluster, &dir) != 0) {
+        return -1;
+    }
+    int result = 0;
+    size_t pos = 0;
+    FatEntry entry;
+    while (result == 0 && fatNextEntry(&dir, &pos, &entry)) {
+        if (entry.attr & FAT_ATTR_DIRECTORY) {
+            result = entry.first_cluster ? fatRemoveTree(vol, entry.first_cluster, removed) : -1;
+        } else {
+            fatFreeChain(vol, entry.first_cluster);
+        }
+        (*removed)++;
+    }
+    fatFreeDir(&dir);
+    fatFreeChain(vol, first_cluster);
+    return result;
+}
+
+// Function to resize the cluster chain of a file in place, keeping as many of its clusters as the new size needs.
+// *first is updated when the chain starts or ends, *kept receives how many old clusters still hold old data.
+static int fatResizeChain(FatVolume *vol, uint32_t *first, uint32_t needed, uint32_t **clusters, uint32_t *kept) {
+    long count = *first ? fatGetChain(vol, *first, clusters) : 0;
+    if (count < 0) {
+        return -1;
+    }
+    if (count == 0) {
+        free(*clusters);
+        *clusters = NULL;
+    }
+
+    if ((uint32_t)count > needed) {
+        // Cut the chain after the last cluster still needed and give the tail back
+        if (needed == 0) {
+            fatFreeChain(vol, *first);
+            *first = 0;
+        } else {
+            fatSetEntry(vol, (*clusters)[needed - 1], FAT32_EOC);
+            fatFreeChain(vol, (*clusters)[needed]);
+        }
+        *kept = needed;
+        return 0;
+    }
+
+    *kept = (uint32_t)count;
+    if ((uint32_t)count < needed) {
+        uint32_t extra;
+        if (fatAllocate(vol, needed - (uint32_t)count, &extra, count ? (*clusters)[count - 1] : 0) != 0) {
+            return -1;
+        }
+        if (*first == 0) {
+            *first = extra;
+        }
+        free(*clusters);
+        *clusters = NULL;
+        if (fatGetChain(vol, *first, clusters) != (long)needed) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to stream a host file over a cluster chain, writing only the clusters whose contents differ.
+// The first kept clusters hold the previous data of the file and are compared, the others are always written.
+static int fatSyncFileData(FatVolume *vol, int host_fd, const uint32_t *clusters, uint32_t count, uint32_t kept,
+                           uint64_t size, uint8_t *old, uint64_t *written) {
+    if (vol->buffer == NULL && (vol->buffer = malloc(FAT_COPY_BUFFER_SIZE)) == NULL) {
+        return -1;
+    }
+    uint32_t per_buffer = FAT_COPY_BUFFER_SIZE / vol->cluster_size;
+
+    for (uint32_t i = 0; i < count && size > 0;) {
+        // One contiguous run of at most one buffer is read from the host and, when needed, from the image
+        uint32_t run = 1;
+        while (i + run < count && run < per_buffer && clusters[i + run] == clusters[i] + run &&
+               (i + run < kept) == (i < kept)) {
+            run++;
+        }
+        uint64_t offset = fatClusterOffset(vol, clusters[i]);
+        size_t chunk = (uint64_t)run * vol->cluster_size < size ? (size_t)run * vol->cluster_size : (size_t)size;
+        size_t filled = 0;
+        while (filled < chunk) {
+            ssize_t got = read(host_fd, vol->buffer + filled, chunk - filled);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                printf("Source file shrank or failed to read while copying.\n");
+                return -1;
+            }
+            filled += got;
+        }
+        if (i < kept && imageRead(vol->image, old, chunk, offset) != 0) {
+            printf("Failed to read file data: %s\n", strerror(errno));
+            return -1;
+        }
+
+        // Differing clusters next to each other go out in one write
+        for (size_t from = 0; from < chunk;) {
+            size_t to = from;
+            while (to < chunk) {
+                size_t len = chunk - to < vol->cluster_size ? chunk - to : vol->cluster_size;
+                if (i < kept && memcmp(vol->buffer + to, old + to, len) == 0) {
+                    break;
+                }
+                to += len;
+            }
+            if (to > from) {
+                if (imageWrite(vol->image, vol->buffer + from, to - from, offset + from) != 0) {
+                    printf("Failed to write file data: %s\n", strerror(errno));
+                    return -1;
+                }
+                *written += to - from;
+                from = to;
+            } else {
+                from += vol->cluster_size;
+            }
+        }
+        size -= chunk;
+        i += run;
+    }
+    return 0;
+}
+
+// Function to bring one file of the image up to date with a host file. Size and modification time decide whether
+// it changed (its contents too with SYNC_CHECKSUM), a changed file keeps its clusters and only rewrites those
+// that differ.
+static int fatSyncFile(FatVolume *vol, FatDir *dir, const char *host_path, const char *name, const struct stat *st,
+                       int flags, uint8_t *old, FatSyncStats *stats) {
+    if ((uint64_t)st->st_size > 0xFFFFFFFFULL) {
+        printf("'%s' is larger than the 4 GB FAT32 file size limit.\n", host_path);
+        return -1;
+    }
+    stats->files++;
+
+    FatEntry existing;
+    int found = fatFindEntry(dir, name, &existing);
+    if (found && (existing.attr & FAT_ATTR_DIRECTORY)) {
+        if (!(flags & SYNC_DELETE)) {
+            printf("'%s' already exists as a directory in the image.\n", name);
+            return -1;
+        }
+        if (fatRemoveTree(vol, existing.first_cluster, &stats->removed) != 0) {
+            return -1;
+        }
+        fatEraseEntry(dir, &existing);
+        stats->removed++;
+        found = 0;
+    }
+
+    int same_time = found && fatSyncTimeMatches(dir->data + existing.offset, st);
+    if (found && existing.size == (uint64_t)st->st_size && same_time && !(flags & SYNC_CHECKSUM)) {
+        return 0;
+    }
+
+    int host_fd = open(host_path, O_RDONLY);
+    if (host_fd < 0) {
+        printf("Failed to open '%s': %s\n", host_path, strerror(errno));
+        return -1;
+    }
+    uint32_t first = found ? existing.first_cluster : 0;
+    uint32_t needed = (uint32_t)(((uint64_t)st->st_size + vol->cluster_size - 1) / vol->cluster_size);
+    uint32_t *clusters = NULL, kept = 0;
+    uint64_t written = 0;
+    int result = fatResizeChain(vol, &first, needed, &clusters, &kept);
+    if (result == 0 && needed > 0) {
+        result = fatSyncFileData(vol, host_fd, clusters, needed, kept, (uint64_t)st->st_size, old, &written);
+    }
+    free(clusters);
+    close(host_fd);
+    stats->bytes += (uint64_t)st->st_size;
+    stats->written += written;
+
+    if (result != 0) {
+        if (found) {
+            // The chain may hold a mix of old and new data, leave a consistent empty file behind
+            fatFreeChain(vol, first);
+            fatFillShortEntry(dir->data + existing.offset, existing.attr, 0, 0, st->st_mtime);
+            dir->dirty = 1;
+        } else if (first) {
+            fatFreeChain(vol, first);
+        }
+        return -1;
+    }
+
+    if (found) {
+        if (written > 0 || existing.size != (uint64_t)st->st_size || !same_time) {
+            fatFillShortEntry(dir->data + existing.offset, existing.attr | FAT_ATTR_ARCHIVE, first,
+                              (uint32_t)st->st_size, st->st_mtime);
+            fatStampSyncTime(dir->data + existing.offset, st);
+            dir->dirty = 1;
+            stats->updated++;
+        }
+    } else if (fatAddEntry(vol, dir, name, FAT_ATTR_ARCHIVE, first, (uint32_t)st->st_size, st->st_mtime,
+                           &existing) != 0) {
+        if (first) {
+            fatFreeChain(vol, first);
+        }
+        return -1;
+    } else {
+        fatStampSyncTime(dir->data + existing.offset, st);
+        stats->added++;
+    }
+    return 0;
+}
+
+// Function to check whether a host directory listing holds a name, case-insensitively like FAT
+static int syncHostHasName(struct dirent **names, int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (names[i] != NULL && strcasecmp(names[i]->d_name, name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to recursively bring a directory of the image up to date with a host directory
+static int fatSyncTree(FatVolume *vol, FatDir *dir, const char *host_dir, int flags, uint8_t *old,
+                       FatSyncStats *stats) {
+    struct dirent **names;
+    int count = scandir(host_dir, &names, NULL, alphasort);
+    if (count < 0) {
+        printf("Failed to read '%s': %s\n", host_dir, strerror(errno));
+        return -1;
+    }
+
+    int result = 0;
+    for (int i = 0; i < count && result == 0; i++) {
+        const char *name = names[i]->d_name;
+        char host_path[4096];
+        struct stat st;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        snprintf(host_path, sizeof(host_path), "%s/%s", host_dir, name);
+        if (stat(host_path, &st) != 0) {
+            printf("Skipping '%s': %s\n", host_path, strerror(errno));
+        } else if (S_ISREG(st.st_mode)) {
+            result = fatSyncFile(vol, dir, host_path, name, &st, flags, old, stats);
+        } else if (S_ISDIR(st.st_mode)) {
+            FatEntry entry;
+            FatDir child;
+            int found = fatFindEntry(dir, name, &entry);
+            if (found && !(entry.attr & FAT_ATTR_DIRECTORY)) {
+                if (!(flags & SYNC_DELETE)) {
+                    printf("'%s' already exists as a file in the image.\n", name);
+                    result = -1;
+                    continue;
+                }
+                fatFreeChain(vol, entry.first_cluster);
+                fatEraseEntry(dir, &entry);
+                stats->removed++;
+                found = 0;
+            }
+            if (!found) {
+                result = fatMakeDir(vol, dir, name, st.st_mtime, &entry);
+                if (result == 0) {
+                    stats->added++;
+                }
+            }
+            if (result == 0 && (result = fatLoadDir(vol, entry.first_cluster, &child)) == 0) {
+                result = fatSyncTree(vol, &child, host_path, flags, old, stats);
+                if (fatStoreDir(vol, &child) != 0) {
+                    result = -1;
+                }
+                fatFreeDir(&child);
+            }
+        } else {
+            printf("Skipping '%s': not a regular file or directory.\n", host_path);
+        }
+    }
+
+    // Whatever the host directory no longer has goes away
+    size_t pos = 0;
+    FatEntry entry;
+    while (result == 0 && (flags & SYNC_DELETE) && fatNextEntry(dir, &pos, &entry)) {
+        if (syncHostHasName(names, count, entry.name)) {
+            continue;
+        }
+        if (entry.attr & FAT_ATTR_DIRECTORY) {
+            result = fatRemoveTree(vol, entry.first_cluster, &stats->removed);
+        } else {
+            fatFreeChain(vol, entry.first_cluster);
+        }
+        fatEraseEntry(dir, &entry);
+        stats->removed++;
+    }
+
+    for (int i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return result;
+}
+
+// Function to bring a directory of an image up to date with a host directory, touching only what changed.
+// Directory entries are written once per directory and the FAT once at the end.
+int syncIntoImage(const char *host_dir, const char *image_path, const char *dest_path, int flags,
+                  FatSyncStats *stats) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(stats, 0, sizeof(*stats));
+
+    struct stat st;
+    if (stat(host_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        printf("'%s' is not a directory.\n", host_dir);
+        return -1;
+    }
+
+    FatVolume vol;
+    FatDir dir;
+    int lock_fd = lockImageForWriting(image_path);
+    if (lock_fd < 0) {
+        return -1;
+    }
+    if (fatOpen(&vol, image_path, 1) != 0) {
+        close(lock_fd);
+        return -1;
+    }
+    uint8_t *old = malloc(FAT_COPY_BUFFER_SIZE);
+    if (old == NULL || fatOpenDirPath(&vol, dest_path, 1, &dir) != 0) {
+        free(old);
+        fatClose(&vol);
+        close(lock_fd);
+        return -1;
+    }
+
+    int result = fatSyncTree(&vol, &dir, host_dir, flags, old, stats);
+    if (fatStoreDir(&vol, &dir) != 0) {
+        result = -1;
+    }
+    fatFreeDir(&dir);
+    free(old);
+    if (fatClose(&vol) != 0) {
+        printf("Failed to flush the FAT of '%s': %s\n", image_path, strerror(errno));
+        result = -1;
+    }
+    close(lock_fd);
+
+    if (result == 0) {
+        printf("Synced '%s' into '%s' in %.1f ms: %lu files checked, %lu updated, %lu added, %lu removed, "
+               "%.2f MB written.\n", host_dir, image_path, elapsedMs(&start), stats->files, stats->updated,
+               stats->added, stats->removed, stats->written / (1024.0 * 1024.0));
+    }
+    return result;
+}
+
+// Function to convert DOS time and date fields back to a Unix timestamp
+time_t unixTimeFromDos(uint16_t time_field, uint16_t date_field) {
+    struct tm tm_value = {0};
+    tm_value.tm_sec = (time_field & 0x1F) * 2;
+    tm_value.tm_min = (time_field >> 5) & 0x3F;
+    tm_value.tm_hour = time_field >> 11;
+    tm_value.tm_mday = date_field & 0x1F;
+    tm_value.tm_mon = ((date_field >> 5) & 0x0F) - 1;
+    tm_value.tm_year = (date_field >> 9) + 80;
+    tm_value.tm_isdst = -1;
+    return mktime(&tm_value);
+}
+
+// Function to resolve a path inside the image to its directory entry, "/" resolves to the root directory
+int fatLookupPath(FatVolume *vol, const char *path, FatEntry *entry) {
+    while (*path == '/') {
+        path++;
+    }
+    if (*path == '\0') {
+        memset(entry, 0, sizeof(*entry));
+        strcpy(entry->name, "/");
+        entry->attr = FAT_ATTR_DIRECTORY;
+        entry->first_cluster = vol->root_cluster;
+        return 0;
+    }
+
+    char parent_path[4096];
+    snprintf(parent_path, sizeof(parent_path), "%s", path);
+    size_t len = strlen(parent_path);
+    while (len > 0 && parent_path[len - 1] == '/') {
+        parent_path[--len] = '\0';
+    }
+    char *slash = strrchr(parent_path, '/');
+    const char *name = slash ? slash + 1 : parent_path;
+    if (slash) {
+        *slash = '\0';
+    }
+
+    FatDir dir;
+    if (fatOpenDirPath(vol, slash ? parent_path : "", 0, &dir) != 0) {
+        return -1;
+    }
+    int found = fatFindEntry(&dir, name, entry);
+    fatFreeDir(&dir);
+    if (!found) {
+        printf("'%s' not found in the image.\n", path);
+        errno = ENOENT;
+        return -1;
+    }
+    if ((entry->attr & FAT_ATTR_DIRECTORY) && entry->first_cluster == 0) {
+        entry->first_cluster = vol->root_cluster;
+    }
+    return 0;
+}
+
+// Function to map a raw image read-only so file data can be handed to write() without a bounce buffer
+int fatMapImage(FatVolume *vol) {
+    struct stat st;
+    if (vol->image->format != IMAGE_FORMAT_RAW) {
+        return 0;  // QCOW2 data is scattered by the L2 tables and goes through imageRead()
+    }
+    if (fstat(vol->image->fd, &st) != 0 || st.st_size == 0) {
+        return -1;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, vol->image->fd, 0);
+    if (map == MAP_FAILED) {
+        printf("Failed to map the image: %s\n", strerror(errno));
+        return -1;
+    }
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    vol->map = map;
+    vol->map_size = (uint64_t)st.st_size;
+    return 0;
+}
+
+// Function to write a buffer completely to a stream descriptor
+int writeStream(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Function to copy one contiguous byte range of the image to the output, in-kernel when possible
+static int fatCopyRange(FatVolume *vol, uint64_t offset, uint64_t len, int out_fd) {
+    if (vol->io != NULL && ioEngineDrain(vol->io) != 0) {
+        printf("Failed to write file data: %s\n", strerror(errno));
+        return -1;
+    }
+    if (vol->map == NULL) {
+        // Unmapped (QCOW2) images are translated cluster by cluster into the staging buffer
+        if (vol->buffer == NULL && (vol->buffer = malloc(FAT_COPY_BUFFER_SIZE)) == NULL) {
+            return -1;
+        }
+        while (len > 0) {
+            size_t chunk = len < FAT_COPY_BUFFER_SIZE ? (size_t)len : FAT_COPY_BUFFER_SIZE;
+            if (imageRead(vol->image, vol->buffer, chunk, offset) != 0) {
+                printf("Failed to read file data: %s\n", strerror(errno));
+                return -1;
+            }
+            if (writeStream(out_fd, vol->buffer, chunk) != 0) {
+                printf("Failed to write file data: %s\n", strerror(errno));
+                return -1;
+            }
+            offset += chunk;
+            len -= chunk;
+        }
+        return 0;
+    }
+    if (offset + len > vol->map_size) {
+        printf("The image is truncated, file data lies beyond its end.\n");
+        return -1;
+    }
+
+#ifdef __linux__
+    // copy_file_range lets the kernel move (or reflink) whole runs without touching user memory
+    while (!vol->no_copy_range && len > 0) {
+        loff_t in_offset = (loff_t)offset;
+        ssize_t copied = copy_file_range(vol->image->fd, &in_offset, out_fd, NULL, len, 0);
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied <= 0) {
+            if (copied == 0 || errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP ||
+                errno == EBADF) {
+                vol->no_copy_range = 1;
+                break;
+            }
+            printf("Failed to copy file data: %s\n", strerror(errno));
+            return -1;
+        }
+        offset += copied;
+        len -= copied;
+    }
+#endif
+
+    if (len > 0 && writeStream(out_fd, vol->map + offset, (size_t)len) != 0) {
+        printf("Failed to write file data: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Function to copy the contents of a file in the image to a host descriptor, one transfer per contiguous run
+int fatCopyOut(FatVolume *vol, const FatEntry *entry, int out_fd) {
+    uint32_t *clusters = NULL;
+    uint64_t remaining = entry->size;
+    if (remaining == 0) {
+        return 0;
+    }
+
+    long count = fatGetChain(vol, entry->first_cluster, &clusters);
+    if (count < 0 || (uint64_t)count * vol->cluster_size < remaining) {
+        printf("Cluster chain of '%s' is shorter than its size.\n", entry->name);
+        free(clusters);
+        return -1;
+    }
+
+    int result = 0;
+    for (long i = 0; i < count && remaining > 0 && result == 0;) {
+        long run = 1;
+        while (i + run < count && clusters[i + run] == clusters[i] + run) {
+            run++;
+        }
+        uint64_t len = (uint64_t)run * vol->cluster_size;
+        if (len > remaining) {
+            len = remaining;
+        }
+        result = fatCopyRange(vol, fatClusterOffset(vol, clusters[i]), len, out_fd);
+        remaining -= len;
+        i += run;
+    }
+    free(clusters);
+    return result;
+}
+
+// Function to extract one file from the image to a host path, keeping its modification time
+static int fatGetFile(FatVolume *vol, const FatEntry *entry, const char *host_path, FatPutStats *stats) {
+    int out_fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        printf("Failed to create '%s': %s\n", host_path, strerror(errno));
+        return -1;
+    }
+    int result = fatCopyOut(vol, entry, out_fd);
+    if (result == 0) {
+        struct timespec times[2];
+        times[0].tv_sec = times[1].tv_sec = unixTimeFromDos(entry->time, entry->date);
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        futimens(out_fd, times);
+        stats->files++;
+        stats->bytes += entry->size;
+    }
+    if (close(out_fd) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+// Function to recursively extract a directory of the image into a host directory
+static int fatGetTree(FatVolume *vol, uint32_t first_cluster, const char *host_dir, FatPutStats *stats) {
+    if (mkdir(host_dir, 0755) != 0 && errno != EEXIST) {
+        printf("Failed to create '%s': %s\n", host_dir, strerror(errno));
+        return -1;
+    }
+
+    FatDir dir;
+    if (fatLoadDir(vol, first_cluster, &dir) != 0) {
+        return -1;
+    }
+    stats->directories++;
+
+    int result = 0;
+    size_t pos = 0;
+    FatEntry entry;
+    while (result == 0 && fatNextEntry(&dir, &pos, &entry)) {
+        char host_path[4096];
+        if (strchr(entry.name, '/') != NULL) {
+            continue;
+        }
+        snprintf(host_path, sizeof(host_path), "%s/%s", host_dir, entry.name);
+        if (entry.attr & FAT_ATTR_DIRECTORY) {
+            result = fatGetTree(vol, entry.first_cluster ? entry.first_cluster : vol->root_cluster, host_path, stats);
+        } else {
+            result = fatGetFile(vol, &entry, host_path, stats);
+        }
+    }
+    fatFreeDir(&dir);
+    return result;
+}
+
+// Function to copy a file or directory tree out of an image without mounting it
+int getFromImage(const char *image_path, const char *image_file, const char *host_path) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    FatVolume vol;
+    FatEntry entry;
+    if (fatOpen(&vol, image_path, 0) != 0) {
+        return -1;
+    }
+    if (fatMapImage(&vol) != 0 || fatLookupPath(&vol, image_file, &entry) != 0) {
+        int saved = errno;
+        fatClose(&vol);
+        errno = saved;
+        return -1;
+    }
+
+    // Default destination is the entry's own name in the current directory, existing directories receive it
+    char target[4096];
+    const char *name = strcmp(entry.name, "/") == 0 ? "." : entry.name;
+    struct stat st;
+    if (host_path == NULL) {
+        snprintf(target, sizeof(target), "%s", name);
+    } else if (stat(host_path, &st) == 0 && S_ISDIR(st.st_mode) && strcmp(name, ".") != 0) {
+        snprintf(target, sizeof(target), "%s/%s", host_path, name);
+    } else {
+        snprintf(target, sizeof(target), "%s", host_path);
+    }
+
+    FatPutStats stats = {0};
+    int result;
+    if (strcmp(target, "-") == 0 && !(entry.attr & FAT_ATTR_DIRECTORY)) {
+        result = fatCopyOut(&vol, &entry, STDOUT_FILENO);
+        fatClose(&vol);
+        return result;
+    }
+    if (entry.attr & FAT_ATTR_DIRECTORY) {
+        result = fatGetTree(&vol, entry.first_cluster, target, &stats);
+    } else {
+        result = fatGetFile(&vol, &entry, target, &stats);
+    }
+    fatClose(&vol);
+
+    if (result == 0) {
+        printf("Extracted %lu files (%.2f MB) from '%s' in %.1f ms.\n", stats.files, stats.bytes / (1024.0 * 1024.0),
+               image_path, elapsedMs(&start));
+    }
+    return result;
+}
+
+// Function to print the entries of one directory of the image, descending into subdirectories when recursive
+static int fatListDir(FatVolume *vol, uint32_t first_cluster, const char *prefix, int recursive) {
+    FatDir dir;
+    if (fatLoadDir(vol, first_cluster, &dir) != 0) {
+        return -1;
+    }
+
+    int result = 0;
+    size_t pos = 0;
+    FatEntry entry;
+    while (result == 0 && fatNextEntry(&dir, &pos, &entry)) {
+        int is_dir = (entry.attr & FAT_ATTR_DIRECTORY) != 0;
+        time_t mtime = unixTimeFromDos(entry.time, entry.date);
+        struct tm tm_buf;
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime_r(&mtime, &tm_buf));
+        printf("%s %12u  %s%s%s\n", when, is_dir ? 0 : entry.size, prefix, entry.name, is_dir ? "/" : "");
+
+        if (recursive && is_dir) {
+            char child_prefix[4096];
+            snprintf(child_prefix, sizeof(child_prefix), "%s%s/", prefix, entry.name);
+            result = fatListDir(vol, entry.first_cluster ? entry.first_cluster : vol->root_cluster, child_prefix, 1);
+        }
+    }
+    fatFreeDir(&dir);
+    return result;
+}
+
+// Function to list a directory (or a single file) inside an image without mounting it
+int listImage(const char *image_path, const char *image_dir, int recursive) {
+    FatVolume vol;
+    FatEntry entry;
+    if (fatOpen(&vol, image_path, 0) != 0) {
+        return -1;
+    }
+    int result = fatLookupPath(&vol, image_dir, &entry);
+    if (result == 0) {
+        if (entry.attr & FAT_ATTR_DIRECTORY) {
+            result = fatListDir(&vol, entry.first_cluster, "", recursive);
+        } else {
+            time_t mtime = unixTimeFromDos(entry.time, entry.date);
+            struct tm tm_buf;
+            char when[32];
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime_r(&mtime, &tm_buf));
+            printf("%s %12u  %s\n", when, entry.size, entry.name);
+        }
+    }
+    int saved = errno;
+    fatClose(&vol);
+    errno = saved;
+    return result;
+}
+
+// Function to deallocate a byte range of a raw image so it no longer takes space on the host
+static int punchHole(int fd, uint64_t offset, uint64_t len) {
+#if defined(__linux__)
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)len);
+#elif defined(F_PUNCHHOLE)
+    fpunchhole_t hole = {0, 0, (off_t)offset, (off_t)len};
+    return fcntl(fd, F_PUNCHHOLE, &hole);
+#else
+    (void)fd;
+    (void)offset;
+    (void)len;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+// Function to give the clusters the FAT marks free back to the host: holes in raw images, released L2 entries
+// and refcounts in QCOW2 images. Only whole host blocks (raw) or whole QCOW2 clusters inside a free run are
+// released, reclaimed receives the bytes the image file shrank by on disk.
+int trimImage(const char *image_path, uint64_t *reclaimed) {
+    FatVolume vol;
+    struct stat before, after;
+    *reclaimed = 0;
+    int lock_fd = lockImageForWriting(image_path);
+    if (lock_fd < 0) {
+        return -1;
+    }
+    if (fatOpen(&vol, image_path, 1) != 0) {
+        close(lock_fd);
+        return -1;
+    }
+    fstat(vol.image->fd, &before);
+    uint64_t align = vol.image->format == IMAGE_FORMAT_QCOW2 ? vol.image->cluster_size
+                                                             : (uint64_t)(before.st_blksize > 0 ? before.st_blksize : 4096);
+
+    int result = 0;
+    uint32_t last = vol.cluster_count + 2;
+    uint64_t runs = 0;
+    for (uint32_t cluster = 2; cluster < last && result == 0;) {
+        if (fatGetEntry(&vol, cluster) != 0) {
+            cluster++;
+            continue;
+        }
+        uint32_t end = cluster;
+        while (end < last && fatGetEntry(&vol, end) == 0) {
+            end++;
+        }
+        uint64_t start = (fatClusterOffset(&vol, cluster) + align - 1) / align * align;
+        uint64_t stop = fatClusterOffset(&vol, end) / align * align;
+        if (start < stop) {
+            if (vol.image->format == IMAGE_FORMAT_QCOW2) {
+                result = imageZero(vol.image, start, stop - start);
+            } else if (punchHole(vol.image->fd, start, stop - start) != 0) {
+                printf("Failed to punch holes into '%s': %s\n", image_path, strerror(errno));
+                result = -1;
+            }
+            runs++;
+        }
+        cluster = end;
+    }
+
+    if (fatClose(&vol) != 0) {
+        result = -1;
+    }
+    close(lock_fd);
+    if (result == 0 && stat(image_path, &after) == 0 && after.st_blocks < before.st_blocks) {
+        *reclaimed = (uint64_t)(before.st_blocks - after.st_blocks) * 512;
+    }
+    if (result == 0) {
+        printf("Trimmed %llu free ranges of '%s', %.2f MB reclaimed.\n", (unsigned long long)runs, image_path,
+               *reclaimed / (1024.0 * 1024.0));
+    }
+    return result;
+}
+
+// Function to copy a byte range between two files at the same offset, in-kernel when possible
+static int copyFileRange(int src_fd, int dst_fd, uint64_t offset, uint64_t len, IoEngine *io) {
+#ifdef __linux__
+    while (len > 0) {
+        loff_t in_offset = (loff_t)offset, out_offset = (loff_t)offset;
+        ssize_t copied = copy_file_range(src_fd, &in_offset, dst_fd, &out_offset, len, 0);
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied <= 0) {
+            break;  // Unsupported here, finish with plain reads and writes
+        }
+        countWritten((uint64_t)copied);
+        offset += copied;
+        len -= copied;
+    }
+#endif
+    // Reads go straight into the engine buffers, the writes of earlier chunks overlap them
+    if (len > 0 && !io->active && ioEngineOpen(io, dst_fd, 1, len) != 0) {
+        return -1;
+    }
+    while (len > 0) {
+        size_t chunk = len < IO_ENGINE_BLOCK ? (size_t)len : IO_ENGINE_BLOCK;
+        uint8_t *buf = ioEngineBuffer(io);
+        if (readAll(src_fd, buf, chunk, offset) != 0 || ioEngineSubmit(io, buf, chunk, offset) != 0) {
+            return -1;
+        }
+        offset += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Function to copy only the data extents of a file, holes stay holes in the copy, returns the bytes copied or -1
+static int64_t copySparseFile(int src_fd, int dst_fd, uint64_t size) {
+    IoEngine io;
+    io.active = 0;
+    uint64_t copied = 0;
+    int result = ftruncate(dst_fd, (off_t)size);
+    for (uint64_t position = 0; result == 0 && position < size;) {
+        uint64_t start = position, end = size;
+#ifdef SEEK_DATA
+        off_t data = lseek(src_fd, (off_t)position, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) {
+            break;  // Only a hole remains
+        }
+        if (data >= 0) {
+            off_t hole = lseek(src_fd, data, SEEK_HOLE);
+            start = (uint64_t)data;
+            end = hole > data ? (uint64_t)hole : size;
+        }
+#endif
+        result = copyFileRange(src_fd, dst_fd, start, end - start, &io);
+        copied += end - start;
+        position = end;
+    }
+    if (ioEngineClose(&io) != 0) {
+        result = -1;
+    }
+    return result == 0 ? (int64_t)copied : -1;
+}
+
+// Function to give a cloned GPT disk its own disk GUID and a new unique GUID for the partition holding the volume,
+// in both copies of the table. Images without a GPT are left alone.
+static int gptRenewGuids(FatVolume *vol) {
+    uint8_t mbr[FAT_SECTOR_SIZE];
+    if (imageRead(vol->image, mbr, sizeof(mbr), 0) != 0 || mbr[MBR_PARTITION_TABLE + 4] != MBR_TYPE_PROTECTIVE) {
+        return 0;
+    }
+    uint8_t disk_guid[16], partition_guid[16];
+    randomGuid(disk_guid);
+    randomGuid(partition_guid);
+    uint64_t lbas[2] = {1, vol->image->size / FAT_SECTOR_SIZE - 1};
+    int result = 0;
+    for (int copy = 0; copy < 2 && result == 0; copy++) {
+        uint8_t header[FAT_SECTOR_SIZE];
+        uint8_t *entries;
+        size_t entries_bytes;
+        if (gptReadHeader(vol->image, lbas[copy], header, &entries, &entries_bytes) != 0) {
+            continue;  // A damaged copy is left for partitioning tools to repair from the other one
+        }
+        uint32_t entry_size = getLE32(header + 84);
+        for (size_t pos = 0; pos + entry_size <= entries_bytes; pos += entry_size) {
+            if (getLE64(entries + pos + 32) * FAT_SECTOR_SIZE == vol->offset) {
+                memcpy(entries + pos + 16, partition_guid, 16);
+            }
+        }
+        memcpy(header + 56, disk_guid, 16);
+        putLE32(header + 88, (uint32_t)crc32(0, entries, entries_bytes));
+        putLE32(header + 16, 0);
+        putLE32(header + 16, (uint32_t)crc32(0, header, getLE32(header + 12)));
+        result = fatWriteMeta(vol, entries, entries_bytes, getLE64(header + 72) * FAT_SECTOR_SIZE);
+        if (result == 0) {
+            result = fatWriteMeta(vol, header, sizeof(header), lbas[copy] * FAT_SECTOR_SIZE);
+        }
+        free(entries);
+    }
+    return result;
+}
+
+// Function to give a clone its own volume serial and, when requested, its own label, in the boot sectors and root
+static int patchCloneIdentity(const char *image_path, const char *label, uint32_t volume_id) {
+    FatVolume vol;
+    FatDir root;
+    if (fatOpen(&vol, image_path, 1) != 0) {
+        return -1;
+    }
+
+    // The boot sector and its backup carry the serial and label in the extended BPB
+    uint8_t boot[FAT_SECTOR_SIZE];
+    uint8_t label_field[11];
+    int result = imageRead(vol.image, boot, sizeof(boot), vol.offset);
+    if (result == 0 && boot[66] != 0x29) {
+        printf("'%s' has no extended boot signature, its serial cannot be patched.\n", image_path);
+        result = -1;
+    }
+    if (result == 0) {
+        memcpy(label_field, boot + 71, sizeof(label_field));
+        if (label != NULL) {
+            Fat32Layout named;
+            setFat32Label(&named, label);
+            memcpy(label_field, named.label, sizeof(label_field));
+        }
+        putLE32(boot + 67, volume_id);
+        memcpy(boot + 71, label_field, sizeof(label_field));
+        uint16_t backup = getLE16(boot + 50);
+        result = fatWriteMeta(&vol, boot, sizeof(boot), vol.offset);
+        if (result == 0 && backup != 0 && backup != 0xFFFF && backup < vol.reserved_sectors) {
+            uint8_t copy[FAT_SECTOR_SIZE];
+            uint64_t backup_offset = vol.offset + (uint64_t)backup * vol.bytes_per_sector;
+            if (imageRead(vol.image, copy, sizeof(copy), backup_offset) == 0 && copy[510] == 0x55 && copy[511] == 0xAA) {
+                putLE32(copy + 67, volume_id);
+                memcpy(copy + 71, label_field, sizeof(label_field));
+                result = fatWriteMeta(&vol, copy, sizeof(copy), backup_offset);
+            }
+        }
+    }
+    if (result == 0) {
+        result = gptRenewGuids(&vol);
+    }
+
+    // Operating systems show the label entry of the root directory, so it is renamed (or added) as well
+    if (result == 0 && label != NULL && (result = fatLoadDir(&vol, vol.root_cluster, &root)) == 0) {
+        long found = -1;
+        for (size_t pos = 0; pos + FAT_DIR_ENTRY_SIZE <= root.size && root.data[pos] != 0x00; pos += FAT_DIR_ENTRY_SIZE) {
+            uint8_t attr = root.data[pos + 11];
+            if (root.data[pos] != FAT_ENTRY_DELETED && attr != FAT_ATTR_LFN && (attr & FAT_ATTR_VOLUME)) {
+                found = (long)pos;
+                break;
+            }
+        }
+        if (found < 0 && memcmp(label_field, "NO NAME    ", sizeof(label_field)) != 0) {
+            found = fatReserveSlots(&vol, &root, 1);
+            if (found >= 0) {
+                memset(root.data + found, 0, FAT_DIR_ENTRY_SIZE);
+                fatFillShortEntry(root.data + found, FAT_ATTR_VOLUME, 0, 0, time(NULL));
+            }
+        }
+        if (found >= 0) {
+            memcpy(root.data + found, label_field, sizeof(label_field));
+            root.dirty = 1;
+        }
+        result = fatStoreDir(&vol, &root);
+        fatFreeDir(&root);
+    }
+
+    if (fatClose(&vol) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+// Function to make a new volume serial, distinct for every clone made in the same microsecond
+static uint32_t newVolumeId(void) {
+    static uint32_t sequence;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint32_t)(((uint64_t)now.tv_sec << 20) | now.tv_usec) + 0x9E3779B1u * ++sequence;
+}
+
+// Function to clone a golden image, sharing its blocks by reflink when the filesystem can, then patch its identity
+int cloneImage(const char *template_path, const char *clone_path, const char *label) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int src_fd = open(template_path, O_RDONLY);
+    struct stat st;
+    if (src_fd < 0 || fstat(src_fd, &st) != 0) {
+        printf("Failed to open '%s': %s\n", template_path, strerror(errno));
+        if (src_fd >= 0) {
+            close(src_fd);
+        }
+        return -1;
+    }
+
+    const char *method = NULL;
+    int64_t copied = 0;
+    int dst_fd = -1;
+#ifdef __APPLE__
+    // APFS clones share every block until it is written, like FICLONE on Linux
+    if (clonefile(template_path, clone_path, 0) == 0) {
+        method = "cloned";
+        dst_fd = open(clone_path, O_RDWR);
+    } else if (errno == EEXIST) {
+        printf("Failed to create '%s': %s\n", clone_path, strerror(errno));
+        close(src_fd);
+        return -1;
+    }
+#endif
+    if (dst_fd < 0 && method == NULL) {
+        dst_fd = open(clone_path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    }
+    if (dst_fd < 0) {
+        printf("Failed to create '%s': %s\n", clone_path, strerror(errno));
+        close(src_fd);
+        return -1;
+    }
+
+    // Nothing else may write to the clone before it has its own identity
+    int lock_fd = lockImageForWriting(clone_path);
+    if (lock_fd < 0) {
+        close(dst_fd);
+        close(src_fd);
+        unlink(clone_path);
+        return -1;
+    }
+#ifdef FICLONE
+    if (method == NULL && ioctl(dst_fd, FICLONE, src_fd) == 0) {
+        method = "reflinked";
+    }
+#endif
+    if (method == NULL) {
+        method = "copied";
+        copied = copySparseFile(src_fd, dst_fd, (uint64_t)st.st_size);
+    }
+    int result = copied < 0 || fsync(dst_fd) != 0 ? -1 : 0;
+    close(dst_fd);
+    close(src_fd);
+    if (result != 0) {
+        printf("Failed to copy '%s' to '%s': %s\n", template_path, clone_path, strerror(errno));
+        unlink(clone_path);
+        close(lock_fd);
+        return -1;
+    }
+
+    // Only the boot sectors and the label entry differ from the golden image
+    uint32_t volume_id = newVolumeId();
+    result = patchCloneIdentity(clone_path, label, volume_id);
+    if (result != 0) {
+        unlink(clone_path);
+    }
+    close(lock_fd);
+    if (result != 0) {
+        return -1;
+    }
+
+    if (copied > 0) {
+        printf("Cloned '%s' to '%s' (%s %.2f MB, holes kept, serial %04X-%04X) in %.1f ms.\n", template_path, clone_path,
+               method, copied / (1024.0 * 1024.0), volume_id >> 16, volume_id & 0xFFFF, elapsedMs(&start));
+    } else {
+        printf("Cloned '%s' to '%s' (%s, serial %04X-%04X) in %.1f ms.\n", template_path, clone_path, method,
+               volume_id >> 16, volume_id & 0xFFFF, elapsedMs(&start));
+    }
+    return 0;
+}
+
+// One image of a batch manifest
+typedef struct {
+    int line;
+    char path[512];
+    ImageFormat format;
+    ImageAllocPolicy policy;
+    uint64_t size;
+    char label[12];
+    char source[4096];            // Empty when the image is only formatted
+    int result;
+    uint64_t allocated;           // Bytes the finished image occupies on disk
+} BatchJob;
+
+// Work queue shared by the batch workers
+typedef struct {
+    BatchJob *jobs;
+    size_t count;
+    size_t next;
+    pthread_mutex_t lock;
+} BatchQueue;
+
+// Function to parse one manifest line "name format size label [srcdir]", returns 1 for a job, 0 to skip, -1 on error
+static int parseManifestLine(char *line, int line_number, BatchJob *job) {
+    char *fields[6];
+    int count = 0;
+    char *hash = strchr(line, '#');
+    if (hash != NULL) {
+        *hash = '\0';
+    }
+    for (char *save = NULL, *field = strtok_r(line, " \t\r\n", &save); field != NULL && count < 6;
+         field = strtok_r(NULL, " \t\r\n", &save)) {
+        fields[count++] = field;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    if (count < 4 || count > 5) {
+        printf("Manifest line %d: expected 'name format size label [srcdir]'.\n", line_number);
+        return -1;
+    }
+
+    memset(job, 0, sizeof(*job));
+    job->line = line_number;
+    job->policy = IMAGE_ALLOC_SPARSE;
+    char *policy = strchr(fields[1], ':');
+    if (policy != NULL) {
+        *policy++ = '\0';
+    }
+    if (strcmp(fields[1], "qcow2") == 0 && policy == NULL) {
+        job->format = IMAGE_FORMAT_QCOW2;
+    } else if (strcmp(fields[1], "raw") == 0 && (policy == NULL || parseAllocPolicy(policy) >= 0)) {
+        job->format = IMAGE_FORMAT_RAW;
+        job->policy = policy ? (ImageAllocPolicy)parseAllocPolicy(policy) : IMAGE_ALLOC_SPARSE;
+    } else {
+        printf("Manifest line %d: format must be raw, raw:sparse, raw:falloc, raw:zero or qcow2.\n", line_number);
+        return -1;
+    }
+    if ((job->size = parseSize(fields[2])) == 0) {
+        printf("Manifest line %d: invalid size '%s'.\n", line_number, fields[2]);
+        return -1;
+    }
+
+    // Bare names land in images/ like the menu creates them, anything with a slash is used as given
+    if (strchr(fields[0], '/') != NULL) {
+        snprintf(job->path, sizeof(job->path), "%s", fields[0]);
+    } else {
+        snprintf(job->path, sizeof(job->path), "images/%s.%s", fields[0],
+                 job->format == IMAGE_FORMAT_QCOW2 ? "qcow2" : "img");
+    }
+    if (strcmp(fields[3], "-") != 0) {
+        snprintf(job->label, sizeof(job->label), "%s", fields[3]);
+        for (char *c = job->label; *c; c++) {
+            *c = toupper((unsigned char)*c);
+        }
+    }
+    if (count == 5) {
+        snprintf(job->source, sizeof(job->source), "%s", fields[4]);
+    }
+    return 1;
+}
+
+// Function to load every job of a manifest, returns the number of jobs or -1 when any line is invalid
+static long loadManifest(const char *manifest_path, BatchJob **jobs) {
+    FILE *manifest = fopen(manifest_path, "r");
+    if (manifest == NULL) {
+        printf("Failed to open '%s': %s\n", manifest_path, strerror(errno));
+        return -1;
+    }
+
+    size_t count = 0, capacity = 0;
+    BatchJob *list = NULL;
+    char line[8192];
+    int line_number = 0, failed = 0;
+    while (fgets(line, sizeof(line), manifest) != NULL) {
+        BatchJob job;
+        int parsed = parseManifestLine(line, ++line_number, &job);
+        if (parsed < 0) {
+            failed = 1;
+        }
+        if (parsed <= 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            BatchJob *grown = realloc(list, capacity * sizeof(BatchJob));
+            if (grown == NULL) {
+                failed = 1;
+                break;
+            }
+            list = grown;
+        }
+        list[count++] = job;
+    }
+    fclose(manifest);
+
+    if (failed) {
+        free(list);
+        return -1;
+    }
+    *jobs = list;
+    return (long)count;
+}
+
+// Function to create, format and populate one image of the batch, a failed image is removed again
+static int provisionImage(BatchJob *job) {
+    const char *label = job->label[0] ? job->label : NULL;
+    int result;
+    if (job->format == IMAGE_FORMAT_QCOW2) {
+        result = createQcow2Image(job->path, job->size, label, IMAGE_LAYOUT_GPT);
+    } else {
+        result = createRawImage(job->path, job->size, job->policy);
+    }
+    if (result != 0) {
+        return -1;  // Creation cleans up after itself and never replaces an existing image
+    }
+    if (job->format == IMAGE_FORMAT_RAW) {
+        result = formatFat32Image(job->path, label, IMAGE_LAYOUT_GPT);
+    }
+    if (result == 0 && job->source[0] != '\0') {
+        result = putIntoImage(job->path, job->source, "/");
+    }
+
+    struct stat st;
+    if (result != 0) {
+        unlink(job->path);
+    } else if (stat(job->path, &st) == 0) {
+        job->allocated = (uint64_t)st.st_blocks * 512;
+    }
+    return result;
+}
+
+// Function run by each batch worker, taking jobs off the shared queue until it is empty
+static void *batchWorker(void *arg) {
+    BatchQueue *queue = arg;
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        size_t index = queue->next < queue->count ? queue->next++ : queue->count;
+        pthread_mutex_unlock(&queue->lock);
+        if (index == queue->count) {
+            return NULL;
+        }
+        BatchJob *job = &queue->jobs[index];
+        job->result = provisionImage(job);
+        if (job->result != 0) {
+            printf("Manifest line %d: failed to provision '%s'.\n", job->line, job->path);
+        }
+    }
+}
+
+// Function to provision every image of a manifest with a pool of workers, one per core unless given
+int runBatch(const char *manifest_path, int workers) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    BatchJob *jobs = NULL;
+    long count = loadManifest(manifest_path, &jobs);
+    if (count < 0) {
+        return -1;
+    }
+    if (count == 0) {
+        printf("'%s' lists no images.\n", manifest_path);
+        free(jobs);
+        return 0;
+    }
+    for (long i = 0; i < count; i++) {
+        if (strncmp(jobs[i].path, "images/", 7) == 0 && mkdir("images", 0755) != 0 && errno != EEXIST) {
+            printf("Failed to create the 'images' subfolder: %s\n", strerror(errno));
+            free(jobs);
+            return -1;
+        }
+    }
+
+    if (workers <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cores > 0 ? (int)cores : 1;
+    }
+    if (workers > count) {
+        workers = (int)count;
+    }
+
+    uint64_t written_before = __atomic_load_n(&written_bytes, __ATOMIC_RELAXED);
+    BatchQueue queue = {jobs, (size_t)count, 0, PTHREAD_MUTEX_INITIALIZER};
+    pthread_t *threads = malloc((size_t)workers * sizeof(pthread_t));
+    int started = 0;
+    while (threads != NULL && started < workers && pthread_create(&threads[started], NULL, batchWorker, &queue) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        batchWorker(&queue);  // No threads available, provision serially on this one
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    long done = 0;
+    uint64_t virtual_bytes = 0, allocated_bytes = 0;
+    uint64_t written = __atomic_load_n(&written_bytes, __ATOMIC_RELAXED) - written_before;
+    for (long i = 0; i < count; i++) {
+        if (jobs[i].result == 0) {
+            done++;
+            virtual_bytes += jobs[i].size;
+            allocated_bytes += jobs[i].allocated;
+        }
+    }
+    free(jobs);
+
+    // Preallocated and sparse space is on disk without having been written, only real writes count for MB/s
+    double seconds = elapsedMs(&start) / 1000.0;
+    printf("Provisioned %ld of %ld images (%.2f GB virtual, %.2f MB on disk, %.2f MB written) in %.2f s with %d "
+           "workers: %.1f images/s, %.1f MB/s written.\n", done, count, virtual_bytes / (1024.0 * 1024.0 * 1024.0),
+           allocated_bytes / (1024.0 * 1024.0), written / (1024.0 * 1024.0), seconds, started ? started : 1,
+           done / seconds, written / (1024.0 * 1024.0) / seconds);
+    return done == count ? 0 : -1;
+}
+
+// External tools are started with posix_spawn and an argv array, never through /bin/sh
+#define PROCESS_TIMEOUT_MS (60 * 1000)  // Default limit for one external step
+#define PROCESS_KILL_GRACE_MS 2000      // Between SIGTERM and SIGKILL for a program that ran out of time
+#define PROCESS_EXEC_MAX 16             // Executables remembered by findExecutable()
+
+extern char **environ;
+
+// An executable looked up in PATH, path is empty when it was not found
+typedef struct {
+    char name[64];
+    char path[4096];
+} ExecutableCacheEntry;
+
+static ExecutableCacheEntry executable_cache[PROCESS_EXEC_MAX];
+static int executable_cache_count;
+
+// Function to find an executable by scanning PATH in-process, each name is resolved once per run.
+// Returns the full path or NULL when it is not installed.
+const char *findExecutable(const char *name) {
+    if (strchr(name, '/') != NULL) {
+        return access(name, X_OK) == 0 ? name : NULL;
+    }
+    for (int i = 0; i < executable_cache_count; i++) {
+        if (strcmp(executable_cache[i].name, name) == 0) {
+            return executable_cache[i].path[0] ? executable_cache[i].path : NULL;
+        }
+    }
+
+    char found[4096] = "";
+    const char *search = getenv("PATH");
+    if (search == NULL) {
+        search = "/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin";
+    }
+    while (found[0] == '\0' && *search != '\0') {
+        size_t len = strcspn(search, ":");
+        struct stat st;
+        snprintf(found, sizeof(found), "%.*s/%s", len ? (int)len : 1, len ? search : ".", name);
+        if (stat(found, &st) != 0 || !S_ISREG(st.st_mode) || access(found, X_OK) != 0) {
+            found[0] = '\0';
+        }
+        search += len + (search[len] == ':');
+    }
+
+    if (executable_cache_count == PROCESS_EXEC_MAX) {
+        executable_cache_count = 0;  // Forget everything rather than growing, the list is tiny
+    }
+    ExecutableCacheEntry *entry = &executable_cache[executable_cache_count++];
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    snprintf(entry->path, sizeof(entry->path), "%s", found);
+    return entry->path[0] ? entry->path : NULL;
+}
+
+// Function to check if an executable file exists in PATH
+int isExecutableAvailable(const char *executable) {
+    return findExecutable(executable) != NULL;
+}
+
+// Function to get a descriptor that becomes readable once a process exits, a pidfd on Linux and a kqueue on macOS.
+// Returns -1 when the kernel offers neither, the caller then has to poll.
+static int processExitFd(pid_t pid) {
+#if defined(__linux__)
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434  // The same number on every architecture, older headers lack it
+#endif
+    return (int)syscall(SYS_pidfd_open, pid, 0);  // Close-on-exec already
+#elif defined(__APPLE__)
+    int fd = kqueue();
+    if (fd < 0) {
+        return -1;
+    }
+    struct kevent change;
+    EV_SET(&change, pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, NULL);
+    if (kevent(fd, &change, 1, NULL, 0, NULL) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+// Function to run a program without a shell. With privileged set it runs through sudo unless we already are root.
+// When output is given, stdout and stderr of the program are captured into it (truncated, NUL-terminated),
+// otherwise they are passed through. Once timeout_ms (0 for none) has passed the program and whatever it started
+// get SIGTERM, which sudo passes on, and SIGKILL when they are still there PROCESS_KILL_GRACE_MS later.
+// Returns the exit status, 128 + the signal when it was killed, or -1 when it could not be started.
+int runProcess(const char *const argv[], int privileged, int timeout_ms, char *output, size_t output_size) {
+    const char *spawn_argv[64];
+    int argc = 0;
+    if (output != NULL && output_size > 0) {
+        output[0] = '\0';
+    }
+    if (privileged && geteuid() != 0) {
+        spawn_argv[argc++] = "sudo";
+    }
+    for (int i = 0; argv[i] != NULL && argc < 63; i++) {
+        spawn_argv[argc++] = argv[i];
+    }
+    spawn_argv[argc] = NULL;
+
+    const char *program = findExecutable(spawn_argv[0]);
+    if (program == NULL) {
+        printf("'%s' was not found in PATH.\n", spawn_argv[0]);
+        return -1;
+    }
+
+    int pipe_fds[2] = {-1, -1};
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (output != NULL) {
+        if (pipe(pipe_fds) != 0) {
+            posix_spawn_file_actions_destroy(&actions);
+            return -1;
+        }
+        fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC);
+        posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDERR_FILENO);
+        posix_spawn_file_actions_addclose(&actions, pipe_fds[1]);
+    }
+
+    // Without a terminal the program gets a process group of its own, so a timeout reaches its children too. On a
+    // terminal it stays in the foreground group, where Ctrl-C reaches it and sudo can ask for a password.
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    int own_group = !isatty(STDIN_FILENO);
+    if (own_group) {
+        posix_spawnattr_setpgroup(&attributes, 0);
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+    }
+
+    fflush(stdout);  // Buffered messages have to come out before the program's own
+    TraceMark mark = traceBegin();
+    pid_t pid;
+    int result = posix_spawn(&pid, program, &actions, &attributes, (char *const *)spawn_argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    if (output != NULL) {
+        close(pipe_fds[1]);
+    }
+    if (result != 0) {
+        printf("Failed to start '%s': %s\n", spawn_argv[0], strerror(result));
+        if (output != NULL) {
+            close(pipe_fds[0]);
+        }
+        return -1;
+    }
+
+    // Collect output until the program exits, a daemon it leaves behind may keep the pipe open. The wait blocks
+    // on the output and the exit itself, only kernels without pidfds fall back to checking every 10 ms.
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int exit_fd = processExitFd(pid);
+    pid_t target = own_group ? -pid : pid;
+    size_t used = 0;
+    int status = -1, stopping = 0;
+    double deadline = timeout_ms;
+    for (;;) {
+        int reading = output != NULL && pipe_fds[0] >= 0;
+        int block = timeout_ms <= 0 && !reading;
+        pid_t waited = waitpid(pid, &status, block ? 0 : WNOHANG);
+        if (waited == pid || (waited < 0 && errno != EINTR)) {
+            break;
+        }
+        int wait_ms = -1;
+        if (timeout_ms > 0) {
+            double left = deadline - elapsedMs(&start);
+            if (left <= 0 && !stopping) {
+                printf("'%s' did not finish within %d s, stopping it.\n", spawn_argv[0], timeout_ms / 1000);
+                kill(target, SIGTERM);
+                stopping = 1;
+                deadline += PROCESS_KILL_GRACE_MS;
+                continue;
+            }
+            if (left <= 0) {
+                kill(target, SIGKILL);
+                timeout_ms = 0;
+                continue;
+            }
+            wait_ms = (int)left + 1;
+        }
+        if (exit_fd < 0 && (wait_ms < 0 || wait_ms > 10)) {
+            wait_ms = 10;
+        }
+        struct pollfd pfds[2];
+        nfds_t count = 0;
+        if (exit_fd >= 0) {
+            pfds[count++] = (struct pollfd){exit_fd, POLLIN, 0};
+        }
+        if (reading) {
+            pfds[count++] = (struct pollfd){pipe_fds[0], POLLIN, 0};
+        }
+        if (poll(pfds, count, wait_ms) > 0 && reading && pfds[count - 1].revents != 0) {
+            char chunk[4096];
+            ssize_t got = read(pipe_fds[0], chunk, sizeof(chunk));
+            if (got <= 0) {
+                close(pipe_fds[0]);
+                pipe_fds[0] = -1;
+            } else if (used + 1 < output_size) {
+                size_t keep = (size_t)got < output_size - 1 - used ? (size_t)got : output_size - 1 - used;
+                memcpy(output + used, chunk, keep);
+                used += keep;
+                output[used] = '\0';
+            }
+        }
+    }
+    if (exit_fd >= 0) {
+        close(exit_fd);
+    }
+    if (output != NULL && pipe_fds[0] >= 0) {
+        // Take what the program wrote before it exited without waiting for its children
+        fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK);
+        ssize_t got;
+        while (used + 1 < output_size && (got = read(pipe_fds[0], output + used, output_size - 1 - used)) > 0) {
+            used += (size_t)got;
+        }
+        output[used] = '\0';
+        close(pipe_fds[0]);
+    }
+    if (trace_enabled) {
+        // The span is named after the program, sudo aside, and its subcommand when it has one ("hdiutil attach"),
+        // the whole command line goes along with it
+        char line[192] = "", name[48];
+        for (int i = 0; spawn_argv[i] != NULL; i++) {
+            size_t at = strlen(line);
+            snprintf(line + at, sizeof(line) - at, "%s%s", i > 0 ? " " : "", spawn_argv[i]);
+        }
+        const char *base = strrchr(argv[0], '/') != NULL ? strrchr(argv[0], '/') + 1 : argv[0];
+        if (argv[1] != NULL && argv[1][0] != '-' && strchr(argv[1], '/') == NULL) {
+            snprintf(name, sizeof(name), "%s %s", base, argv[1]);
+        } else {
+            snprintf(name, sizeof(name), "%s", base);
+        }
+        traceEnd(&mark, "process", name, line);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Function to clear the terminal without starting clear(1)
+void clearScreen(void) {
+    printf("\033[H\033[2J\033[3J");
+    fflush(stdout);
+}
+
+// Exit codes of the command line interface, 0 is success and 1 a failed operation
+#define EXIT_USAGE 2
+#define EXIT_NOT_FOUND 3
+#define EXIT_EXISTS 4
+#define EXIT_NO_SPACE 5
+#define EXIT_DEPENDENCY 6
+
+// Folders the menu and the management commands work in
+#define IMAGES_DIR "images"
+#define MOUNT_POINT "mnt"
+
+// An image found in the images folder
+typedef struct {
+    char name[256];
+    char path[512];
+    ImageFormat format;
+    uint64_t size;                // Guest size in bytes
+    uint64_t allocated;           // Bytes used on the host
+    char label[12];               // FAT volume label, empty when the image has none
+    int64_t created;              // Creation time, filled from the catalog
+    uint64_t hash;                // XXH64 of the content, filled from the catalog
+} ImageInfo;
+
+// Platform specific attach and detach, implemented by DiskProvision.c and DiskProvision_Darwin.c
+// Both return 0 or one of the exit codes above, device receives what was attached or detached
+int mountImage(const char *image_path, const char *mount_point, char *device, size_t device_size);
+int unmountImage(const char *mount_point, char *device, size_t device_size);
+
+// Provisioning benchmark, implemented by DiskProvision_Bench.h
+int runBench(int argc, char *argv[]);
+
+// Unix socket server, implemented by DiskProvision_Daemon.h
+int runDaemon(int argc, char *argv[]);
+
+// Destination of --json output, NULL when the output is meant for humans
+static FILE *json_out;
+static int json_written;
+
+// Function to write a JSON string literal
+static void jsonString(FILE *out, const char *text) {
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(out, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Function to open the JSON result object of a command, the caller adds its fields and closes it with jsonEnd()
+static int jsonBegin(const char *command, int code) {
+    if (json_out == NULL) {
+        return 0;
+    }
+    fprintf(json_out, "{\"command\":");
+    jsonString(json_out, command);
+    fprintf(json_out, ",\"status\":\"%s\",\"exit_code\":%d", code == 0 ? "ok" : "error", code);
+    json_written = 1;
+    return 1;
+}
+
+static void jsonEnd(void) {
+    fprintf(json_out, "}\n");
+}
+
+// Function to write the description of an image as a JSON object
+static void jsonImage(FILE *out, const ImageInfo *info) {
+    fprintf(out, "{\"name\":");
+    jsonString(out, info->name);
+    fprintf(out, ",\"path\":");
+    jsonString(out, info->path);
+    fprintf(out, ",\"format\":\"%s\",\"size\":%llu,\"allocated\":%llu,\"label\":", imageFormatName(info->format),
+            (unsigned long long)info->size, (unsigned long long)info->allocated);
+    jsonString(out, info->label);
+    if (info->created != 0) {
+        fprintf(out, ",\"created\":%lld,\"hash\":\"%016llx\"", (long long)info->created,
+                (unsigned long long)info->hash);
+    }
+    fputc('}', out);
+}
+
+// Function to write the recorded spans as Chrome trace-event JSON, for chrome://tracing or Perfetto
+static int traceWriteChrome(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        printf("Failed to write the trace to '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (size_t i = 0; i < trace_count; i++) {
+        const TraceSpan *span = &trace_spans[i];
+        fprintf(out, "%s\n{\"name\":", i > 0 ? "," : "");
+        jsonString(out, span->name);
+        fprintf(out, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d,\"args\":{\"bytes\":%llu",
+                span->category, (unsigned long long)span->start_us, (unsigned long long)span->duration_us, (int)getpid(),
+                span->thread, (unsigned long long)span->bytes);
+        if (span->detail[0] != '\0') {
+            fprintf(out, ",\"detail\":");
+            jsonString(out, span->detail);
+        }
+        fprintf(out, "}}");
+    }
+    fprintf(out, "\n]}\n");
+    if (fclose(out) != 0) {
+        printf("Failed to write the trace to '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    printf("Trace of %zu spans written to '%s'.\n", trace_count, path);
+    return 0;
+}
+
+// Function to print the recorded spans summed up per category and name, in the order they first appeared
+static void traceSummary(void) {
+    printf("\n%-8s %-20s %6s %11s %11s %12s\n", "Category", "Span", "Count", "Total ms", "Max ms", "Written");
+    for (size_t i = 0; i < trace_count; i++) {
+        const TraceSpan *first = &trace_spans[i];
+        int seen = 0;
+        for (size_t j = 0; j < i && !seen; j++) {
+            seen = trace_spans[j].category == first->category && strcmp(trace_spans[j].name, first->name) == 0;
+        }
+        if (seen) {
+            continue;
+        }
+        unsigned long count = 0;
+        uint64_t total = 0, longest = 0, bytes = 0;
+        for (size_t j = i; j < trace_count; j++) {
+            const TraceSpan *span = &trace_spans[j];
+            if (span->category == first->category && strcmp(span->name, first->name) == 0) {
+                count++;
+                total += span->duration_us;
+                bytes += span->bytes;
+                longest = span->duration_us > longest ? span->duration_us : longest;
+            }
+        }
+        printf("%-8s %-20.20s %6lu %11.3f %11.3f %9.2f MB\n", first->category, first->name, count, total / 1000.0,
+               longest / 1000.0, bytes / (1024.0 * 1024.0));
+    }
+}
+
+// Function to describe an image file: format, virtual size and the space it takes on the host
+int describeImage(const char *image_path, ImageInfo *info) {
+    struct stat st;
+    memset(info, 0, sizeof(*info));
+    if (stat(image_path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    const char *slash = strrchr(image_path, '/');
+    snprintf(info->name, sizeof(info->name), "%s", slash ? slash + 1 : image_path);
+    snprintf(info->path, sizeof(info->path), "%s", image_path);
+    info->allocated = (uint64_t)st.st_blocks * 512;
+    info->size = (uint64_t)st.st_size;
+    info->format = detectImageFormat(image_path) == IMAGE_FORMAT_QCOW2 ? IMAGE_FORMAT_QCOW2 : IMAGE_FORMAT_RAW;
+
+    // The label comes from the extended boot signature of a FAT32 boot sector
+    DiskImage image;
+    uint8_t boot[FAT_SECTOR_SIZE];
+    if (info->format == IMAGE_FORMAT_QCOW2) {
+        info->size = 0;
+    }
+    if (imageOpen(&image, image_path, 0) == 0) {
+        info->size = image.size;
+        uint64_t offset;
+        if (findFatVolume(&image, &offset) >= 0 && imageRead(&image, boot, sizeof(boot), offset) == 0 &&
+            boot[66] == 0x29 && boot[510] == 0x55 && boot[511] == 0xAA) {
+            int len = 11;
+            while (len > 0 && boot[71 + len - 1] == ' ') {
+                len--;
+            }
+            memcpy(info->label, boot + 71, len);
+            if (strcmp(info->label, "NO NAME") == 0) {
+                info->label[0] = '\0';
+            }
+        }
+        imageClose(&image);
+    }
+    return 0;
+}
+
+// Function to check whether a directory entry names a disk image
+static int isImageName(const char *name) {
+    size_t len = strlen(name);
+    return (len > 4 && strcmp(name + len - 4, ".img") == 0) || (len > 6 && strcmp(name + len - 6, ".qcow2") == 0);
+}
+
+// Function to order images by name
+static int compareImageInfo(const void *a, const void *b) {
+    return strcmp(((const ImageInfo *)a)->name, ((const ImageInfo *)b)->name);
+}
+
+// Function to collect the images of a folder sorted by name, returns the count or -1 when the folder cannot be read
+long collectImages(const char *dir_path, ImageInfo **images) {
+    *images = NULL;
+    DIR *dp = opendir(dir_path);
+    if (dp == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    size_t count = 0, capacity = 0;
+    ImageInfo *list = NULL;
+    struct dirent *entry;
+    while ((entry = readdir(dp)) != NULL) {
+        char path[512];
+        if (!isImageName(entry->d_name)) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            ImageInfo *grown = realloc(list, capacity * sizeof(ImageInfo));
+            if (grown == NULL) {
+                break;
+            }
+            list = grown;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+        if (describeImage(path, &list[count]) == 0) {
+            count++;
+        }
+    }
+    closedir(dp);
+
+    qsort(list, count, sizeof(ImageInfo), compareImageInfo);
+    *images = list;
+    return (long)count;
+}
+
+// XXH64 constants, the hash records the content of every image in the catalog
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+// Streaming XXH64 state
+typedef struct {
+    uint64_t v[4];
+    uint64_t total;
+    uint64_t seed;
+    uint8_t mem[32];
+    size_t mem_size;
+} Xxh64State;
+
+static uint64_t xxhRotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxhRound(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    return xxhRotl(acc, 31) * XXH_PRIME64_1;
+}
+
+static uint64_t xxhMerge(uint64_t acc, uint64_t value) {
+    acc ^= xxhRound(0, value);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// Function to start an XXH64 hash
+void xxh64Init(Xxh64State *state, uint64_t seed) {
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = seed + XXH_PRIME64_2;
+    state->v[2] = seed;
+    state->v[3] = seed - XXH_PRIME64_1;
+}
+
+// Function to feed data into an XXH64 hash, 32-byte stripes are consumed as they fill up
+void xxh64Update(Xxh64State *state, const void *data, size_t len) {
+    const uint8_t *p = data;
+    state->total += len;
+    if (state->mem_size + len < 32) {
+        memcpy(state->mem + state->mem_size, p, len);
+        state->mem_size += len;
+        return;
+    }
+    if (state->mem_size > 0) {
+        size_t fill = 32 - state->mem_size;
+        memcpy(state->mem + state->mem_size, p, fill);
+        for (int i = 0; i < 4; i++) {
+            state->v[i] = xxhRound(state->v[i], getLE64(state->mem + i * 8));
+        }
+        p += fill;
+        len -= fill;
+        state->mem_size = 0;
+    }
+    for (; len >= 32; p += 32, len -= 32) {
+        for (int i = 0; i < 4; i++) {
+            state->v[i] = xxhRound(state->v[i], getLE64(p + i * 8));
+        }
+    }
+    memcpy(state->mem, p, len);
+    state->mem_size = len;
+}
+
+// Function to finish an XXH64 hash
+uint64_t xxh64Digest(const Xxh64State *state) {
+    uint64_t h;
+    if (state->total >= 32) {
+        h = xxhRotl(state->v[0], 1) + xxhRotl(state->v[1], 7) + xxhRotl(state->v[2], 12) + xxhRotl(state->v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = xxhMerge(h, state->v[i]);
+        }
+    } else {
+        h = state->seed + XXH_PRIME64_5;
+    }
+    h += state->total;
+
+    const uint8_t *p = state->mem;
+    size_t len = state->mem_size;
+    for (; len >= 8; p += 8, len -= 8) {
+        h ^= xxhRound(0, getLE64(p));
+        h = xxhRotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (len >= 4) {
+        h ^= (uint64_t)getLE32(p) * XXH_PRIME64_1;
+        h = xxhRotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; p++, len--) {
+        h ^= *p * XXH_PRIME64_5;
+        h = xxhRotl(h, 11) * XXH_PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Granularity of the content hash, only blocks holding non-zero bytes are hashed
+#define CONTENT_HASH_BLOCK (64 * 1024)
+
+// Function to visit the non-zero CONTENT_HASH_BLOCK blocks of a file between two block aligned offsets, holes are
+// skipped with SEEK_DATA. The visitor gets each block with its offset, the last block of the file may be short.
+static int scanDataBlocks(int fd, uint64_t from, uint64_t to,
+                          int (*visit)(void *ctx, uint64_t offset, const uint8_t *block, size_t len), void *ctx) {
+    const size_t chunk = 16 * CONTENT_HASH_BLOCK;
+    uint8_t *buf = malloc(chunk);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    uint64_t next = from;  // Everything before this offset has been visited
+    int result = 0;
+    while (next < to && result == 0) {
+        off_t data = (off_t)next, hole = (off_t)to;  // Without SEEK_DATA the rest is treated as data
+#ifdef SEEK_DATA
+        data = lseek(fd, (off_t)next, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) {
+            break;
+        }
+        if (data < 0) {
+            data = (off_t)next;
+        } else if ((hole = lseek(fd, data, SEEK_HOLE)) < 0) {
+            hole = (off_t)to;
+        }
+#endif
+
+        // Whole blocks on a fixed grid, the parts of a block lying in a hole read back as zeros
+        uint64_t start = (uint64_t)data / CONTENT_HASH_BLOCK * CONTENT_HASH_BLOCK;
+        uint64_t end = ((uint64_t)hole + CONTENT_HASH_BLOCK - 1) / CONTENT_HASH_BLOCK * CONTENT_HASH_BLOCK;
+        if (start < next) {
+            start = next;
+        }
+        if (end > to) {
+            end = to;
+        }
+        for (uint64_t offset = start; offset < end && result == 0;) {
+            size_t len = end - offset < chunk ? (size_t)(end - offset) : chunk;
+            if (readAll(fd, buf, len, offset) != 0) {
+                result = -1;
+                break;
+            }
+            for (size_t pos = 0; pos < len && result == 0; pos += CONTENT_HASH_BLOCK) {
+                size_t block = len - pos < CONTENT_HASH_BLOCK ? len - pos : CONTENT_HASH_BLOCK;
+                if (!isZeroBuffer(buf + pos, block)) {
+                    result = visit(ctx, offset + pos, buf + pos, block);
+                }
+            }
+            offset += len;
+        }
+        next = end > next ? end : next + 1;
+    }
+    free(buf);
+    return result;
+}
+
+// Function to add one block and its offset to a content hash
+static int contentHashBlock(void *ctx, uint64_t offset, const uint8_t *block, size_t len) {
+    uint8_t where[8];
+    putLE32(where, (uint32_t)offset);
+    putLE32(where + 4, (uint32_t)(offset >> 32));
+    xxh64Update(ctx, where, sizeof(where));
+    xxh64Update(ctx, block, len);
+    return 0;
+}
+
+// Function to hash the content of an image file, holes and zero blocks are skipped so the result does not
+// depend on how the file happens to be allocated
+int imageContentHash(const char *image_path, uint64_t *hash) {
+    int fd = open(image_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    Xxh64State state;
+    xxh64Init(&state, 0);
+    uint64_t size = (uint64_t)st.st_size;
+    int result = scanDataBlocks(fd, 0, size, contentHashBlock, &state);
+    close(fd);
+
+    uint8_t tail[8];
+    putLE32(tail, (uint32_t)size);
+    putLE32(tail + 4, (uint32_t)(size >> 32));
+    xxh64Update(&state, tail, sizeof(tail));
+    *hash = xxh64Digest(&state);
+    return result;
+}
+
+// Catalog of the images folder: a header followed by fixed-size records sorted by name, mapped into memory.
+// It is a cache, a record is trusted while the image's mtime, size and inode match, and the folder is only
+// rescanned when its own mtime changes. Values are stored in host byte order.
+#define CATALOG_FILE ".catalog"
+#define CATALOG_MAGIC "DPCATLG1"
+#define CATALOG_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t count;
+    int64_t dir_mtime_sec;      // Folder mtime of the last full scan
+    int64_t dir_mtime_nsec;
+    uint8_t reserved[24];
+} CatalogHeader;
+
+typedef struct {
+    char name[256];
+    char label[12];
+    uint32_t format;
+    uint64_t size;
+    uint64_t allocated;
+    uint64_t file_size;
+    uint64_t inode;
+    int64_t created;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t hash;
+    uint8_t reserved[48];
+} CatalogEntry;
+
+// An open, locked and mapped catalog
+typedef struct {
+    int fd;
+    char dir[512];
+    uint8_t *map;
+    size_t map_size;
+    CatalogHeader *header;
+    CatalogEntry *entries;
+    uint64_t capacity;
+} Catalog;
+
+// Function to map the catalog file at its current size, an invalid or foreign file is reset to empty
+static int catalogMap(Catalog *cat) {
+    struct stat st;
+    if (fstat(cat->fd, &st) != 0) {
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(CatalogHeader)) {
+        if (ftruncate(cat->fd, sizeof(CatalogHeader)) != 0) {
+            return -1;
+        }
+        st.st_size = sizeof(CatalogHeader);
+    }
+    cat->map_size = (size_t)st.st_size;
+    cat->map = mmap(NULL, cat->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, cat->fd, 0);
+    if (cat->map == MAP_FAILED) {
+        cat->map = NULL;
+        return -1;
+    }
+    cat->header = (CatalogHeader *)cat->map;
+    cat->entries = (CatalogEntry *)(cat->map + sizeof(CatalogHeader));
+    cat->capacity = (cat->map_size - sizeof(CatalogHeader)) / sizeof(CatalogEntry);
+
+    CatalogHeader *h = cat->header;
+    if (memcmp(h->magic, CATALOG_MAGIC, 8) != 0 || h->version != CATALOG_VERSION ||
+        h->entry_size != sizeof(CatalogEntry) || h->count > cat->capacity) {
+        memset(h, 0, sizeof(*h));
+        memcpy(h->magic, CATALOG_MAGIC, 8);
+        h->version = CATALOG_VERSION;
+        h->entry_size = sizeof(CatalogEntry);  // A zero folder mtime forces a full scan
+    }
+    return 0;
+}
+
+// Function to make room for count records, the file grows by doubling and is mapped again
+static int catalogReserve(Catalog *cat, uint64_t count) {
+    if (count <= cat->capacity) {
+        return 0;
+    }
+    uint64_t capacity = cat->capacity ? cat->capacity : 64;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    munmap(cat->map, cat->map_size);
+    cat->map = NULL;
+    if (ftruncate(cat->fd, (off_t)(sizeof(CatalogHeader) + capacity * sizeof(CatalogEntry))) != 0) {
+        return -1;
+    }
+    return catalogMap(cat);
+}
+
+// Function to open the catalog of a folder, created when missing, and lock it against other processes
+static int catalogOpen(Catalog *cat, const char *dir_path) {
+    char path[600];
+    memset(cat, 0, sizeof(*cat));
+    snprintf(cat->dir, sizeof(cat->dir), "%s", dir_path);
+    snprintf(path, sizeof(path), "%s/" CATALOG_FILE, dir_path);
+    cat->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (cat->fd < 0) {
+        return -1;
+    }
+    if (flock(cat->fd, LOCK_EX) != 0 || catalogMap(cat) != 0) {
+        close(cat->fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to unmap and unlock a catalog, the kernel writes the shared mapping back
+static void catalogClose(Catalog *cat) {
+    if (cat->map != NULL) {
+        munmap(cat->map, cat->map_size);
+    }
+    close(cat->fd);
+}
+
+// Function to find the record of a name by binary search, returns its index or where it would be inserted
+static uint64_t catalogFind(const Catalog *cat, const char *name, int *found) {
+    uint64_t low = 0, high = cat->header->count;
+    while (low < high) {
+        uint64_t mid = (low + high) / 2;
+        int order = strcmp(cat->entries[mid].name, name);
+        if (order == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (order < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *found = 0;
+    return low;
+}
+
+// Function to check whether a record still describes the file behind it
+static int catalogEntryCurrent(const CatalogEntry *entry, const struct stat *st) {
+    return entry->mtime_sec == (int64_t)st->st_mtim.tv_sec && entry->mtime_nsec == (int64_t)st->st_mtim.tv_nsec &&
+           entry->file_size == (uint64_t)st->st_size && entry->inode == (uint64_t)st->st_ino;
+}
+
+// Function to describe and hash one image into its record, created keeps a known creation time
+static int catalogDescribe(const Catalog *cat, const char *name, CatalogEntry *entry, int64_t created) {
+    char path[600];
+    ImageInfo info;
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", cat->dir, name);
+    if (stat(path, &st) != 0 || describeImage(path, &info) != 0) {
+        return -1;
+    }
+    memset(entry, 0, sizeof(*entry));
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    memcpy(entry->label, info.label, sizeof(entry->label));
+    entry->format = info.format;
+    entry->size = info.size;
+    entry->allocated = info.allocated;
+    entry->file_size = (uint64_t)st.st_size;
+    entry->inode = (uint64_t)st.st_ino;
+    entry->created = created ? created : (int64_t)st.st_mtim.tv_sec;
+    entry->mtime_sec = (int64_t)st.st_mtim.tv_sec;
+    entry->mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+    imageContentHash(path, &entry->hash);
+    return 0;
+}
+
+// Function to remove the record at index, keeping the records sorted
+static void catalogErase(Catalog *cat, uint64_t index) {
+    CatalogHeader *h = cat->header;
+    memmove(&cat->entries[index], &cat->entries[index + 1], (h->count - index - 1) * sizeof(CatalogEntry));
+    h->count--;
+}
+
+// Function to add or refresh the record of one image, removing it when the image is gone
+static int catalogPut(Catalog *cat, const char *name, int64_t created) {
+    int found;
+    uint64_t index = catalogFind(cat, name, &found);
+    CatalogEntry entry;
+    if (catalogDescribe(cat, name, &entry, found ? cat->entries[index].created : created) != 0) {
+        if (found) {
+            catalogErase(cat, index);
+        }
+        return -1;
+    }
+    if (!found) {
+        if (catalogReserve(cat, cat->header->count + 1) != 0) {
+            return -1;
+        }
+        CatalogHeader *h = cat->header;
+        memmove(&cat->entries[index + 1], &cat->entries[index], (h->count - index) * sizeof(CatalogEntry));
+        h->count++;
+    }
+    cat->entries[index] = entry;
+    return 0;
+}
+
+// Function to order names for the folder scan
+static int compareNames(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Function to bring the catalog in line with the folder after its mtime changed: one readdir, merged with the
+// sorted records, so only images that appeared are described and hashed
+static int catalogRescan(Catalog *cat, const struct stat *dir_st) {
+    DIR *dp = opendir(cat->dir);
+    if (dp == NULL) {
+        return -1;
+    }
+    size_t count = 0, capacity = 0;
+    char **names = NULL;
+    struct dirent *dirent;
+    while ((dirent = readdir(dp)) != NULL) {
+        if (!isImageName(dirent->d_name) || strlen(dirent->d_name) >= sizeof(((CatalogEntry *)0)->name)) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            char **grown = realloc(names, capacity * sizeof(char *));
+            if (grown == NULL) {
+                break;
+            }
+            names = grown;
+        }
+        if ((names[count] = strdup(dirent->d_name)) != NULL) {
+            count++;
+        }
+    }
+    closedir(dp);
+    qsort(names, count, sizeof(char *), compareNames);
+
+    // Drop records whose file is gone, then add the names that have no record yet
+    uint64_t kept = 0;
+    for (uint64_t i = 0, j = 0; i < cat->header->count; i++) {
+        while (j < count && strcmp(names[j], cat->entries[i].name) < 0) {
+            j++;
+        }
+        if (j < count && strcmp(names[j], cat->entries[i].name) == 0) {
+            if (kept != i) {
+                cat->entries[kept] = cat->entries[i];
+            }
+            kept++;
+        }
+    }
+    cat->header->count = kept;
+    for (size_t i = 0; i < count; i++) {
+        int found;
+        catalogFind(cat, names[i], &found);
+        if (!found) {
+            catalogPut(cat, names[i], 0);
+        }
+        free(names[i]);
+    }
+    free(names);
+
+    cat->header->dir_mtime_sec = (int64_t)dir_st->st_mtim.tv_sec;
+    cat->header->dir_mtime_nsec = (int64_t)dir_st->st_mtim.tv_nsec;
+    return 0;
+}
+
+// Function to record a new or changed image of a folder in its catalog
+int catalogUpdate(const char *dir_path, const char *name) {
+    Catalog cat;
+    if (catalogOpen(&cat, dir_path) != 0) {
+        return -1;
+    }
+    int result = catalogPut(&cat, name, (int64_t)time(NULL));
+    catalogClose(&cat);
+    return result;
+}
+
+// Function to forget a deleted image of a folder
+int catalogRemove(const char *dir_path, const char *name) {
+    Catalog cat;
+    if (catalogOpen(&cat, dir_path) != 0) {
+        return -1;
+    }
+    int found;
+    uint64_t index = catalogFind(&cat, name, &found);
+    if (found) {
+        catalogErase(&cat, index);
+    }
+    catalogClose(&cat);
+    return 0;
+}
+
+// Function to list the images of a folder from its catalog, revalidating each record by mtime and rescanning
+// the folder only when it changed; falls back to collectImages() when the catalog cannot be used
+long catalogImages(const char *dir_path, ImageInfo **images) {
+    Catalog cat;
+    struct stat dir_st;
+    *images = NULL;
+    if (stat(dir_path, &dir_st) != 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (catalogOpen(&cat, dir_path) != 0) {
+        return collectImages(dir_path, images);
+    }
+    if (cat.header->dir_mtime_sec != (int64_t)dir_st.st_mtim.tv_sec ||
+        cat.header->dir_mtime_nsec != (int64_t)dir_st.st_mtim.tv_nsec) {
+        catalogRescan(&cat, &dir_st);
+    }
+
+    int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+    ImageInfo *list = calloc(cat.header->count ? cat.header->count : 1, sizeof(ImageInfo));
+    if (dir_fd < 0 || list == NULL) {
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        free(list);
+        catalogClose(&cat);
+        return -1;
+    }
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < cat.header->count;) {
+        CatalogEntry *entry = &cat.entries[i];
+        struct stat st;
+        if (fstatat(dir_fd, entry->name, &st, 0) != 0) {
+            catalogErase(&cat, i);
+            continue;
+        }
+        if (!catalogEntryCurrent(entry, &st) && catalogPut(&cat, entry->name, entry->created) != 0) {
+            continue;  // catalogPut() dropped the record
+        }
+        entry = &cat.entries[i];  // catalogPut() may have mapped the catalog again
+        ImageInfo *info = &list[count++];
+        snprintf(info->name, sizeof(info->name), "%s", entry->name);
+        snprintf(info->path, sizeof(info->path), "%s/%s", dir_path, entry->name);
+        memcpy(info->label, entry->label, sizeof(info->label));
+        info->format = entry->format == IMAGE_FORMAT_QCOW2 ? IMAGE_FORMAT_QCOW2 : IMAGE_FORMAT_RAW;
+        info->size = entry->size;
+        info->allocated = entry->allocated;
+        info->created = entry->created;
+        info->hash = entry->hash;
+        i++;
+    }
+    close(dir_fd);
+    catalogClose(&cat);
+    *images = list;
+    return (long)count;
+}
+
+// Deduplication works on the CONTENT_HASH_BLOCK grid, each thread hashes one segment of an image at a time
+#define DEDUPE_SEGMENT_SIZE (64ULL * 1024 * 1024)
+#define DEDUPE_MAX_RUN (16ULL * 1024 * 1024)  // Largest range handed to FIDEDUPERANGE at once
+
+// A non-zero block of an image and the hash of its content
+typedef struct {
+    uint64_t hash;
+    uint64_t offset;
+    uint32_t image;
+    uint32_t len;
+} DedupeChunk;
+
+// A growable list of chunks, one per worker so hashing needs no lock
+typedef struct {
+    DedupeChunk *chunks;
+    size_t count;
+    size_t capacity;
+    uint32_t image;               // Image of the segment being hashed
+    int failed;
+} DedupeList;
+
+// Work shared by the hashing threads: every segment of every image
+typedef struct {
+    const ImageInfo *images;
+    uint64_t (*segments)[2];      // Image index and start offset
+    size_t count;
+    size_t next;
+    pthread_mutex_t lock;
+} DedupeQueue;
+
+typedef struct {
+    DedupeQueue *queue;
+    DedupeList list;
+} DedupeWorker;
+
+// Function to record one block of a segment
+static int dedupeAddChunk(void *ctx, uint64_t offset, const uint8_t *block, size_t len) {
+    DedupeList *list = ctx;
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 4096;
+        DedupeChunk *grown = realloc(list->chunks, capacity * sizeof(DedupeChunk));
+        if (grown == NULL) {
+            return -1;
+        }
+        list->chunks = grown;
+        list->capacity = capacity;
+    }
+    Xxh64State state;
+    xxh64Init(&state, len);
+    xxh64Update(&state, block, len);
+    DedupeChunk *chunk = &list->chunks[list->count++];
+    chunk->hash = xxh64Digest(&state);
+    chunk->offset = offset;
+    chunk->image = list->image;
+    chunk->len = (uint32_t)len;
+    return 0;
+}
+
+// Function run by each hashing thread, takes segments until none are left
+static void *dedupeWorker(void *arg) {
+    DedupeWorker *worker = arg;
+    DedupeQueue *queue = worker->queue;
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        size_t index = queue->next < queue->count ? queue->next++ : queue->count;
+        pthread_mutex_unlock(&queue->lock);
+        if (index == queue->count) {
+            return NULL;
+        }
+        const ImageInfo *info = &queue->images[queue->segments[index][0]];
+        uint64_t start = queue->segments[index][1];
+        int fd = open(info->path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            printf("Failed to read '%s': %s\n", info->path, strerror(errno));
+            worker->list.failed = 1;
+            if (fd >= 0) {
+                close(fd);
+            }
+            continue;
+        }
+        uint64_t end = start + DEDUPE_SEGMENT_SIZE < (uint64_t)st.st_size ? start + DEDUPE_SEGMENT_SIZE : (uint64_t)st.st_size;
+        worker->list.image = (uint32_t)queue->segments[index][0];
+        if (scanDataBlocks(fd, start, end, dedupeAddChunk, &worker->list) != 0) {
+            printf("Failed to hash '%s'.\n", info->path);
+            worker->list.failed = 1;
+        }
+        close(fd);
+    }
+}
+
+// Functions to order chunks by content, and by image and position
+static int compareChunkHashes(const void *a, const void *b) {
+    const DedupeChunk *x = a, *y = b;
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    if (x->len != y->len) {
+        return x->len < y->len ? -1 : 1;
+    }
+    if (x->image != y->image) {
+        return x->image < y->image ? -1 : 1;
+    }
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int compareChunkPositions(const void *a, const void *b) {
+    const DedupeChunk *x = a, *y = b;
+    if (x->image != y->image) {
+        return x->image < y->image ? -1 : 1;
+    }
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// A block to share with an identical block of another (or the same) image
+typedef struct {
+    uint32_t src_image;
+    uint32_t dst_image;
+    uint64_t src_offset;
+    uint64_t dst_offset;
+    uint64_t len;
+} DedupePair;
+
+static int compareDedupePairs(const void *a, const void *b) {
+    const DedupePair *x = a, *y = b;
+    if (x->dst_image != y->dst_image) {
+        return x->dst_image < y->dst_image ? -1 : 1;
+    }
+    if (x->src_image != y->src_image) {
+        return x->src_image < y->src_image ? -1 : 1;
+    }
+    return x->dst_offset < y->dst_offset ? -1 : x->dst_offset > y->dst_offset;
+}
+
+// Function to let the filesystem share the extents of identical blocks, adjacent blocks are merged into one range.
+// The kernel compares the bytes itself, blocks changed since hashing are left alone. Returns the bytes shared.
+static int64_t dedupeMerge(const ImageInfo *images, long image_count, DedupePair *pairs, size_t pair_count) {
+#ifdef FIDEDUPERANGE
+    int *fds = malloc((size_t)image_count * sizeof(int));
+    struct file_dedupe_range *range = calloc(1, sizeof(*range) + sizeof(struct file_dedupe_range_info));
+    if (fds == NULL || range == NULL) {
+        free(fds);
+        free(range);
+        return -1;
+    }
+    for (long i = 0; i < image_count; i++) {
+        // Destinations have to be writable unless we own them
+        if ((fds[i] = open(images[i].path, O_RDWR)) < 0) {
+            fds[i] = open(images[i].path, O_RDONLY);
+        }
+    }
+
+    qsort(pairs, pair_count, sizeof(DedupePair), compareDedupePairs);
+    int64_t shared = 0;
+    uint64_t differs = 0, attempts = 0;
+    for (size_t i = 0; i < pair_count;) {
+        DedupePair run = pairs[i++];
+        while (i < pair_count && pairs[i].dst_image == run.dst_image && pairs[i].src_image == run.src_image &&
+               pairs[i].dst_offset == run.dst_offset + run.len && pairs[i].src_offset == run.src_offset + run.len &&
+               run.len + pairs[i].len <= DEDUPE_MAX_RUN) {
+            run.len += pairs[i++].len;
+        }
+        if (fds[run.src_image] < 0 || fds[run.dst_image] < 0) {
+            continue;
+        }
+
+        range->src_offset = run.src_offset;
+        range->src_length = run.len;
+        range->dest_count = 1;
+        range->info[0].dest_fd = fds[run.dst_image];
+        range->info[0].dest_offset = run.dst_offset;
+        range->info[0].bytes_deduped = 0;
+        range->info[0].status = 0;
+        if (ioctl(fds[run.src_image], FIDEDUPERANGE, range) != 0) {
+            if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV || (errno == EINVAL && attempts == 0)) {
+                printf("The filesystem of '%s' cannot share extents (%s), nothing was merged.\n", IMAGES_DIR,
+                       strerror(errno));
+                shared = shared ? shared : -1;
+                break;
+            }
+            printf("Failed to merge '%s' into '%s': %s\n", images[run.src_image].name, images[run.dst_image].name,
+                   strerror(errno));
+            continue;
+        }
+        attempts++;
+        if (range->info[0].status == FILE_DEDUPE_RANGE_DIFFERS) {
+            differs += run.len;
+        } else if (range->info[0].status < 0) {
+            printf("Failed to merge '%s' into '%s': %s\n", images[run.src_image].name, images[run.dst_image].name,
+                   strerror(-range->info[0].status));
+        } else {
+            shared += (int64_t)range->info[0].bytes_deduped;
+        }
+    }
+    if (differs > 0) {
+        printf("%.2f MB changed since they were hashed and were left alone.\n", differs / (1024.0 * 1024.0));
+    }
+    for (long i = 0; i < image_count; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    free(fds);
+    free(range);
+    return shared;
+#else
+    (void)images;
+    (void)image_count;
+    (void)pairs;
+    (void)pair_count;
+    printf("Merging duplicate blocks needs FIDEDUPERANGE, which this system does not have.\n");
+    return -1;
+#endif
+}
+
+// Totals of a deduplication run
+typedef struct {
+    long images;
+    uint64_t data_bytes;          // Non-zero bytes hashed
+    uint64_t duplicate_bytes;     // Bytes whose content already appears elsewhere
+    int64_t merged_bytes;         // Bytes the filesystem now shares, -1 when merging failed
+} DedupeStats;
+
+// Function to hash every image in a folder in parallel and report duplicate blocks and identical images,
+// optionally asking the filesystem to share the duplicate blocks
+int dedupeImages(const char *dir_path, int workers, int merge, DedupeStats *stats) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(stats, 0, sizeof(*stats));
+
+    ImageInfo *images = NULL;
+    long image_count = collectImages(dir_path, &images);
+    if (image_count < 0) {
+        printf("Failed to open '%s' directory.\n", dir_path);
+        return -1;
+    }
+    if (image_count == 0) {
+        printf("No disk images found in '%s' directory.\n", dir_path);
+        free(images);
+        return 0;
+    }
+
+    // Large images are split so one of them does not leave the other threads idle
+    uint64_t *file_sizes = calloc((size_t)image_count, sizeof(uint64_t));
+    size_t segment_count = 0;
+    for (long i = 0; file_sizes != NULL && i < image_count; i++) {
+        struct stat st;
+        file_sizes[i] = stat(images[i].path, &st) == 0 ? (uint64_t)st.st_size : 0;
+        segment_count += (size_t)((file_sizes[i] + DEDUPE_SEGMENT_SIZE - 1) / DEDUPE_SEGMENT_SIZE);
+    }
+    DedupeQueue queue = {images, malloc((segment_count ? segment_count : 1) * sizeof(*queue.segments)), 0, 0,
+                         PTHREAD_MUTEX_INITIALIZER};
+    if (file_sizes == NULL || queue.segments == NULL) {
+        free(file_sizes);
+        free(queue.segments);
+        free(images);
+        return -1;
+    }
+    for (long i = 0; i < image_count; i++) {
+        for (uint64_t offset = 0; offset < file_sizes[i]; offset += DEDUPE_SEGMENT_SIZE) {
+            queue.segments[queue.count][0] = (uint64_t)i;
+            queue.segments[queue.count][1] = offset;
+            queue.count++;
+        }
+    }
+    free(file_sizes);
+
+    if (workers <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cores > 0 ? (int)cores : 1;
+    }
+    if ((size_t)workers > queue.count) {
+        workers = queue.count ? (int)queue.count : 1;
+    }
+    DedupeWorker *pool = calloc((size_t)workers, sizeof(DedupeWorker));
+    pthread_t *threads = malloc((size_t)workers * sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; pool != NULL && i < workers; i++) {
+        pool[i].queue = &queue;
+    }
+    while (pool != NULL && threads != NULL && started < workers &&
+           pthread_create(&threads[started], NULL, dedupeWorker, &pool[started]) == 0) {
+        started++;
+    }
+    if (pool != NULL && started == 0) {
+        dedupeWorker(&pool[0]);  // No threads available, hash serially on this one
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(queue.segments);
+
+    // Gather the chunks of every worker
+    size_t count = 0;
+    int failed = pool == NULL;
+    for (int i = 0; pool != NULL && i < workers; i++) {
+        count += pool[i].list.count;
+        failed |= pool[i].list.failed;
+    }
+    DedupeChunk *chunks = malloc((count ? count : 1) * sizeof(DedupeChunk));
+    size_t used = 0;
+    for (int i = 0; pool != NULL && i < workers; i++) {
+        if (chunks != NULL) {
+            memcpy(chunks + used, pool[i].list.chunks, pool[i].list.count * sizeof(DedupeChunk));
+            used += pool[i].list.count;
+        }
+        free(pool[i].list.chunks);
+    }
+    free(pool);
+    if (chunks == NULL || failed) {
+        free(chunks);
+        free(images);
+        return -1;
+    }
+    double hash_ms = elapsedMs(&start);
+
+    // Fingerprint of each image: its chunks in order, identical images share one
+    uint64_t *fingerprints = calloc((size_t)image_count, sizeof(uint64_t));
+    uint64_t *image_data = calloc((size_t)image_count, sizeof(uint64_t));
+    uint64_t *image_shared = calloc((size_t)image_count, sizeof(uint64_t));
+    if (fingerprints == NULL || image_data == NULL || image_shared == NULL) {
+        free(fingerprints);
+        free(image_data);
+        free(image_shared);
+        free(chunks);
+        free(images);
+        return -1;
+    }
+    qsort(chunks, count, sizeof(DedupeChunk), compareChunkPositions);
+    for (size_t i = 0; i < count;) {
+        uint32_t image = chunks[i].image;
+        Xxh64State state;
+        xxh64Init(&state, images[image].size);
+        for (; i < count && chunks[i].image == image; i++) {
+            uint8_t record[16];
+            putLE32(record, (uint32_t)chunks[i].offset);
+            putLE32(record + 4, (uint32_t)(chunks[i].offset >> 32));
+            putLE32(record + 8, (uint32_t)chunks[i].hash);
+            putLE32(record + 12, (uint32_t)(chunks[i].hash >> 32));
+            xxh64Update(&state, record, sizeof(record));
+            image_data[image] += chunks[i].len;
+        }
+        fingerprints[image] = xxh64Digest(&state);
+    }
+
+    // Every chunk after the first of its content is a duplicate, and becomes a merge candidate
+    qsort(chunks, count, sizeof(DedupeChunk), compareChunkHashes);
+    DedupePair *pairs = merge ? malloc((count ? count : 1) * sizeof(DedupePair)) : NULL;
+    size_t pair_count = 0;
+    uint64_t unique_chunks = 0;
+    for (size_t i = 0; i < count;) {
+        size_t group = i + 1;
+        while (group < count && chunks[group].hash == chunks[i].hash && chunks[group].len == chunks[i].len) {
+            group++;
+        }
+        unique_chunks++;
+        for (size_t j = i + 1; j < group; j++) {
+            stats->duplicate_bytes += chunks[j].len;
+            image_shared[chunks[j].image] += chunks[j].len;
+            if (pairs != NULL && chunks[j].len == CONTENT_HASH_BLOCK) {
+                DedupePair pair = {chunks[i].image, chunks[j].image, chunks[i].offset, chunks[j].offset, chunks[j].len};
+                pairs[pair_count++] = pair;
+            }
+        }
+        if (group - i > 1) {
+            image_shared[chunks[i].image] += chunks[i].len;
+        }
+        i = group;
+    }
+    for (long i = 0; i < image_count; i++) {
+        stats->data_bytes += image_data[i];
+    }
+    stats->images = image_count;
+
+    printf("%-28s %12s %10s\n", "NAME", "DATA", "SHARED");
+    for (long i = 0; i < image_count; i++) {
+        printf("%-28s %9.2f MB %9.1f%%\n", images[i].name, image_data[i] / (1024.0 * 1024.0),
+               image_data[i] ? 100.0 * image_shared[i] / image_data[i] : 0.0);
+    }
+    for (long i = 0; i < image_count; i++) {
+        long matches = 0;
+        for (long j = 0; j < image_count; j++) {
+            if (j == i || fingerprints[j] != fingerprints[i] || images[j].size != images[i].size) {
+                continue;
+            }
+            if (j < i) {
+                break;  // Already reported with an earlier image
+            }
+            if (matches++ == 0) {
+                printf("Identical: %s", images[i].name);
+            }
+            printf(" = %s", images[j].name);
+        }
+        if (matches > 0) {
+            printf("\n");
+        }
+    }
+    printf("Hashed %.2f MB in %ld images with %d workers in %.1f ms (%.1f MB/s): %llu unique blocks, "
+           "%.2f MB duplicated.\n", stats->data_bytes / (1024.0 * 1024.0), image_count, started ? started : 1, hash_ms,
+           stats->data_bytes / (1024.0 * 1024.0) / (hash_ms > 0 ? hash_ms / 1000.0 : 1), (unsigned long long)unique_chunks,
+           stats->duplicate_bytes / (1024.0 * 1024.0));
+
+    int result = 0;
+    if (merge) {
+        stats->merged_bytes = pairs ? dedupeMerge(images, image_count, pairs, pair_count) : -1;
+        if (stats->merged_bytes < 0) {
+            result = -1;
+        } else {
+            printf("Merged %.2f MB of duplicate blocks.\n", stats->merged_bytes / (1024.0 * 1024.0));
+        }
+    }
+    free(pairs);
+    free(fingerprints);
+    free(image_data);
+    free(image_shared);
+    free(chunks);
+    free(images);
+    return result;
+}
+
+// Function to find an image by path, file name or bare name in the images folder, returns 0 or EXIT_NOT_FOUND
+int resolveImagePath(const char *name, char *path, size_t path_size) {
+    static const char *const candidates[] = {"%s", IMAGES_DIR "/%s", IMAGES_DIR "/%s.img", IMAGES_DIR "/%s.qcow2"};
+    struct stat st;
+    for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+        if (i > 0 && strchr(name, '/') != NULL) {
+            break;
+        }
+        snprintf(path, path_size, candidates[i], name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            return 0;
+        }
+    }
+    printf("Disk image '%s' not found.\n", name);
+    return EXIT_NOT_FOUND;
+}
+
+// Function to get the space available to unprivileged users in a folder
+static uint64_t availableSpace(const char *dir_path) {
+    struct statvfs buf;
+    if (statvfs(dir_path, &buf) != 0) {
+        return 0;
+    }
+    return (uint64_t)buf.f_frsize * buf.f_bavail;
+}
+
+// Function to create and format a named image in the images folder, returns 0 or one of the exit codes
+int createDiskImage(const char *name, ImageFormat format, uint64_t size, ImageAllocPolicy policy, ImageLayout kind,
+                    const char *label, ImageInfo *info) {
+    char image_path[512];
+    if (name[0] == '\0' || strchr(name, '/') != NULL) {
+        printf("Invalid image name '%s'.\n", name);
+        return EXIT_USAGE;
+    }
+    if (mkdir(IMAGES_DIR, 0755) != 0 && errno != EEXIST) {
+        printf("Failed to create the '%s' subfolder: %s\n", IMAGES_DIR, strerror(errno));
+        return 1;
+    }
+    snprintf(image_path, sizeof(image_path), IMAGES_DIR "/%s.%s", name, format == IMAGE_FORMAT_QCOW2 ? "qcow2" : "img");
+    if (access(image_path, F_OK) == 0) {
+        printf("Disk image '%s' already exists! Please choose another name.\n", image_path);
+        return EXIT_EXISTS;
+    }
+
+    uint64_t free_space = availableSpace(IMAGES_DIR);
+    if (size > free_space) {
+        printf("Error: Not enough free space to create the disk image. Available space: %.2f GB\n",
+               free_space / (1024.0 * 1024.0 * 1024.0));
+        return EXIT_NO_SPACE;
+    }
+
+    // The volume label defaults to the image name, setFat32Label uppercases it
+    if (label == NULL) {
+        label = name;
+    }
+    int result;
+    TraceMark mark = traceBegin();
+    if (format == IMAGE_FORMAT_QCOW2) {
+        result = createQcow2Image(image_path, size, label, kind);
+        traceEnd(&mark, "phase", "create qcow2", image_path);
+    } else {
+        result = createRawImage(image_path, size, policy);
+        traceEnd(&mark, "phase", "allocate", image_path);
+        mark = traceBegin();
+        if (result == 0 && (result = formatFat32Image(image_path, label, kind)) != 0) {
+            unlink(image_path);
+        }
+        traceEnd(&mark, "phase", "format", image_path);
+    }
+    if (result != 0) {
+        printf("Failed to create disk image '%s'.\n", name);
+        return 1;
+    }
+    mark = traceBegin();
+    catalogUpdate(IMAGES_DIR, image_path + strlen(IMAGES_DIR "/"));
+    traceEnd(&mark, "phase", "catalog", NULL);
+    if (info != NULL) {
+        describeImage(image_path, info);
+    }
+    printf("Disk image '%s' created and formatted successfully.\n", image_path);
+    return 0;
+}
+
+// Function to delete an image, returns 0 or one of the exit codes
+int deleteDiskImage(const char *image_path) {
+    TraceMark mark = traceBegin();
+    if (access(image_path, F_OK) != 0) {
+        printf("Failed to delete disk image '%s': %s\n", image_path, strerror(errno));
+        return errno == ENOENT ? EXIT_NOT_FOUND : 1;
+    }
+    int lock_fd = lockImageForWriting(image_path);
+    if (lock_fd < 0) {
+        return errno == EBUSY ? EXIT_EXISTS : 1;
+    }
+    if (remove(image_path) != 0) {
+        printf("Failed to delete disk image '%s': %s\n", image_path, strerror(errno));
+        close(lock_fd);
+        return 1;
+    }
+    char journal_path[4096];
+    snprintf(journal_path, sizeof(journal_path), "%s" FAT_JOURNAL_SUFFIX, image_path);
+    unlink(journal_path);
+    close(lock_fd);
+    traceEnd(&mark, "phase", "remove", image_path);
+    const char *name = image_path + strlen(IMAGES_DIR "/");
+    if (strncmp(image_path, IMAGES_DIR "/", strlen(IMAGES_DIR "/")) == 0 && strchr(name, '/') == NULL) {
+        mark = traceBegin();
+        catalogRemove(IMAGES_DIR, name);
+        traceEnd(&mark, "phase", "catalog", NULL);
+    }
+    printf("Disk image '%s' deleted successfully.\n", image_path);
+    return 0;
+}
+
+// Function to print the images of the images folder as a table or a JSON array
+static int listCommand(void) {
+    ImageInfo *images;
+    long count = catalogImages(IMAGES_DIR, &images);
+    int code = count < 0 ? 1 : 0;
+    if (count < 0) {
+        printf("Failed to open '%s' subfolder.\n", IMAGES_DIR);
+    }
+    if (jsonBegin("list", code)) {
+        fprintf(json_out, ",\"images\":[");
+        for (long i = 0; i < count; i++) {
+            if (i > 0) {
+                fputc(',', json_out);
+            }
+            jsonImage(json_out, &images[i]);
+        }
+        fputc(']', json_out);
+        jsonEnd();
+    } else if (count == 0) {
+        printf("No disk images found in '%s' subfolder.\n", IMAGES_DIR);
+    } else {
+        printf("%-32s %-6s %-11s %12s %12s\n", "NAME", "FORMAT", "LABEL", "SIZE", "ALLOCATED");
+        for (long i = 0; i < count; i++) {
+            printf("%-32s %-6s %-11s %10.2f G %10.2f M\n", images[i].name, imageFormatName(images[i].format),
+                   images[i].label, images[i].size / (1024.0 * 1024.0 * 1024.0), images[i].allocated / (1024.0 * 1024.0));
+        }
+    }
+    free(images);
+    return code;
+}
+
+// Function to discard the rest of the current input line
+void clearInputLine(void) {
+    int c;
+    while ((c = getchar()) != '\n' && c != EOF) {
+    }
+}
+
+// Function to keep a menu result on screen until the user has read it
+void waitForEnter(void) {
+    printf("\nPress Enter to return to the menu...");
+    fflush(stdout);
+    clearInputLine();
+}
+
+// Function to let the user pick an image of the images folder, returns 0 and fills path on success
+int chooseImage(const char *action, char *path, size_t path_size) {
+    ImageInfo *images;
+    long count = catalogImages(IMAGES_DIR, &images);
+    if (count <= 0) {
+        printf("No disk images found in '%s' subfolder. Create some images first.\n", IMAGES_DIR);
+        free(images);
+        return -1;
+    }
+
+    printf("Disk images available:\n");
+    for (long i = 0; i < count; i++) {
+        printf("%ld. %s\n", i + 1, images[i].name);
+    }
+    int selected = 0;
+    printf("Enter the number of the image to %s (1-%ld): ", action, count);
+    if (scanf("%d", &selected) != 1) {
+        selected = 0;
+    }
+    clearInputLine();
+    if (selected < 1 || selected > count) {
+        printf("Invalid selection.\n");
+        free(images);
+        return -1;
+    }
+    snprintf(path, path_size, "%s", images[selected - 1].path);
+    free(images);
+    return 0;
+}
+
+// Function to find the value of a "--name value" option, NULL when it is not given
+static const char *optionValue(int argc, char *argv[], const char *name) {
+    for (int i = 2; i + 1 < argc; i++) {
+        if (strcmp(argv[i], name) == 0) {
+            return argv[i + 1];
+        }
+    }
+    return NULL;
+}
+
+// Function to get the positional argument at index (after the command), skipping "--name value" options
+static const char *positional(int argc, char *argv[], int index) {
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) == 0) {
+            i++;
+        } else if (index-- == 0) {
+            return argv[i];
+        }
+    }
+    return NULL;
+}
+
+// Function to handle create, delete, list, mount and unmount, returns -1 when argv is none of them
+static int manageCommand(int argc, char *argv[]) {
+    const char *command = argv[1];
+    const char *name = positional(argc, argv, 0);
+    const char *mount_point = optionValue(argc, argv, "--mountpoint");
+    char image_path[512];
+    char device[64] = "";
+    int code;
+
+    if (mount_point == NULL) {
+        mount_point = MOUNT_POINT;
+    }
+    if (strcmp(command, "list") == 0) {
+        return listCommand();
+    }
+    if (strcmp(command, "create") == 0 && name != NULL) {
+        const char *format_name = optionValue(argc, argv, "--format");
+        const char *size_text = optionValue(argc, argv, "--size");
+        const char *alloc_name = optionValue(argc, argv, "--alloc");
+        uint64_t size = parseSize(size_text ? size_text : "1G");
+        int policy = alloc_name ? parseAllocPolicy(alloc_name) : IMAGE_ALLOC_SPARSE;
+        int kind = parseImageLayout(optionValue(argc, argv, "--layout"));
+        int qcow2 = format_name != NULL && strcmp(format_name, "qcow2") == 0;
+        if (size == 0 || policy < 0 || kind < 0 || (format_name != NULL && !qcow2 && strcmp(format_name, "raw") != 0)) {
+            printf("Usage: %s create <name> [--format raw|qcow2] [--size 1G] [--alloc sparse|falloc|zero]\n"
+                   "       [--layout gpt|superfloppy] [--label L]\n", argv[0]);
+            code = EXIT_USAGE;
+        } else {
+            ImageInfo info = {0};
+            code = createDiskImage(name, qcow2 ? IMAGE_FORMAT_QCOW2 : IMAGE_FORMAT_RAW, size, (ImageAllocPolicy)policy,
+                                   (ImageLayout)kind, optionValue(argc, argv, "--label"), &info);
+            if (code == 0 && jsonBegin(command, code)) {
+                fprintf(json_out, ",\"image\":");
+                jsonImage(json_out, &info);
+                jsonEnd();
+            }
+        }
+        return code;
+    }
+    if ((strcmp(command, "delete") == 0 || strcmp(command, "mount") == 0) && name != NULL) {
+        code = resolveImagePath(name, image_path, sizeof(image_path));
+        if (code == 0) {
+            code = strcmp(command, "delete") == 0 ? deleteDiskImage(image_path)
+                                                  : mountImage(image_path, mount_point, device, sizeof(device));
+        }
+        if (code == 0 && jsonBegin(command, code)) {
+            fprintf(json_out, ",\"path\":");
+            jsonString(json_out, image_path);
+            if (strcmp(command, "mount") == 0) {
+                fprintf(json_out, ",\"mount_point\":");
+                jsonString(json_out, mount_point);
+                fprintf(json_out, ",\"device\":");
+                jsonString(json_out, device);
+            }
+            jsonEnd();
+        }
+        return code;
+    }
+    if (strcmp(command, "unmount") == 0) {
+        code = unmountImage(mount_point, device, sizeof(device));
+        if (code == 0 && jsonBegin(command, code)) {
+            fprintf(json_out, ",\"mount_point\":");
+            jsonString(json_out, mount_point);
+            fprintf(json_out, ",\"device\":");
+            jsonString(json_out, device);
+            jsonEnd();
+        }
+        return code;
+    }
+    return -1;
+}
+
+// Function to run one image command, returns the process exit code
+static int dispatchImageCommand(int argc, char *argv[]) {
+    int code = manageCommand(argc, argv);
+    if (code >= 0) {
+        return code;
+    }
+    if (strcmp(argv[1], "format") == 0 && positional(argc, argv, 0) != NULL && positional(argc, argv, 2) == NULL) {
+        // format <image> [label] [--layout gpt|superfloppy]
+        int kind = parseImageLayout(optionValue(argc, argv, "--layout"));
+        if (kind < 0) {
+            printf("Usage: %s format <image> [label] [--layout gpt|superfloppy]\n", argv[0]);
+            return EXIT_USAGE;
+        }
+        return formatFat32Image(positional(argc, argv, 0), positional(argc, argv, 1), (ImageLayout)kind) == 0 ? 0 : 1;
+    }
+    if (strcmp(argv[1], "create-raw") == 0 && (argc == 4 || argc == 5)) {
+        uint64_t size = parseSize(argv[3]);
+        int policy = argc == 5 ? parseAllocPolicy(argv[4]) : IMAGE_ALLOC_SPARSE;
+        if (size == 0 || policy < 0) {
+            printf("Usage: %s create-raw <image> <size> [sparse|falloc|zero]\n", argv[0]);
+            return EXIT_USAGE;
+        }
+        return createRawImage(argv[2], size, (ImageAllocPolicy)policy) == 0 ? 0 : 1;
+    }
+    if (strcmp(argv[1], "create-qcow2") == 0 && positional(argc, argv, 1) != NULL && positional(argc, argv, 3) == NULL) {
+        // create-qcow2 <image> <size> [label] [--layout gpt|superfloppy]
+        uint64_t size = parseSize(positional(argc, argv, 1));
+        int kind = parseImageLayout(optionValue(argc, argv, "--layout"));
+        if (size == 0 || kind < 0) {
+            printf("Usage: %s create-qcow2 <image> <size> [label] [--layout gpt|superfloppy]\n", argv[0]);
+            return EXIT_USAGE;
+        }
+        return createQcow2Image(positional(argc, argv, 0), size, positional(argc, argv, 2), (ImageLayout)kind) == 0 ? 0 : 1;
+    }
+    if (strcmp(argv[1], "put") == 0 && (argc == 4 || argc == 5)) {
+        return putIntoImage(argv[2], argv[3], argc == 5 ? argv[4] : "/") == 0 ? 0 : 1;
+    }
+    if (strcmp(argv[1], "sync") == 0 && argc >= 4) {
+        // sync [--checksum] [--delete] <hostdir> <image> [/dest]
+        int flags = 0, first = 2;
+        for (; first < argc && argv[first][0] == '-' && argv[first][1] == '-'; first++) {
+            if (strcmp(argv[first], "--checksum") == 0) {
+                flags |= SYNC_CHECKSUM;
+            } else if (strcmp(argv[first], "--delete") == 0) {
+                flags |= SYNC_DELETE;
+            } else {
+                break;
+            }
+        }
+        if (argc - first == 2 || argc - first == 3) {
+            FatSyncStats stats;
+            int code = syncIntoImage(argv[first], argv[first + 1], argc - first == 3 ? argv[first + 2] : "/", flags,
+                                     &stats) == 0 ? 0 : 1;
+            if (code == 0 && jsonBegin(argv[1], code)) {
+                fprintf(json_out, ",\"files\":%lu,\"updated\":%lu,\"added\":%lu,\"removed\":%lu,\"written\":%llu",
+                        stats.files, stats.updated, stats.added, stats.removed, (unsigned long long)stats.written);
+                jsonEnd();
+            }
+            return code;
+        }
+    }
+    if (strcmp(argv[1], "get") == 0 && (argc == 4 || argc == 5)) {
+        // With --json stdout carries the result and stderr the messages, the file data has nowhere to go
+        if (json_out != NULL && argc == 5 && strcmp(argv[4], "-") == 0) {
+            printf("'-' cannot be used with --json, stdout carries the JSON result.\n");
+            return EXIT_USAGE;
+        }
+        if (getFromImage(argv[2], argv[3], argc == 5 ? argv[4] : NULL) != 0) {
+            return errno == ENOENT ? EXIT_NOT_FOUND : 1;
+        }
+        return 0;
+    }
+    if (strcmp(argv[1], "clone") == 0 && argc >= 4) {
+        // clone [-l LABEL] <template> <image> [image...], every clone gets its own serial
+        int first = strcmp(argv[2], "-l") == 0 ? 4 : 2;
+        const char *label = first == 4 ? argv[3] : NULL;
+        if (argc - first >= 2) {
+            int failed = 0;
+            for (int i = first + 1; i < argc; i++) {
+                failed |= cloneImage(argv[first], argv[i], label) != 0;
+            }
+            return failed ? 1 : 0;
+        }
+    }
+    if (strcmp(argv[1], "batch") == 0 && (argc == 3 || (argc == 5 && strcmp(argv[2], "-j") == 0))) {
+        int workers = argc == 5 ? atoi(argv[3]) : 0;
+        return runBatch(argv[argc - 1], workers) == 0 ? 0 : 1;
+    }
+    if (strcmp(argv[1], "dedupe") == 0) {
+        // dedupe [--merge] [-j N]
+        int merge = 0, workers = 0, valid = 1;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--merge") == 0) {
+                merge = 1;
+            } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+                workers = atoi(argv[++i]);
+            } else {
+                valid = 0;
+            }
+        }
+        if (valid) {
+            DedupeStats stats;
+            int code = dedupeImages(IMAGES_DIR, workers, merge, &stats) == 0 ? 0 : 1;
+            if (jsonBegin(argv[1], code)) {
+                fprintf(json_out, ",\"images\":%ld,\"data_bytes\":%llu,\"duplicate_bytes\":%llu", stats.images,
+                        (unsigned long long)stats.data_bytes, (unsigned long long)stats.duplicate_bytes);
+                if (merge) {
+                    fprintf(json_out, ",\"merged_bytes\":%lld", (long long)stats.merged_bytes);
+                }
+                jsonEnd();
+            }
+            return code;
+        }
+    }
+    if (strcmp(argv[1], "trim") == 0 && argc == 3) {
+        uint64_t reclaimed;
+        int code = trimImage(argv[2], &reclaimed) == 0 ? 0 : 1;
+        if (code == 0 && jsonBegin(argv[1], code)) {
+            fprintf(json_out, ",\"path\":");
+            jsonString(json_out, argv[2]);
+            fprintf(json_out, ",\"reclaimed\":%llu", (unsigned long long)reclaimed);
+            jsonEnd();
+        }
+        return code;
+    }
+    if (strcmp(argv[1], "convert") == 0 && argc >= 4) {
+        // convert <source> <dest> [-O raw|qcow2] [-c] [-j N], the format follows the destination extension
+        const char *ext = strrchr(argv[3], '.');
+        ImageFormat format = ext && strcasecmp(ext, ".qcow2") == 0 ? IMAGE_FORMAT_QCOW2 : IMAGE_FORMAT_RAW;
+        int compress = 0, workers = 0, valid = 1;
+        for (int i = 4; i < argc; i++) {
+            if (strcmp(argv[i], "-O") == 0 && i + 1 < argc &&
+                (strcmp(argv[i + 1], "raw") == 0 || strcmp(argv[i + 1], "qcow2") == 0)) {
+                format = strcmp(argv[++i], "qcow2") == 0 ? IMAGE_FORMAT_QCOW2 : IMAGE_FORMAT_RAW;
+            } else if (strcmp(argv[i], "-c") == 0) {
+                compress = 1;
+            } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+                workers = atoi(argv[++i]);
+            } else {
+                valid = 0;
+            }
+        }
+        if (valid) {
+            if (compress && format != IMAGE_FORMAT_QCOW2) {
+                printf("Only qcow2 output can be compressed.\n");
+                return EXIT_USAGE;
+            }
+            return convertImage(argv[2], argv[3], format, compress, workers) == 0 ? 0 : 1;
+        }
+    }
+    if (strcmp(argv[1], "bench") == 0) {
+        return runBench(argc, argv);
+    }
+    if (strcmp(argv[1], "daemon") == 0) {
+        return runDaemon(argc, argv);
+    }
+    if (strcmp(argv[1], "ls") == 0 && argc >= 3) {
+        int recursive = strcmp(argv[2], "-R") == 0;
+        if (argc - recursive == 3 || argc - recursive == 4) {
+            if (listImage(argv[2 + recursive], argc - recursive == 4 ? argv[3 + recursive] : "/", recursive) != 0) {
+                return errno == ENOENT ? EXIT_NOT_FOUND : 1;
+            }
+            return 0;
+        }
+    }
+
+    printf("Usage:\n");
+    printf("  %s                            Interactive menu\n", argv[0]);
+    printf("  %s list                       List the images in '" IMAGES_DIR "'\n", argv[0]);
+    printf("  %s create <name> [--format raw|qcow2] [--size 1G] [--alloc sparse|falloc|zero] [--label L]\n", argv[0]);
+    printf("                                         Create a FAT32 image in '" IMAGES_DIR "', inside a GPT EFI System\n");
+    printf("                                         Partition unless --layout superfloppy is given\n");
+    printf("  %s delete <name>              Delete an image\n", argv[0]);
+    printf("  %s mount <name> [--mountpoint DIR]\n", argv[0]);
+    printf("                                         Mount an image, at '" MOUNT_POINT "' by default\n");
+    printf("  %s unmount [--mountpoint DIR] Unmount the image mounted at '" MOUNT_POINT "'\n", argv[0]);
+#ifdef __linux__
+    printf("  %s fuse [-f] <name> [DIR]     Mount an image without root through FUSE, at '" MOUNT_POINT "' by default\n",
+           argv[0]);
+#endif
+    printf("  %s create-raw <image> <size> [sparse|falloc|zero]\n", argv[0]);
+    printf("                                         Create a raw image, size like 512M or 1G\n");
+    printf("  %s create-qcow2 <image> <size> [label] [--layout gpt|superfloppy]\n", argv[0]);
+    printf("                                         Create a FAT32 formatted QCOW2 image\n");
+    printf("  %s format <image> [label] [--layout gpt|superfloppy]\n", argv[0]);
+    printf("                                         Format an image as FAT32, in a GPT EFI System Partition by default\n");
+    printf("  %s put <image> <path> [/dest] Copy a file or directory tree into an image\n", argv[0]);
+    printf("  %s sync [--checksum] [--delete] <hostdir> <image> [/dest]\n", argv[0]);
+    printf("                                         Update an image from a host directory, writing only what changed\n");
+    printf("  %s get <image> <path> [dest]  Copy a file or directory tree out of an image\n", argv[0]);
+    printf("  %s ls [-R] <image> [path]     List a directory inside an image\n", argv[0]);
+    printf("  %s trim <image>               Give the space of deleted files back to the host\n", argv[0]);
+    printf("  %s convert <src> <dest> [-O raw|qcow2] [-c] [-j N]\n", argv[0]);
+    printf("                                         Convert between raw and QCOW2, -c compresses QCOW2 clusters\n");
+    printf("  %s dedupe [--merge] [-j N]    Report duplicate blocks across '" IMAGES_DIR "', --merge shares them\n",
+           argv[0]);
+    printf("  %s clone [-l LABEL] <template> <image>...\n", argv[0]);
+    printf("                                         Clone a golden image (reflink when possible) with new serials\n");
+    printf("  %s batch [-j N] <manifest>    Provision every image listed in a manifest in parallel\n", argv[0]);
+    printf("                                         Lines: name raw[:sparse|falloc|zero]|qcow2 size label|- [srcdir]\n");
+    printf("  %s bench [--dir DIR] [--sizes 64M,1G,16G,64G] [--runs N] [--files N] [--dist small|mixed|large]\n",
+           argv[0]);
+    printf("                                         Time create, format, populate, mount and teardown, CSV output\n");
+    printf("  %s daemon [--socket PATH] [-j N]  Serve commands over a Unix socket, '<id> <command> [args]' per line\n",
+           argv[0]);
+    printf("Add --json to any command for a JSON result on stdout, messages then go to stderr.\n");
+    printf("Add --queue-depth N to keep N bulk writes in flight (%d by default, at most %d).\n", IO_ENGINE_DEFAULT_DEPTH,
+           IO_ENGINE_MAX_DEPTH);
+    printf("Add --trace for a table of the time spent in each phase and program, --trace=FILE for Chrome trace JSON.\n");
+    printf("Exit codes: 0 success, 1 failure, 2 usage, 3 not found, 4 already exists, 5 no space, 6 missing tool.\n");
+    return strcmp(argv[1], "help") == 0 || strcmp(argv[1], "--help") == 0 ? 0 : EXIT_USAGE;
+}
+
+// Function to handle the image commands shared by every platform, returns the process exit code
+int runImageCommand(int argc, char *argv[]) {
+    // --json, --trace and --queue-depth may appear anywhere, they are removed before the command is parsed
+    int json = 0, kept = 1;
+    const char *trace_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = 1;
+        } else if (strcmp(argv[i], "--trace") == 0 || strncmp(argv[i], "--trace=", 8) == 0) {
+            trace_path = argv[i][7] == '=' ? argv[i] + 8 : NULL;
+            traceStart();
+        } else if (strcmp(argv[i], "--queue-depth") == 0) {
+            char *end = NULL;
+            long depth = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : 0;
+            if (end == NULL || *end != '\0' || depth < 1 || depth > IO_ENGINE_MAX_DEPTH) {
+                printf("--queue-depth takes a number from 1 to %d.\n", IO_ENGINE_MAX_DEPTH);
+                return EXIT_USAGE;
+            }
+            io_queue_depth = (int)depth;
+            i++;
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argc = kept;
+    argv[argc] = NULL;
+    if (argc < 2) {
+        argv[argc++] = "help";
+        argv[argc] = NULL;
+    }
+
+    // Human readable messages move to stderr so stdout carries nothing but the JSON result
+    if (json) {
+        fflush(stdout);
+        int fd = dup(STDOUT_FILENO);
+        json_out = fd >= 0 ? fdopen(fd, "w") : NULL;
+        if (json_out == NULL || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            return 1;
+        }
+    }
+
+    TraceMark mark = traceBegin();
+    int code = dispatchImageCommand(argc, argv);
+    if (trace_enabled) {
+        traceEnd(&mark, "command", argv[1], NULL);
+        if (trace_path != NULL && trace_path[0] != '\0') {
+            traceWriteChrome(trace_path);
+        } else {
+            traceSummary();
+        }
+    }
+    if (json) {
+        fflush(stdout);
+        if (!json_written && jsonBegin(argv[1], code)) {
+            jsonEnd();
+        }
+        fclose(json_out);
+        json_out = NULL;
+    }
+    return code;
+}
+
+#endif